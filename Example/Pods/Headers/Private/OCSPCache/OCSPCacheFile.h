@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheFile.h
\ No newline at end of file
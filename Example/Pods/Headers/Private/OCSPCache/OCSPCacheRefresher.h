@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheRefresher.h
\ No newline at end of file
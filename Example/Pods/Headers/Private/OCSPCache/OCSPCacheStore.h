@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheStore.h
\ No newline at end of file
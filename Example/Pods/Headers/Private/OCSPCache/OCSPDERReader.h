@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPDERReader.h
\ No newline at end of file
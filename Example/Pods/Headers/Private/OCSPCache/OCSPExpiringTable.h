@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPExpiringTable.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPGeneralizedTime.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPNegativeCache.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPRequestBatcher.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPResponderRegistry.h
\ No newline at end of file
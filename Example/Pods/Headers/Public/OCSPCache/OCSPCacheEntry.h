@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheEntry.h
\ No newline at end of file
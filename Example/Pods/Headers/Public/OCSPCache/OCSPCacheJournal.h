@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheJournal.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPCacheKey.h
\ No newline at end of file
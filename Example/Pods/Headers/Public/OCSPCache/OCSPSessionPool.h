@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPSessionPool.h
\ No newline at end of file
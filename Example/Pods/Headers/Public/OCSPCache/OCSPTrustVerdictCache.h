@@ -0,0 +1 @@
+../../../../../OCSPCache/Classes/OCSPTrustVerdictCache.h
\ No newline at end of file
@@ -20,13 +20,25 @@
 @import XCTest;
 
 #import <openssl/ocsp.h>
+#import <openssl/rsa.h>
 #import "ErrorT.h"
 #import "ErrorTs.h"
 #import "OCSPAuthURLSessionDelegate.h"
 #import "OCSPCache.h"
+#import "OCSPCacheEntry.h"
+#import "OCSPCacheFile.h"
+#import "OCSPCacheJournal.h"
+#import "OCSPCacheKey.h"
+#import "OCSPDERReader.h"
 #import "OCSPCert.h"
 #import "OCSPError.h"
+#import "OCSPGeneralizedTime.h"
+#import "OCSPOpenSSLBridge.h"
+#import "OCSPRequestService.h"
 #import "OCSPSecTrust.h"
+#import "OCSPTrustVerdictCache.h"
+#import "OCSPStandInResponder.h"
+#import "RACSignal+Operations.h"
 
 @interface CertTests : XCTestCase
 
@@ -188,6 +200,7 @@
         ErrorTs *xs =
         [self checkResultAndEvaluate:trust
                                 cert:leaf
+                              issuer:intermediate
                               result:result
                                cache:ocspCache
                         expectCached:NO
@@ -252,6 +265,13 @@
             OCSPSecTrustPrintPolicies(trust);
             XCTAssert(OCSPSecTrustSSLPolicyPresent(trust, @"google.com"));
 
+            // The chain was never evaluated successfully, so the OCSP cache is not checked
+            // before the first evaluation
+            OCSPAuthURLSessionDelegateMetrics *metrics = [authURLSessionDelegate metrics];
+            XCTAssertEqual(metrics.ocspCacheFirstCompletions, 0);
+            XCTAssertEqual(metrics.rejections, 1);
+            XCTAssert(metrics.evaluations > 0);
+
             [expectResult fulfill];
         }
      ];
@@ -263,6 +283,522 @@
     }];
 }
 
+#pragma mark - Cached responses
+
+// Cached responses should be returned without a lookup
+- (void)testCachedResponseForCert
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+
+    XCTAssert([ocspCache cachedResponseForCert:cert issuer:issuer] == nil);
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:data];
+
+    OCSPResponse *response = [ocspCache cachedResponseForCert:cert issuer:issuer];
+    XCTAssertEqualObjects(response.data, data);
+
+    // Not cached for another issuer
+    XCTAssert([ocspCache cachedResponseForCert:cert issuer:[self rootCACert]] == nil);
+
+    // Expired responses are not returned
+    NSData *expired = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-120 nextUpdate:-60];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:expired];
+    XCTAssert([ocspCache cachedResponseForCert:cert issuer:issuer] == nil);
+}
+
+// Responses persisted to user defaults under keys which are not their CertID, as they were before
+// responses were keyed by CertID, should be moved to the key of their single response
+- (void)testLegacyUserDefaultsMigration
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    NSData *multiple = [self ocspResponseForCerts:@[(__bridge id)cert, (__bridge id)issuer]
+                                          issuers:@[(__bridge id)issuer, (__bridge id)[self rootCACert]]
+                                       thisUpdate:-60
+                                       nextUpdate:60 * 60];
+
+    NSString *userDefaultsKey = @"OCSPCache.legacy";
+    NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setObject:@{[[self cacheKey:1] base64String]: data,
+                              [[self cacheKey:2] base64String]: multiple}
+                     forKey:userDefaultsKey];
+
+    OCSPCache *ocspCache =
+    [[OCSPCache alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPCache] %@", logLine);
+    } andLoadFromUserDefaults:userDefaults withKey:userDefaultsKey];
+
+    [userDefaults removeObjectForKey:userDefaultsKey];
+
+    OCSPResponse *response = [ocspCache cachedResponseForCert:cert issuer:issuer];
+    XCTAssertEqualObjects(response.data, data);
+
+    // Responses with several single responses cannot be attributed to one certificate
+    XCTAssert([ocspCache cachedResponseForCert:issuer issuer:[self rootCACert]] == nil);
+}
+
+// Only the responses which fail the check should be evicted
+- (void)testValidateCacheValue
+{
+    EVP_PKEY *rootKey = [self generateRSAKey];
+    X509 *root = [self x509WithCommonName:@"Root" key:rootKey issuer:NULL issuerKey:NULL
+                                       ca:TRUE ocspSigning:FALSE];
+
+    EVP_PKEY *intermediateKey = [self generateRSAKey];
+    X509 *intermediate = [self x509WithCommonName:@"Intermediate" key:intermediateKey issuer:root
+                                        issuerKey:rootKey ca:TRUE ocspSigning:FALSE];
+
+    EVP_PKEY *leafKey = [self generateRSAKey];
+    X509 *leaf = [self x509WithCommonName:@"Leaf" key:leafKey issuer:intermediate
+                                issuerKey:intermediateKey ca:FALSE ocspSigning:FALSE];
+
+    SecCertificateRef rootRef = [self secCertFromX509:root];
+    SecCertificateRef intermediateRef = [self secCertFromX509:intermediate];
+    SecCertificateRef leafRef = [self secCertFromX509:leaf];
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+
+    NSError *err = nil;
+
+    // Nothing cached
+    XCTAssertFalse([ocspCache validateCacheValueForCert:leafRef issuer:intermediateRef error:&err]);
+    XCTAssert(err == nil);
+
+    // Signed by a key which is not the intermediate's
+    NSData *leafData = [self signedOCSPResponseForCert:leaf
+                                                issuer:intermediate
+                                                status:V_OCSP_CERTSTATUS_GOOD
+                                            thisUpdate:-60
+                                            nextUpdate:60 * 60
+                                                signer:intermediate
+                                             signerKey:leafKey];
+    NSData *intermediateData = [self signedOCSPResponseForCert:intermediate
+                                                        issuer:root
+                                                        status:V_OCSP_CERTSTATUS_GOOD
+                                                    thisUpdate:-60
+                                                    nextUpdate:24 * 60 * 60
+                                                        signer:root
+                                                     signerKey:rootKey];
+
+    [ocspCache setCacheValueForCert:leafRef issuer:intermediateRef data:leafData];
+    [ocspCache setCacheValueForCert:intermediateRef issuer:rootRef data:intermediateData];
+
+    XCTAssertTrue([ocspCache validateCacheValueForCert:intermediateRef issuer:rootRef error:&err]);
+    XCTAssert(err == nil);
+
+    XCTAssertFalse([ocspCache validateCacheValueForCert:leafRef issuer:intermediateRef error:&err]);
+    XCTAssertEqualObjects(err.domain, OCSPResponseErrorDomain);
+    XCTAssertEqual(err.code, OCSPResponseErrorCodeInvalidSignature);
+
+    // The intermediate response survives the eviction of the leaf response
+    XCTAssert([ocspCache cachedResponseForCert:leafRef issuer:intermediateRef] == nil);
+    XCTAssertEqualObjects([ocspCache cachedResponseForCert:intermediateRef issuer:rootRef].data,
+                          intermediateData);
+
+    CFRelease(leafRef);
+    CFRelease(intermediateRef);
+    CFRelease(rootRef);
+    X509_free(leaf);
+    X509_free(intermediate);
+    X509_free(root);
+    EVP_PKEY_free(leafKey);
+    EVP_PKEY_free(intermediateKey);
+    EVP_PKEY_free(rootKey);
+}
+
+// Responses which fail the check should not be cached
+- (void)testVerifyResponses
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    [OCSPStandInResponder setResponse:[self loadOCSPResponseFailOnError:
+                                       @"local_ocsp_urls_good_wrong_signer.der"]
+                                delay:0.01
+                              forHost:@"verify.standin"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    NSURL* (^modifyOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        return [NSURL URLWithString:@"http://verify.standin/"];
+    };
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    XCTAssertTrue(ocspCache.verifyResponses);
+
+    OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                      withIssuer:issuer
+                                      andTimeout:10
+                                   modifyOCSPURL:modifyOCSPURL
+                                         session:session];
+    XCTAssertEqual(r.err.code, OCSPCacheErrorCodeNoSuccessfulResponse);
+    NSError *underlyingError = [r.err.userInfo objectForKey:NSUnderlyingErrorKey];
+    XCTAssertEqualObjects(underlyingError.domain, OCSPResponseErrorDomain);
+    XCTAssertEqual(underlyingError.code, OCSPResponseErrorCodeInvalidSignature);
+    XCTAssert([ocspCache cachedResponseForCert:cert issuer:issuer] == nil);
+
+    // The failure is cached like an unsuccessful response
+    XCTAssertEqual([ocspCache.negativeCache metrics].insertions, 1);
+    [ocspCache.negativeCache removeAllErrors];
+
+    NSData *good = [self loadOCSPResponseFailOnError:@"local_ocsp_urls_good.der"];
+    [OCSPStandInResponder setResponse:good delay:0.01 forHost:@"verify.standin"];
+
+    r = [ocspCache lookup:cert
+               withIssuer:issuer
+               andTimeout:10
+            modifyOCSPURL:modifyOCSPURL
+                  session:session];
+    XCTAssertNil(r.err);
+    XCTAssertEqualObjects([ocspCache cachedResponseForCert:cert issuer:issuer].data, good);
+
+    // A valid response which says the certificate is revoked is cached and returned
+    [ocspCache removeCacheValueForCert:cert issuer:issuer];
+    NSData *revoked = [self loadOCSPResponseFailOnError:@"local_ocsp_urls_revoked.der"];
+    [OCSPStandInResponder setResponse:revoked delay:0.01 forHost:@"verify.standin"];
+
+    r = [ocspCache lookup:cert
+               withIssuer:issuer
+               andTimeout:10
+            modifyOCSPURL:modifyOCSPURL
+                  session:session];
+    XCTAssertNil(r.err);
+    XCTAssertEqualObjects(r.response.data, revoked);
+    XCTAssertEqualObjects([ocspCache cachedResponseForCert:cert issuer:issuer].data, revoked);
+    // No failure was cached since the first lookup
+    XCTAssertEqual([ocspCache.negativeCache metrics].insertions, 1);
+
+    [OCSPStandInResponder removeAllHosts];
+}
+
+// A challenge whose leaf certificate a valid OCSP response says is revoked should be rejected,
+// without falling through to the CRL checks
+- (void)testRevokedResponseRejectsChallenge
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    [OCSPStandInResponder setResponse:[self loadOCSPResponseFailOnError:
+                                       @"local_ocsp_urls_revoked.der"]
+                                delay:0.01
+                              forHost:@"leaf.standin"];
+    [OCSPStandInResponder setResponse:[self loadOCSPResponseFailOnError:@"intermediate_CA_good.der"]
+                                delay:0.01
+                              forHost:@"intermediate.standin"];
+
+    NSURL* (^modifyOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        if ([url.port isEqualToNumber:@8081]) {
+            return [NSURL URLWithString:@"http://leaf.standin/"];
+        }
+        return [NSURL URLWithString:@"http://intermediate.standin/"];
+    };
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPAuthURLSessionDelegate *authURLSessionDelegate =
+    [[OCSPAuthURLSessionDelegate alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPAuthURLSessionDelegate] %@", logLine);
+    }
+                                             ocspCache:[self ocspCacheWithLogging]
+                                         modifyOCSPURL:modifyOCSPURL
+                                               session:session
+                                               timeout:10];
+
+    SecTrustRef trust = [self trustForCerts:@[(__bridge id)cert, (__bridge id)issuer]
+                                       host:@"localhost"];
+    SecTrustSetAnchorCertificates(trust, (__bridge CFArrayRef)@[(__bridge id)root]);
+
+    XCTestExpectation *expectCompletion = [self expectationWithDescription:@"Expected completion"];
+
+    [authURLSessionDelegate evaluateTrustAsync:trust
+                         modifyOCSPURLOverride:nil
+                               sessionOverride:nil
+                             completionHandler:^(NSURLSessionAuthChallengeDisposition disposition,
+                                                 NSURLCredential * _Nullable credential) {
+        XCTAssertEqual(disposition, NSURLSessionAuthChallengeRejectProtectionSpace);
+        XCTAssertNil(credential);
+        [expectCompletion fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    OCSPAuthURLSessionDelegateMetrics *metrics = [authURLSessionDelegate metrics];
+    XCTAssertEqual(metrics.rejections, 1);
+    XCTAssertEqual(metrics.systemCRLCompletions, 0);
+    XCTAssertEqual(metrics.fallbackCompletions, 0);
+
+    CFRelease(trust);
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
+#pragma mark - Trust verdict cache
+
+- (SecTrustRef)trustForCerts:(NSArray*)certArray host:(NSString*)host CF_RETURNS_RETAINED
+{
+    SecPolicyRef policy = SecPolicyCreateSSL(YES, (__bridge CFStringRef)host);
+
+    SecTrustRef trust = NULL;
+    OSStatus status = SecTrustCreateWithCertificates((__bridge CFTypeRef)certArray,
+                                                     policy,
+                                                     &trust);
+    CFRelease(policy);
+    XCTAssert(status == 0, @"Unexpected OSStatus %d", status);
+
+    return trust;
+}
+
+// Verdicts should be keyed by certificates and policies, and expire
+- (void)testTrustVerdictCache
+{
+    NSArray *certArray = @[(__bridge id)[self localOCSPURLsCert]];
+    NSArray *otherCertArray = @[(__bridge id)[self noOCSPURLsCert]];
+
+    SecTrustRef trust = [self trustForCerts:certArray host:@"a.example.com"];
+    SecTrustRef sameTrust = [self trustForCerts:certArray host:@"a.example.com"];
+    SecTrustRef otherHostTrust = [self trustForCerts:certArray host:@"b.example.com"];
+    SecTrustRef otherCertTrust = [self trustForCerts:otherCertArray host:@"a.example.com"];
+
+    NSData *key = [OCSPTrustVerdictCache keyForTrust:trust policies:NULL];
+    XCTAssertEqualObjects(key, [OCSPTrustVerdictCache keyForTrust:sameTrust policies:NULL]);
+    XCTAssertNotEqualObjects(key, [OCSPTrustVerdictCache keyForTrust:otherHostTrust policies:NULL]);
+    XCTAssertNotEqualObjects(key, [OCSPTrustVerdictCache keyForTrust:otherCertTrust policies:NULL]);
+
+    // Adding a revocation policy changes the key
+    NSArray *policies = OCSPSecTrustPolicies(trust);
+    SecPolicyRef revocation = SecPolicyCreateRevocation(kSecRevocationOCSPMethod);
+    NSArray *morePolicies = [policies arrayByAddingObject:(__bridge_transfer id)revocation];
+    XCTAssertEqualObjects(key, [OCSPTrustVerdictCache keyForTrust:trust
+                                                         policies:(__bridge CFArrayRef)policies]);
+    XCTAssertNotEqualObjects(key,
+                             [OCSPTrustVerdictCache keyForTrust:trust
+                                                       policies:(__bridge CFArrayRef)morePolicies]);
+
+    CFRelease(trust);
+    CFRelease(sameTrust);
+    CFRelease(otherHostTrust);
+    CFRelease(otherCertTrust);
+
+    OCSPTrustVerdictCache *cache = [[OCSPTrustVerdictCache alloc] initWithMaxEntries:2];
+
+    XCTAssertFalse([cache hasVerdictForKey:key]);
+    [cache setVerdictForKey:key expiry:[NSDate dateWithTimeIntervalSinceNow:60]];
+    XCTAssert([cache hasVerdictForKey:key]);
+
+    // Verdicts which already expired are not cached
+    NSData *expiredKey = [@"expired" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setVerdictForKey:expiredKey expiry:[NSDate dateWithTimeIntervalSinceNow:-1]];
+    XCTAssertFalse([cache hasVerdictForKey:expiredKey]);
+
+    // Verdicts expire at their expiry
+    NSData *shortKey = [@"short" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setVerdictForKey:shortKey expiry:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+    XCTAssert([cache hasVerdictForKey:shortKey]);
+    [NSThread sleepForTimeInterval:1];
+    XCTAssertFalse([cache hasVerdictForKey:shortKey]);
+
+    // Verdicts expire after maxAge, whatever their expiry
+    cache.maxAge = 0.5;
+    NSData *maxAgeKey = [@"maxAge" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setVerdictForKey:maxAgeKey expiry:nil];
+    XCTAssert([cache hasVerdictForKey:maxAgeKey]);
+    [NSThread sleepForTimeInterval:1];
+    XCTAssertFalse([cache hasVerdictForKey:maxAgeKey]);
+
+    // The verdict closest to expiry is evicted to make room
+    cache.maxAge = 60 * 60;
+    NSData *laterKey = [@"later" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setVerdictForKey:laterKey expiry:[NSDate dateWithTimeIntervalSinceNow:120]];
+    NSData *newKey = [@"new" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setVerdictForKey:newKey expiry:[NSDate dateWithTimeIntervalSinceNow:120]];
+    XCTAssertFalse([cache hasVerdictForKey:key]);
+    XCTAssert([cache hasVerdictForKey:laterKey]);
+    XCTAssert([cache hasVerdictForKey:newKey]);
+
+    [cache removeVerdictForKey:newKey];
+    XCTAssertFalse([cache hasVerdictForKey:newKey]);
+
+    OCSPTrustVerdictCacheMetrics *metrics = [cache metrics];
+    XCTAssertEqual(metrics.entryCount, 1);
+    XCTAssertEqual(metrics.insertions, 5);
+    XCTAssertEqual(metrics.evictions, 3);
+    XCTAssertEqual(metrics.removals, 1);
+    XCTAssertEqual(metrics.hits, 5);
+    XCTAssertEqual(metrics.misses, 6);
+}
+
+// A cached verdict should only skip the revocation checks: a chain which no longer evaluates, e.g.
+// because the anchors changed, should not be accepted and its verdict should be dropped
+- (void)testTrustVerdictStillEvaluatesChain
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    EVP_PKEY *otherKey = [self generateRSAKey];
+    X509 *other = [self x509WithCommonName:@"Other Root" key:otherKey issuer:NULL issuerKey:NULL
+                                        ca:TRUE ocspSigning:FALSE];
+    SecCertificateRef otherRef = [self secCertFromX509:other];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPAuthURLSessionDelegate *authURLSessionDelegate =
+    [[OCSPAuthURLSessionDelegate alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPAuthURLSessionDelegate] %@", logLine);
+    }
+                                             ocspCache:[self ocspCacheWithLogging]
+                                         modifyOCSPURL:^NSURL*(NSURL *url) {
+        return [NSURL URLWithString:@"http://unknown.standin/"];
+    }
+                                               session:session
+                                               timeout:1];
+
+    SecTrustRef trust = [self trustForCerts:@[(__bridge id)cert, (__bridge id)issuer]
+                                       host:@"localhost"];
+    SecTrustSetAnchorCertificates(trust, (__bridge CFArrayRef)@[(__bridge id)otherRef]);
+    SecTrustSetAnchorCertificatesOnly(trust, TRUE);
+
+    NSData *key = [OCSPTrustVerdictCache keyForTrust:trust policies:NULL];
+    [authURLSessionDelegate.verdictCache setVerdictForKey:key
+                                                   expiry:[NSDate dateWithTimeIntervalSinceNow:60]];
+
+    XCTestExpectation *expectCompletion = [self expectationWithDescription:@"Expected completion"];
+
+    [authURLSessionDelegate evaluateTrustAsync:trust
+                         modifyOCSPURLOverride:nil
+                               sessionOverride:nil
+                             completionHandler:^(NSURLSessionAuthChallengeDisposition disposition,
+                                                 NSURLCredential * _Nullable credential) {
+        XCTAssertEqual(disposition, NSURLSessionAuthChallengeRejectProtectionSpace);
+        XCTAssertNil(credential);
+        [expectCompletion fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+
+    OCSPAuthURLSessionDelegateMetrics *metrics = [authURLSessionDelegate metrics];
+    XCTAssertEqual(metrics.verdictCacheCompletions, 0);
+    XCTAssertEqual(metrics.rejections, 1);
+    XCTAssertFalse([authURLSessionDelegate.verdictCache hasVerdictForKey:key]);
+
+    CFRelease(trust);
+    CFRelease(otherRef);
+    X509_free(other);
+    EVP_PKEY_free(otherKey);
+    [session invalidateAndCancel];
+}
+
+#pragma mark - Concurrent trust evaluation
+
+// Measure the throughput of many challenges evaluated at once. Every challenge should complete
+// exactly once, without more trust objects evaluated at once than the delegate allows.
+- (void)testConcurrentChallengesPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    NSArray *certArray = @[(__bridge id)cert, (__bridge id)issuer];
+    NSArray *anchors = @[(__bridge id)root];
+
+    // The leaf is checked by the responder of the intermediate CA on port 8081, and the
+    // intermediate CA by the responder of the root CA on port 8080
+    [OCSPStandInResponder setResponse:[self loadOCSPResponseFailOnError:@"local_ocsp_urls_good.der"]
+                                delay:0.05
+                              forHost:@"leaf.standin"];
+    [OCSPStandInResponder setResponse:[self loadOCSPResponseFailOnError:@"intermediate_CA_good.der"]
+                                delay:0.05
+                              forHost:@"intermediate.standin"];
+
+    NSURL* (^modifyOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        if ([url.port isEqualToNumber:@8081]) {
+            return [NSURL URLWithString:@"http://leaf.standin/"];
+        }
+        return [NSURL URLWithString:@"http://intermediate.standin/"];
+    };
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPAuthURLSessionDelegate *authURLSessionDelegate =
+    [[OCSPAuthURLSessionDelegate alloc] initWithLogger:^(NSString * _Nonnull logLine) {}
+                                             ocspCache:[[OCSPCache alloc] init]
+                                         modifyOCSPURL:modifyOCSPURL
+                                               session:session
+                                               timeout:10];
+    authURLSessionDelegate.maxConcurrentEvaluations = 4;
+    // Otherwise all challenges after the first are completed with its verdict
+    authURLSessionDelegate.verdictCache.maxAge = 0;
+
+    NSUInteger numChallenges = 64;
+
+    [self measureBlock:^{
+        NSMutableArray *trusts = [[NSMutableArray alloc] initWithCapacity:numChallenges];
+        for (NSUInteger i = 0; i < numChallenges; i++) {
+            SecTrustRef trust = [self trustForCerts:certArray host:@"localhost"];
+            SecTrustSetAnchorCertificates(trust, (__bridge CFArrayRef)anchors);
+            [trusts addObject:(__bridge_transfer id)trust];
+        }
+
+        dispatch_group_t group = dispatch_group_create();
+        __block NSUInteger completions = 0;
+        NSDate *start = [NSDate date];
+
+        for (id trust in trusts) {
+            dispatch_group_enter(group);
+            [authURLSessionDelegate evaluateTrustAsync:(__bridge SecTrustRef)trust
+                                 modifyOCSPURLOverride:nil
+                                       sessionOverride:nil
+                                     completionHandler:^(NSURLSessionAuthChallengeDisposition disposition,
+                                                         NSURLCredential * _Nullable credential) {
+                @synchronized (trusts) {
+                    completions++;
+                }
+                dispatch_group_leave(group);
+            }];
+        }
+
+        long timedOut = dispatch_group_wait(group,
+                                            dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC));
+        XCTAssertEqual(timedOut, 0);
+
+        NSTimeInterval elapsed = -[start timeIntervalSinceNow];
+        NSLog(@"%lu challenges completed in %.3fs (%.1f/s)",
+              (unsigned long)numChallenges, elapsed, numChallenges / elapsed);
+
+        // Completion handlers called more than once would be counted
+        [NSThread sleepForTimeInterval:0.1];
+        @synchronized (trusts) {
+            XCTAssertEqual(completions, numChallenges);
+        }
+    }];
+
+    OCSPAuthURLSessionDelegateMetrics *metrics = [authURLSessionDelegate metrics];
+    XCTAssertEqual(metrics.verdictCacheCompletions, 0);
+    XCTAssert(metrics.evaluations >= numChallenges);
+    XCTAssert(metrics.peakConcurrentEvaluations > 0);
+    XCTAssert(metrics.peakConcurrentEvaluations <= 4);
+
+    [OCSPStandInResponder removeAllHosts];
+}
+
 #pragma mark - Demo CA
 
 // Test OCSP Cache with Demo CA Certificate using local OCSP Server
@@ -319,6 +855,115 @@
     }
 }
 
+#pragma mark - Chain lookup
+
+// Chain lookup should report results in chain order without blocking, and complete exactly once
+// when cancelled or once the required links are resolved
+- (void)testAsyncLookupAll
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef intermediate = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    NSArray *certArray = @[(__bridge id)cert, (__bridge id)intermediate, (__bridge id)root];
+
+    SecPolicyRef policy = SecPolicyCreateBasicX509();
+
+    SecTrustRef trust;
+    OSStatus status = SecTrustCreateWithCertificates((__bridge CFTypeRef)certArray,
+                                                     policy,
+                                                     &trust);
+    CFRelease(policy);
+    if (status != 0) {
+        XCTFail(@"Unexpected OSStatus %d. Check https://osstatus.com/.", status);
+    }
+
+    NSData *leafResponse = [self ocspResponseForCert:cert
+                                              issuer:intermediate
+                                          thisUpdate:-60
+                                          nextUpdate:60 * 60];
+    NSData *intermediateResponse = [self ocspResponseForCert:intermediate
+                                                      issuer:root
+                                                  thisUpdate:-60
+                                                  nextUpdate:60 * 60];
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    [ocspCache setCacheValueForCert:cert issuer:intermediate data:leafResponse];
+    [ocspCache setCacheValueForCert:intermediate issuer:root data:intermediateResponse];
+
+    // All links cached
+    XCTestExpectation *expectAll = [self expectationWithDescription:@"Expected all results"];
+    __block NSUInteger linksResolved = 0;
+
+    [ocspCache lookupAll:trust
+              andTimeout:10
+           modifyOCSPURL:nil
+                 session:nil
+           requiredLinks:0
+          linkCompletion:^(NSUInteger index, OCSPCacheLookupResult *result) {
+        linksResolved++;
+    } completion:^(NSArray<OCSPCacheLookupResult*>* results) {
+        XCTAssertEqual([results count], 2);
+        XCTAssertEqual(linksResolved, 2);
+        XCTAssertEqualObjects([results objectAtIndex:0].response.data, leafResponse);
+        XCTAssertEqualObjects([results objectAtIndex:1].response.data, intermediateResponse);
+        [expectAll fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    // Only the leaf is required
+    [ocspCache removeCacheValueForCert:intermediate issuer:root];
+
+    XCTestExpectation *expectLeaf = [self expectationWithDescription:@"Expected leaf result"];
+
+    [ocspCache lookupAll:trust
+              andTimeout:10
+           modifyOCSPURL:nil
+                 session:nil
+           requiredLinks:1
+          linkCompletion:nil
+              completion:^(NSArray<OCSPCacheLookupResult*>* results) {
+        XCTAssertEqual([results count], 2);
+        XCTAssert([results objectAtIndex:0].cached);
+        [expectLeaf fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    // Cancelled before any link is resolved
+    [ocspCache removeCacheValueForCert:cert issuer:intermediate];
+
+    XCTestExpectation *expectCancelled = [self expectationWithDescription:@"Expected cancellation"];
+
+    OCSPCacheLookupToken *token =
+    [ocspCache lookupAll:trust
+              andTimeout:10
+           modifyOCSPURL:nil
+                 session:nil
+           requiredLinks:0
+          linkCompletion:nil
+              completion:^(NSArray<OCSPCacheLookupResult*>* results) {
+        XCTAssertEqual([results count], 2);
+        for (OCSPCacheLookupResult *result in results) {
+            if (result.err != nil) {
+                XCTAssertEqual(result.err.code, OCSPCacheErrorCodeLookupCancelled);
+            }
+        }
+        [expectCancelled fulfill];
+    }];
+
+    [token cancel];
+    [token cancel];
+    XCTAssertTrue(token.cancelled);
+
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    CFRelease(trust);
+}
+
 #pragma mark - Cache race
 
 // Test OCSP Cache with Demo CA Certificate using local OCSP Server
@@ -370,6 +1015,79 @@
     }];
 }
 
+#pragma mark - Lookup overhead
+
+// Measure the overhead of cache misses without network requests: each lookup starts a fetch, which
+// fails immediately since the certificate has no OCSP URLs, and is completed through the pending
+// fetch table.
+- (void)testLookupMissOverheadPerformance
+{
+    SecCertificateRef cert = [self noOCSPURLsCert];
+
+    SecCertificateRef issuer = [self rootCACert];
+
+    OCSPCache *ocspCache = [[OCSPCache alloc] init];
+    // Otherwise the failure is cached after the first lookup
+    [ocspCache.negativeCache setTTL:0 forErrorClass:OCSPNegativeCacheErrorClassNoOCSPURLs];
+
+    NSUInteger numLookups = 1000;
+
+    [self measureBlock:^{
+        dispatch_group_t group = dispatch_group_create();
+
+        for (NSUInteger i = 0; i < numLookups; i++) {
+            dispatch_group_enter(group);
+            [ocspCache lookup:cert
+                   withIssuer:issuer
+                   andTimeout:10
+                modifyOCSPURL:nil
+                      session:nil
+                   completion:^(OCSPCacheLookupResult *r) {
+                XCTAssert(r.err != nil);
+                dispatch_group_leave(group);
+            }];
+        }
+
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    }];
+}
+
+// Measure the overhead of lookups which hit the cache. These share the response decoded when the
+// entry was created.
+- (void)testLookupHitOverheadPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    OCSPCache *ocspCache = [[OCSPCache alloc] init];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:data];
+
+    NSUInteger numLookups = 1000;
+
+    [self measureBlock:^{
+        dispatch_group_t group = dispatch_group_create();
+
+        for (NSUInteger i = 0; i < numLookups; i++) {
+            dispatch_group_enter(group);
+            [ocspCache lookup:cert
+                   withIssuer:issuer
+                   andTimeout:10
+                modifyOCSPURL:nil
+                      session:nil
+                   completion:^(OCSPCacheLookupResult *r) {
+                XCTAssert(r.err == nil);
+                XCTAssert(r.cached);
+                dispatch_group_leave(group);
+            }];
+        }
+
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    }];
+}
+
 #pragma mark - No OCSP URLs
 
 // Certificate with no OCSP URLs should return an error
@@ -416,6 +1134,108 @@
     }];
 }
 
+// Lookups should fail fast while a failure is cached, and reach the responder again once it expires
+- (void)testNegativeCache
+{
+    SecCertificateRef noURLsCert = [self noOCSPURLsCert];
+
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    [OCSPStandInResponder setResponse:nil delay:0.01 forHost:@"down.standin"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    NSURL* (^modifyOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        return [NSURL URLWithString:@"http://down.standin/"];
+    };
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    [ocspCache setRequestMethod:OCSPRequestMethodPOST
+                     forOCSPURL:[NSURL URLWithString:@"http://down.standin/"]];
+    [ocspCache.negativeCache setTTL:0.5 forErrorClass:OCSPNegativeCacheErrorClassNetworkFailure];
+
+    // Certificate without OCSP URLs
+    for (int i = 0; i < 2; i++) {
+        OCSPCacheLookupResult *r = [ocspCache lookup:noURLsCert
+                                          withIssuer:root
+                                          andTimeout:10
+                                       modifyOCSPURL:nil
+                                             session:nil];
+        XCTAssertEqual(r.err.code, OCSPCacheErrorConstructingOCSPRequests);
+    }
+
+    OCSPNegativeCacheMetrics *metrics = [ocspCache.negativeCache metrics];
+    XCTAssertEqual(metrics.insertions, 1);
+    XCTAssertEqual(metrics.hits, 1);
+
+    // Responder which refuses connections
+    for (int i = 0; i < 2; i++) {
+        OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                          withIssuer:issuer
+                                          andTimeout:10
+                                       modifyOCSPURL:modifyOCSPURL
+                                             session:session];
+        XCTAssertEqual(r.err.code, OCSPCacheErrorCodeNoSuccessfulResponse);
+    }
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"down.standin"], 1);
+
+    metrics = [ocspCache.negativeCache metrics];
+    XCTAssertEqual(metrics.entryCount, 2);
+    XCTAssertEqual(metrics.insertions, 2);
+    XCTAssertEqual(metrics.hits, 2);
+
+    // The network failure expires
+    [NSThread sleepForTimeInterval:0.5];
+
+    OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                      withIssuer:issuer
+                                      andTimeout:10
+                                   modifyOCSPURL:modifyOCSPURL
+                                         session:session];
+    XCTAssertEqual(r.err.code, OCSPCacheErrorCodeNoSuccessfulResponse);
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"down.standin"], 2);
+    XCTAssertEqual([ocspCache.negativeCache metrics].evictions, 1);
+
+    // A response obtained for the certificate replaces the failure
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:0 nextUpdate:3600];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:d];
+    XCTAssertEqual([ocspCache.negativeCache metrics].removals, 1);
+
+    // A lookup which times out before the responder answers is not cached, so a lookup with a
+    // longer timeout is not failed by it
+    OCSPCache *slowCache = [self ocspCacheWithLogging];
+    slowCache.verifyResponses = FALSE;
+    [OCSPStandInResponder setResponse:d delay:0.5 forHost:@"slow.standin"];
+
+    NSURL* (^slowOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        return [NSURL URLWithString:@"http://slow.standin/"];
+    };
+
+    r = [slowCache lookup:cert
+               withIssuer:issuer
+               andTimeout:0.1
+            modifyOCSPURL:slowOCSPURL
+                  session:session];
+    XCTAssertEqual(r.err.code, OCSPCacheErrorCodeLookupTimedOut);
+    XCTAssertEqual([slowCache.negativeCache metrics].insertions, 0);
+
+    r = [slowCache lookup:cert
+               withIssuer:issuer
+               andTimeout:10
+            modifyOCSPURL:slowOCSPURL
+                  session:session];
+    XCTAssertNil(r.err);
+    XCTAssertEqualObjects(r.response.data, d);
+
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
 # pragma mark - Bad OCSP URLs
 
 // Test OCSP Cache with Demo CA Certificate with bad OCSP URLs using local OCSP Server
@@ -542,7 +1362,7 @@
     /// Cache recovery from cached invalid data
 
     // Cache invalid data
-    [ocspCache setCacheValueForCert:certRef data:[[NSData alloc] init]];
+    [ocspCache setCacheValueForCert:certRef issuer:issuerRef data:[[NSData alloc] init]];
 
     xs =
     [self cacheBasicTest:trust
@@ -557,6 +1377,28 @@
 
     [errors mappendWithContext:xs context:@"CacheInvalidData"];
 
+    /// Cache miss on expired response
+
+    // Cache a response whose nextUpdate has passed
+    NSData *expired = [self ocspResponseForCert:certRef
+                                         issuer:issuerRef
+                                     thisUpdate:-2 * 60 * 60
+                                     nextUpdate:-60 * 60];
+    [ocspCache setCacheValueForCert:certRef issuer:issuerRef data:expired];
+
+    xs =
+    [self cacheBasicTest:trust
+                 certRef:certRef
+                  issuer:issuerRef
+                   cache:ocspCache
+                 timeout:defaultTimeout
+            expectCached:NO
+           expectSuccess:YES
+     expectLookupFailure:NO
+          evictOnFailure:NO];
+
+    [errors mappendWithContext:xs context:@"CacheExpiredResponse"];
+
     /// Cache recovery from cached invalid response
 
     // Create invalid response which indicates success
@@ -566,7 +1408,7 @@
     NSData *d = [NSData dataWithBytes:ocspResponse length:len];
 
     // Cache valid data, but invalid response
-    [ocspCache setCacheValueForCert:certRef data:d];
+    [ocspCache setCacheValueForCert:certRef issuer:issuerRef data:d];
 
     // First attempt fails, but the invalid response is evicted
     // NOTE: if this test starts failing the OCSP response may have
@@ -601,7 +1443,7 @@
 
     /// Lookup timeout
 
-    [ocspCache removeCacheValueForCert:certRef];
+    [ocspCache removeCacheValueForCert:certRef issuer:issuerRef];
 
     xs =
     [self cacheBasicTest:trust
@@ -620,7 +1462,7 @@
     /// Tests a previous bug where pending responses were not cleared in OCSPCache when a timeout
     /// occurred.
 
-    [ocspCache removeCacheValueForCert:certRef];
+    [ocspCache removeCacheValueForCert:certRef issuer:issuerRef];
 
     xs =
     [self cacheBasicTest:trust
@@ -665,6 +1507,7 @@
          ErrorTs *xs =
          [self checkResultAndEvaluate:trust
                                  cert:certRef
+                               issuer:issuerRef
                                result:result
                                 cache:cache
                          expectCached:expectCached
@@ -691,6 +1534,7 @@
 // Helper for testing the cache
 - (ErrorTs*)checkResultAndEvaluate:(SecTrustRef)trust
                               cert:(SecCertificateRef)cert
+                            issuer:(SecCertificateRef)issuer
                             result:(OCSPCacheLookupResult*)result
                              cache:(OCSPCache*)cache
                       expectCached:(BOOL)expectCached
@@ -783,29 +1627,1912 @@
     }
 
     if (!success && evictOnFailure) {
-        [cache removeCacheValueForCert:cert];
+        [cache removeCacheValueForCert:cert issuer:issuer];
     }
 
     return errors;
 }
 
-#pragma mark - OCSPCache initialization
+#pragma mark - Cache entries
 
-- (OCSPCache*)ocspCacheWithLogging {
-    OCSPCache *cache=
-    [[OCSPCache alloc] initWithLogger:^(NSString * _Nonnull logLine) {
-        NSLog(@"[OCSPCache] %@", logLine);
-    }];
+// Cache entries should expose the validity window of the response
+- (void)testCacheEntryValidityWindow
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
 
-    return cache;
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *fresh = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:fresh];
+    XCTAssert(entry.thisUpdate != nil);
+    XCTAssert(entry.nextUpdate != nil);
+    XCTAssert(entry.producedAt != nil);
+    XCTAssert([entry.thisUpdate compare:entry.nextUpdate] == NSOrderedAscending);
+    XCTAssertFalse([entry expiredAt:[NSDate date]]);
+
+    // The decoded response is kept with the entry and its single responses are decoded once
+    XCTAssert(entry.response != nil);
+    XCTAssertEqualObjects(entry.response.data, fresh);
+    XCTAssert([[entry.response singleResponses] count] == 1);
+    XCTAssert([entry.response singleResponses] == [entry.response singleResponses]);
+    XCTAssert([entry.response hasSingleResponseForCert:cert issuer:issuer]);
+    XCTAssertTrue([entry expiredAt:[NSDate dateWithTimeIntervalSinceNow:2 * 60 * 60]]);
+
+    NSData *expired = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-120 nextUpdate:-60];
+    entry = [OCSPCacheEntry entryWithData:expired];
+    XCTAssertTrue([entry expiredAt:[NSDate date]]);
+
+    XCTAssertFalse(entry.invalid);
+
+    // A response without nextUpdate expires a bounded time after its thisUpdate
+    NSData *noNextUpdate = [self ocspResponseForCert:cert
+                                              issuer:issuer
+                                          thisUpdate:-60
+                                          nextUpdate:CertTestsNoNextUpdate];
+    entry = [OCSPCacheEntry entryWithData:noNextUpdate];
+    XCTAssertFalse(entry.invalid);
+    XCTAssert(entry.nextUpdate == nil);
+    XCTAssertEqualWithAccuracy([entry.expiry timeIntervalSinceDate:entry.thisUpdate],
+                               OCSPCacheEntryMaxAgeWithoutNextUpdate, 1);
+    XCTAssertFalse([entry expiredAt:[NSDate date]]);
+    XCTAssertTrue([entry expiredAt:[NSDate dateWithTimeIntervalSinceNow:OCSPCacheEntryMaxAgeWithoutNextUpdate]]);
+
+    // Invalid data has no validity window and is always expired
+    entry = [OCSPCacheEntry entryWithData:[[NSData alloc] init]];
+    XCTAssert(entry.response == nil);
+    XCTAssert(entry.nextUpdate == nil);
+    XCTAssertTrue(entry.invalid);
+    XCTAssertTrue([entry expiredAt:[NSDate date]]);
 }
 
-#pragma mark - OCSPAuthURLSessionDelegate initialization
+// Single responses should remain valid after the response which they were decoded from is released
+- (void)testSingleResponseOutlivesResponse
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
 
-- (OCSPAuthURLSessionDelegate*)ocspAuthURLSessionDelegateWithLogging {
-    void (^logger)(NSString * _Nonnull logLine) =
-    ^(NSString * _Nonnull logLine) {
-        NSLog(@"[OCSPAuthURLSessionDelegate] %@", logLine);
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPSingleResponse *singleResponse;
+    @autoreleasepool {
+        OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+        singleResponse = [[response singleResponses] firstObject];
+    }
+
+    XCTAssert(singleResponse != nil);
+    XCTAssert(singleResponse.response->certStatus->type == V_OCSP_CERTSTATUS_GOOD);
+
+    NSDate *thisUpdate, *nextUpdate;
+    XCTAssert([singleResponse thisUpdate:&thisUpdate nextUpdate:&nextUpdate] == nil);
+    XCTAssert([thisUpdate compare:nextUpdate] == NSOrderedAscending);
+
+    BOOL expired;
+    XCTAssert([singleResponse expired:&expired] == nil);
+    XCTAssertFalse(expired);
+}
+
+// Measure the cost of decoding a response, which is paid once per cache entry rather than on
+// every cache hit.
+- (void)testResponseDecodePerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    NSUInteger numDecodes = 1000;
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numDecodes; i++) {
+            OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:data];
+            XCTAssert(entry.response != nil);
+        }
+    }];
+}
+
+#pragma mark - Response check
+
+- (void)testResponseCheck
+{
+    EVP_PKEY *issuerKey = [self generateRSAKey];
+    X509 *issuer = [self x509WithCommonName:@"Issuer" key:issuerKey issuer:NULL issuerKey:NULL
+                                         ca:TRUE ocspSigning:FALSE];
+
+    EVP_PKEY *leafKey = [self generateRSAKey];
+    X509 *leaf = [self x509WithCommonName:@"Leaf" key:leafKey issuer:issuer issuerKey:issuerKey
+                                       ca:FALSE ocspSigning:FALSE];
+    X509 *otherLeaf = [self x509WithCommonName:@"Other Leaf" key:leafKey issuer:issuer
+                                     issuerKey:issuerKey ca:FALSE ocspSigning:FALSE];
+
+    // Delegated responders, with and without the OCSP signing extended key usage
+    EVP_PKEY *responderKey = [self generateRSAKey];
+    X509 *responder = [self x509WithCommonName:@"Responder" key:responderKey issuer:issuer
+                                     issuerKey:issuerKey ca:FALSE ocspSigning:TRUE];
+    X509 *nonResponder = [self x509WithCommonName:@"Non-responder" key:responderKey issuer:issuer
+                                        issuerKey:issuerKey ca:FALSE ocspSigning:FALSE];
+
+    // Not issued by the issuer
+    EVP_PKEY *otherKey = [self generateRSAKey];
+    X509 *other = [self x509WithCommonName:@"Other" key:otherKey issuer:NULL issuerKey:NULL
+                                        ca:TRUE ocspSigning:TRUE];
+
+    SecCertificateRef issuerRef = [self secCertFromX509:issuer];
+    SecCertificateRef leafRef = [self secCertFromX509:leaf];
+    SecCertificateRef otherLeafRef = [self secCertFromX509:otherLeaf];
+
+    OCSPResponseErrorCode (^check)(NSData*, SecCertificateRef) =
+    ^OCSPResponseErrorCode(NSData *data, SecCertificateRef cert) {
+        OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+        XCTAssert(response != nil);
+        NSError *err = [response checkForCert:cert issuer:issuerRef];
+        if (err == nil) {
+            return 0;
+        }
+        XCTAssertEqualObjects(err.domain, OCSPResponseErrorDomain);
+        return err.code;
+    };
+
+    NSData *(^sign)(int, long, long, X509*, EVP_PKEY*) =
+    ^NSData*(int status, long thisUpdate, long nextUpdate, X509 *signer, EVP_PKEY *signerKey) {
+        return [self signedOCSPResponseForCert:leaf
+                                        issuer:issuer
+                                        status:status
+                                    thisUpdate:thisUpdate
+                                    nextUpdate:nextUpdate
+                                        signer:signer
+                                     signerKey:signerKey];
+    };
+
+    // Signed by the issuer
+    NSData *good = sign(V_OCSP_CERTSTATUS_GOOD, -60, 60 * 60, issuer, issuerKey);
+    XCTAssertEqual(check(good, leafRef), 0);
+
+    // Signed by a delegated responder
+    XCTAssertEqual(check(sign(V_OCSP_CERTSTATUS_GOOD, -60, 60 * 60, responder, responderKey),
+                         leafRef), 0);
+
+    // Responder certificate without the OCSP signing extended key usage
+    XCTAssertEqual(check(sign(V_OCSP_CERTSTATUS_GOOD, -60, 60 * 60, nonResponder, responderKey),
+                         leafRef), OCSPResponseErrorCodeInvalidSignature);
+
+    // Responder certificate not issued by the issuer
+    XCTAssertEqual(check(sign(V_OCSP_CERTSTATUS_GOOD, -60, 60 * 60, other, otherKey), leafRef),
+                   OCSPResponseErrorCodeInvalidSignature);
+
+    // Unsigned
+    XCTAssertEqual(check([self ocspResponseForCert:leafRef
+                                            issuer:issuerRef
+                                        thisUpdate:-60
+                                        nextUpdate:60 * 60], leafRef),
+                   OCSPResponseErrorCodeInvalidSignature);
+
+    // Another certificate of the issuer
+    XCTAssertEqual(check(good, otherLeafRef), OCSPResponseErrorCodeNoSingleResponseForCert);
+
+    // Revoked and unknown are answers, which pass the check so that they are kept and acted on
+    NSData *revoked = sign(V_OCSP_CERTSTATUS_REVOKED, -60, 60 * 60, issuer, issuerKey);
+    NSData *unknown = sign(V_OCSP_CERTSTATUS_UNKNOWN, -60, 60 * 60, issuer, issuerKey);
+    XCTAssertEqual(check(revoked, leafRef), 0);
+    XCTAssertEqual(check(unknown, leafRef), 0);
+    XCTAssertTrue([[[OCSPResponse alloc] initWithData:revoked] reportsRevokedOrUnknownForCert:leafRef
+                                                                                        issuer:issuerRef]);
+    XCTAssertTrue([[[OCSPResponse alloc] initWithData:unknown] reportsRevokedOrUnknownForCert:leafRef
+                                                                                        issuer:issuerRef]);
+    XCTAssertFalse([[[OCSPResponse alloc] initWithData:good] reportsRevokedOrUnknownForCert:leafRef
+                                                                                      issuer:issuerRef]);
+
+    // Unless they are not authentic
+    NSData *forgedRevoked = sign(V_OCSP_CERTSTATUS_REVOKED, -60, 60 * 60, other, otherKey);
+    XCTAssertFalse([[[OCSPResponse alloc] initWithData:forgedRevoked]
+                    reportsRevokedOrUnknownForCert:leafRef issuer:issuerRef]);
+
+    // Expired, and not yet valid beyond the allowed clock skew
+    XCTAssertEqual(check(sign(V_OCSP_CERTSTATUS_GOOD, -120, -60, issuer, issuerKey), leafRef),
+                   OCSPResponseErrorCodeOutsideValidityWindow);
+    XCTAssertEqual(check(sign(V_OCSP_CERTSTATUS_GOOD, 60 * 60, 2 * 60 * 60, issuer, issuerKey),
+                         leafRef), OCSPResponseErrorCodeOutsideValidityWindow);
+
+    // Unsuccessful
+    OCSP_RESPONSE *r = OCSP_response_create(OCSP_RESPONSE_STATUS_TRYLATER, NULL);
+    unsigned char *der = NULL;
+    int len = i2d_OCSP_RESPONSE(r, &der);
+    NSData *unsuccessful = [NSData dataWithBytes:der length:len];
+    OPENSSL_free(der);
+    OCSP_RESPONSE_free(r);
+    XCTAssertEqual(check(unsuccessful, leafRef), OCSPResponseErrorCodeUnsuccessful);
+
+    CFRelease(otherLeafRef);
+    CFRelease(leafRef);
+    CFRelease(issuerRef);
+    X509_free(other);
+    X509_free(nonResponder);
+    X509_free(responder);
+    X509_free(otherLeaf);
+    X509_free(leaf);
+    X509_free(issuer);
+    EVP_PKEY_free(otherKey);
+    EVP_PKEY_free(responderKey);
+    EVP_PKEY_free(leafKey);
+    EVP_PKEY_free(issuerKey);
+}
+
+// Responses generated by `openssl ocsp` for the demo CA by setup.sh
+- (void)testResponseCheckWithOpenSSLFixtures
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    NSError* (^check)(NSString*, SecCertificateRef, SecCertificateRef) =
+    ^NSError*(NSString *fileName, SecCertificateRef c, SecCertificateRef i) {
+        NSData *data = [self loadOCSPResponseFailOnError:fileName];
+        OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+        XCTAssert(response != nil);
+        return [response checkForCert:c issuer:i];
+    };
+
+    // Signed by the delegated responder of the issuer, as the demo OCSP servers do
+    XCTAssertNil(check(@"local_ocsp_urls_good.der", cert, issuer));
+
+    // Signed by the issuer, without certificates
+    XCTAssertNil(check(@"local_ocsp_urls_good_signed_by_issuer.der", cert, issuer));
+
+    XCTAssertNil(check(@"intermediate_CA_good.der", issuer, root));
+
+    // Signed by a responder of another CA
+    XCTAssertEqual(check(@"local_ocsp_urls_good_wrong_signer.der", cert, issuer).code,
+                   OCSPResponseErrorCodeInvalidSignature);
+
+    // Revoked is an answer, which passes the check
+    XCTAssertNil(check(@"local_ocsp_urls_revoked.der", cert, issuer));
+    OCSPResponse *revoked =
+        [[OCSPResponse alloc] initWithData:[self loadOCSPResponseFailOnError:
+                                            @"local_ocsp_urls_revoked.der"]];
+    XCTAssertTrue([revoked reportsRevokedOrUnknownForCert:cert issuer:issuer]);
+
+    XCTAssertEqual(check(@"local_ocsp_urls_good.der", [self noOCSPURLsCert], issuer).code,
+                   OCSPResponseErrorCodeNoSingleResponseForCert);
+
+    // Checked against the wrong issuer
+    XCTAssertEqual(check(@"intermediate_CA_good.der", issuer, issuer).code,
+                   OCSPResponseErrorCodeNoSingleResponseForCert);
+}
+
+// The validity window should be checked on every call, even though the other checks are memoized
+- (void)testResponseCheckValidityWindow
+{
+    EVP_PKEY *issuerKey = [self generateRSAKey];
+    X509 *issuer = [self x509WithCommonName:@"Issuer" key:issuerKey issuer:NULL issuerKey:NULL
+                                         ca:TRUE ocspSigning:FALSE];
+
+    EVP_PKEY *leafKey = [self generateRSAKey];
+    X509 *leaf = [self x509WithCommonName:@"Leaf" key:leafKey issuer:issuer issuerKey:issuerKey
+                                       ca:FALSE ocspSigning:FALSE];
+
+    SecCertificateRef issuerRef = [self secCertFromX509:issuer];
+    SecCertificateRef leafRef = [self secCertFromX509:leaf];
+
+    NSData *data = [self signedOCSPResponseForCert:leaf
+                                            issuer:issuer
+                                            status:V_OCSP_CERTSTATUS_GOOD
+                                        thisUpdate:-60
+                                        nextUpdate:1
+                                            signer:issuer
+                                         signerKey:issuerKey];
+    OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+
+    XCTAssertNil([response checkForCert:leafRef issuer:issuerRef]);
+
+    [NSThread sleepForTimeInterval:1.5];
+
+    XCTAssertEqual([response checkForCert:leafRef issuer:issuerRef].code,
+                   OCSPResponseErrorCodeOutsideValidityWindow);
+
+    CFRelease(leafRef);
+    CFRelease(issuerRef);
+    X509_free(leaf);
+    X509_free(issuer);
+    EVP_PKEY_free(leafKey);
+    EVP_PKEY_free(issuerKey);
+}
+
+// Measure repeated checks of a shared response, which only verify the signature once
+- (void)testResponseCheckPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self loadOCSPResponseFailOnError:@"local_ocsp_urls_good.der"];
+    OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+
+    NSUInteger numChecks = 1000;
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numChecks; i++) {
+            XCTAssertNil([response checkForCert:cert issuer:issuer]);
+        }
+    }];
+}
+
+#pragma mark - Cache store
+
+// Store should stay within its entry budget, giving referenced entries a second chance
+- (void)testMemoryCacheStoreEntryBudget
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPMemoryCacheStore *store = [[OCSPMemoryCacheStore alloc] initWithMaxEntries:2 maxBytes:0];
+
+    [store setEntry:[OCSPCacheEntry entryWithData:d] forKey:[self cacheKey:0]];
+    [store setEntry:[OCSPCacheEntry entryWithData:d] forKey:[self cacheKey:1]];
+
+    // Reference "a" so "b" is evicted when "c" is added
+    XCTAssert([store entryForKey:[self cacheKey:0]] != nil);
+
+    [store setEntry:[OCSPCacheEntry entryWithData:d] forKey:[self cacheKey:2]];
+
+    XCTAssert([store entryForKey:[self cacheKey:0]] != nil);
+    XCTAssert([store entryForKey:[self cacheKey:1]] == nil);
+    XCTAssert([store entryForKey:[self cacheKey:2]] != nil);
+
+    OCSPCacheStoreMetrics *metrics = [store metrics];
+    XCTAssertEqual(metrics.entryCount, 2);
+    XCTAssertEqual(metrics.byteCount, 2 * d.length);
+    XCTAssertEqual(metrics.capacityEvictions, 1);
+    XCTAssertEqual(metrics.hits, 3);
+    XCTAssertEqual(metrics.misses, 1);
+
+    XCTAssertTrue([store removeEntryForKey:[self cacheKey:0]]);
+    XCTAssertFalse([store removeEntryForKey:[self cacheKey:0]]);
+    XCTAssertEqual([store metrics].removals, 1);
+    XCTAssertEqual([store metrics].byteCount, d.length);
+}
+
+// Store should stay within its byte budget and evict expired entries first
+- (void)testMemoryCacheStoreByteBudgetAndExpiry
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *fresh = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    NSData *expired = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-120 nextUpdate:-60];
+
+    OCSPMemoryCacheStore *store =
+    [[OCSPMemoryCacheStore alloc] initWithMaxEntries:0 maxBytes:2 * fresh.length];
+
+    [store setEntry:[OCSPCacheEntry entryWithData:fresh] forKey:[self cacheKey:0]];
+    [store setEntry:[OCSPCacheEntry entryWithData:expired] forKey:[self cacheKey:1]];
+    [store setEntry:[OCSPCacheEntry entryWithData:fresh] forKey:[self cacheKey:2]];
+
+    // The expired entry is evicted even though "a" is older
+    XCTAssertEqual([store metrics].expiryEvictions, 1);
+    XCTAssertEqual([store metrics].capacityEvictions, 0);
+    XCTAssert([store entryForKey:[self cacheKey:0]] != nil);
+    XCTAssert([store entryForKey:[self cacheKey:2]] != nil);
+
+    // Expired entries are never returned
+    [store setEntry:[OCSPCacheEntry entryWithData:expired] forKey:[self cacheKey:1]];
+    XCTAssert([store entryForKey:[self cacheKey:1]] == nil);
+    XCTAssertEqual([store metrics].expiryEvictions, 2);
+
+    XCTAssertEqual([store removeEntriesExpiredAt:[NSDate dateWithTimeIntervalSinceNow:2 * 60 * 60]], 2);
+    XCTAssertEqual([store metrics].entryCount, 0);
+}
+
+// Sharded store should split its budget between shards and aggregate their metrics
+- (void)testShardedCacheStore
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPShardedCacheStore *store =
+    [[OCSPShardedCacheStore alloc] initWithShardCount:4 maxEntries:64 maxBytes:0];
+
+    for (int i = 0; i < 256; i++) {
+        [store setEntry:[OCSPCacheEntry entryWithData:d] forKey:[self cacheKey:i]];
+    }
+
+    OCSPCacheStoreMetrics *metrics = [store metrics];
+    XCTAssertLessThanOrEqual(metrics.entryCount, 64);
+    XCTAssertEqual(metrics.entryCount + metrics.capacityEvictions, 256);
+
+    __block NSUInteger enumerated = 0;
+    [store enumerateEntriesUsingBlock:^(OCSPCacheKey *key, OCSPCacheEntry *entry, BOOL *stop) {
+        XCTAssert([store entryForKey:key] != nil);
+        enumerated++;
+    }];
+    XCTAssertEqual(enumerated, metrics.entryCount);
+    XCTAssertEqual([store metrics].hits, enumerated);
+}
+
+// Measure lookups of cached entries from many threads at once
+- (void)testCacheStoreConcurrentReadPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    NSUInteger numKeys = 64;
+    NSUInteger numReaders = 32;
+    NSUInteger readsPerReader = 10000;
+
+    OCSPShardedCacheStore *store = [[OCSPShardedCacheStore alloc] init];
+
+    NSMutableArray<OCSPCacheKey*>* keys = [[NSMutableArray alloc] init];
+    for (NSUInteger i = 0; i < numKeys; i++) {
+        OCSPCacheKey *key = [self cacheKey:i];
+        [store setEntry:[OCSPCacheEntry entryWithData:d] forKey:key];
+        [keys addObject:key];
+    }
+
+    dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+
+    [self measureBlock:^{
+        dispatch_apply(numReaders, queue, ^(size_t reader) {
+            for (NSUInteger i = 0; i < readsPerReader; i++) {
+                [store entryForKey:[keys objectAtIndex:(reader + i) % numKeys]];
+            }
+        });
+    }];
+}
+
+// Keys should be derived from the CertID, so they match the single responses for the certificate
+- (void)testCacheKey
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    // A distinct certificate object for the same issuer
+    NSData *der = (__bridge_transfer NSData*)SecCertificateCopyData(issuer);
+    SecCertificateRef issuerCopy = SecCertificateCreateWithData(NULL, (__bridge CFDataRef)der);
+
+    OCSPCacheKey *key = [OCSPCacheKey keyForCertificate:cert issuer:issuer];
+    XCTAssertEqualObjects(key, [OCSPCacheKey keyForCertificate:cert issuer:issuerCopy]);
+    XCTAssertEqual([key hash], [[OCSPCacheKey keyForCertificate:cert issuer:issuerCopy] hash]);
+    XCTAssertNotEqualObjects(key, [OCSPCacheKey keyForCertificate:issuer issuer:root]);
+
+    // Keys are memoized per certificate, but only for the issuer they were derived with
+    XCTAssertTrue([OCSPCacheKey keyForCertificate:cert issuer:issuer] == key);
+    XCTAssertNotEqualObjects(key, [OCSPCacheKey keyForCertificate:cert issuer:root]);
+    XCTAssertEqualObjects(key, [OCSPCacheKey keyForCertificate:cert issuer:issuer]);
+
+    CFRelease(issuerCopy);
+
+    // Same key as the single response in a response for the certificate
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    OCSPResponse *response = [[OCSPResponse alloc] initWithData:d];
+    XCTAssertEqualObjects([OCSPCacheKey keysForResponse:response], @[key]);
+
+    XCTAssertEqual([key data].length, OCSPCacheKeyLength);
+    XCTAssertEqualObjects([OCSPCacheKey keyWithData:[key data]], key);
+    XCTAssertEqualObjects([OCSPCacheKey keyWithBase64String:[key base64String]], key);
+    XCTAssert([OCSPCacheKey keyWithData:[NSData data]] == nil);
+    XCTAssert([OCSPCacheKey keyWithBase64String:@"not a key"] == nil);
+
+    XCTAssertEqual([[self cacheKey:0] compare:[self cacheKey:1]], NSOrderedAscending);
+    XCTAssertEqual([[self cacheKey:1] compare:[self cacheKey:1]], NSOrderedSame);
+}
+
+/// Key whose bytes are the big-endian encoding of n, so keys sort in the order of n.
+- (OCSPCacheKey*)cacheKey:(NSUInteger)n {
+    uint8_t bytes[OCSPCacheKeyLength] = {0};
+    for (int i = OCSPCacheKeyLength - 1; i >= 0 && n > 0; i--, n >>= 8) {
+        bytes[i] = n & 0xff;
+    }
+    return [OCSPCacheKey keyWithBytes:bytes];
+}
+
+#pragma mark - Proactive refresh
+
+// Refreshes should be scheduled within the configured fraction of the validity window
+- (void)testRefreshDate
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:0 nextUpdate:1000];
+    OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:d];
+
+    OCSPCacheRefreshPolicy *policy = [OCSPCacheRefreshPolicy defaultPolicy];
+    policy.refreshFraction = 0.5;
+    policy.jitterFraction = 0.1;
+
+    for (int i = 0; i < 100; i++) {
+        NSDate *refreshDate = [OCSPCacheRefresher refreshDateForEntry:entry policy:policy];
+        NSTimeInterval offset = [refreshDate timeIntervalSinceDate:entry.thisUpdate];
+        XCTAssert(offset >= 400 && offset <= 600, @"Unexpected refresh offset %f", offset);
+    }
+
+    // No refresh without a validity window
+    entry = [OCSPCacheEntry entryWithData:[[NSData alloc] init]];
+    XCTAssert([OCSPCacheRefresher refreshDateForEntry:entry policy:policy] == nil);
+}
+
+// Response should be refreshed in the background once the refresh time is reached
+- (void)testProactiveRefresh
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+
+    OCSPCacheRefreshPolicy *policy = [OCSPCacheRefreshPolicy defaultPolicy];
+    policy.refreshFraction = 0.01;
+    policy.jitterFraction = 0;
+    policy.timeout = 10;
+    [ocspCache startProactiveRefresh:policy];
+
+    // Cache a response which is due for refresh and look it up
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:d];
+
+    OCSPCacheLookupResult *result = [ocspCache lookup:cert
+                                           withIssuer:issuer
+                                           andTimeout:10
+                                        modifyOCSPURL:nil
+                                              session:nil];
+    XCTAssert(result.cached);
+    XCTAssertEqualObjects(result.response.data, d);
+
+    // Wait for the refresh to replace the cached response
+    NSPredicate *refreshed = [NSPredicate predicateWithBlock:^BOOL(id obj, NSDictionary *bindings) {
+        OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                          withIssuer:issuer
+                                          andTimeout:10
+                                       modifyOCSPURL:nil
+                                             session:nil];
+        return r.cached && ![r.response.data isEqualToData:d];
+    }];
+
+    [self expectationForPredicate:refreshed evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    XCTAssertEqual([ocspCache refreshMetrics].started, 1);
+    XCTAssertEqual([ocspCache refreshMetrics].failed, 0);
+
+    [ocspCache stopProactiveRefresh];
+}
+
+#pragma mark - Stale-while-revalidate
+
+// A response close to its nextUpdate should be returned immediately while a single background
+// fetch replaces it
+- (void)testStaleWhileRevalidate
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *expiring = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:30];
+    NSData *fresh = [self ocspResponseForCert:cert issuer:issuer thisUpdate:0 nextUpdate:3600];
+
+    [OCSPStandInResponder setResponse:fresh delay:0.5 forHost:@"swr.standin"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    NSURL* (^modifyOCSPURL)(NSURL *url) = ^NSURL*(NSURL *url) {
+        return [NSURL URLWithString:@"http://swr.standin/"];
+    };
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    ocspCache.staleWhileRevalidateWindow = 60;
+    // The stand-in serves unsigned responses
+    ocspCache.verifyResponses = FALSE;
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:expiring];
+
+    // Served from the cache without waiting for the stand-in, which triggers a single fetch
+    for (int i = 0; i < 3; i++) {
+        OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                          withIssuer:issuer
+                                          andTimeout:10
+                                       modifyOCSPURL:modifyOCSPURL
+                                             session:session];
+        XCTAssertNil(r.err);
+        XCTAssertTrue(r.cached);
+        XCTAssertTrue(r.revalidating);
+        XCTAssertEqualObjects(r.response.data, expiring);
+    }
+
+    [NSThread sleepForTimeInterval:1];
+
+    OCSPCacheLookupResult *r = [ocspCache lookup:cert
+                                      withIssuer:issuer
+                                      andTimeout:10
+                                   modifyOCSPURL:modifyOCSPURL
+                                         session:session];
+    XCTAssertNil(r.err);
+    XCTAssertTrue(r.cached);
+    XCTAssertFalse(r.revalidating);
+    XCTAssertEqualObjects(r.response.data, fresh);
+
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"swr.standin"], 1);
+
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
+#pragma mark - Cache file
+
+// Responses persisted to a file should be returned from the cache after loading the file
+- (void)testPersistToFile
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSURL *url = [self temporaryFileURL];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:d];
+
+    NSError *e;
+    XCTAssertTrue([ocspCache persistToFile:url error:&e]);
+    XCTAssert(e == nil);
+
+    OCSPCacheFile *file = [OCSPCacheFile fileWithContentsOfURL:url error:&e];
+    XCTAssert(file != nil);
+    XCTAssertEqual(file.count, 1);
+
+    ocspCache = [self ocspCacheLoadedFromFile:url];
+
+    OCSPCacheLookupResult *result = [ocspCache lookup:cert
+                                           withIssuer:issuer
+                                           andTimeout:10
+                                        modifyOCSPURL:nil
+                                              session:nil];
+    XCTAssert(result.err == nil);
+    XCTAssert(result.cached);
+    XCTAssertEqualObjects(result.response.data, d);
+
+    // Evicted responses are not returned from the file or persisted again
+    XCTAssertTrue([ocspCache removeCacheValueForCert:cert issuer:issuer]);
+    XCTAssertFalse([ocspCache removeCacheValueForCert:cert issuer:issuer]);
+    XCTAssertTrue([ocspCache persistToFile:url error:&e]);
+
+    file = [OCSPCacheFile fileWithContentsOfURL:url error:&e];
+    XCTAssertEqual(file.count, 0);
+
+    // Responses which were never looked up are only carried over if their expiry can be read
+    NSData *garbage = [@"not a response" dataUsingEncoding:NSUTF8StringEncoding];
+    NSDictionary<OCSPCacheKey*, NSData*>* carried = @{
+        [OCSPCacheKey keyForCertificate:cert issuer:issuer]: d,
+        [self cacheKey:1]: garbage,
+    };
+    XCTAssertTrue([OCSPCacheFile writeEntries:carried toURL:url error:&e]);
+
+    ocspCache = [self ocspCacheLoadedFromFile:url];
+    XCTAssertTrue([ocspCache persistToFile:url error:&e]);
+
+    file = [OCSPCacheFile fileWithContentsOfURL:url error:&e];
+    XCTAssertEqual(file.count, 1);
+    XCTAssertEqualObjects([file dataForKey:[OCSPCacheKey keyForCertificate:cert issuer:issuer]], d);
+    XCTAssertNil([file dataForKey:[self cacheKey:1]]);
+
+    // Concurrent writes to the same file each use their own temporary file, and the file left
+    // behind is one of them whole
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:d];
+    dispatch_apply(8, dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^(size_t i) {
+        XCTAssertTrue([ocspCache persistToFile:url error:NULL]);
+    });
+
+    file = [OCSPCacheFile fileWithContentsOfURL:url error:&e];
+    XCTAssertEqual(file.count, 1);
+
+    NSArray *leftovers =
+        [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[[url path] stringByDeletingLastPathComponent]
+                                                            error:nil];
+    for (NSString *name in leftovers) {
+        XCTAssertFalse([name hasPrefix:[[url lastPathComponent] stringByAppendingString:@".tmp-"]]);
+    }
+
+    [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+}
+
+// Invalid files should be rejected
+- (void)testInvalidCacheFile
+{
+    NSURL *url = [self temporaryFileURL];
+
+    NSError *e;
+    XCTAssert([OCSPCacheFile fileWithContentsOfURL:url error:&e] == nil);
+    XCTAssertEqual(e.code, OCSPCacheFileErrorCodeReadFailed);
+
+    [[@"not an OCSP cache file" dataUsingEncoding:NSUTF8StringEncoding] writeToURL:url
+                                                                        atomically:YES];
+    e = nil;
+    XCTAssert([OCSPCacheFile fileWithContentsOfURL:url error:&e] == nil);
+    XCTAssertEqual(e.code, OCSPCacheFileErrorCodeInvalidFormat);
+
+    // Truncated index
+    NSMutableDictionary *entries = [[NSMutableDictionary alloc] init];
+    [entries setObject:[@"response" dataUsingEncoding:NSUTF8StringEncoding]
+                forKey:[self cacheKey:0]];
+    XCTAssertTrue([OCSPCacheFile writeEntries:entries toURL:url error:&e]);
+
+    NSData *written = [NSData dataWithContentsOfURL:url];
+    [[written subdataWithRange:NSMakeRange(0, 40)] writeToURL:url atomically:YES];
+    e = nil;
+    XCTAssert([OCSPCacheFile fileWithContentsOfURL:url error:&e] == nil);
+    XCTAssertEqual(e.code, OCSPCacheFileErrorCodeInvalidFormat);
+
+    [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+}
+
+// Journal should replay valid records and drop a torn record at its tail
+- (void)testJournalReplay
+{
+    NSURL *url = [self temporaryFileURL];
+
+    OCSPCacheKey *a = [self cacheKey:0];
+    OCSPCacheKey *b = [self cacheKey:1];
+    NSData *response = [@"response" dataUsingEncoding:NSUTF8StringEncoding];
+
+    NSError *e;
+    OCSPCacheJournal *journal = [OCSPCacheJournal journalWithURL:url replay:nil error:&e];
+    XCTAssert(journal != nil);
+    XCTAssertTrue([journal appendOp:OCSPCacheJournalOpSet key:a data:response error:&e]);
+    XCTAssertTrue([journal appendOp:OCSPCacheJournalOpRemove key:a data:nil error:&e]);
+    XCTAssertTrue([journal appendOp:OCSPCacheJournalOpSet key:b data:response error:&e]);
+    uint64_t size = journal.size;
+    journal = nil;
+
+    // Simulate a crash during the last append
+    NSData *written = [NSData dataWithContentsOfURL:url];
+    XCTAssertEqual(written.length, size);
+    [[written subdataWithRange:NSMakeRange(0, written.length - 1)] writeToURL:url atomically:YES];
+
+    NSMutableArray *ops = [[NSMutableArray alloc] init];
+    journal = [OCSPCacheJournal journalWithURL:url
+                                        replay:^(OCSPCacheJournalOp op, OCSPCacheKey *key, NSData *data) {
+        XCTAssertEqualObjects(key, a);
+        XCTAssertEqualObjects(data, op == OCSPCacheJournalOpSet ? response : nil);
+        [ops addObject:@(op)];
+    } error:&e];
+    XCTAssert(journal != nil);
+    XCTAssertEqualObjects(ops, (@[@(OCSPCacheJournalOpSet), @(OCSPCacheJournalOpRemove)]));
+
+    // Appends follow the last valid record
+    XCTAssertTrue([journal appendOp:OCSPCacheJournalOpSet key:b data:response error:&e]);
+    XCTAssertEqual(journal.size, size);
+
+    [[@"not an OCSP cache journal" dataUsingEncoding:NSUTF8StringEncoding] writeToURL:url
+                                                                           atomically:YES];
+    e = nil;
+    XCTAssert([OCSPCacheJournal journalWithURL:url replay:nil error:&e] == nil);
+    XCTAssertEqual(e.code, OCSPCacheJournalErrorCodeInvalidFormat);
+
+    [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+}
+
+// Changes should be journaled as they happen and survive compaction
+- (void)testPersistToDirectory
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSURL *directory = [self temporaryFileURL];
+    XCTAssertTrue([[NSFileManager defaultManager] createDirectoryAtURL:directory
+                                           withIntermediateDirectories:NO
+                                                            attributes:nil
+                                                                 error:nil]);
+    NSURL *journalURL = [directory URLByAppendingPathComponent:@"ocsp-cache.journal"];
+
+    NSData *d = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPCache *ocspCache = [self ocspCachePersistedToDirectory:directory];
+    NSNumber *emptySize = [self fileSizeAtURL:journalURL];
+    [ocspCache setCacheValueForCert:cert issuer:issuer data:d];
+    [self waitForFileAtURL:journalURL toGrowPast:emptySize];
+
+    // Replayed from the journal
+    ocspCache = [self ocspCachePersistedToDirectory:directory];
+
+    OCSPCacheLookupResult *result = [ocspCache lookup:cert
+                                           withIssuer:issuer
+                                           andTimeout:10
+                                        modifyOCSPURL:nil
+                                              session:nil];
+    XCTAssert(result.cached);
+    XCTAssertEqualObjects(result.response.data, d);
+
+    // Folded into the snapshot
+    NSError *e;
+    XCTAssertTrue([ocspCache compactPersistedCache:&e]);
+    XCTAssertEqualObjects([self fileSizeAtURL:journalURL], emptySize);
+
+    OCSPCacheFile *file =
+    [OCSPCacheFile fileWithContentsOfURL:[directory URLByAppendingPathComponent:@"ocsp-cache"]
+                                   error:&e];
+    XCTAssertEqual(file.count, 1);
+
+    // Evictions of responses in the snapshot are journaled
+    XCTAssertTrue([ocspCache removeCacheValueForCert:cert issuer:issuer]);
+    [self waitForFileAtURL:journalURL toGrowPast:emptySize];
+
+    ocspCache = [self ocspCachePersistedToDirectory:directory];
+    XCTAssertFalse([ocspCache removeCacheValueForCert:cert issuer:issuer]);
+
+    [[NSFileManager defaultManager] removeItemAtURL:directory error:nil];
+}
+
+- (OCSPCache*)ocspCachePersistedToDirectory:(NSURL*)directory {
+    return [[OCSPCache alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPCache] %@", logLine);
+    } store:[[OCSPMemoryCacheStore alloc] init] andPersistToDirectory:directory];
+}
+
+- (NSNumber*)fileSizeAtURL:(NSURL*)url {
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[url path]
+                                                                                error:nil];
+    return [attributes objectForKey:NSFileSize];
+}
+
+// Journal appends happen in the background
+- (void)waitForFileAtURL:(NSURL*)url toGrowPast:(NSNumber*)size {
+    NSPredicate *grown = [NSPredicate predicateWithBlock:^BOOL(id obj, NSDictionary *bindings) {
+        return [[self fileSizeAtURL:url] compare:size] == NSOrderedDescending;
+    }];
+    [self waitForExpectations:@[[[XCTNSPredicateExpectation alloc] initWithPredicate:grown
+                                                                              object:nil]]
+                      timeout:5];
+}
+
+- (NSURL*)temporaryFileURL {
+    NSString *name = [NSString stringWithFormat:@"ocsp-cache-%@", [[NSUUID UUID] UUIDString]];
+    return [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:name]];
+}
+
+- (OCSPCache*)ocspCacheLoadedFromFile:(NSURL*)url {
+    return [[OCSPCache alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPCache] %@", logLine);
+    } store:[[OCSPMemoryCacheStore alloc] init] andLoadFromFile:url];
+}
+
+#pragma mark - Request batching
+
+// Requests for several certificates should contain a CertID for each, and responses should be
+// matched back to the certificates they answer for
+- (void)testMultiCertOCSPRequest
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef intermediate = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    NSError *e;
+    NSData *d = [OCSPCert ocspDataForPostRequestFromSecCertRefs:@[(__bridge id)cert,
+                                                                  (__bridge id)intermediate]
+                                             withIssuerCertRefs:@[(__bridge id)intermediate,
+                                                                  (__bridge id)root]
+                                                          error:&e];
+    XCTAssert(e == nil);
+    XCTAssert(d != nil);
+
+    const unsigned char *p = d.bytes;
+    OCSP_REQUEST *req = d2i_OCSP_REQUEST(NULL, &p, d.length);
+    XCTAssert(req != NULL);
+    XCTAssertEqual(OCSP_request_onereq_count(req), 2);
+    OCSP_REQUEST_free(req);
+
+    // Mismatched issuers
+    e = nil;
+    d = [OCSPCert ocspDataForPostRequestFromSecCertRefs:@[(__bridge id)cert]
+                                     withIssuerCertRefs:@[]
+                                                  error:&e];
+    XCTAssert(e != nil);
+
+    OCSPResponse *r =
+    [[OCSPResponse alloc] initWithData:[self ocspResponseForCert:cert
+                                                          issuer:intermediate
+                                                      thisUpdate:-60
+                                                      nextUpdate:60 * 60]];
+    XCTAssertTrue([r hasSingleResponseForCert:cert issuer:intermediate]);
+    XCTAssertFalse([r hasSingleResponseForCert:intermediate issuer:root]);
+}
+
+// A request with nothing to coalesce with should be sent right away, and only the requests which
+// follow it for the same issuer should be batched, since a response with single responses for
+// several issuers cannot be verified
+- (void)testBatchingByIssuer
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef intermediate = [self intermediateCACert];
+
+    SecCertificateRef root = [self rootCACert];
+
+    SecCertificateRef noURLsCert = [self noOCSPURLsCert];
+
+    // Answers for all three certificates; the intermediate and the no URLs cert share the root
+    // as issuer
+    NSData *response = [self ocspResponseForCerts:@[(__bridge id)cert,
+                                                    (__bridge id)intermediate,
+                                                    (__bridge id)noURLsCert]
+                                          issuers:@[(__bridge id)intermediate,
+                                                    (__bridge id)root,
+                                                    (__bridge id)root]
+                                       thisUpdate:0
+                                       nextUpdate:3600];
+
+    // Each of the first two requests would be answered by the response if they were batched
+    OCSPResponse *r = [[OCSPResponse alloc] initWithData:response];
+    XCTAssertTrue([r hasSingleResponseForCert:cert issuer:intermediate]);
+    XCTAssertTrue([r hasSingleResponseForCert:intermediate issuer:root]);
+
+    [OCSPStandInResponder setResponse:response delay:0.01 forHost:@"batch.standin"];
+
+    NSURL *url = [NSURL URLWithString:@"http://batch.standin/"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPRequestBatcher *batcher =
+        [[OCSPRequestBatcher alloc] initWithQueue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)];
+    batcher.coalescingWindow = 1;
+    // One stand-in request per attempt, without a fallback from GET to POST
+    [batcher setRequestMethod:OCSPRequestMethodPOST forURL:url];
+
+    RACSignal *(^request)(SecCertificateRef, SecCertificateRef) =
+    ^RACSignal *(SecCertificateRef c, SecCertificateRef i) {
+        NSError *e;
+        NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:c
+                                                   withIssuerCertRef:i
+                                                               error:&e];
+        XCTAssert(req != nil);
+        return [batcher requestForCert:c
+                                issuer:i
+                       ocspRequestData:req
+                                  urls:@[url]
+                               session:session];
+    };
+
+    // Different issuers are requested separately, without waiting for the coalescing window
+    NSDate *start = [NSDate date];
+    RACSignal *leafSignal = request(cert, intermediate);
+    RACSignal *intermediateSignal = request(intermediate, root);
+
+    NSError *e;
+    XCTAssertTrue([leafSignal waitUntilCompleted:&e]);
+    XCTAssertNil(e);
+    XCTAssertTrue([intermediateSignal waitUntilCompleted:&e]);
+    XCTAssertNil(e);
+    XCTAssertLessThan([[NSDate date] timeIntervalSinceDate:start], batcher.coalescingWindow / 2);
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"batch.standin"], 2);
+
+    // The requests which follow within the window of the request for the same issuer are
+    // requested together
+    RACSignal *noURLsSignal = request(noURLsCert, root);
+    intermediateSignal = request(intermediate, root);
+
+    XCTAssertTrue([noURLsSignal waitUntilCompleted:&e]);
+    XCTAssertNil(e);
+    XCTAssertTrue([intermediateSignal waitUntilCompleted:&e]);
+    XCTAssertNil(e);
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"batch.standin"], 3);
+
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
+#pragma mark - Hedged requests
+
+// A responder which does not answer should be hedged to the next one, and the first successful
+// response should complete the request
+- (void)testHedgedOCSPRequest
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSError *e;
+    NSArray<NSURL*>* urls = [OCSPCert ocspURLsFromSecCertRef:cert error:&e];
+    XCTAssert([urls count] > 0);
+
+    NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:cert
+                                               withIssuerCertRef:issuer
+                                                           error:&e];
+    XCTAssert(req != nil);
+
+    // Non-routable address, so the request hangs until it is cancelled
+    NSURL *unresponsive = [NSURL URLWithString:@"http://10.255.255.1/"];
+
+    NSArray<NSURL*>* hedgedURLs = [@[unresponsive] arrayByAddingObjectsFromArray:urls];
+
+    NSMutableArray<NSURL*>* successes = [[NSMutableArray alloc] init];
+    NSMutableArray<NSURL*>* cancellations = [[NSMutableArray alloc] init];
+
+    OCSPRequestAttemptObserver observer = ^(NSURL *url, NSTimeInterval latency,
+                                            OCSPRequestAttemptResult result) {
+        @synchronized (successes) {
+            if (result == OCSPRequestAttemptResultSucceeded) {
+                [successes addObject:url];
+            } else if (result == OCSPRequestAttemptResultCancelled) {
+                [cancellations addObject:url];
+            }
+        }
+    };
+
+    XCTestExpectation *expectResponse = [self expectationWithDescription:@"Expected response"];
+
+    [[OCSPRequestService getSuccessfulOCSPResponse:hedgedURLs
+                                   ocspRequestData:req
+                                     requestMethod:nil
+                                        hedgeDelay:0.2
+                              attemptStartObserver:nil
+                                   attemptObserver:observer
+                                           session:nil
+                                       sessionPool:nil
+                                             queue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)]
+     subscribeError:^(NSError *error) {
+        XCTFail(@"Unexpected error %@", error);
+    } completed:^{
+        [expectResponse fulfill];
+    }];
+
+    // Well within the timeout of the unresponsive request
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    @synchronized (successes) {
+        XCTAssertEqual([successes count], 1);
+        XCTAssertFalse([successes containsObject:unresponsive]);
+        XCTAssertEqualObjects(cancellations, @[unresponsive]);
+    }
+}
+
+#pragma mark - Responder health
+
+// Requests should be routed to the faster of two responders once both have been measured
+- (void)testResponderRouting
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSError *e;
+    NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:cert
+                                               withIssuerCertRef:issuer
+                                                           error:&e];
+    XCTAssert(req != nil);
+
+    NSData *response = [self ocspResponseForCert:cert issuer:issuer thisUpdate:0 nextUpdate:3600];
+
+    [OCSPStandInResponder setResponse:response delay:0.3 forHost:@"slow.standin"];
+    [OCSPStandInResponder setResponse:response delay:0.01 forHost:@"fast.standin"];
+
+    NSURL *slow = [NSURL URLWithString:@"http://slow.standin/"];
+    NSURL *fast = [NSURL URLWithString:@"http://fast.standin/"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPRequestBatcher *batcher =
+        [[OCSPRequestBatcher alloc] initWithQueue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)];
+    batcher.coalescingWindow = 0;
+    // Longer than the slow responder, so that it answers the first request on its own
+    batcher.hedgeDelay = 1;
+
+    // The first request goes to the slow responder since neither has been measured. The second
+    // goes to the fast one to measure it. From then on the fast one is preferred.
+    for (int i = 0; i < 4; i++) {
+        e = nil;
+        [[batcher requestForCert:cert
+                          issuer:issuer
+                 ocspRequestData:req
+                            urls:@[slow, fast]
+                         session:session] waitUntilCompleted:&e];
+        XCTAssertNil(e);
+    }
+
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"slow.standin"], 1);
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"fast.standin"], 3);
+
+    OCSPResponderStats *slowStats = [batcher.responderRegistry statsForHost:@"slow.standin"];
+    OCSPResponderStats *fastStats = [batcher.responderRegistry statsForHost:@"fast.standin"];
+
+    XCTAssertEqual(slowStats.requests, 1);
+    XCTAssertEqual(fastStats.requests, 3);
+    XCTAssertGreaterThanOrEqual(slowStats.latency, 0.3);
+    XCTAssertLessThan(fastStats.latency, slowStats.latency);
+    XCTAssertEqual(fastStats.errorRate, 0);
+    XCTAssertEqual(fastStats.state, OCSPResponderStateClosed);
+
+    NSArray<NSURL*>* expectedOrder = @[fast, slow];
+    XCTAssertEqualObjects([batcher.responderRegistry orderURLs:@[slow, fast]], expectedOrder);
+    XCTAssertEqual([[batcher.responderRegistry allStats] count], 2);
+
+    // Requests to rewritten URLs, e.g. through a proxy, are recorded under the OCSP URL of the
+    // certificate
+    NSURL *responder = [NSURL URLWithString:@"http://responder.example/"];
+    e = nil;
+    [[batcher requestForCert:cert
+                      issuer:issuer
+             ocspRequestData:req
+                        urls:@[fast]
+               responderURLs:@[responder]
+                     session:session] waitUntilCompleted:&e];
+    XCTAssertNil(e);
+
+    XCTAssertEqual([batcher.responderRegistry statsForHost:@"responder.example"].requests, 1);
+    XCTAssertEqual([batcher.responderRegistry statsForHost:@"fast.standin"].requests, 3);
+
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
+// Requests to a responder which keeps failing should fail fast until a probe finds it has
+// recovered
+- (void)testResponderCircuitBreaker
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSError *e;
+    NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:cert
+                                               withIssuerCertRef:issuer
+                                                           error:&e];
+    XCTAssert(req != nil);
+
+    [OCSPStandInResponder setResponse:nil delay:0.01 forHost:@"down.standin"];
+
+    NSURL *down = [NSURL URLWithString:@"http://down.standin/"];
+
+    NSURLSession *session =
+        [NSURLSession sessionWithConfiguration:[OCSPStandInResponder sessionConfiguration]];
+
+    OCSPRequestBatcher *batcher =
+        [[OCSPRequestBatcher alloc] initWithQueue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)];
+    batcher.coalescingWindow = 0;
+    batcher.responderRegistry.failureThreshold = 3;
+    batcher.responderRegistry.openDuration = 0.5;
+    // One stand-in request per attempt, without a fallback from GET to POST
+    [batcher setRequestMethod:OCSPRequestMethodPOST forURL:down];
+
+    RACSignal *(^request)(void) = ^RACSignal *{
+        return [batcher requestForCert:cert
+                                issuer:issuer
+                       ocspRequestData:req
+                                  urls:@[down]
+                               session:session];
+    };
+
+    // Open the circuit
+    for (int i = 0; i < 3; i++) {
+        e = nil;
+        [request() waitUntilCompleted:&e];
+        XCTAssertEqual(e.code, OCSPRequestServiceErrorCodeNoSuccessfulResponse);
+    }
+
+    OCSPResponderStats *stats = [batcher.responderRegistry statsForHost:@"down.standin"];
+    XCTAssertEqual(stats.state, OCSPResponderStateOpen);
+    XCTAssertEqual(stats.consecutiveFailures, 3);
+    XCTAssertEqual(stats.failures, 3);
+    XCTAssertNotNil(stats.lastFailure);
+
+    // Requests fail fast while the circuit is open
+    e = nil;
+    [request() waitUntilCompleted:&e];
+    XCTAssertEqualObjects(e.domain, OCSPRequestServiceErrorDomain);
+    XCTAssertEqual(e.code, OCSPRequestServiceErrorCodeRespondersUnavailable);
+    XCTAssertEqual([OCSPStandInResponder requestCountForHost:@"down.standin"], 3);
+
+    // The responder recovers and the half-open probe closes the circuit
+    NSData *response = [self ocspResponseForCert:cert issuer:issuer thisUpdate:0 nextUpdate:3600];
+    [OCSPStandInResponder setResponse:response delay:0.01 forHost:@"down.standin"];
+
+    [NSThread sleepForTimeInterval:0.5];
+
+    // Ordering the URLs does not use up the probe; only sending a request does
+    NSArray<NSURL*>* expectedURLs = @[down];
+    XCTAssertEqualObjects([batcher.responderRegistry orderURLs:@[down]], expectedURLs);
+    XCTAssertEqualObjects([batcher.responderRegistry orderURLs:@[down]], expectedURLs);
+
+    e = nil;
+    [request() waitUntilCompleted:&e];
+    XCTAssertNil(e);
+
+    stats = [batcher.responderRegistry statsForHost:@"down.standin"];
+    XCTAssertEqual(stats.state, OCSPResponderStateClosed);
+    XCTAssertEqual(stats.consecutiveFailures, 0);
+    XCTAssertEqual(stats.requests, 4);
+
+    [OCSPStandInResponder removeAllHosts];
+    [session invalidateAndCancel];
+}
+
+#pragma mark - Session pool
+
+// Requests to the same host should share a session, which is invalidated once idle
+- (void)testSessionPool
+{
+    OCSPSessionPool *pool = [[OCSPSessionPool alloc] init];
+    XCTAssertEqual(pool.configuration.HTTPMaximumConnectionsPerHost, 2);
+
+    NSURLSession *a = [pool sessionForURL:[NSURL URLWithString:@"http://a.example.com/1"]];
+    NSURLSession *a2 = [pool sessionForURL:[NSURL URLWithString:@"http://A.example.com/2"]];
+    NSURLSession *b = [pool sessionForURL:[NSURL URLWithString:@"http://b.example.com/1"]];
+
+    XCTAssertEqual(a, a2);
+    XCTAssertNotEqual(a, b);
+    XCTAssertEqual(pool.sessionCount, 2);
+    XCTAssertEqual(pool.sessionsCreated, 2);
+
+    // All sessions are idle, so a new one is created
+    pool.idleTimeout = 0;
+    NSURLSession *a3 = [pool sessionForURL:[NSURL URLWithString:@"http://a.example.com/1"]];
+    XCTAssertNotEqual(a, a3);
+    XCTAssertEqual(pool.sessionCount, 1);
+    XCTAssertEqual(pool.sessionsCreated, 3);
+
+    [pool invalidateSessions];
+    XCTAssertEqual(pool.sessionCount, 0);
+}
+
+// Measure OCSP requests to the local OCSP server which each pay for a new connection
+- (void)testColdOCSPFetchPerformance
+{
+    [self measureOCSPFetchesWithSessionPool:nil];
+}
+
+// Measure OCSP requests to the local OCSP server which reuse the connection of a pooled session
+- (void)testWarmOCSPFetchPerformance
+{
+    [self measureOCSPFetchesWithSessionPool:[[OCSPSessionPool alloc] init]];
+}
+
+// Measure POST requests, which HTTP caches do not answer, to the local OCSP server. If the pool is
+// nil, each request is made with a new session.
+- (void)measureOCSPFetchesWithSessionPool:(OCSPSessionPool*)sharedPool
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSError *e;
+    NSArray<NSURL*>* urls = [OCSPCert ocspURLsFromSecCertRef:cert error:&e];
+    XCTAssert([urls count] > 0);
+
+    NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:cert
+                                               withIssuerCertRef:issuer
+                                                           error:&e];
+    XCTAssert(req != nil);
+
+    NSURL *url = [urls firstObject];
+    NSUInteger numFetches = 20;
+
+    // Open the connection before measuring
+    if (sharedPool != nil) {
+        [[OCSPRequestService ocspRequest:url
+                         ocspRequestData:req
+                                 session:[sharedPool sessionForURL:url]
+                                   queue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)]
+         waitUntilCompleted:nil];
+    }
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numFetches; i++) {
+            OCSPSessionPool *pool = sharedPool ?: [[OCSPSessionPool alloc] init];
+
+            NSObject *x =
+            [[OCSPRequestService ocspRequest:url
+                             ocspRequestData:req
+                                     session:[pool sessionForURL:url]
+                                       queue:dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0)]
+             first];
+            XCTAssert([x isKindOfClass:[OCSPResponse class]] && [(OCSPResponse*)x success]);
+
+            if (sharedPool == nil) {
+                [pool invalidateSessions];
+            }
+        }
+    }];
+
+    [sharedPool invalidateSessions];
+}
+
+#pragma mark - GET requests
+
+// Short requests should be encoded in the URL and others sent with POST
+- (void)testOCSPGetRequestURL
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSError *e;
+    NSData *req = [OCSPCert ocspDataForPostRequestFromSecCertRef:cert
+                                               withIssuerCertRef:issuer
+                                                           error:&e];
+    XCTAssert(req != nil);
+
+    NSURL *url = [NSURL URLWithString:@"http://ocsp.example.com"];
+    NSURL *urlWithSlash = [NSURL URLWithString:@"http://ocsp.example.com/"];
+    NSURL *urlWithQuery = [NSURL URLWithString:@"http://127.0.0.1/ocsp?url=x"];
+
+    NSURL *getURL = [OCSPRequestService getRequestURL:url ocspRequestData:req];
+    XCTAssert([[getURL absoluteString] hasPrefix:@"http://ocsp.example.com/"]);
+
+    NSString *encoded = [[getURL absoluteString] substringFromIndex:24];
+    XCTAssertEqualObjects([[NSData alloc] initWithBase64EncodedString:
+                           [encoded stringByRemovingPercentEncoding] options:0], req);
+
+    // No double slash
+    XCTAssertEqualObjects([OCSPRequestService getRequestURL:urlWithSlash ocspRequestData:req],
+                          getURL);
+
+    // The request cannot be appended to a query
+    XCTAssert([OCSPRequestService getRequestURL:urlWithQuery ocspRequestData:req] == nil);
+
+    // Too long once encoded
+    NSData *longReq = [NSMutableData dataWithLength:200];
+    XCTAssert([OCSPRequestService getRequestURL:url ocspRequestData:longReq] == nil);
+
+    // Request methods are configured per URL
+    OCSPCache *ocspCache = [self ocspCacheWithLogging];
+    XCTAssertEqual([ocspCache requestMethodForOCSPURL:url], OCSPRequestMethodAutomatic);
+    [ocspCache setRequestMethod:OCSPRequestMethodPOST forOCSPURL:url];
+    XCTAssertEqual([ocspCache requestMethodForOCSPURL:url], OCSPRequestMethodPOST);
+    XCTAssertEqual([ocspCache requestMethodForOCSPURL:urlWithQuery], OCSPRequestMethodAutomatic);
+}
+
+#pragma mark - GeneralizedTime
+
+// NSDateFormatter based parsing which OCSPGeneralizedTime replaced. Used as the reference in
+// differential tests.
+- (NSDate*)dateFromGeneralizedTimeWithFormatter:(NSString*)generalizedTime
+{
+    for (NSString *format in @[@"yyyyMMddHHmmssZ", @"yyMMddHHmmssZ"]) {
+        NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+        [formatter setLocale:[NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"]];
+        [formatter setTimeZone:[NSTimeZone timeZoneForSecondsFromGMT:0]];
+        [formatter setDateFormat:format];
+
+        NSDate *date = [formatter dateFromString:generalizedTime];
+        if (date != nil) {
+            return date;
+        }
+    }
+
+    return nil;
+}
+
+- (NSDate*)dateFromGeneralizedTime:(NSString*)generalizedTime
+{
+    const char *bytes = [generalizedTime UTF8String];
+
+    NSTimeInterval seconds;
+    if (![OCSPGeneralizedTime decodeBytes:(const unsigned char*)bytes
+                                   length:strlen(bytes)
+                                  seconds:&seconds]) {
+        return nil;
+    }
+
+    return [NSDate dateWithTimeIntervalSince1970:seconds];
+}
+
+// Times should decode to the same dates as with NSDateFormatter
+- (void)testGeneralizedTimeMatchesDateFormatter
+{
+    NSMutableArray<NSString*>* times = [[NSMutableArray alloc] initWithArray:@[
+        @"20190101000000Z",
+        @"20191231235959Z",
+        @"20000229120000Z",
+        @"19700101000000Z",
+        @"20490630153000Z",
+        @"190615083000Z",
+        @"20190101000000+0000",
+        @"20190101000000+0130",
+        @"20190101000000-0800",
+    ]];
+
+    // Times generated by OpenSSL, as in responses
+    long range = 400 * 24 * 60 * 60;
+    for (long offset = -range; offset <= range; offset += 7919 * 60 + 13) {
+        ASN1_TIME *t = ASN1_GENERALIZEDTIME_adj(NULL, time(NULL), 0, offset);
+        [times addObject:[[NSString alloc] initWithBytes:t->data
+                                                  length:t->length
+                                                encoding:NSASCIIStringEncoding]];
+        ASN1_TIME_free(t);
+    }
+
+    for (NSString *t in times) {
+        NSDate *expected = [self dateFromGeneralizedTimeWithFormatter:t];
+        XCTAssert(expected != nil, @"%@", t);
+        XCTAssertEqualObjects([self dateFromGeneralizedTime:t], expected, @"%@", t);
+    }
+}
+
+// Times with fractional seconds should decode; malformed times should not
+- (void)testGeneralizedTimeFormats
+{
+    NSDate *date = [self dateFromGeneralizedTime:@"20190101000000Z"];
+    XCTAssertEqual([date timeIntervalSince1970], 1546300800);
+
+    date = [self dateFromGeneralizedTime:@"20190101000000.25Z"];
+    XCTAssertEqual([date timeIntervalSince1970], 1546300800.25);
+
+    date = [self dateFromGeneralizedTime:@"20190101000000,5+0100"];
+    XCTAssertEqual([date timeIntervalSince1970], 1546300800.5 - 60 * 60);
+
+    // Two digit years follow RFC 5280
+    date = [self dateFromGeneralizedTime:@"991231235959Z"];
+    XCTAssertEqual([date timeIntervalSince1970], 946684799);
+
+    NSArray<NSString*>* malformed = @[
+        @"",
+        @"20190101000000",
+        @"2019010100000Z",
+        @"201901010000000Z",
+        @"20191301000000Z",
+        @"20190230000000Z",
+        @"20190101240000Z",
+        @"20190101006000Z",
+        @"20190101000000.Z",
+        @"20190101000000+01",
+        @"20190101000000Z ",
+        @"2019O101000000Z",
+    ];
+
+    for (NSString *t in malformed) {
+        XCTAssert([self dateFromGeneralizedTime:t] == nil, @"%@", t);
+    }
+}
+
+- (void)testGeneralizedTimeDecodePerformance
+{
+    const unsigned char *bytes = (const unsigned char*)"20190101000000Z";
+    size_t length = strlen((const char*)bytes);
+
+    NSUInteger numDecodes = 100000;
+
+    [self measureBlock:^{
+        NSTimeInterval seconds = 0;
+        for (NSUInteger i = 0; i < numDecodes; i++) {
+            XCTAssert([OCSPGeneralizedTime decodeBytes:bytes length:length seconds:&seconds]);
+        }
+    }];
+}
+
+- (void)testGeneralizedTimeDateFormatterPerformance
+{
+    NSUInteger numDecodes = 1000;
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numDecodes; i++) {
+            XCTAssert([self dateFromGeneralizedTimeWithFormatter:@"20190101000000Z"] != nil);
+        }
+    }];
+}
+
+#pragma mark - DER reader
+
+// Returns FALSE if the DER reader and OpenSSL both read the response but disagree on its contents.
+- (BOOL)derReaderAgreesWithOpenSSL:(NSData*)data
+{
+    OCSPDERResponse response;
+    if (![OCSPDERReader readResponse:data.bytes length:data.length response:&response]) {
+        return TRUE;
+    }
+
+    const unsigned char *p = data.bytes;
+    OCSP_RESPONSE *r = d2i_OCSP_RESPONSE(NULL, &p, data.length);
+    if (r == NULL) {
+        return TRUE;
+    }
+
+    BOOL agrees = response.status == OCSP_response_status(r);
+
+    OCSP_BASICRESP *bs = OCSP_response_get1_basic(r);
+    if (agrees && bs != NULL) {
+        OCSPDERSlice cursor = response.responses;
+        OCSPDERSingleResponse single;
+        int i = 0;
+
+        while (agrees && [OCSPDERReader nextSingleResponse:&single cursor:&cursor]) {
+            OCSP_SINGLERESP *sr = OCSP_resp_get0(bs, i++);
+            if (sr == NULL) {
+                agrees = FALSE;
+                break;
+            }
+
+            int reason;
+            ASN1_GENERALIZEDTIME *revocationTime, *thisUpdate, *nextUpdate;
+            int status = OCSP_single_get0_status(sr, &reason, &revocationTime,
+                                                 &thisUpdate, &nextUpdate);
+
+            agrees = status == single.certStatus &&
+                     thisUpdate->length == single.thisUpdate.length &&
+                     memcmp(thisUpdate->data, single.thisUpdate.bytes, thisUpdate->length) == 0 &&
+                     (nextUpdate == NULL) == (single.nextUpdate.bytes == NULL) &&
+                     sr->certId->serialNumber->length == single.serialNumber.length;
+        }
+
+        agrees = agrees && i == OCSP_resp_count(bs);
+    }
+
+    OCSP_BASICRESP_free(bs);
+    OCSP_RESPONSE_free(r);
+
+    return agrees;
+}
+
+// The DER reader should read the same fields as OpenSSL
+- (void)testDERReader
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    OCSPDERResponse response;
+    XCTAssert([OCSPDERReader readResponse:data.bytes length:data.length response:&response]);
+    XCTAssert(response.status == OCSP_RESPONSE_STATUS_SUCCESSFUL);
+    XCTAssert(response.producedAt.length > 0);
+    XCTAssert([self derReaderAgreesWithOpenSSL:data]);
+
+    OCSPDERSlice cursor = response.responses;
+    OCSPDERSingleResponse single;
+    XCTAssert([OCSPDERReader nextSingleResponse:&single cursor:&cursor]);
+    XCTAssert(single.certStatus == OCSPDERCertStatusGood);
+    XCTAssert(single.issuerNameHash.length == 20);
+    XCTAssert(single.issuerKeyHash.length == 20);
+    XCTAssert(single.revocationTime.bytes == NULL);
+    XCTAssertFalse([OCSPDERReader nextSingleResponse:&single cursor:&cursor]);
+
+    // The earliest nextUpdate is the one of the cache entry
+    NSTimeInterval nextUpdate;
+    XCTAssert([OCSPDERReader earliestNextUpdate:&nextUpdate ofResponseData:data]);
+    OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:data];
+    XCTAssertEqual(nextUpdate, [entry.nextUpdate timeIntervalSince1970]);
+
+    // Unsuccessful responses only have a status
+    OCSP_RESPONSE *r = OCSP_response_create(OCSP_RESPONSE_STATUS_TRYLATER, NULL);
+    unsigned char *der = NULL;
+    int len = i2d_OCSP_RESPONSE(r, &der);
+    NSData *unsuccessful = [NSData dataWithBytes:der length:len];
+    OPENSSL_free(der);
+    OCSP_RESPONSE_free(r);
+
+    XCTAssert([OCSPDERReader readResponse:unsuccessful.bytes
+                                   length:unsuccessful.length
+                                 response:&response]);
+    XCTAssert(response.status == OCSP_RESPONSE_STATUS_TRYLATER);
+    XCTAssert(response.responses.length == 0);
+    XCTAssertFalse([OCSPDERReader earliestNextUpdate:&nextUpdate ofResponseData:unsuccessful]);
+
+    // Truncated and empty data
+    XCTAssertFalse([OCSPDERReader readResponse:data.bytes
+                                        length:data.length - 1
+                                      response:&response]);
+    XCTAssertFalse([OCSPDERReader readResponse:data.bytes length:0 response:&response]);
+}
+
+// Mutated responses should not crash the DER reader, and whenever both the DER reader and OpenSSL
+// accept a mutated response they should agree on its contents.
+- (void)testDERReaderFuzz
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    // Fixed seed so that failures can be reproduced
+    unsigned short seed[3] = {0x4f43, 0x5350, 0x4445};
+
+    NSUInteger numMutations = 20000;
+
+    for (NSUInteger i = 0; i < numMutations; i++) {
+        NSMutableData *mutated = [data mutableCopy];
+        uint8_t *bytes = mutated.mutableBytes;
+
+        long numEdits = 1 + nrand48(seed) % 4;
+        for (long j = 0; j < numEdits; j++) {
+            NSUInteger offset = nrand48(seed) % mutated.length;
+            switch (nrand48(seed) % 3) {
+                case 0:
+                    bytes[offset] ^= 1 << (nrand48(seed) % 8);
+                    break;
+                case 1:
+                    bytes[offset] = (uint8_t)nrand48(seed);
+                    break;
+                default:
+                    [mutated setLength:offset + 1];
+                    break;
+            }
+        }
+
+        XCTAssert([self derReaderAgreesWithOpenSSL:mutated], @"%@", mutated);
+    }
+}
+
+- (void)testDERReaderPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    NSUInteger numReads = 10000;
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numReads; i++) {
+            OCSPDERResponse response;
+            XCTAssert([OCSPDERReader readResponse:data.bytes length:data.length response:&response]);
+
+            OCSPDERSlice cursor = response.responses;
+            OCSPDERSingleResponse single;
+            while ([OCSPDERReader nextSingleResponse:&single cursor:&cursor]) {
+                XCTAssert(single.certStatus == OCSPDERCertStatusGood);
+            }
+        }
+    }];
+}
+
+// Same as testDERReaderPerformance, but decoding with OpenSSL
+- (void)testDERReaderOpenSSLPerformance
+{
+    SecCertificateRef cert = [self localOCSPURLsCert];
+
+    SecCertificateRef issuer = [self intermediateCACert];
+
+    NSData *data = [self ocspResponseForCert:cert issuer:issuer thisUpdate:-60 nextUpdate:60 * 60];
+
+    NSUInteger numReads = 10000;
+
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < numReads; i++) {
+            const unsigned char *p = data.bytes;
+            OCSP_RESPONSE *r = d2i_OCSP_RESPONSE(NULL, &p, data.length);
+            XCTAssert(OCSP_response_status(r) == OCSP_RESPONSE_STATUS_SUCCESSFUL);
+
+            OCSP_BASICRESP *bs = OCSP_response_get1_basic(r);
+            for (int j = 0; j < OCSP_resp_count(bs); j++) {
+                OCSP_SINGLERESP *sr = OCSP_resp_get0(bs, j);
+                XCTAssert(sr->certStatus->type == V_OCSP_CERTSTATUS_GOOD);
+            }
+
+            OCSP_BASICRESP_free(bs);
+            OCSP_RESPONSE_free(r);
+        }
+    }];
+}
+
+#pragma mark - Helpers for constructing OCSP responses
+
+// Construct an unsigned OCSP response with a single "good" response for the provided certificate.
+// thisUpdate and nextUpdate are offsets in seconds from the current time.
+- (NSData*)ocspResponseForCert:(SecCertificateRef)certRef
+                        issuer:(SecCertificateRef)issuerRef
+                    thisUpdate:(long)thisUpdateOffset
+                    nextUpdate:(long)nextUpdateOffset
+{
+    return [self ocspResponseForCerts:@[(__bridge id)certRef]
+                              issuers:@[(__bridge id)issuerRef]
+                           thisUpdate:thisUpdateOffset
+                           nextUpdate:nextUpdateOffset];
+}
+
+// nextUpdate offset which omits nextUpdate from the single responses.
+static const long CertTestsNoNextUpdate = LONG_MIN;
+
+// Construct an unsigned OCSP response with a "good" single response for each certificate, which is
+// issued by the issuer at the same index. The responder ID is the name of the first issuer.
+// nextUpdate is omitted if its offset is CertTestsNoNextUpdate.
+- (NSData*)ocspResponseForCerts:(NSArray*)certRefs
+                        issuers:(NSArray*)issuerRefs
+                     thisUpdate:(long)thisUpdateOffset
+                     nextUpdate:(long)nextUpdateOffset
+{
+    XCTAssertEqual([certRefs count], [issuerRefs count]);
+
+    OCSP_BASICRESP *bs = OCSP_BASICRESP_new();
+
+    ASN1_TIME *thisUpdate = X509_gmtime_adj(NULL, thisUpdateOffset);
+    ASN1_TIME *nextUpdate = NULL;
+    if (nextUpdateOffset != CertTestsNoNextUpdate) {
+        nextUpdate = X509_gmtime_adj(NULL, nextUpdateOffset);
+    }
+
+    for (NSUInteger i = 0; i < [certRefs count]; i++) {
+        X509 *leaf =
+            [OCSPOpenSSLBridge secCertRefToX509:(__bridge SecCertificateRef)certRefs[i]];
+        X509 *issuer =
+            [OCSPOpenSSLBridge secCertRefToX509:(__bridge SecCertificateRef)issuerRefs[i]];
+
+        OCSP_CERTID *certID = OCSP_cert_to_id(EVP_sha1(), leaf, issuer);
+        OCSP_basic_add1_status(bs, certID, V_OCSP_CERTSTATUS_GOOD, 0, NULL,
+                               thisUpdate, nextUpdate);
+
+        OCSP_CERTID_free(certID);
+        X509_free(leaf);
+        X509_free(issuer);
+    }
+
+    X509 *issuer =
+        [OCSPOpenSSLBridge secCertRefToX509:(__bridge SecCertificateRef)[issuerRefs firstObject]];
+
+    X509_gmtime_adj(bs->tbsResponseData->producedAt, 0);
+    // The responder ID is required, otherwise it is omitted from the encoding and the response
+    // cannot be decoded
+    OCSP_RESPID *responderId = bs->tbsResponseData->responderId;
+    X509_NAME_set(&responderId->value.byName, X509_get_subject_name(issuer));
+    responderId->type = V_OCSP_RESPID_NAME;
+    X509_ALGOR_set0(bs->signatureAlgorithm, OBJ_nid2obj(NID_sha256WithRSAEncryption),
+                    V_ASN1_NULL, NULL);
+
+    OCSP_RESPONSE *r = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+
+    unsigned char *ocspResponse = NULL;
+    int len = i2d_OCSP_RESPONSE(r, &ocspResponse);
+    NSData *d = [NSData dataWithBytes:ocspResponse length:len];
+
+    OPENSSL_free(ocspResponse);
+    OCSP_RESPONSE_free(r);
+    OCSP_BASICRESP_free(bs);
+    ASN1_TIME_free(thisUpdate);
+    ASN1_TIME_free(nextUpdate);
+    X509_free(issuer);
+
+    return d;
+}
+
+/// Generate a 2048-bit RSA key, so that responses can be signed without bundling private keys.
+- (EVP_PKEY*)generateRSAKey
+{
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+
+    RSA *rsa = RSA_new();
+    XCTAssert(RSA_generate_key_ex(rsa, 2048, e, NULL) == 1);
+    BN_free(e);
+
+    EVP_PKEY *key = EVP_PKEY_new();
+    EVP_PKEY_assign_RSA(key, rsa);
+
+    return key;
+}
+
+/// Create a certificate for the key, valid for a day. Self-signed if issuer is NULL.
+- (X509*)x509WithCommonName:(NSString*)commonName
+                        key:(EVP_PKEY*)key
+                     issuer:(X509*)issuer
+                  issuerKey:(EVP_PKEY*)issuerKey
+                         ca:(BOOL)ca
+                ocspSigning:(BOOL)ocspSigning
+{
+    // CertIDs of certificates from the same issuer must differ
+    static long serial = 1;
+
+    X509 *x509 = X509_new();
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), serial++);
+    X509_gmtime_adj(X509_get_notBefore(x509), -60 * 60);
+    X509_gmtime_adj(X509_get_notAfter(x509), 24 * 60 * 60);
+    X509_set_pubkey(x509, key);
+
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char*)[commonName UTF8String], -1, -1, 0);
+    X509_set_issuer_name(x509, issuer != NULL ? X509_get_subject_name(issuer) : name);
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, issuer != NULL ? issuer : x509, x509, NULL, NULL, 0);
+
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_basic_constraints,
+                                              ca ? "critical,CA:TRUE" : "critical,CA:FALSE");
+    X509_add_ext(x509, ext, -1);
+    X509_EXTENSION_free(ext);
+
+    if (ocspSigning) {
+        ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_ext_key_usage, "OCSPSigning");
+        X509_add_ext(x509, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    XCTAssert(X509_sign(x509, issuerKey != NULL ? issuerKey : key, EVP_sha256()) > 0);
+
+    return x509;
+}
+
+- (SecCertificateRef)secCertFromX509:(X509*)x509 CF_RETURNS_RETAINED
+{
+    unsigned char *der = NULL;
+    int len = i2d_X509(x509, &der);
+    NSData *data = [NSData dataWithBytes:der length:len];
+    OPENSSL_free(der);
+
+    SecCertificateRef cert = SecCertificateCreateWithData(NULL, (__bridge CFDataRef)data);
+    XCTAssert(cert != NULL);
+
+    return cert;
+}
+
+/// Create a response signed by the signer. The signer certificate is included in the response
+/// unless it is the issuer, as it would be by a delegated responder.
+- (NSData*)signedOCSPResponseForCert:(X509*)leaf
+                              issuer:(X509*)issuer
+                              status:(int)status
+                          thisUpdate:(long)thisUpdateOffset
+                          nextUpdate:(long)nextUpdateOffset
+                              signer:(X509*)signer
+                           signerKey:(EVP_PKEY*)signerKey
+{
+    OCSP_CERTID *certID = OCSP_cert_to_id(EVP_sha1(), leaf, issuer);
+    OCSP_BASICRESP *bs = OCSP_BASICRESP_new();
+
+    ASN1_TIME *thisUpdate = X509_gmtime_adj(NULL, thisUpdateOffset);
+    ASN1_TIME *nextUpdate = X509_gmtime_adj(NULL, nextUpdateOffset);
+
+    BOOL revoked = status == V_OCSP_CERTSTATUS_REVOKED;
+    OCSP_basic_add1_status(bs, certID, status,
+                           revoked ? OCSP_REVOKED_STATUS_UNSPECIFIED : OCSP_REVOKED_STATUS_NOSTATUS,
+                           revoked ? thisUpdate : NULL, thisUpdate, nextUpdate);
+
+    unsigned long flags = signer == issuer ? OCSP_NOCERTS : 0;
+    XCTAssert(OCSP_basic_sign(bs, signer, signerKey, EVP_sha256(), NULL, flags) == 1);
+
+    OCSP_RESPONSE *r = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+
+    unsigned char *ocspResponse = NULL;
+    int len = i2d_OCSP_RESPONSE(r, &ocspResponse);
+    NSData *d = [NSData dataWithBytes:ocspResponse length:len];
+
+    OPENSSL_free(ocspResponse);
+    OCSP_RESPONSE_free(r);
+    OCSP_BASICRESP_free(bs);
+    ASN1_TIME_free(thisUpdate);
+    ASN1_TIME_free(nextUpdate);
+    OCSP_CERTID_free(certID);
+
+    return d;
+}
+
+#pragma mark - OCSPCache initialization
+
+- (OCSPCache*)ocspCacheWithLogging {
+    OCSPCache *cache=
+    [[OCSPCache alloc] initWithLogger:^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPCache] %@", logLine);
+    }];
+
+    return cache;
+}
+
+#pragma mark - OCSPAuthURLSessionDelegate initialization
+
+- (OCSPAuthURLSessionDelegate*)ocspAuthURLSessionDelegateWithLogging {
+    void (^logger)(NSString * _Nonnull logLine) =
+    ^(NSString * _Nonnull logLine) {
+        NSLog(@"[OCSPAuthURLSessionDelegate] %@", logLine);
     };
 
     NSURL* (^modifyOCSPURL)(NSURL *url) =
@@ -874,6 +3601,22 @@
 
 #pragma mark - Helpers for loading certificates
 
+- (NSData*)loadOCSPResponseFailOnError:(NSString*)fileName {
+    NSString *filePath =
+        [@"Certs/DemoCA/CA/ocsp_responses" stringByAppendingPathComponent:fileName];
+
+    NSBundle *bundle = [NSBundle bundleForClass:self.class];
+    NSString *path = [bundle pathForResource:filePath ofType:nil];
+    NSData *data = path != nil ? [NSData dataWithContentsOfFile:path] : nil;
+
+    if (data == nil) {
+        XCTFail(@"OCSP response \"%@\" does not exist at path \"%@\"", filePath,
+                bundle.bundlePath);
+    }
+
+    return data;
+}
+
 - (SecCertificateRef)loadCertificateFailOnError:(NSString*)filePath
                              expectedCommonName:(NSString*)expectedCommonName {
     SecCertificateRef cert;
@@ -257,3 +257,83 @@ cd "$BASE_DIR"/CA
 touch cert_chain.pem
 cat "$INTERMEDIATE_CA_CERTS_DIR"/local_ocsp_urls.pem >> cert_chain.pem
 cat "$ROOT_CA_CERTS_DIR"/intermediate_CA.pem >> cert_chain.pem
+
+# Generate OCSP response fixtures with `openssl ocsp`, valid for as long as the certificates
+
+OCSP_RESPONSES_DIR=$BASE_DIR/CA/ocsp_responses
+
+mkdir -p "$OCSP_RESPONSES_DIR"
+
+cd "$OCSP_RESPONSES_DIR"
+
+## Requests
+
+openssl ocsp -issuer "$INTERMEDIATE_CA_CRT"\
+             -cert "$INTERMEDIATE_CA_CERTS_DIR"/local_ocsp_urls.crt\
+             -no_nonce\
+             -reqout local_ocsp_urls_req.der
+
+openssl ocsp -issuer "$ROOT_CA_CRT"\
+             -cert "$INTERMEDIATE_CA_CRT"\
+             -no_nonce\
+             -reqout intermediate_CA_req.der
+
+## Good, signed by the delegated responder of the intermediate CA
+
+openssl ocsp -index "$INTERMEDIATE_CA_CERTS_DIR"/certindex\
+             -rsigner "$INTERMEDIATE_CA_CERTS_DIR"/ocsp_signing.crt\
+             -rkey "$INTERMEDIATE_CA_CERTS_DIR"/ocsp_signing.key\
+             -CA "$INTERMEDIATE_CA_CRT"\
+             -ndays 3650\
+             -reqin local_ocsp_urls_req.der\
+             -respout local_ocsp_urls_good.der
+
+## Good, signed by the intermediate CA itself
+
+openssl ocsp -index "$INTERMEDIATE_CA_CERTS_DIR"/certindex\
+             -rsigner "$INTERMEDIATE_CA_CRT"\
+             -rkey "$INTERMEDIATE_CA_KEY"\
+             -CA "$INTERMEDIATE_CA_CRT"\
+             -resp_no_certs\
+             -ndays 3650\
+             -reqin local_ocsp_urls_req.der\
+             -respout local_ocsp_urls_good_signed_by_issuer.der
+
+## Good, signed by the delegated responder of the root CA, which the intermediate CA did not
+## delegate to
+
+openssl ocsp -index "$INTERMEDIATE_CA_CERTS_DIR"/certindex\
+             -rsigner "$ROOT_CA_CERTS_DIR"/ocsp_signing.crt\
+             -rkey "$ROOT_CA_CERTS_DIR"/ocsp_signing.key\
+             -CA "$INTERMEDIATE_CA_CRT"\
+             -ndays 3650\
+             -reqin local_ocsp_urls_req.der\
+             -respout local_ocsp_urls_good_wrong_signer.der
+
+## Revoked, signed by the delegated responder of the intermediate CA. Revoked in a copy of the
+## index, so that the certificate is still good for the OCSP server.
+
+sed 's/^V\t\([^\t]*\)\t\t\(.*\/CN=localhost\/.*\)$/R\t\1\t150813080000Z\t\2/'\
+    "$INTERMEDIATE_CA_CERTS_DIR"/certindex > revoked_certindex
+
+openssl ocsp -index revoked_certindex\
+             -rsigner "$INTERMEDIATE_CA_CERTS_DIR"/ocsp_signing.crt\
+             -rkey "$INTERMEDIATE_CA_CERTS_DIR"/ocsp_signing.key\
+             -CA "$INTERMEDIATE_CA_CRT"\
+             -ndays 3650\
+             -reqin local_ocsp_urls_req.der\
+             -respout local_ocsp_urls_revoked.der
+
+rm revoked_certindex
+
+## Intermediate CA good, signed by the delegated responder of the root CA
+
+openssl ocsp -index "$ROOT_CA_CERTS_DIR"/certindex\
+             -rsigner "$ROOT_CA_CERTS_DIR"/ocsp_signing.crt\
+             -rkey "$ROOT_CA_CERTS_DIR"/ocsp_signing.key\
+             -CA "$ROOT_CA_CRT"\
+             -ndays 3650\
+             -reqin intermediate_CA_req.der\
+             -respout intermediate_CA_good.der
+
+rm local_ocsp_urls_req.der intermediate_CA_req.der
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ Stands in for OCSP responders in tests.
+
+ Requests to a host registered with setResponse:delay:forHost: are answered with the provided
+ OCSP response after the delay, or fail as if the host refused the connection if the response is
+ nil. Requests to other hosts are not handled.
+
+ Only sessions created with sessionConfiguration are answered by the stand-in.
+ */
+@interface OCSPStandInResponder : NSURLProtocol
+
+/// Ephemeral session configuration whose requests are answered by the stand-in.
++ (NSURLSessionConfiguration*)sessionConfiguration;
+
+/// Answer requests to the host with the response after the delay. Replaces any previous setting
+/// for the host.
++ (void)setResponse:(NSData*__nullable)response
+              delay:(NSTimeInterval)delay
+            forHost:(NSString*)host;
+
+/// Stop answering requests to all hosts and reset the request counts.
++ (void)removeAllHosts;
+
+/// Number of requests made to the host since it was registered.
++ (NSUInteger)requestCountForHost:(NSString*)host;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import "OCSPStandInResponder.h"
+
+/// Response and delay of a stand-in host.
+@interface OCSPStandInHost : NSObject
+
+@property (strong, nonatomic) NSData *response;
+@property (assign, nonatomic) NSTimeInterval delay;
+@property (assign, nonatomic) NSUInteger requestCount;
+
+@end
+
+@implementation OCSPStandInHost
+@end
+
+/// Registered hosts. Guarded by synchronizing on the dictionary.
+static NSMutableDictionary<NSString*, OCSPStandInHost*>* standInHosts;
+
+@implementation OCSPStandInResponder
+
++ (void)initialize {
+    if (self == [OCSPStandInResponder class]) {
+        standInHosts = [[NSMutableDictionary alloc] init];
+    }
+}
+
++ (NSURLSessionConfiguration*)sessionConfiguration {
+    NSURLSessionConfiguration *config = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+    config.protocolClasses = @[[OCSPStandInResponder class]];
+    return config;
+}
+
++ (void)setResponse:(NSData*)response delay:(NSTimeInterval)delay forHost:(NSString*)host {
+    OCSPStandInHost *h = [[OCSPStandInHost alloc] init];
+    h.response = response;
+    h.delay = delay;
+
+    @synchronized (standInHosts) {
+        [standInHosts setObject:h forKey:[host lowercaseString]];
+    }
+}
+
++ (void)removeAllHosts {
+    @synchronized (standInHosts) {
+        [standInHosts removeAllObjects];
+    }
+}
+
++ (NSUInteger)requestCountForHost:(NSString*)host {
+    @synchronized (standInHosts) {
+        return [standInHosts objectForKey:[host lowercaseString]].requestCount;
+    }
+}
+
+#pragma mark - NSURLProtocol
+
++ (BOOL)canInitWithRequest:(NSURLRequest *)request {
+    @synchronized (standInHosts) {
+        return [standInHosts objectForKey:[request.URL.host lowercaseString]] != nil;
+    }
+}
+
++ (NSURLRequest *)canonicalRequestForRequest:(NSURLRequest *)request {
+    return request;
+}
+
+- (void)startLoading {
+    OCSPStandInHost *h;
+
+    @synchronized (standInHosts) {
+        h = [standInHosts objectForKey:[self.request.URL.host lowercaseString]];
+        h.requestCount++;
+    }
+
+    // Answer on the loading thread's run loop, as NSURLProtocol clients expect; cancelled in
+    // stopLoading
+    [self performSelector:@selector(answerWithResponse:)
+               withObject:h.response
+               afterDelay:h.delay];
+}
+
+- (void)stopLoading {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self];
+}
+
+- (void)answerWithResponse:(NSData*)response {
+    if (response == nil) {
+        NSError *e = [NSError errorWithDomain:NSURLErrorDomain
+                                         code:NSURLErrorCannotConnectToHost
+                                     userInfo:nil];
+        [self.client URLProtocol:self didFailWithError:e];
+        return;
+    }
+
+    NSHTTPURLResponse *r =
+    [[NSHTTPURLResponse alloc] initWithURL:self.request.URL
+                                statusCode:200
+                               HTTPVersion:@"HTTP/1.1"
+                              headerFields:@{@"Content-Type": @"application/ocsp-response"}];
+
+    [self.client URLProtocol:self
+          didReceiveResponse:r
+          cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    [self.client URLProtocol:self didLoadData:response];
+    [self.client URLProtocolDidFinishLoading:self];
+}
+
+@end
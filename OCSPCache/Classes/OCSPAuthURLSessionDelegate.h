@@ -19,11 +19,48 @@
 
 #import <Foundation/Foundation.h>
 #import "OCSPCache.h"
+#import "OCSPTrustVerdictCache.h"
 
 NS_ASSUME_NONNULL_BEGIN
 
 typedef void (^AuthCompletion)(NSURLSessionAuthChallengeDisposition, NSURLCredential *__nullable);
 
+/// Snapshot of the counters kept by OCSPAuthURLSessionDelegate. Each trust evaluation is completed
+/// by exactly one step of the revocation ladder, or rejected after all of them failed.
+@interface OCSPAuthURLSessionDelegateMetrics : NSObject
+
+/// Number of trust evaluations completed with a cached verdict, which skips the revocation checks
+/// but still evaluates the chain.
+@property (readonly, assign, nonatomic) NSUInteger verdictCacheCompletions;
+
+/// Number of trust evaluations completed with responses which the OCSP cache held before the first
+/// evaluation.
+@property (readonly, assign, nonatomic) NSUInteger ocspCacheFirstCompletions;
+
+/// Number of trust evaluations completed with a pinned OCSP response or one cached by the system.
+@property (readonly, assign, nonatomic) NSUInteger systemOCSPCompletions;
+
+/// Number of trust evaluations completed with responses looked up through the OCSP cache.
+@property (readonly, assign, nonatomic) NSUInteger ocspCacheCompletions;
+
+/// Number of trust evaluations completed by the system CRL check.
+@property (readonly, assign, nonatomic) NSUInteger systemCRLCompletions;
+
+/// Number of trust evaluations completed by the fallback system check.
+@property (readonly, assign, nonatomic) NSUInteger fallbackCompletions;
+
+/// Number of trust evaluations which rejected the protection space, whether a step of the ladder
+/// rejected the trust or all of them failed.
+@property (readonly, assign, nonatomic) NSUInteger rejections;
+
+/// Number of trust evaluations, whether with SecTrustEvaluateAsyncWithError or SecTrustEvaluate.
+@property (readonly, assign, nonatomic) NSUInteger evaluations;
+
+/// Highest number of trust evaluations which ran at once. Bounded by `maxConcurrentEvaluations`.
+@property (readonly, assign, nonatomic) NSUInteger peakConcurrentEvaluations;
+
+@end
+
 /*!
  * OCSPAuthURLSessionDelegate implements URLSession:task:didReceiveChallenge:completionHandler:
  * of the NSURLSessionDelegate protocol.
@@ -50,6 +87,16 @@ typedef void (^AuthCompletion)(NSURLSessionAuthChallengeDisposition, NSURLCreden
  */
 @interface OCSPAuthURLSessionDelegate : NSObject <NSURLSessionDelegate, NSURLSessionTaskDelegate>
 
+/// Verdicts of trust objects which were evaluated successfully with OCSP responses from the OCSP
+/// cache. Trust objects with the same certificates and policies skip the revocation checks until
+/// the earliest nextUpdate of those responses; their chain is still evaluated, so changes to the
+/// anchors take effect.
+@property (readonly, strong, nonatomic) OCSPTrustVerdictCache *verdictCache;
+
+/// Maximum number of trust objects evaluated at once on the evaluation queue. Challenges beyond it
+/// wait their turn; challenges waiting on OCSP lookups do not count towards it. Defaults to 8.
+@property (atomic, assign) NSUInteger maxConcurrentEvaluations;
+
 /// Initialize OCSPAuthURLSessionDelegate.
 /// @param logger logger Logger for emitting diagnostic information. Logging should only be used for
 /// testing since it emits the URLs corresponding to the certificate being validated.
@@ -58,13 +105,13 @@ typedef void (^AuthCompletion)(NSURLSessionAuthChallengeDisposition, NSURLCreden
 /// update the URL to point through a local proxy, whitelist the URL if needed, etc. If the provided
 /// block returns nil, the original URL is used.
 /// @param session Session with which to perform OCSP requests. This is an opportunity for the
-/// caller to specify a proxy to be used by the OCSP requests. If nil, a session with
-/// `ephemeralSessionConfiguration` is created and used.
+/// caller to specify a proxy to be used by the OCSP requests. If nil, sessions from the session pool
+/// of `ocspCache` are used.
 /// @param timeout Timeout in seconds for each set of OCSP requests made for a certificate (often 1
 ///                request) via OCSPAuthURLSessionDelegate. If the timeout values set in the
 ///                provided NSURLSession are shorter, then this value is effectively ignored; if no
-///                NSURLSession is provided, the same applies for the default timeout values of
-///                NSURLSessionConfiguration:ephemeralSessionConfiguration.
+///                NSURLSession is provided, the same applies for the timeout values of the
+///                configuration of the session pool of `ocspCache`.
 -  (instancetype)initWithLogger:(void (^)(NSString*))logger
                       ocspCache:(OCSPCache*)ocspCache
                   modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
@@ -72,12 +119,17 @@ typedef void (^AuthCompletion)(NSURLSessionAuthChallengeDisposition, NSURLCreden
                         timeout:(NSTimeInterval)timeout;
 
 /// Evaluate trust object performing certificate revocation checks in the following order:
-///   1. OCSP staple
-///   2. OCSP cache
-///   3. OCSP remote
-///   4. CRL with positive response and network
-///   5. CRL with network
+///   0. Verdict cache, which skips the revocation checks but still evaluates the chain
+///   1. OCSP cache, without network, if the chain was evaluated successfully before
+///   2. OCSP staple, skipped if step 1 evaluated the trust
+///   3. OCSP cache
+///   4. OCSP remote
+///   5. CRL with positive response and network
+///   6. CRL with network
 /// Returns TRUE if the trust was evaulated with a postive response; otherwise returns FALSE.
+/// Blocks the calling thread until the evaluation is done; the completion handler is called on the
+/// evaluation queue before this returns. See evaluateTrustAsync:modifyOCSPURLOverride:
+/// sessionOverride:completionHandler:.
 /// @param trust Target trust reference. Must include the target certificate and the certificate
 /// of its issuer.
 /// @param completionHandler Completion handler from the NSURLSessionDelegate or NSURLSessionTaskDelegate
@@ -87,12 +139,16 @@ typedef void (^AuthCompletion)(NSURLSessionAuthChallengeDisposition, NSURLCreden
     completionHandler:(AuthCompletion)completionHandler;
 
 /// Evaluate trust object performing certificate revocation checks in the following order:
-///   1. OCSP staple
-///   2. OCSP cache
-///   3. OCSP remote
-///   4. CRL with positive response and network
-///   5. CRL with network
+///   0. Verdict cache, which skips the revocation checks but still evaluates the chain
+///   1. OCSP cache, without network, if the chain was evaluated successfully before
+///   2. OCSP staple, skipped if step 1 evaluated the trust
+///   3. OCSP cache
+///   4. OCSP remote
+///   5. CRL with positive response and network
+///   6. CRL with network
 /// Returns TRUE if the trust was evaulated with a postive response; otherwise returns FALSE.
+/// Blocks the calling thread until the evaluation is done; the completion handler is called on the
+/// evaluation queue before this returns.
 /// @param trust Target trust reference. Must include the target certificate and the certificate
 /// of its issuer.
 /// @param modifyOCSPURLOverride Override the block specified when OCSPAuthURLSessionDelegate was initialized. This allows
@@ -107,12 +163,37 @@ modifyOCSPURLOverride:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURLOverride
       sessionOverride:(NSURLSession*__nullable)sessionOverride
     completionHandler:(AuthCompletion)completionHandler;
 
-/// NSURLSessionDelegate implementation
+/// Evaluate trust object, performing the revocation checks of evaluateTrust:modifyOCSPURLOverride:
+/// sessionOverride:completionHandler:, without blocking the calling thread.
+///
+/// Trust objects are evaluated on a concurrent evaluation queue, at most `maxConcurrentEvaluations`
+/// at once, with SecTrustEvaluateAsyncWithError on iOS 13 and later and SecTrustEvaluate before.
+/// OCSP lookups do not block any thread. The completion handler is called exactly once, from the
+/// evaluation queue or the queue on which the OCSP cache completes lookups.
+/// @param trust Target trust reference. Must include the target certificate and the certificate
+/// of its issuer. Retained until the evaluation is done.
+/// @param modifyOCSPURLOverride See evaluateTrust:modifyOCSPURLOverride:sessionOverride:completionHandler:.
+/// @param sessionOverride See evaluateTrust:modifyOCSPURLOverride:sessionOverride:completionHandler:.
+/// @param completionHandler Completion handler from the NSURLSessionDelegate or NSURLSessionTaskDelegate
+/// authentication challenge.
+/// @warning The trust object will be modified and is not safe to access until the completion
+/// handler is called.
+- (void)evaluateTrustAsync:(SecTrustRef)trust
+     modifyOCSPURLOverride:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURLOverride
+           sessionOverride:(NSURLSession*__nullable)sessionOverride
+         completionHandler:(AuthCompletion)completionHandler;
+
+/// Snapshot of the counters.
+- (OCSPAuthURLSessionDelegateMetrics*)metrics;
+
+/// NSURLSessionDelegate implementation. Evaluates server trust challenges with
+/// evaluateTrustAsync:modifyOCSPURLOverride:sessionOverride:completionHandler:.
 - (void)URLSession:(NSURLSession *)session
 didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
  completionHandler:(void (^)(NSURLSessionAuthChallengeDisposition, NSURLCredential * _Nullable))completionHandler;
 
-/// NSURLSessionTaskDelegate implementation
+/// NSURLSessionTaskDelegate implementation. Evaluates server trust challenges with
+/// evaluateTrustAsync:modifyOCSPURLOverride:sessionOverride:completionHandler:.
 - (void)URLSession:(NSURLSession *)session
               task:(NSURLSessionTask *__nullable)task
 didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
@@ -20,16 +20,142 @@
 #import "OCSPAuthURLSessionDelegate.h"
 
 #import "OCSPCache.h"
+#import "OCSPGeneralizedTime.h"
+#import "OCSPOpenSSLBridge.h"
 #import "OCSPURLEncode.h"
 #import "OCSPSecTrust.h"
 
+/// Maximum number of chains remembered for checking the OCSP cache before the first evaluation.
+#define OCSPAuthURLSessionDelegateChainMemoLimit 256
+
+/// Default maximum number of trust objects evaluated at once.
+#define OCSPAuthURLSessionDelegateDefaultMaxConcurrentEvaluations 8
+
+/// Steps of the revocation ladder which can complete a challenge.
+typedef NS_ENUM(NSInteger, OCSPAuthRung) {
+    OCSPAuthRungVerdictCache = 0,
+    OCSPAuthRungOCSPCacheFirst,
+    OCSPAuthRungSystemOCSP,
+    OCSPAuthRungOCSPCache,
+    OCSPAuthRungSystemCRL,
+    OCSPAuthRungFallback,
+    OCSPAuthRungCount
+};
+
+/// Called when a step of the revocation ladder has evaluated the trust object. `completed` is TRUE
+/// if the completion handler of the challenge was called, and `completedWithError` is TRUE if it
+/// was called to reject the protection space.
+typedef void (^OCSPAuthStepCompletion)(BOOL completed, BOOL completedWithError);
+
+/// Work run on the evaluation queue, which calls `done` once it no longer needs its slot.
+typedef void (^OCSPAuthScheduledEvaluation)(void (^done)(void));
+
+@interface OCSPAuthURLSessionDelegateMetrics ()
+
+@property (assign, nonatomic) NSUInteger verdictCacheCompletions;
+@property (assign, nonatomic) NSUInteger ocspCacheFirstCompletions;
+@property (assign, nonatomic) NSUInteger systemOCSPCompletions;
+@property (assign, nonatomic) NSUInteger ocspCacheCompletions;
+@property (assign, nonatomic) NSUInteger systemCRLCompletions;
+@property (assign, nonatomic) NSUInteger fallbackCompletions;
+@property (assign, nonatomic) NSUInteger rejections;
+@property (assign, nonatomic) NSUInteger evaluations;
+@property (assign, nonatomic) NSUInteger peakConcurrentEvaluations;
+
+@end
+
+@implementation OCSPAuthURLSessionDelegateMetrics
+
+- (NSString*)description {
+    return [NSString stringWithFormat:@"completions: verdict cache %lu, OCSP cache first %lu, "
+                                       "system OCSP %lu, OCSP cache %lu, system CRL %lu, "
+                                       "fallback %lu; rejections: %lu, evaluations: %lu, "
+                                       "peak concurrent evaluations: %lu",
+            (unsigned long)self.verdictCacheCompletions,
+            (unsigned long)self.ocspCacheFirstCompletions,
+            (unsigned long)self.systemOCSPCompletions,
+            (unsigned long)self.ocspCacheCompletions,
+            (unsigned long)self.systemCRLCompletions,
+            (unsigned long)self.fallbackCompletions,
+            (unsigned long)self.rejections,
+            (unsigned long)self.evaluations,
+            (unsigned long)self.peakConcurrentEvaluations];
+}
+
+@end
+
+/// State of a trust object on its way down the revocation ladder. Only one step of the ladder
+/// accesses it at a time.
+@interface OCSPAuthEvaluation : NSObject
+
+@property (readonly, assign, nonatomic) SecTrustRef trust;
+
+/// Policies of the trust object before any revocation policy was added, restored after each step.
+@property (readonly, assign, nonatomic) CFArrayRef originalPolicies;
+
+@property (strong, nonatomic) NSData *verdictKey;
+@property (copy, nonatomic) NSURL* (^modifyOCSPURL)(NSURL *url);
+@property (strong, nonatomic) NSURLSession *session;
+@property (copy, nonatomic) AuthCompletion completionHandler;
+
+/// TRUE if the trust object was evaluated with the responses which the OCSP cache held before the
+/// first evaluation.
+@property (assign, nonatomic) BOOL triedOCSPCacheFirst;
+
+/// Called once the evaluation is done, with TRUE if a step of the ladder called the completion
+/// handler and FALSE if all of them failed. May be nil.
+@property (copy, nonatomic) void (^finished)(BOOL completed);
+
+- (instancetype)initWithTrust:(SecTrustRef)trust;
+
+@end
+
+@implementation OCSPAuthEvaluation
+
+- (instancetype)initWithTrust:(SecTrustRef)trust {
+    self = [super init];
+
+    if (self) {
+        CFRetain(trust);
+        self->_trust = trust;
+
+        // Copy the original set of policies so the original set can be
+        // restored after each evaluation attempt.
+        CFArrayRef policies = NULL;
+        if (SecTrustCopyPolicies(trust, &policies) != errSecSuccess || policies == NULL) {
+            policies = CFArrayCreate(NULL, NULL, 0, &kCFTypeArrayCallBacks);
+        }
+        self->_originalPolicies = policies;
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    CFRelease(self->_originalPolicies);
+    CFRelease(self->_trust);
+}
+
+@end
+
 @implementation OCSPAuthURLSessionDelegate {
     void (^logger)(NSString*);
     NSURL* (^modifyOCSPURL)(NSURL *url);
     OCSPCache* ocspCache;
     NSURLSession *session;
     NSTimeInterval timeout;
-    void (^successfullyValidatedTrust)(SecTrustRef trust);
+    // Chains, leaf first, of trust objects which were evaluated successfully with responses from
+    // the OCSP cache, keyed by leaf certificate.
+    NSCache<id, NSArray*>* chains;
+    // Concurrent queue on which trust objects are evaluated
+    dispatch_queue_t evaluationQueue;
+    // Guarded by synchronizing on self
+    NSUInteger rungCompletions[OCSPAuthRungCount];
+    NSUInteger rejections;
+    NSUInteger evaluations;
+    NSUInteger evaluationsInFlight;
+    NSUInteger peakEvaluationsInFlight;
+    NSMutableArray<OCSPAuthScheduledEvaluation>* pendingEvaluations;
 }
 
 - (instancetype)init {
@@ -41,6 +167,7 @@
             NSLog(@"[OCSPCache] %@", logLine);
         }];
         self->timeout = 0;
+        [self initTasks];
     }
 
     return self;
@@ -58,21 +185,26 @@
         self->logger = logger;
         self->ocspCache = ocspCache;
         self->modifyOCSPURL = modifyOCSPURL;
-        if (session) {
-            self->session = session;
-        } else {
-            NSURLSessionConfiguration *config =
-            [NSURLSessionConfiguration ephemeralSessionConfiguration];
-
-            self->session = [NSURLSession sessionWithConfiguration:config];
-        }
+        // If nil, the session pool of the cache is used
+        self->session = session;
         assert(timeout >= 0);
         self->timeout = timeout;
+        [self initTasks];
     }
 
     return self;
 }
 
+- (void)initTasks {
+    self->_verdictCache = [[OCSPTrustVerdictCache alloc] init];
+    self->_maxConcurrentEvaluations = OCSPAuthURLSessionDelegateDefaultMaxConcurrentEvaluations;
+    self->chains = [[NSCache alloc] init];
+    self->chains.countLimit = OCSPAuthURLSessionDelegateChainMemoLimit;
+    self->evaluationQueue = dispatch_queue_create("ca.psiphon.OCSPCache.EvaluationQueue",
+                                                  DISPATCH_QUEUE_CONCURRENT);
+    self->pendingEvaluations = [[NSMutableArray alloc] init];
+}
+
 #pragma mark - NSURLSessionDelegate implementation
 
 // See comment in header
@@ -90,7 +222,10 @@
 
         SecTrustRef trust = challenge.protectionSpace.serverTrust;
 
-        [self evaluateTrust:trust completionHandler:completionHandler];
+        [self evaluateTrustAsync:trust
+           modifyOCSPURLOverride:nil
+                 sessionOverride:nil
+               completionHandler:completionHandler];
 
         return;
     }
@@ -119,7 +254,10 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
 
         SecTrustRef trust = challenge.protectionSpace.serverTrust;
 
-        [self evaluateTrust:trust completionHandler:completionHandler];
+        [self evaluateTrustAsync:trust
+           modifyOCSPURLOverride:nil
+                 sessionOverride:nil
+               completionHandler:completionHandler];
 
         return;
     }
@@ -145,197 +283,426 @@ modifyOCSPURLOverride:(nullable NSURL * _Nonnull (^)(NSURL * _Nonnull))modifyOCS
       sessionOverride:(NSURLSession*)sessionOverride
     completionHandler:(AuthCompletion)completionHandler {
 
-    NSURL* (^modifyOCSPURL)(NSURL *url);
+    dispatch_semaphore_t sem = dispatch_semaphore_create(0);
+    __block BOOL evaluated = FALSE;
 
-    if (modifyOCSPURLOverride) {
-        modifyOCSPURL = modifyOCSPURLOverride;
-    } else {
-        modifyOCSPURL = self->modifyOCSPURL;
-    }
+    [self startEvaluation:trust
+            modifyOCSPURL:modifyOCSPURLOverride
+                  session:sessionOverride
+        completionHandler:completionHandler
+                 finished:^(BOOL completed) {
+        evaluated = completed;
+        dispatch_semaphore_signal(sem);
+    }];
 
-    NSURLSession *session;
-    if (sessionOverride) {
-        session = sessionOverride;
-    } else {
-        session = self->session;
-    }
+    // The lookups of the ladder are bounded by the timeout
+    dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
 
-    BOOL completed;
-    BOOL completedWithError;
+    return evaluated;
+}
 
-    // Copy the original set of policies so the original set can be
-    // restored after each evaluation attempt.
-    CFArrayRef originalPolicies;
-    SecTrustCopyPolicies(trust, &originalPolicies);
+/// See comment in header
+- (void)evaluateTrustAsync:(SecTrustRef)trust
+     modifyOCSPURLOverride:(nullable NSURL * _Nonnull (^)(NSURL * _Nonnull))modifyOCSPURLOverride
+           sessionOverride:(NSURLSession*)sessionOverride
+         completionHandler:(AuthCompletion)completionHandler {
 
-    // Check if there is a pinned or cached OCSP response
+    [self startEvaluation:trust
+            modifyOCSPURL:modifyOCSPURLOverride
+                  session:sessionOverride
+        completionHandler:completionHandler
+                 finished:nil];
+}
 
-    [self trySystemOCSPNoRemote:trust
-               originalPolicies:originalPolicies
-                      completed:&completed
-             completedWithError:&completedWithError
-              completionHandler:completionHandler];
+/// Start the trust object down the revocation ladder.
+- (void)startEvaluation:(SecTrustRef)trust
+          modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURLOverride
+                session:(NSURLSession*__nullable)sessionOverride
+      completionHandler:(AuthCompletion)completionHandler
+               finished:(void (^__nullable)(BOOL completed))finished {
+
+    // Count rejections, whichever step rejects the trust
+    AuthCompletion originalCompletionHandler = completionHandler;
+    completionHandler = ^(NSURLSessionAuthChallengeDisposition disposition,
+                          NSURLCredential *__nullable credential) {
+        if (disposition == NSURLSessionAuthChallengeRejectProtectionSpace) {
+            @synchronized (self) {
+                self->rejections++;
+            }
+        }
+        originalCompletionHandler(disposition, credential);
+    };
+
+    OCSPAuthEvaluation *evaluation = [[OCSPAuthEvaluation alloc] initWithTrust:trust];
+    evaluation.verdictKey = [OCSPTrustVerdictCache keyForTrust:trust policies:NULL];
+    evaluation.modifyOCSPURL = modifyOCSPURLOverride ? modifyOCSPURLOverride : self->modifyOCSPURL;
+    evaluation.session = sessionOverride ? sessionOverride : self->session;
+    evaluation.completionHandler = completionHandler;
+    evaluation.finished = finished;
+
+    // Skip the revocation checks if the same certificates and policies were evaluated successfully
+    // with OCSP responses which are still current
+    if ([self.verdictCache hasVerdictForKey:evaluation.verdictKey]) {
+        [self tryVerdictCache:evaluation];
+        return;
+    }
 
-    if (completed) {
-        SecTrustSetPolicies(trust, originalPolicies);
-        [self logWithFormat:@"Pinned or cached OCSP response found by the system"];
-        return TRUE;
+    // Check if the OCSP cache already has responses for the chain, which is the common case for
+    // servers seen before. This saves evaluating without them first.
+    [self tryOCSPCacheFirst:evaluation];
+}
+
+/// Finish an evaluation which the step `rung` of the ladder completed.
+- (void)finishEvaluation:(OCSPAuthEvaluation*)evaluation byRung:(OCSPAuthRung)rung {
+    SecTrustSetPolicies(evaluation.trust, evaluation.originalPolicies);
+    [self countCompletionByRung:rung];
+    if (evaluation.finished != nil) {
+        evaluation.finished(TRUE);
     }
+}
 
-    // No pinned OCSP response, try fetching one
+/// Finish an evaluation which every step of the ladder failed to complete.
+- (void)rejectEvaluation:(OCSPAuthEvaluation*)evaluation {
+    SecTrustSetPolicies(evaluation.trust, evaluation.originalPolicies);
+    // Reject the protection space.
+    // Do not use NSURLSessionAuthChallengePerformDefaultHandling because it can trigger
+    // plaintext OCSP requests.
+    evaluation.completionHandler(NSURLSessionAuthChallengeRejectProtectionSpace, nil);
+    if (evaluation.finished != nil) {
+        evaluation.finished(FALSE);
+    }
+}
 
-    [self logWithFormat:@"Fetching OCSP response through OCSPCache"];
+// See comment in header
+- (OCSPAuthURLSessionDelegateMetrics*)metrics {
+    OCSPAuthURLSessionDelegateMetrics *m = [[OCSPAuthURLSessionDelegateMetrics alloc] init];
+
+    @synchronized (self) {
+        m.verdictCacheCompletions = self->rungCompletions[OCSPAuthRungVerdictCache];
+        m.ocspCacheFirstCompletions = self->rungCompletions[OCSPAuthRungOCSPCacheFirst];
+        m.systemOCSPCompletions = self->rungCompletions[OCSPAuthRungSystemOCSP];
+        m.ocspCacheCompletions = self->rungCompletions[OCSPAuthRungOCSPCache];
+        m.systemCRLCompletions = self->rungCompletions[OCSPAuthRungSystemCRL];
+        m.fallbackCompletions = self->rungCompletions[OCSPAuthRungFallback];
+        m.rejections = self->rejections;
+        m.evaluations = self->evaluations;
+        m.peakConcurrentEvaluations = self->peakEvaluationsInFlight;
+    }
 
-    NSArray<OCSPCacheLookupResult*> *results = [self->ocspCache lookupAll:trust
-                                                               andTimeout:self->timeout
-                                                            modifyOCSPURL:modifyOCSPURL
-                                                                  session:session];
-
-    BOOL evictedResponse;
-
-    [self evaluateOCSPCacheResult:results
-                 originalPolicies:originalPolicies
-                  evictedResponse:&evictedResponse
-                            trust:trust
-                        completed:&completed
-               completedWithError:&completedWithError
-                completionHandler:completionHandler];
-
-    if (completed) {
-        SecTrustSetPolicies(trust, originalPolicies);
-        [self logWithFormat:@"Completed with OCSP response"];
-        return TRUE;
-    }
-
-    // Check if check failed and a response was evicted from the cache
-    if (!completed && evictedResponse) {
-        // In the scenario that an intermediate certificate in the chain was missing,
-        // but retrievable through an X509 extension:
-        // - The first SecTrustEvaluate will fail, but the missing certificates will be downloaded
-        //   in this step
-        // - The responses will be evicted
-        // We should retry in this scenario because missing certificates may have been fetched.
-
-        // Cache returned pending response
-        NSArray<OCSPCacheLookupResult*> *results = [self->ocspCache lookupAll:trust
-                                                                   andTimeout:self->timeout
-                                                                modifyOCSPURL:modifyOCSPURL
-                                                                      session:session];
+    return m;
+}
 
-        [self evaluateOCSPCacheResult:results
-                     originalPolicies:originalPolicies
-                      evictedResponse:&evictedResponse
-                                trust:trust
-                            completed:&completed
-                   completedWithError:&completedWithError
-                    completionHandler:completionHandler];
-        if (completed) {
-            SecTrustSetPolicies(trust, originalPolicies);
-            [self logWithFormat:@"Completed with OCSP response after evict and fetch"];
-            return TRUE;
-        }
+- (void)countCompletionByRung:(OCSPAuthRung)rung {
+    @synchronized (self) {
+        self->rungCompletions[rung]++;
     }
+}
 
-    // Try system CRL check and require a positive response
+#pragma mark - Verdict cache
 
-    [self trySystemCRL:trust
-      originalPolicies:originalPolicies
-             completed:&completed
-    completedWithError:&completedWithError
-     completionHandler:completionHandler];
+/// Responses of the successful lookup results.
+- (NSArray<OCSPResponse*>*)responsesOfResults:(NSArray<OCSPCacheLookupResult*>*)results {
+    NSMutableArray<OCSPResponse*>* responses = [[NSMutableArray alloc] init];
 
-    if (completed) {
-        SecTrustSetPolicies(trust, originalPolicies);
-        [self logWithFormat:@"Evaluate completed by successful system CRL check"];
-        return TRUE;
+    for (OCSPCacheLookupResult *result in results) {
+        if (result.err == nil && result.response != nil) {
+            [responses addObject:result.response];
+        }
     }
 
-    // Unfortunately relax our requirements
+    return responses;
+}
+
+/// Cache the verdict for a trust object which was evaluated successfully with the provided
+/// responses. The verdict expires at the earliest nextUpdate of the responses or notAfter of the
+/// certificates, whichever comes first.
+- (void)cacheVerdictForKey:(NSData*)key
+                     trust:(SecTrustRef)trust
+                 responses:(NSArray<OCSPResponse*>*)responses {
 
-    [self tryFallback:trust
-     originalPolicies:originalPolicies
-            completed:&completed
-   completedWithError:&completedWithError
-    completionHandler:completionHandler];
+    NSDate *expiry = nil;
 
-    if (completed) {
-        SecTrustSetPolicies(trust, originalPolicies);
-        [self logWithFormat:@"Completed with fallback system check"];
-        return TRUE;
+    for (OCSPResponse *response in responses) {
+        NSDate *thisUpdate, *nextUpdate;
+        if ([response thisUpdate:&thisUpdate nextUpdate:&nextUpdate] != nil) {
+            [self logWithFormat:@"Not caching verdict: failed to parse validity of response"];
+            return;
+        }
+
+        if (nextUpdate != nil &&
+            (expiry == nil || [nextUpdate compare:expiry] == NSOrderedAscending)) {
+            expiry = nextUpdate;
+        }
     }
 
-    SecTrustSetPolicies(trust, originalPolicies);
-    // Reject the protection space.
-    // Do not use NSURLSessionAuthChallengePerformDefaultHandling because it can trigger
-    // plaintext OCSP requests.
-    completionHandler(NSURLSessionAuthChallengeRejectProtectionSpace, nil);
+    // The trust object has been evaluated, so this is the full chain
+    CFIndex certCount = SecTrustGetCertificateCount(trust);
+    for (CFIndex i = 0; i < certCount; i++) {
+        X509 *x = [OCSPOpenSSLBridge secCertRefToX509:SecTrustGetCertificateAtIndex(trust, i)];
+        NSDate *notAfter = x != NULL ? [OCSPGeneralizedTime dateFromASN1Time:X509_get_notAfter(x)]
+                                     : nil;
+        X509_free(x);
+
+        if (notAfter == nil) {
+            [self logWithFormat:@"Not caching verdict: failed to parse validity of certificate"];
+            return;
+        }
 
-    return FALSE;
+        if (expiry == nil || [notAfter compare:expiry] == NSOrderedAscending) {
+            expiry = notAfter;
+        }
+    }
+
+    [self.verdictCache setVerdictForKey:key expiry:expiry];
 }
 
 #pragma mark - Revocation checks
 
-/// Helper to eliminate boilerplate
+/// Helper to eliminate boilerplate. Takes ownership of `policy`.
 - (void)evaluateWithPolicy:(SecPolicyRef)policy
-          originalPolicies:(CFArrayRef)originalPolicies
-                     trust:(SecTrustRef)trust
-                 completed:(BOOL*)completed
-        completedWithError:(BOOL*)completedWithError
-         completionHandler:(AuthCompletion)completionHandler {
+                evaluation:(OCSPAuthEvaluation*)evaluation
+                completion:(OCSPAuthStepCompletion)completion {
+
+    [self scheduleEvaluation:^(void (^done)(void)) {
+        CFArrayRef originalPolicies = evaluation.originalPolicies;
+        CFIndex policyCount = CFArrayGetCount(originalPolicies);
+        CFMutableArrayRef newPolicies = CFArrayCreateMutableCopy(NULL, policyCount+1, originalPolicies);
+        CFArrayAppendValue(newPolicies, policy);
+
+        OSStatus s = SecTrustSetPolicies(evaluation.trust, newPolicies);
+        CFRelease(newPolicies);
+        CFRelease(policy);
+        if (s != 0) {
+            [self logWithFormat:@"Unexpected result code from SecTrustSetPolicies %d", s];
+            done();
+            completion(FALSE, FALSE);
+            return;
+        }
 
-    CFIndex policyCount = CFArrayGetCount(originalPolicies);
-    CFMutableArrayRef newPolicies = CFArrayCreateMutableCopy(NULL, policyCount+1, originalPolicies);
-    CFArrayAppendValue(newPolicies, policy);
+        [self evaluateTrust:evaluation.trust
+          completionHandler:evaluation.completionHandler
+                 completion:^(BOOL completed, BOOL completedWithError) {
+            done();
+            completion(completed, completedWithError);
+        }];
+    }];
+}
 
-    OSStatus s = SecTrustSetPolicies(trust, newPolicies);
-    CFRelease(newPolicies);
-    CFRelease(policy);
-    if (s != 0) {
-        [self logWithFormat:@"Unexpected result code from SecTrustSetPolicies %d", s];
-        *completed = FALSE;
-        *completedWithError = FALSE;
+/// Remember the chain of a trust object which was evaluated successfully, so that the OCSP cache
+/// can be checked for its responses before evaluating the trust object of the next challenge.
+- (void)rememberChainOfTrust:(SecTrustRef)trust {
+    CFIndex certCount = SecTrustGetCertificateCount(trust);
+    if (certCount < 2) {
+        return;
+    }
+
+    NSMutableArray *chain = [[NSMutableArray alloc] initWithCapacity:certCount];
+    for (CFIndex i = 0; i < certCount; i++) {
+        [chain addObject:(__bridge id)SecTrustGetCertificateAtIndex(trust, i)];
+    }
+
+    [self->chains setObject:chain forKey:[chain firstObject]];
+}
+
+/// Evaluates the chain without a revocation policy, since a cached verdict says the revocation
+/// checks passed. The verdict is keyed by the leaf and policies only, so the chain is still built
+/// and checked against the current anchors. If the evaluation fails the verdict is dropped; a
+/// recoverable failure moves on to the revocation checks.
+- (void)tryVerdictCache:(OCSPAuthEvaluation*)evaluation {
+
+    [self scheduleEvaluation:^(void (^done)(void)) {
+        SecTrustSetPolicies(evaluation.trust, evaluation.originalPolicies);
+
+        [self evaluateTrust:evaluation.trust
+          completionHandler:evaluation.completionHandler
+                 completion:^(BOOL completed, BOOL completedWithError) {
+            done();
+
+            if (!completed || completedWithError) {
+                [self.verdictCache removeVerdictForKey:evaluation.verdictKey];
+            }
+
+            if (!completed) {
+                [self tryOCSPCacheFirst:evaluation];
+                return;
+            }
+
+            [self logWithFormat:@"Completed with cached verdict"];
+            [self finishEvaluation:evaluation byRung:OCSPAuthRungVerdictCache];
+        }];
+    }];
+}
+
+/// Evaluate with the responses which the OCSP cache already holds for the chain, without network
+/// access. Only possible if the leaf certificate was evaluated successfully before, since the chain
+/// is not known until the trust object is evaluated, and if the cache has an unexpired response
+/// for every certificate of the chain except the root. Otherwise no evaluation is done.
+- (void)tryOCSPCacheFirst:(OCSPAuthEvaluation*)evaluation {
+
+    NSArray<OCSPResponse*>* responses = [self cachedResponsesForChainOfTrust:evaluation.trust];
+    if (responses == nil) {
+        [self trySystemOCSPNoRemote:evaluation];
         return;
     }
 
-    [self evaluateTrust:trust
-              completed:completed
-     completedWithError:completedWithError
-      completionHandler:completionHandler];
+    [self logWithFormat:@"Evaluating with OCSP responses from cache"];
+    evaluation.triedOCSPCacheFirst = TRUE;
+
+    NSMutableArray<NSData*>* responseData = [[NSMutableArray alloc] init];
+    for (OCSPResponse *response in responses) {
+        [responseData addObject:response.data];
+    }
+    SecTrustSetOCSPResponse(evaluation.trust, (__bridge CFArrayRef)responseData);
+
+    SecPolicyRef policy = SecPolicyCreateRevocation(kSecRevocationOCSPMethod |
+                                                    kSecRevocationRequirePositiveResponse |
+                                                    kSecRevocationNetworkAccessDisabled);
+
+    [self evaluateWithPolicy:policy
+                  evaluation:evaluation
+                  completion:^(BOOL completed, BOOL completedWithError) {
+        if (!completed) {
+            [self trySystemOCSPNoRemote:evaluation];
+            return;
+        }
+
+        [self logWithFormat:@"Completed with OCSP response from cache before first evaluation"];
+        if (!completedWithError) {
+            [self cacheVerdictForKey:evaluation.verdictKey
+                               trust:evaluation.trust
+                           responses:responses];
+        }
+        [self finishEvaluation:evaluation byRung:OCSPAuthRungOCSPCacheFirst];
+    }];
+}
+
+/// Responses which the OCSP cache holds for every certificate of the remembered chain of the leaf
+/// certificate of the trust object, except the root. Returns nil if the chain is not remembered or
+/// any response is missing.
+- (NSArray<OCSPResponse*>*__nullable)cachedResponsesForChainOfTrust:(SecTrustRef)trust {
+
+    // Does not evaluate the trust object
+    SecCertificateRef leaf = SecTrustGetCertificateAtIndex(trust, 0);
+    if (leaf == NULL) {
+        return nil;
+    }
+
+    NSArray *chain = [self->chains objectForKey:(__bridge id)leaf];
+    if (chain == nil) {
+        return nil;
+    }
+
+    NSMutableArray<OCSPResponse*>* responses = [[NSMutableArray alloc] init];
+
+    for (NSUInteger i = 0; i + 1 < [chain count]; i++) {
+        SecCertificateRef cert = (__bridge SecCertificateRef)[chain objectAtIndex:i];
+        SecCertificateRef issuer = (__bridge SecCertificateRef)[chain objectAtIndex:i + 1];
+
+        OCSPResponse *response = [self->ocspCache cachedResponseForCert:cert issuer:issuer];
+        if (response == nil) {
+            [self logWithFormat:@"OCSP cache does not have responses for the whole chain"];
+            return nil;
+        }
+
+        [responses addObject:response];
+    }
+
+    return responses;
 }
 
 /// Uses default checking with no remote calls.
 /// Succeeds if there is a pinned OCSP response or one was cached by the system.
-- (void)trySystemOCSPNoRemote:(SecTrustRef)trust
-             originalPolicies:(CFArrayRef)originalPolicies
-                    completed:(BOOL*)completed
-           completedWithError:(BOOL*)completedWithError
-            completionHandler:(AuthCompletion)completionHandler {
+/// Skipped if the OCSP cache was tried, since its responses replaced any pinned response and the
+/// evaluation would be the same.
+- (void)trySystemOCSPNoRemote:(OCSPAuthEvaluation*)evaluation {
+
+    if (evaluation.triedOCSPCacheFirst) {
+        [self tryOCSPCache:evaluation isRetry:FALSE];
+        return;
+    }
+
     SecPolicyRef policy = SecPolicyCreateRevocation(kSecRevocationOCSPMethod |
                                                     kSecRevocationRequirePositiveResponse |
                                                     kSecRevocationNetworkAccessDisabled);
+
     [self evaluateWithPolicy:policy
-            originalPolicies:originalPolicies
-                       trust:trust
-                   completed:completed
-          completedWithError:completedWithError
-           completionHandler:completionHandler];
+                  evaluation:evaluation
+                  completion:^(BOOL completed, BOOL completedWithError) {
+#pragma unused(completedWithError)
+        if (!completed) {
+            // No pinned OCSP response, try fetching one
+            [self tryOCSPCache:evaluation isRetry:FALSE];
+            return;
+        }
 
-    return;
+        [self logWithFormat:@"Pinned or cached OCSP response found by the system"];
+        [self finishEvaluation:evaluation byRung:OCSPAuthRungSystemOCSP];
+    }];
+}
+
+/// Look up responses for the chain through the OCSP cache, without blocking, and evaluate with
+/// them.
+/// @param isRetry TRUE if this is the lookup which follows a failed evaluation which evicted
+/// responses, in which case it is not retried again.
+- (void)tryOCSPCache:(OCSPAuthEvaluation*)evaluation isRetry:(BOOL)isRetry {
+
+    [self logWithFormat:@"Fetching OCSP response through OCSPCache"];
+
+    [self->ocspCache lookupAll:evaluation.trust
+                    andTimeout:self->timeout
+                 modifyOCSPURL:evaluation.modifyOCSPURL
+                       session:evaluation.session
+                 requiredLinks:0
+                linkCompletion:nil
+                    completion:^(NSArray<OCSPCacheLookupResult*>* results) {
+
+        [self evaluateOCSPCacheResult:results
+                           evaluation:evaluation
+                           completion:^(BOOL completed,
+                                        BOOL completedWithError,
+                                        BOOL evictedResponse) {
+            if (completed) {
+                if (isRetry) {
+                    [self logWithFormat:@"Completed with OCSP response after evict and fetch"];
+                } else {
+                    [self logWithFormat:@"Completed with OCSP response"];
+                }
+                if (!completedWithError) {
+                    [self rememberChainOfTrust:evaluation.trust];
+                    [self cacheVerdictForKey:evaluation.verdictKey
+                                       trust:evaluation.trust
+                                   responses:[self responsesOfResults:results]];
+                }
+                [self finishEvaluation:evaluation byRung:OCSPAuthRungOCSPCache];
+                return;
+            }
+
+            // Check if check failed and a response was evicted from the cache, or is missing for a link
+            if (evictedResponse && !isRetry) {
+                // In the scenario that an intermediate certificate in the chain was missing,
+                // but retrievable through an X509 extension:
+                // - The first SecTrustEvaluate will fail, but the missing certificates will be downloaded
+                //   in this step
+                // - The responses will be evicted
+                // We should retry in this scenario because missing certificates may have been fetched.
+                [self tryOCSPCache:evaluation isRetry:TRUE];
+                return;
+            }
+
+            // Try system CRL check and require a positive response
+            [self trySystemCRL:evaluation];
+        }];
+    }];
 }
 
 /// Evaluate response from OCSP cache
 - (void)evaluateOCSPCacheResult:(NSArray<OCSPCacheLookupResult*>*)results
-               originalPolicies:(CFArrayRef)originalPolicies
-                evictedResponse:(BOOL*)evictedResponse
-                          trust:(SecTrustRef)trust
-                      completed:(BOOL*)completed
-             completedWithError:(BOOL*)completedWithError
-              completionHandler:(AuthCompletion)completionHandler {
-
-    *completed = FALSE;
-    *completedWithError = FALSE;
-    *evictedResponse = FALSE;
+                     evaluation:(OCSPAuthEvaluation*)evaluation
+                     completion:(void (^)(BOOL completed,
+                                          BOOL completedWithError,
+                                          BOOL evictedResponse))completion {
 
+    SecTrustRef trust = evaluation.trust;
     NSMutableArray *ocspResponses = [[NSMutableArray alloc] init];
 
     for (OCSPCacheLookupResult* result in results) {
@@ -359,6 +726,7 @@ modifyOCSPURLOverride:(nullable NSURL * _Nonnull (^)(NSURL * _Nonnull))modifyOCS
         SecTrustSetOCSPResponse(trust, (__bridge CFArrayRef)ocspResponses);
     } else {
         // Already checked this case in the no remote OCSP check
+        completion(FALSE, FALSE, FALSE);
         return;
     }
 
@@ -367,92 +735,202 @@ modifyOCSPURLOverride:(nullable NSURL * _Nonnull (^)(NSURL * _Nonnull))modifyOCS
                                                     kSecRevocationNetworkAccessDisabled);
 
     [self evaluateWithPolicy:policy
-            originalPolicies:originalPolicies
-                       trust:trust
-                   completed:completed
-          completedWithError:completedWithError
-           completionHandler:completionHandler];
-
-    if (!*completed || (*completed && *completedWithError)) {
-        [self logWithFormat:@"Evaluate failed with OCSP response from cache"];
-
-        // Remove the cached value. There is no way to tell if it was the reason for
-        // rejection since the iOS OCSP cache is a black box; so we should remove it
-        // just incase the response was invalid or expired.
-        NSInteger certCount = SecTrustGetCertificateCount(trust);
-        if (certCount > 0) {
-            // Evict responses for all certificates except the root since there
-            // will be no OCSP response.
-            for (int i = 0; i < certCount-1; i ++) {
-                SecCertificateRef cert = SecTrustGetCertificateAtIndex(trust, i);
-                [self->ocspCache removeCacheValueForCert:cert];
+                  evaluation:evaluation
+                  completion:^(BOOL completed, BOOL completedWithError) {
+
+        BOOL evictedResponse = FALSE;
+
+        if (!completed && [self chainOfTrustIsRevokedOrUnknown:trust]) {
+            // A valid response says a certificate of the chain is revoked or unknown. This is a
+            // definite answer, so the challenge is rejected rather than falling through to CRL
+            // checks, whose fallback does not require a positive response.
+            [self logWithFormat:@"OCSP response says a certificate is revoked or unknown"];
+            evaluation.completionHandler(NSURLSessionAuthChallengeRejectProtectionSpace, nil);
+            completion(TRUE, TRUE, FALSE);
+            return;
+        }
+
+        if (!completed || (completed && completedWithError)) {
+            [self logWithFormat:@"Evaluate failed with OCSP response from cache"];
+
+            // The iOS OCSP check is a black box, so each cached response is checked by OCSPCache and
+            // only the ones which fail are evicted. Responses for the other links are kept, e.g. an
+            // intermediate response valid for days is not refetched because of a bad leaf response.
+            NSInteger certCount = SecTrustGetCertificateCount(trust);
+            if (certCount > 0) {
+                // No response is cached for the root
+                for (int i = 0; i < certCount-1; i ++) {
+                    SecCertificateRef cert = SecTrustGetCertificateAtIndex(trust, i);
+                    SecCertificateRef issuer = SecTrustGetCertificateAtIndex(trust, i+1);
+                    NSError *err = nil;
+                    if (![self->ocspCache validateCacheValueForCert:cert issuer:issuer error:&err]) {
+                        // Either the response was evicted or there is no response for the link, e.g.
+                        // because a missing intermediate was fetched by the evaluation. Both are fixed
+                        // by looking up the chain again.
+                        if (err != nil) {
+                            [self logWithFormat:@"Evicted OCSP response for cert %d: %@", i, err];
+                        }
+                        evictedResponse = YES;
+                    }
+                }
+            } else {
+                [self logWithFormat:@"No certs in trust"];
             }
-            *evictedResponse = YES;
-        } else {
-            [self logWithFormat:@"No certs in trust"];
+        }
+
+        completion(completed, completedWithError, evictedResponse);
+    }];
+}
+
+/// Returns TRUE if the OCSP cache has a response for a certificate of the evaluated trust object
+/// which says the certificate is revoked or unknown.
+- (BOOL)chainOfTrustIsRevokedOrUnknown:(SecTrustRef)trust {
+    CFIndex certCount = SecTrustGetCertificateCount(trust);
+
+    // No response is cached for the root
+    for (CFIndex i = 0; i + 1 < certCount; i++) {
+        SecCertificateRef cert = SecTrustGetCertificateAtIndex(trust, i);
+        SecCertificateRef issuer = SecTrustGetCertificateAtIndex(trust, i + 1);
+        OCSPResponse *response = [self->ocspCache cachedResponseForCert:cert issuer:issuer];
+        if ([response reportsRevokedOrUnknownForCert:cert issuer:issuer]) {
+            return TRUE;
         }
     }
 
-    return;
+    return FALSE;
 }
 
 /// Try default system CRL checking with a positive response required
-- (void)trySystemCRL:(SecTrustRef)trust
-    originalPolicies:(CFArrayRef)originalPolicies
-           completed:(BOOL*)completed
-  completedWithError:(BOOL*)completedWithError
-   completionHandler:(AuthCompletion)completionHandler {
+- (void)trySystemCRL:(OCSPAuthEvaluation*)evaluation {
     SecPolicyRef policy = SecPolicyCreateRevocation(kSecRevocationCRLMethod |
                                                     kSecRevocationRequirePositiveResponse);
 
     [self evaluateWithPolicy:policy
-            originalPolicies:originalPolicies
-                       trust:trust
-                   completed:completed
-          completedWithError:completedWithError
-           completionHandler:completionHandler];
-
-    if (*completed) {
-        [self logWithFormat:@"Evaluate completed by successful CRL check"];
-        return;
-    }
+                  evaluation:evaluation
+                  completion:^(BOOL completed, BOOL completedWithError) {
+#pragma unused(completedWithError)
+        if (!completed) {
+            // Unfortunately relax our requirements
+            [self tryFallback:evaluation];
+            return;
+        }
+
+        [self logWithFormat:@"Evaluate completed by successful system CRL check"];
+        [self finishEvaluation:evaluation byRung:OCSPAuthRungSystemCRL];
+    }];
 }
 
 /// Basic system check with positive response not required
-- (void)tryFallback:(SecTrustRef)trust
-   originalPolicies:(CFArrayRef)originalPolicies
-          completed:(BOOL*)completed
- completedWithError:(BOOL*)completedWithError
-  completionHandler:(AuthCompletion)completionHandler {
+- (void)tryFallback:(OCSPAuthEvaluation*)evaluation {
 
     SecPolicyRef policy = SecPolicyCreateRevocation(kSecRevocationCRLMethod);
 
     [self evaluateWithPolicy:policy
-            originalPolicies:originalPolicies
-                       trust:trust
-                   completed:completed
-          completedWithError:completedWithError
-           completionHandler:completionHandler];
-
-    if (*completed) {
-        [self logWithFormat:@"Evaluate completed by fallback revocation check"];
-        return;
+                  evaluation:evaluation
+                  completion:^(BOOL completed, BOOL completedWithError) {
+#pragma unused(completedWithError)
+        if (!completed) {
+            [self rejectEvaluation:evaluation];
+            return;
+        }
+
+        [self logWithFormat:@"Completed with fallback system check"];
+        [self finishEvaluation:evaluation byRung:OCSPAuthRungFallback];
+    }];
+}
+
+#pragma mark - Evaluation queue
+
+/// Run `evaluation` on the evaluation queue once fewer than `maxConcurrentEvaluations` are running.
+/// The evaluation must call `done` exactly once, when it no longer needs its slot. Lookups of the
+/// ladder do not hold a slot, so a challenge waiting on the network does not delay the others.
+- (void)scheduleEvaluation:(OCSPAuthScheduledEvaluation)evaluation {
+    @synchronized (self) {
+        [self->pendingEvaluations addObject:[evaluation copy]];
     }
+    [self pumpEvaluations];
 }
 
-/// Evaluate trust.
+/// Start pending evaluations up to the concurrency limit.
+- (void)pumpEvaluations {
+    NSMutableArray<OCSPAuthScheduledEvaluation>* started = [[NSMutableArray alloc] init];
+
+    @synchronized (self) {
+        NSUInteger limit = MAX(self.maxConcurrentEvaluations, 1);
+        while (self->evaluationsInFlight < limit && [self->pendingEvaluations count] > 0) {
+            [started addObject:[self->pendingEvaluations firstObject]];
+            [self->pendingEvaluations removeObjectAtIndex:0];
+            self->evaluationsInFlight++;
+        }
+        self->peakEvaluationsInFlight = MAX(self->peakEvaluationsInFlight,
+                                            self->evaluationsInFlight);
+    }
+
+    for (OCSPAuthScheduledEvaluation evaluation in started) {
+        dispatch_async(self->evaluationQueue, ^{
+            evaluation(^{
+                @synchronized (self) {
+                    self->evaluationsInFlight--;
+                }
+                [self pumpEvaluations];
+            });
+        });
+    }
+}
+
+/// Evaluate trust. Must be called on the evaluation queue; `completion` is called on it.
 /// Revocation policy should already be set with `SecPolicyCreateRevocation` at this point.
+/// SecTrustEvaluateAsyncWithError is used where available, otherwise SecTrustEvaluate, which
+/// blocks the evaluation queue rather than the caller.
 - (void)evaluateTrust:(SecTrustRef)trust
-            completed:(BOOL*)completed
-   completedWithError:(BOOL*)completedWithError
-    completionHandler:(AuthCompletion)completionHandler {
+    completionHandler:(AuthCompletion)completionHandler
+           completion:(OCSPAuthStepCompletion)completion {
+
+    @synchronized (self) {
+        self->evaluations++;
+    }
 
-    SecTrustResultType result;
+    if (@available(iOS 13.0, *)) {
+        OSStatus s = SecTrustEvaluateAsyncWithError(trust,
+                                                    self->evaluationQueue,
+                                                    ^(SecTrustRef t, bool trusted, CFErrorRef error) {
+#pragma unused(trusted, error)
+            // The result distinguishes recoverable failures, which the ladder moves on from
+            SecTrustResultType result = kSecTrustResultInvalid;
+            OSStatus s = SecTrustGetTrustResult(t, &result);
+            [self completeEvaluationOfTrust:t
+                                     status:s
+                                     result:result
+                          completionHandler:completionHandler
+                                 completion:completion];
+        });
+        if (s != 0) {
+            [self logWithFormat:@"Unexpected result code from SecTrustEvaluateAsyncWithError %d", s];
+            completion(FALSE, FALSE);
+        }
+        return;
+    }
+
+    SecTrustResultType result = kSecTrustResultInvalid;
     OSStatus s = SecTrustEvaluate(trust, &result);
+    [self completeEvaluationOfTrust:trust
+                             status:s
+                             result:result
+                  completionHandler:completionHandler
+                         completion:completion];
+}
+
+/// Complete the challenge according to the result of evaluating the trust object, unless the
+/// failure is recoverable.
+- (void)completeEvaluationOfTrust:(SecTrustRef)trust
+                           status:(OSStatus)s
+                           result:(SecTrustResultType)result
+                completionHandler:(AuthCompletion)completionHandler
+                       completion:(OCSPAuthStepCompletion)completion {
+
     if (s != 0) {
         [self logWithFormat:@"Unexpected result code from SecTrustEvaluate %d", s];
-        *completed = FALSE;
-        *completedWithError = FALSE;
+        completion(FALSE, FALSE);
         return;
     }
 
@@ -461,21 +939,17 @@ modifyOCSPURLOverride:(nullable NSURL * _Nonnull (^)(NSURL * _Nonnull))modifyOCS
         assert(credential != nil);
 
         completionHandler(NSURLSessionAuthChallengeUseCredential, credential);
-        *completed = TRUE;
-        *completedWithError = FALSE;
+        completion(TRUE, FALSE);
         return;
     }
 
     if (result != kSecTrustResultRecoverableTrustFailure) {
-        *completed = TRUE;
-        *completedWithError = TRUE;
         completionHandler(NSURLSessionAuthChallengeRejectProtectionSpace, nil);
+        completion(TRUE, TRUE);
         return;
     }
 
-    *completed = FALSE;
-    *completedWithError = FALSE;
-    return;
+    completion(FALSE, FALSE);
 }
 
 #pragma mark - Logging
@@ -18,6 +18,11 @@
  */
 
 #import <Foundation/Foundation.h>
+#import "OCSPCacheRefresher.h"
+#import "OCSPCacheStore.h"
+#import "OCSPNegativeCache.h"
+#import "OCSPRequestBatcher.h"
+#import "OCSPRequestService.h"
 #import "OCSPResponse.h"
 
 NS_ASSUME_NONNULL_BEGIN
@@ -59,6 +64,17 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
      * Timeout was exceeded before a successful OCSP response could be obtained.
      */
     OCSPCacheErrorCodeLookupTimedOut,
+
+    /*!
+     * The chain lookup was cancelled before the response for this certificate was obtained.
+     */
+    OCSPCacheErrorCodeLookupCancelled,
+
+    /*!
+     * The chain lookup completed early, once the required certificates were resolved, before the
+     * response for this certificate was obtained.
+     */
+    OCSPCacheErrorCodeLookupNotAwaited,
 };
 
 /// Cache lookup result
@@ -83,11 +99,131 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
  */
 @property (readonly, assign, nonatomic) BOOL cached;
 
+/*!
+ * If TRUE, the cached OCSP response is close to its nextUpdate and a new one is being fetched in
+ * the background. See OCSPCache.staleWhileRevalidateWindow.
+ */
+@property (readonly, assign, nonatomic) BOOL revalidating;
+
+@end
+
+/// Handle for an in progress chain lookup.
+@interface OCSPCacheLookupToken : NSObject
+
+/*!
+ * Cancel the chain lookup, e.g. when the task which requested it is cancelled. The completion is
+ * called immediately with the results obtained so far; certificates which were not resolved have
+ * a result with the error code OCSPCacheErrorCodeLookupCancelled. Does nothing if the lookup has
+ * already completed.
+ *
+ * Fetches already in progress are not stopped since they may be shared with other lookups, and
+ * their responses are still cached.
+ */
+- (void)cancel;
+
+/// TRUE if the lookup was cancelled before it completed.
+@property (readonly, atomic, assign) BOOL cancelled;
+
 @end
 
 /// Cache which facilitates making OCSP requests and caching OCSP responses.
 @interface OCSPCache : NSObject
 
+/*!
+ Store which holds the cached OCSP responses. Its metrics can be used to size the store budget.
+ */
+@property (readonly, strong, nonatomic) id<OCSPCacheStore> store;
+
+/*!
+ Recent lookup failures: certificates without usable OCSP URLs and fetches which failed. Until a
+ failure expires, lookups of the certificate fail fast with the same error instead of decoding the
+ certificate and waiting on OCSP responders again. The TTL of each class of failure can be
+ configured, and its metrics show how many lookups it answered.
+ */
+@property (readonly, strong, nonatomic) OCSPNegativeCache *negativeCache;
+
+/*!
+ If TRUE, which is the default, responses obtained from OCSP responders are only cached and returned
+ if they pass -[OCSPResponse checkForCert:issuer:]: the CertID matches, the signature verifies to
+ the issuer or a responder it delegated to and the response is within its validity window.
+ Responses which pass and say the certificate is revoked or unknown are cached and returned like
+ any other, so that trust evaluation rejects the certificate. Lookups which obtain a response that
+ fails fail with
+ OCSPCacheErrorCodeNoSuccessfulResponse, with the reason as the underlying error, and the failure
+ is cached like an unsuccessful response.
+
+ Values set with setCacheValueForCert:issuer:data: are not checked.
+ */
+@property (atomic, assign) BOOL verifyResponses;
+
+/*!
+ Time in seconds before the nextUpdate of a cached response during which lookups still return it
+ immediately, but also fetch a new response in the background. Only a single background fetch is
+ made for each certificate at a time; further lookups keep returning the cached response until it
+ completes. This keeps lookups from blocking on a network request when many responses come up for
+ renewal at once.
+
+ Responses past their nextUpdate are never returned. If 0, which is the default, lookups only
+ fetch a new response once the cached one has expired.
+ */
+@property (atomic, assign) NSTimeInterval staleWhileRevalidateWindow;
+
+/*!
+ Time in seconds after an OCSP request is made during which the lookups of other certificates of
+ the same issuer with the same OCSP responders are held, so that their statuses can be requested
+ together. A lookup which has nothing to be requested with is not delayed. This saves round trips
+ when many certificates of the same issuer are looked up at once. Defaults to 10ms. If 0, each
+ certificate is requested on its own.
+
+ See OCSPRequestBatcher.
+ */
+@property (atomic, assign) NSTimeInterval requestCoalescingWindow;
+
+/*!
+ Time in seconds to wait for the OCSP responder of a certificate before also requesting its next
+ OCSP URL. The first successful response is used and the other requests are cancelled. Defaults to
+ OCSPRequestBatcherAdaptiveHedgeDelay, the 95th percentile latency of recent successful requests.
+ If 0, all the OCSP URLs of a certificate are requested in parallel.
+
+ See OCSPRequestService.
+ */
+@property (atomic, assign) NSTimeInterval requestHedgeDelay;
+
+/*!
+ Health of the OCSP responders requested: latency, error rate and circuit breaker state per host.
+ The OCSP URLs of a certificate are attempted in the order of the health of their responders, so
+ that a slow or unavailable responder does not cost every lookup a timeout.
+
+ See OCSPResponderRegistry.
+ */
+@property (readonly, strong, nonatomic) OCSPResponderRegistry *responderRegistry;
+
+/*!
+ Sessions used for OCSP requests when lookups are not provided a session. Connections to each OCSP
+ responder are kept alive between lookups.
+
+ See OCSPSessionPool.
+ */
+@property (readonly, strong, nonatomic) OCSPSessionPool *sessionPool;
+
+/*!
+ Request method used for OCSP requests to the URL. Defaults to OCSPRequestMethodAutomatic, which
+ uses GET for small requests so that HTTP caches in front of the responder, or on the way to it,
+ can answer them.
+
+ @param url OCSP URL as it is requested, i.e. after it has been modified by modifyOCSPURL.
+ */
+- (OCSPRequestMethod)requestMethodForOCSPURL:(NSURL*)url;
+
+/*!
+ Set the request method used for OCSP requests to the URL. Responders which do not handle GET
+ requests correctly can be set to OCSPRequestMethodPOST.
+
+ @param method Request method.
+ @param url OCSP URL as it is requested, i.e. after it has been modified by modifyOCSPURL.
+ */
+- (void)setRequestMethod:(OCSPRequestMethod)method forOCSPURL:(NSURL*)url;
+
 /*!
  Initalize OCSPCache with logger.
 
@@ -99,10 +235,24 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
  */
 - (instancetype)initWithLogger:(void (^__nonnull)(NSString*logLine))logger;
 
+/*!
+ Initalize OCSPCache with logger and the store which should hold the cached OCSP responses.
+
+ @param logger Logger for emitting diagnostic information. See initWithLogger:.
+ @param store Store for cached OCSP responses. initWithLogger: uses an OCSPShardedCacheStore with
+ its default budget.
+ @return The OCSPCache instance.
+ */
+- (instancetype)initWithLogger:(void (^__nonnull)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store;
 
 /*!
  Initalize OCSPCache with logger and load persisted cache data from user defaults.
 
+ Data persisted by versions before 1.0.0, which keyed responses by the digest of the certificate, is
+ migrated: each response which has a single response is loaded under the key of its CertID. Other
+ responses under such keys are dropped.
+
  @param logger Logger for emitting diagnostic information. The provided block is called on a serial
  queue. Logs may include personally identifying information (PII) through errors generated by the
  networking framework; logging should only be used for testing. TODO: implement log levels to
@@ -117,7 +267,18 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
                        withKey:(NSString*)key;
 
 /*!
- Persist cache data to user defaults.
+ Initalize OCSPCache with logger and store, and load persisted cache data from user defaults into
+ the store.
+
+ See initWithLogger:andLoadFromUserDefaults:withKey: and initWithLogger:store:.
+ */
+- (instancetype)initWithLogger:(void (^__nonnull)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+       andLoadFromUserDefaults:(NSUserDefaults*)userDefaults
+                       withKey:(NSString*)key;
+
+/*!
+ Persist cache data to user defaults. Expired entries are evicted and are not persisted.
 
  @param userDefaults User defaults instance which should be used for loading persisted cache data.
  @param key Key in the provided user defaults instance which the persisted cache data is to be
@@ -127,10 +288,70 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
                       withKey:(NSString*)key;
 
 
+/*!
+ Initalize OCSPCache with logger and store, and map a cache file previously written with
+ persistToFile:error:.
+
+ The file is memory mapped and responses are only parsed and moved into the store when they are
+ looked up, so startup time does not depend on the number of persisted responses. If the file
+ cannot be loaded the error is logged and the cache starts empty.
+
+ @param logger Logger for emitting diagnostic information. See initWithLogger:.
+ @param store Store for cached OCSP responses.
+ @param url Location of the cache file.
+ @return The OCSPCache instance.
+ */
+- (instancetype)initWithLogger:(void (^__nonnull)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+               andLoadFromFile:(NSURL*)url;
+
+/*!
+ Atomically persist cache data to a file in the format of OCSPCacheFile. Expired responses are not
+ persisted. Responses of a loaded file which were never looked up are only persisted again if
+ their nextUpdate can be read and has not passed.
+
+ @param url Location of the cache file. The directory must exist.
+ @param error Set if the file could not be written.
+ @return Returns TRUE if the file was written; otherwise FALSE.
+ */
+- (BOOL)persistToFile:(NSURL*)url error:(NSError**)error;
+
+/*!
+ Initalize OCSPCache with logger and store, and persist changes to the cache incrementally in the
+ provided directory.
+
+ The directory holds a snapshot in the format of OCSPCacheFile and a journal (OCSPCacheJournal)
+ of responses cached and evicted since the snapshot was written. On initialization the snapshot is
+ mapped as in initWithLogger:store:andLoadFromFile: and the journal is replayed into the store.
+ Each subsequent change made by a lookup, setCacheValueForCert:issuer:data: or
+ removeCacheValueForCert:issuer: is appended to the journal in the background, so the cost of
+ persisting is proportional to the volume of changes rather than the size of the cache. Once the
+ journal grows past a threshold it is folded into a new snapshot.
+
+ @param logger Logger for emitting diagnostic information. See initWithLogger:.
+ @param store Store for cached OCSP responses.
+ @param directory Directory in which to persist the cache. The directory must exist and should
+ not be used by another OCSPCache instance.
+ @return The OCSPCache instance.
+ */
+- (instancetype)initWithLogger:(void (^__nonnull)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+         andPersistToDirectory:(NSURL*)directory;
+
+/*!
+ Fold the journal into a new snapshot immediately, e.g. when the app moves to the background.
+ Does nothing if the cache was not initialized with initWithLogger:store:andPersistToDirectory:.
+
+ @param error Set if the snapshot or journal could not be written.
+ @return Returns TRUE if compaction succeeded; otherwise FALSE.
+ */
+- (BOOL)compactPersistedCache:(NSError**)error;
+
 /*!
  Obtain an OCSP response for the provided certificate.
 
- If a cached value is found, it is returned.
+ If a cached value is found, it is returned. Cached values whose nextUpdate has passed are treated
+ as cache misses and are evicted by the store.
 
  If the value is not cached, network requests are made to obtain a valid OCSP response. A valid OCSP
  response is one with the status code indicating success.
@@ -146,8 +367,8 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
  update the URL to point through a local proxy, whitelist the URL if needed, etc. If the provided
  block returns nil, the original URL is used.
  @param session Session with which to perform OCSP requests. This is an opportunity for the caller
- to specify a proxy to be used by the OCSP requests. If nil, a session with
- `ephemeralSessionConfiguration` is created and used.
+ to specify a proxy to be used by the OCSP requests. If nil, a session from `sessionPool` is
+ used.
  @param completion Completion handler which is called when the lookup completes. If result.err is
  set then the other values should be ignored.
  */
@@ -164,18 +385,47 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
                          session:(NSURLSession*__nullable)session;
 
 /// Blocking lookup which obtains an OCSP response for each certificate in
-/// the chain (excluding the root certificate).
-/// TODO: in the future there should be an async version, but this will require a
-///       small refactor.
+/// the chain (excluding the root certificate). Results are in chain order.
+/// See lookupAll:andTimeout:modifyOCSPURL:session:requiredLinks:linkCompletion:completion:.
 - (NSArray<OCSPCacheLookupResult*>*)lookupAll:(SecTrustRef)secTrustRef
                                    andTimeout:(NSTimeInterval)timeout
                                 modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
                                       session:(NSURLSession*__nullable)session;
 
+/*!
+ Obtain an OCSP response for each certificate in the chain (excluding the root certificate) without
+ blocking the calling thread.
+
+ The certificates are looked up in parallel as with lookup:withIssuer:andTimeout:modifyOCSPURL:
+ session:completion:, each with the next certificate in the chain as its issuer.
+
+ @param secTrustRef Trust object holding the chain, leaf first.
+ @param timeout Timeout in seconds for each certificate. See lookup:andTimeout:modifyOCSPURL:session:completion:.
+ @param modifyOCSPURL See lookup:andTimeout:modifyOCSPURL:session:completion:.
+ @param session See lookup:andTimeout:modifyOCSPURL:session:completion:.
+ @param requiredLinks Number of certificates, counting from the leaf, which must be resolved before
+ the lookup completes. Once they are, the lookup completes without waiting for the others, whose
+ results have the error code OCSPCacheErrorCodeLookupNotAwaited. If 0, or greater than the number
+ of certificates, all certificates are required.
+ @param linkCompletion Called with the index in the chain and result of each certificate as soon as
+ it is resolved, until the lookup completes. May be nil.
+ @param completion Called exactly once with one result per certificate in chain order.
+ @return Token which can be used to cancel the lookup.
+ */
+- (OCSPCacheLookupToken*)lookupAll:(SecTrustRef)secTrustRef
+                        andTimeout:(NSTimeInterval)timeout
+                     modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
+                           session:(NSURLSession*__nullable)session
+                     requiredLinks:(NSUInteger)requiredLinks
+                    linkCompletion:(void (^__nullable)(NSUInteger index,
+                                                       OCSPCacheLookupResult *result))linkCompletion
+                        completion:(void (^)(NSArray<OCSPCacheLookupResult*>* results))completion;
+
 /*!
  Obtain an OCSP response for the provided certificate.
 
- If a cached value is found, it is returned.
+ If a cached value is found, it is returned. Cached values whose nextUpdate has passed are treated
+ as cache misses and are evicted by the store.
 
  If the value is not cached, network requests are made to obtain a valid OCSP response. A valid OCSP
  response is one with the status code indicating success.
@@ -191,8 +441,8 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
  update the URL to point through a local proxy, whitelist the URL if needed, etc. If the provided
  block returns nil, the original URL is used.
  @param session Session with which to perform OCSP requests. This is an opportunity for the caller
- to specify a proxy to be used by the OCSP requests.  If nil, a session with
- `ephemeralSessionConfiguration` is created and used.
+ to specify a proxy to be used by the OCSP requests. If nil, a session from `sessionPool` is
+ used.
  @param completion Completion handler which is called when the lookup completes. If result.err is
  set then the other values should be ignored.
  */
@@ -210,22 +460,72 @@ typedef NS_ERROR_ENUM(OCSPCacheErrorDomain, OCSPCacheErrorCode) {
                    modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
                          session:(NSURLSession*__nullable)session;
 
+/// Returns the cached response for the certificate, or nil if no response is cached or it has
+/// expired. Unlike a lookup, this never makes OCSP requests, waits for fetches in flight or
+/// dispatches to another queue, so it can be used to check whether a lookup is needed at all. The
+/// certificate is not tracked for proactive refresh and the response is not revalidated.
+/// @param secCertRef Target certificate.
+/// @param issuerRef Issuer certificate of the target certificate.
+- (OCSPResponse*__nullable)cachedResponseForCert:(SecCertificateRef)secCertRef
+                                          issuer:(SecCertificateRef)issuerRef;
+
+/*!
+ Start refreshing cached OCSP responses in the background before they expire.
+
+ Each certificate looked up is tracked. Once a response is cached for it, a refresh is scheduled
+ according to the policy using the modifyOCSPURL block and session of the most recent lookup of the
+ certificate. Certificates which are not looked up between two refreshes are no longer tracked.
+
+ Calling this method again replaces the policy and forgets all tracked certificates.
+
+ @param policy Refresh policy.
+ */
+- (void)startProactiveRefresh:(OCSPCacheRefreshPolicy*)policy;
+
+/// Stop refreshing cached OCSP responses in the background. Refreshes in flight complete.
+- (void)stopProactiveRefresh;
+
+/// Refresh counters. Nil if proactive refresh is not enabled.
+- (OCSPCacheRefresherMetrics*__nullable)refreshMetrics;
+
 /*!
  Set the cache value for a certificate.
 
  @note This function is primarily used for testing.
  @param secCertRef Certificate which the data corresponds to.
+ @param issuerRef Issuer of the certificate. Responses are cached by OCSP CertID, which is derived
+ from the certificate serial number and the issuer.
  @param data The data to cache. Must be a valid OCSP response.
  */
-- (void)setCacheValueForCert:(SecCertificateRef)secCertRef data:(NSData*)data;
+- (void)setCacheValueForCert:(SecCertificateRef)secCertRef
+                      issuer:(SecCertificateRef)issuerRef
+                        data:(NSData*)data;
 
 /*!
  Remove the cache value for a certificate.
 
  @param secCertRef Certificate which the value in the cache corresponds to.
+ @param issuerRef Issuer of the certificate.
  @return Returns TRUE if a value was evicted; otherwise FALSE.
  */
-- (BOOL)removeCacheValueForCert:(SecCertificateRef)secCertRef;
+- (BOOL)removeCacheValueForCert:(SecCertificateRef)secCertRef
+                         issuer:(SecCertificateRef)issuerRef;
+
+/*!
+ Check the cached response for a certificate with -[OCSPResponse checkForCert:issuer:] and evict it
+ if the check fails. This allows evicting only the responses which could have caused a trust
+ evaluation to fail, rather than every response for the chain. A valid response which says the
+ certificate is revoked or unknown passes the check and is kept.
+
+ @param secCertRef Certificate which the value in the cache corresponds to.
+ @param issuerRef Issuer of the certificate.
+ @param error Set to the reason the response was evicted, if it was evicted.
+ @return Returns TRUE if a response is cached for the certificate and passed the check; otherwise
+ FALSE, either because no response is cached or because it was evicted.
+ */
+- (BOOL)validateCacheValueForCert:(SecCertificateRef)secCertRef
+                           issuer:(SecCertificateRef)issuerRef
+                            error:(NSError*__nullable*__nullable)error;
 
 @end
 
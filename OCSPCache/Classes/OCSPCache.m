@@ -18,21 +18,33 @@
  */
 
 #import "OCSPCache.h"
-#import <CommonCrypto/CommonDigest.h>
+#import <stdatomic.h>
 #import "OCSPTrustToLeafAndIssuer.h"
-#import "OCSPRequestService.h"
+#import "OCSPRequestBatcher.h"
 #import "OCSPCert.h"
-#import "RACScheduler.h"
-#import "RACReplaySubject.h"
-#import "RACSignal+Operations.h"
+#import "OCSPCacheEntry.h"
+#import "OCSPCacheFile.h"
+#import "OCSPCacheJournal.h"
+#import "OCSPCacheKey.h"
+#import "OCSPCacheRefresher.h"
+#import "OCSPDERReader.h"
+#import "RACSignal.h"
 
 NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
 
+/// Name of the snapshot file in the persistence directory.
+static NSString *const OCSPCacheSnapshotFileName = @"ocsp-cache";
+/// Name of the journal file in the persistence directory.
+static NSString *const OCSPCacheJournalFileName = @"ocsp-cache.journal";
+/// Journal size in bytes after which it is folded into the snapshot.
+static const uint64_t OCSPCacheJournalCompactionThreshold = 256 * 1024;
+
 @interface OCSPCacheLookupResult ()
 
 @property (strong, nonatomic) OCSPResponse *response;
 @property (strong, nonatomic) NSError *err;
 @property (assign, nonatomic) BOOL cached;
+@property (assign, nonatomic) BOOL revalidating;
 
 @end
 
@@ -51,45 +63,133 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
 
 @end
 
+@interface OCSPCacheLookupToken ()
+
+/// Called once when the token is cancelled.
+@property (strong, atomic) void (^cancelHandler)(void);
+
+@end
+
+@implementation OCSPCacheLookupToken {
+    BOOL isCancelled;
+}
+
+// See comment in header
+- (void)cancel {
+    void (^handler)(void);
+
+    @synchronized (self) {
+        if (self->isCancelled) {
+            return;
+        }
+        self->isCancelled = TRUE;
+        handler = self.cancelHandler;
+        self.cancelHandler = nil;
+    }
+
+    if (handler != nil) {
+        handler();
+    }
+}
+
+// See comment in header
+- (BOOL)cancelled {
+    @synchronized (self) {
+        return self->isCancelled;
+    }
+}
+
+@end
+
+/// Fetch in progress for a cache key. Guarded by synchronizing on the OCSPCache.
+@interface OCSPCachePendingFetch : NSObject
+
+/// Completions of the lookups waiting for the fetch, starting with the lookup which started it.
+/// Set to nil once the lookups have been completed.
+@property (strong, nonatomic) NSMutableArray<void (^)(OCSPCacheLookupResult*)>* waiters;
+
+/// Fires when the timeout of the lookup which started the fetch is exceeded.
+@property (strong, nonatomic) dispatch_source_t timer;
+
+@end
+
+@implementation OCSPCachePendingFetch
+@end
+
+@interface OCSPCache ()
+
+/// Refresher, if proactive refresh was started. Atomic so that lookups can read it without
+/// synchronizing.
+@property (atomic, strong) OCSPCacheRefresher *refresher;
+
+@end
+
 @implementation OCSPCache {
-    NSMutableDictionary<NSString*, NSData*>* cache;
-    NSMutableDictionary<NSString*, RACReplaySubject<OCSPResponse *>*>* pendingResponseCache;
+    id<OCSPCacheStore> cache;
+    NSMutableDictionary<OCSPCacheKey*, OCSPCachePendingFetch*>* pendingFetches;
     void (^logger)(NSString*);
     dispatch_queue_t callbackQueue;
     dispatch_queue_t workQueue;
     dispatch_queue_t logQueue;
-    RACScheduler * scheduler;
+    // Number of responses stored by fetches. Lets lookups which missed the store without
+    // synchronizing detect that a fetch completed before they synchronized.
+    _Atomic(NSUInteger) storedFetches;
+    OCSPRequestBatcher *batcher;
+
+    // Responses loaded from a file. Entries are promoted to the store when they are looked up.
+    OCSPCacheFile *file;
+    // Keys of responses in `file` which were evicted and must not be promoted again.
+    NSMutableSet<OCSPCacheKey*>* fileRemovals;
+    // Keys of cached responses being fetched again in the background. Guarded by synchronizing on
+    // self.
+    NSMutableSet<OCSPCacheKey*>* revalidatingKeys;
+
+    // Changes since the snapshot at `snapshotURL` was written. Only accessed on `persistenceQueue`.
+    OCSPCacheJournal *journal;
+    NSURL *snapshotURL;
+    dispatch_queue_t persistenceQueue;
 }
 
 - (instancetype)init {
     self = [super init];
 
     if (self) {
-        [self initTasks];
+        [self initTasks:[[OCSPShardedCacheStore alloc] init]];
     }
 
     return self;
 }
 
-- (void)initTasks {
-    self->cache = [[NSMutableDictionary alloc] init];
-    self->pendingResponseCache = [[NSMutableDictionary alloc] init];
+- (void)initTasks:(id<OCSPCacheStore>)store {
+    self->cache = store;
+    self->fileRemovals = [[NSMutableSet alloc] init];
+    self->revalidatingKeys = [[NSMutableSet alloc] init];
+    self->_negativeCache = [[OCSPNegativeCache alloc] init];
+    self->_verifyResponses = TRUE;
+    self->pendingFetches = [[NSMutableDictionary alloc] init];
     self->callbackQueue = dispatch_queue_create("ca.psiphon.OCSPCache.CallbackQueue",
                                                 DISPATCH_QUEUE_CONCURRENT);
     self->logQueue = dispatch_queue_create("ca.psiphon.OCSPCache.LogQueue",
                                            DISPATCH_QUEUE_SERIAL);
     self->workQueue = dispatch_queue_create("ca.psiphon.OCSPCache.WorkQueue",
                                             DISPATCH_QUEUE_CONCURRENT);
-    self->scheduler = [RACScheduler schedulerWithPriority:RACSchedulerPriorityHigh
-                                                     name:@"ca.psiphon.OCSPCache.Scheduler"];
+    self->persistenceQueue = dispatch_queue_create("ca.psiphon.OCSPCache.PersistenceQueue",
+                                                   DISPATCH_QUEUE_SERIAL);
+    self->batcher = [[OCSPRequestBatcher alloc] initWithQueue:self->workQueue];
 }
 
 // See comment in header
 - (instancetype)initWithLogger:(void (^)(NSString * _Nonnull log))logger {
+    return [self initWithLogger:logger store:[[OCSPShardedCacheStore alloc] init]];
+}
+
+// See comment in header
+- (instancetype)initWithLogger:(void (^)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store {
     self = [super init];
 
     if (self) {
-        [self initTasks];
+        [self initTasks:store];
         self->logger = logger;
     }
 
@@ -100,27 +200,243 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
 - (instancetype)initWithLogger:(void (^)(NSString*logLine))logger
        andLoadFromUserDefaults:(NSUserDefaults*)userDefaults
                        withKey:(NSString*)key {
+    return [self initWithLogger:logger
+                          store:[[OCSPShardedCacheStore alloc] init]
+        andLoadFromUserDefaults:userDefaults
+                        withKey:key];
+}
+
+// See comment in header
+- (instancetype)initWithLogger:(void (^)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+       andLoadFromUserDefaults:(NSUserDefaults*)userDefaults
+                       withKey:(NSString*)key {
     self = [super init];
 
     if (self) {
-        [self initTasks];
+        [self initTasks:store];
         self->logger = logger;
 
         id persisted = [userDefaults objectForKey:key];
         if ([persisted isKindOfClass:[NSDictionary class]]) {
-            [self->cache addEntriesFromDictionary:(NSDictionary*)persisted];
+            NSDate *now = [NSDate date];
+            [(NSDictionary*)persisted enumerateKeysAndObjectsUsingBlock:^(id k, id v, BOOL *stop) {
+                if (![k isKindOfClass:[NSString class]] || ![v isKindOfClass:[NSData class]]) {
+                    return;
+                }
+                OCSPCacheKey *key = [OCSPCacheKey keyWithBase64String:(NSString*)k];
+                if (key == nil) {
+                    return;
+                }
+                OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:(NSData*)v];
+                if ([entry expiredAt:now]) {
+                    // Do not load responses which can no longer be used
+                    return;
+                }
+                NSArray<OCSPCacheKey*>* responseKeys = [OCSPCacheKey keysForResponse:entry.response];
+                if (![responseKeys containsObject:key]) {
+                    // Before responses were keyed by CertID they were keyed by the digest of the
+                    // certificate, which no lookup derives anymore. Such a response was fetched
+                    // for a single certificate, so move it to the key of its single response.
+                    if ([responseKeys count] != 1) {
+                        return;
+                    }
+                    key = [responseKeys firstObject];
+                }
+                [self->cache setEntry:entry forKey:key];
+            }];
+        }
+    }
+
+    return self;
+}
+
+// See comment in header
+- (instancetype)initWithLogger:(void (^)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+               andLoadFromFile:(NSURL*)url {
+    self = [super init];
+
+    if (self) {
+        [self initTasks:store];
+        self->logger = logger;
+
+        NSError *e;
+        self->file = [OCSPCacheFile fileWithContentsOfURL:url error:&e];
+        if (self->file == nil) {
+            [self logError:e];
+        }
+    }
+
+    return self;
+}
+
+// See comment in header
+- (BOOL)persistToFile:(NSURL*)url error:(NSError**)error {
+    OCSPCacheFile *loadedFile;
+    NSSet<OCSPCacheKey*>* removed;
+
+    @synchronized (self) {
+        loadedFile = self->file;
+        removed = [self->fileRemovals copy];
+    }
+
+    NSDate *now = [NSDate date];
+    NSMutableDictionary<OCSPCacheKey*, NSData*>* entries = [[NSMutableDictionary alloc] init];
+
+    // Carry over responses from the loaded file which were never looked up. Only their expiry is
+    // needed, which is read from the mapped bytes without decoding the responses. Responses which
+    // cannot be read, or have no nextUpdate, are dropped rather than carried over indefinitely:
+    // responses without nextUpdate are only persisted while the store keeps them.
+    NSTimeInterval nowSeconds = [now timeIntervalSince1970];
+    [loadedFile enumerateKeysAndDataUsingBlock:^(OCSPCacheKey *k, NSData *data, BOOL *stop) {
+        if ([removed containsObject:k]) {
+            return;
+        }
+        NSTimeInterval nextUpdate;
+        if (![OCSPDERReader earliestNextUpdate:&nextUpdate ofResponseData:data] ||
+            nextUpdate <= nowSeconds) {
+            return;
+        }
+        [entries setObject:data forKey:k];
+    }];
+
+    [self->cache removeEntriesExpiredAt:now];
+    [self->cache enumerateEntriesUsingBlock:^(OCSPCacheKey *k, OCSPCacheEntry *v, BOOL *stop) {
+        [entries setObject:v.data forKey:k];
+    }];
+
+    return [OCSPCacheFile writeEntries:entries toURL:url error:error];
+}
+
+// See comment in header
+- (instancetype)initWithLogger:(void (^)(NSString*logLine))logger
+                         store:(id<OCSPCacheStore>)store
+         andPersistToDirectory:(NSURL*)directory {
+    self = [super init];
+
+    if (self) {
+        [self initTasks:store];
+        self->logger = logger;
+        self->snapshotURL = [directory URLByAppendingPathComponent:OCSPCacheSnapshotFileName];
+
+        NSError *e;
+
+        if ([[NSFileManager defaultManager] fileExistsAtPath:[self->snapshotURL path]]) {
+            self->file = [OCSPCacheFile fileWithContentsOfURL:self->snapshotURL error:&e];
+            if (self->file == nil) {
+                [self logError:e];
+            }
+        }
+
+        NSURL *journalURL = [directory URLByAppendingPathComponent:OCSPCacheJournalFileName];
+        NSDate *now = [NSDate date];
+
+        void (^replay)(OCSPCacheJournalOp, OCSPCacheKey*, NSData*) =
+        ^(OCSPCacheJournalOp op, OCSPCacheKey *key, NSData *data) {
+            if (op == OCSPCacheJournalOpSet) {
+                OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:data];
+                if (![entry expiredAt:now]) {
+                    [self->cache setEntry:entry forKey:key];
+                }
+            } else {
+                [self->cache removeEntryForKey:key];
+                if ([self->file dataForKey:key] != nil) {
+                    [self->fileRemovals addObject:key];
+                }
+            }
+        };
+
+        self->journal = [OCSPCacheJournal journalWithURL:journalURL replay:replay error:&e];
+        if (self->journal == nil) {
+            // Start over with an empty journal; responses in the snapshot are still used
+            [self logError:e];
+            [[NSFileManager defaultManager] removeItemAtURL:journalURL error:nil];
+            self->journal = [OCSPCacheJournal journalWithURL:journalURL replay:nil error:&e];
+            if (self->journal == nil) {
+                [self logError:e];
+            }
         }
     }
 
     return self;
 }
 
+// See comment in header
+- (BOOL)compactPersistedCache:(NSError**)error {
+    if (self->snapshotURL == nil) {
+        return TRUE;
+    }
+
+    __block BOOL success;
+    __block NSError *err;
+
+    dispatch_sync(self->persistenceQueue, ^{
+        success = [self compactJournal:&err];
+    });
+
+    if (!success) {
+        if (error != NULL) {
+            *error = err;
+        }
+    }
+
+    return success;
+}
+
+/// Write a new snapshot of the cache and discard the journal records it supersedes.
+/// Must be called on the persistence queue.
+- (BOOL)compactJournal:(NSError**)error {
+    // Changes made after the snapshot is taken are journaled after the reset below, since appends
+    // are serialized on the persistence queue behind this call. Changes made while the snapshot is
+    // being taken may be both in the snapshot and the journal, which is harmless since replay is
+    // idempotent.
+    if (![self persistToFile:self->snapshotURL error:error]) {
+        return FALSE;
+    }
+
+    if (self->journal != nil && ![self->journal reset:error]) {
+        return FALSE;
+    }
+
+    [self log:@"Compacted cache journal"];
+
+    return TRUE;
+}
+
+/// Record a change to the cache in the journal, if persisting to a directory.
+- (void)journalOp:(OCSPCacheJournalOp)op key:(OCSPCacheKey*)key data:(NSData*)data {
+    if (self->journal == nil) {
+        return;
+    }
+
+    // Retain self so that changes are recorded even if the cache is released in the meantime
+    dispatch_async(self->persistenceQueue, ^{
+        NSError *e;
+        if (![self->journal appendOp:op key:key data:data error:&e]) {
+            [self logError:e];
+            return;
+        }
+
+        if (self->journal.size > OCSPCacheJournalCompactionThreshold) {
+            if (![self compactJournal:&e]) {
+                [self logError:e];
+            }
+        }
+    });
+}
+
 // See comment in header
 - (void)persistToUserDefaults:(NSUserDefaults*)userDefaults
                       withKey:(NSString*)key {
-    @synchronized (self->cache) {
-        [userDefaults setObject:self->cache forKey:key];
-    }
+    NSMutableDictionary<NSString*, NSData*>* persist = [[NSMutableDictionary alloc] init];
+
+    [self->cache removeEntriesExpiredAt:[NSDate date]];
+    [self->cache enumerateEntriesUsingBlock:^(OCSPCacheKey *k, OCSPCacheEntry *v, BOOL *stop) {
+        [persist setObject:v.data forKey:[k base64String]];
+    }];
+
+    [userDefaults setObject:persist forKey:key];
 }
 
 // See comment in header
@@ -189,18 +505,95 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
                                 modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
                                       session:(NSURLSession*__nullable)session
 {
+    dispatch_semaphore_t sem = dispatch_semaphore_create(0);
+
+    __block NSArray<OCSPCacheLookupResult*>* r;
+
+    [self lookupAll:secTrustRef
+         andTimeout:timeout
+      modifyOCSPURL:modifyOCSPURL
+            session:session
+      requiredLinks:0
+     linkCompletion:nil
+         completion:^(NSArray<OCSPCacheLookupResult*>* results) {
+        r = results;
+        dispatch_semaphore_signal(sem);
+    }];
+
+    dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER); // There is a timeout in the lookup call
+
+    return r;
+}
+
+/// See comment in header
+- (OCSPCacheLookupToken*)lookupAll:(SecTrustRef)secTrustRef
+                        andTimeout:(NSTimeInterval)timeout
+                     modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
+                           session:(NSURLSession*__nullable)session
+                     requiredLinks:(NSUInteger)requiredLinks
+                    linkCompletion:(void (^__nullable)(NSUInteger index,
+                                                       OCSPCacheLookupResult *result))linkCompletion
+                        completion:(void (^)(NSArray<OCSPCacheLookupResult*>* results))completion
+{
+    OCSPCacheLookupToken *token = [[OCSPCacheLookupToken alloc] init];
 
     CFIndex certCount = SecTrustGetCertificateCount(secTrustRef);
+    NSUInteger linkCount = certCount > 1 ? (NSUInteger)(certCount - 1) : 0;
 
-    dispatch_group_t group = dispatch_group_create();
+    if (requiredLinks == 0 || requiredLinks > linkCount) {
+        requiredLinks = linkCount;
+    }
+
+    // Unresolved links hold NSNull. Guarded by synchronizing on `results`.
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:linkCount];
+    for (NSUInteger i = 0; i < linkCount; i++) {
+        [results addObject:[NSNull null]];
+    }
+    __block BOOL finished = FALSE;
 
-    __block NSMutableArray<OCSPCacheLookupResult*>* results = [[NSMutableArray alloc] init];
+    void (^finish)(OCSPCacheErrorCode unresolvedCode) = ^(OCSPCacheErrorCode unresolvedCode) {
+        NSArray<OCSPCacheLookupResult*>* final;
 
-    for (int i = 0; i < certCount-1; i++) {
-        dispatch_group_enter(group);
+        @synchronized (results) {
+            if (finished) {
+                return;
+            }
+            finished = TRUE;
+
+            for (NSUInteger i = 0; i < linkCount; i++) {
+                if ([results objectAtIndex:i] == [NSNull null]) {
+                    NSError *err =
+                    [NSError errorWithDomain:OCSPCacheErrorDomain
+                                        code:unresolvedCode
+                                    userInfo:@{NSLocalizedDescriptionKey:
+                                               @"Chain lookup completed before the certificate was "
+                                                "resolved"}];
+                    [results replaceObjectAtIndex:i
+                                       withObject:[OCSPCacheLookupResult lookupResultWithResponse:nil
+                                                                                            error:err
+                                                                                           cached:FALSE]];
+                }
+            }
+            final = [results copy];
+        }
+
+        token.cancelHandler = nil;
+
+        dispatch_async(self->callbackQueue, ^{
+            completion(final);
+        });
+    };
+
+    if (requiredLinks == 0) {
+        finish(OCSPCacheErrorCodeLookupNotAwaited);
+        return token;
     }
 
-    for (int i = 0; i < certCount-1; i++) {
+    token.cancelHandler = ^{
+        finish(OCSPCacheErrorCodeLookupCancelled);
+    };
+
+    for (NSUInteger i = 0; i < linkCount; i++) {
         SecCertificateRef issued = SecTrustGetCertificateAtIndex(secTrustRef, i);
         SecCertificateRef issuer = SecTrustGetCertificateAtIndex(secTrustRef, i+1);
 
@@ -210,16 +603,34 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
        modifyOCSPURL:modifyOCSPURL
              session:session
           completion:^(OCSPCacheLookupResult * _Nonnull result) {
-              @synchronized (results) {
-                  [results addObject:result];
-              }
-              dispatch_group_leave(group);
-          }];
-    }
+            BOOL requiredResolved = TRUE;
 
-    dispatch_group_wait(group, DISPATCH_TIME_FOREVER); // There is a timeout in the lookup call
+            @synchronized (results) {
+                if (finished) {
+                    return;
+                }
+                [results replaceObjectAtIndex:i withObject:result];
+
+                for (NSUInteger j = 0; j < requiredLinks; j++) {
+                    if ([results objectAtIndex:j] == [NSNull null]) {
+                        requiredResolved = FALSE;
+                        break;
+                    }
+                }
 
-    return results;
+                // Called while synchronized so that it is never called after the completion
+                if (linkCompletion != nil) {
+                    linkCompletion(i, result);
+                }
+            }
+
+            if (requiredResolved) {
+                finish(OCSPCacheErrorCodeLookupNotAwaited);
+            }
+        }];
+    }
+
+    return token;
 }
 
 
@@ -231,6 +642,25 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
        session:(NSURLSession*__nullable)session
     completion:(void (^)(OCSPCacheLookupResult *result))completion {
 
+    [self lookup:secCertRef
+      withIssuer:issuerRef
+      andTimeout:timeout
+   modifyOCSPURL:modifyOCSPURL
+         session:session
+    forceRefresh:FALSE
+      completion:completion];
+}
+
+/// Lookup which skips the cached response, if any, when forceRefresh is TRUE. A response which is
+/// already being fetched is still shared.
+- (void)lookup:(SecCertificateRef)secCertRef
+    withIssuer:(SecCertificateRef)issuerRef
+    andTimeout:(NSTimeInterval)timeout
+ modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
+       session:(NSURLSession*__nullable)session
+  forceRefresh:(BOOL)forceRefresh
+    completion:(void (^)(OCSPCacheLookupResult *result))completion {
+
     __weak OCSPCache *weakSelf = self;
 
     dispatch_async(workQueue, ^{
@@ -240,62 +670,136 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
             return;
         }
 
-        NSString *key = [OCSPCache sha256Base64Key:secCertRef];
+        OCSPCacheKey *key = [OCSPCacheKey keyForCertificate:secCertRef issuer:issuerRef];
+
+        OCSPCacheRefresher *activeRefresher = forceRefresh ? nil : strongSelf.refresher;
+
+        // Hits only need the store, which serves lookups in parallel, so they do not synchronize
+        // with fetches. Expired responses are treated as misses and evicted by the store.
+        NSUInteger storedFetchesBeforeLookup = atomic_load(&strongSelf->storedFetches);
+        OCSPCacheEntry *cachedEntry = nil;
+        if (!forceRefresh) {
+            cachedEntry = [strongSelf->cache entryForKey:key];
+        }
+
+        if (cachedEntry != nil) {
+            [activeRefresher trackKey:key
+                                 cert:secCertRef
+                               issuer:issuerRef
+                        modifyOCSPURL:modifyOCSPURL
+                              session:session
+                                entry:cachedEntry];
+
+            BOOL revalidating = [strongSelf revalidateEntry:cachedEntry
+                                                     forKey:key
+                                                       cert:secCertRef
+                                                     issuer:issuerRef
+                                                    timeout:timeout
+                                              modifyOCSPURL:modifyOCSPURL
+                                                    session:session];
+
+            if ([strongSelf completeLookup:completion
+                           withCachedEntry:cachedEntry
+                                    forKey:key
+                              revalidating:revalidating]) {
+                return;
+            }
+        }
+
+        // Fail fast if the last fetch failed recently
+        NSError *cachedError = [strongSelf.negativeCache errorForKey:key];
+        if (cachedError != nil) {
+            [strongSelf log:@"Negative cache returned error"];
+            dispatch_async(strongSelf->callbackQueue, ^{
+                completion([OCSPCacheLookupResult lookupResultWithResponse:nil
+                                                                     error:cachedError
+                                                                    cached:FALSE]);
+            });
+            return;
+        }
 
-        // TODO: It could be worth replacing RACReplaySubject with something more lightweight
-        //       like promises: https://github.com/google/promises
-        RACReplaySubject<OCSPResponse*>* response;
+        OCSPCachePendingFetch *fetch;
 
         @synchronized (self) {
-            NSData *cachedResponse = [strongSelf->cache objectForKey:key];
-            if (cachedResponse) {
-                OCSPResponse *r = [[OCSPResponse alloc] initWithData:cachedResponse];
-                if (r != nil) {
-                    [self log:@"Cache returned response"];
-                    dispatch_async(strongSelf->callbackQueue, ^{
-                        completion([OCSPCacheLookupResult lookupResultWithResponse:r
-                                                                             error:nil
-                                                                            cached:TRUE]);
-                    });
-                    return;
-                } else {
-                    [self log:@"Error: cache returned invalid data, evicting invalid data"];
-                    [self removeCacheValueForKey:key];
+            cachedEntry = nil;
+            if (!forceRefresh) {
+                // A fetch may have stored a response since the store was checked
+                if (atomic_load(&strongSelf->storedFetches) != storedFetchesBeforeLookup) {
+                    cachedEntry = [strongSelf->cache entryForKey:key];
+                }
+                if (cachedEntry == nil) {
+                    cachedEntry = [strongSelf promoteFileEntryForKey:key];
                 }
             }
 
-            RACReplaySubject<OCSPResponse*>* cachedPendingResponse =
-            [self->pendingResponseCache objectForKey:key];
+            [activeRefresher trackKey:key
+                                 cert:secCertRef
+                               issuer:issuerRef
+                        modifyOCSPURL:modifyOCSPURL
+                              session:session
+                                entry:cachedEntry];
+
+            if (cachedEntry != nil) {
+                BOOL revalidating = [strongSelf revalidateEntry:cachedEntry
+                                                         forKey:key
+                                                           cert:secCertRef
+                                                         issuer:issuerRef
+                                                        timeout:timeout
+                                                  modifyOCSPURL:modifyOCSPURL
+                                                        session:session];
+
+                if ([strongSelf completeLookup:completion
+                               withCachedEntry:cachedEntry
+                                        forKey:key
+                                  revalidating:revalidating]) {
+                    return;
+                }
+            }
 
             // Check if a response is already being fetched
-            if (cachedPendingResponse != nil) {
-                [self log:@"Cache returned pending response"];
+            OCSPCachePendingFetch *pendingFetch = [self->pendingFetches objectForKey:key];
 
-                [[cachedPendingResponse subscribeOn:strongSelf->scheduler]
-                 subscribeNext:^(OCSPResponse * _Nullable x) {
-                     [self log:@"Pending response from cache got result"];
-                     dispatch_async(strongSelf->callbackQueue, ^{
-                         completion([OCSPCacheLookupResult lookupResultWithResponse:x
-                                                                              error:nil
-                                                                             cached:TRUE]);
-                     });
-                 } error:^(NSError * _Nullable error) {
-                     [self logError:error];
-                     dispatch_async(strongSelf->callbackQueue, ^{
-                         completion([OCSPCacheLookupResult lookupResultWithResponse:nil
-                                                                              error:error
-                                                                             cached:FALSE]);
-                     });
-                 } completed:^{
-                     [self log:@"Pending response completed"];
-                 }];
+            if (pendingFetch != nil) {
+                [self log:@"Cache returned pending response"];
+                [pendingFetch.waiters addObject:completion];
                 return;
             }
 
-            // No response is currently being fetched, put pending response in the cache
-
-            response = [RACReplaySubject replaySubjectWithCapacity:1];
-            [self->pendingResponseCache setObject:response forKey:key];
+            // No response is currently being fetched, put pending fetch in the table
+
+            fetch = [[OCSPCachePendingFetch alloc] init];
+            fetch.waiters = [[NSMutableArray alloc] initWithObjects:completion, nil];
+            [self->pendingFetches setObject:fetch forKey:key];
+
+            if (timeout > 0) {
+                fetch.timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                                     strongSelf->workQueue);
+                dispatch_source_set_timer(fetch.timer,
+                                          dispatch_time(DISPATCH_TIME_NOW,
+                                                        (int64_t)(timeout * NSEC_PER_SEC)),
+                                          DISPATCH_TIME_FOREVER,
+                                          10 * NSEC_PER_MSEC);
+                __weak OCSPCachePendingFetch *weakFetch = fetch;
+                dispatch_source_set_event_handler(fetch.timer, ^{
+                    __strong OCSPCache *strongSelf = weakSelf;
+                    __strong OCSPCachePendingFetch *strongFetch = weakFetch;
+                    if (!strongSelf || !strongFetch) {
+                        return;
+                    }
+                    NSError *timeoutError =
+                    [NSError errorWithDomain:OCSPCacheErrorDomain
+                                        code:OCSPCacheErrorCodeLookupTimedOut
+                                    userInfo:@{NSLocalizedDescriptionKey:@"Lookup timed out"}];
+                    // Not negatively cached: the timeout is the caller's, not the responders',
+                    // and lookups with a longer timeout or another session may still succeed.
+                    // The requests carry on, and their failure is cached if they fail.
+                    [strongSelf finishFetch:strongFetch
+                                     forKey:key
+                                   response:nil
+                                      error:timeoutError];
+                });
+                dispatch_resume(fetch.timer);
+            }
         }
 
         // Get the OCSP request URLs
@@ -313,16 +817,22 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
                             userInfo:@{NSLocalizedDescriptionKey:@"Error constructing OCSP "
                                                                   "requests",
                                        NSUnderlyingErrorKey:errorGettingOCSPURLs}];
-            [self logError:err];
-            @synchronized (self) {
-                [self->pendingResponseCache removeObjectForKey:key];
+
+            if ([errorGettingOCSPURLs.domain isEqualToString:OCSPCertErrorDomain] &&
+                errorGettingOCSPURLs.code == OCSPCertErrorCodeNoOCSPURLs) {
+                [strongSelf failFetch:fetch
+                               forKey:key
+                                error:err
+                           errorClass:OCSPNegativeCacheErrorClassNoOCSPURLs];
+            } else if ([errorGettingOCSPURLs.domain isEqualToString:OCSPCertErrorDomain] &&
+                       errorGettingOCSPURLs.code == OCSPCertErrorCodeConstructedInvalidURL) {
+                [strongSelf failFetch:fetch
+                               forKey:key
+                                error:err
+                           errorClass:OCSPNegativeCacheErrorClassInvalidOCSPURL];
+            } else {
+                [strongSelf finishFetch:fetch forKey:key response:nil error:err];
             }
-            [response sendError:err];
-            dispatch_async(strongSelf->callbackQueue, ^{
-                completion([OCSPCacheLookupResult lookupResultWithResponse:nil
-                                                                     error:err
-                                                                    cached:FALSE]);
-            });
             return;
         }
 
@@ -331,7 +841,7 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
         NSError *errorGettingOCSPRequestData;
         NSData *ocspReqData = [OCSPCert ocspDataForPostRequestFromSecCertRef:secCertRef
                                                            withIssuerCertRef:issuerRef
-                                                                       error:&errorGettingOCSPURLs];
+                                                                       error:&errorGettingOCSPRequestData];
 
         if (errorGettingOCSPRequestData != nil) {
             NSError *err =
@@ -339,17 +849,8 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
                                 code:OCSPCacheErrorConstructingOCSPRequests
                             userInfo:@{NSLocalizedDescriptionKey:@"Error constructing OCSP "
                                                                   "requests",
-                                       NSUnderlyingErrorKey:errorGettingOCSPURLs}];
-            [self logError:err];
-            @synchronized (self) {
-                [self->pendingResponseCache removeObjectForKey:key];
-            }
-            [response sendError:err];
-            dispatch_async(strongSelf->callbackQueue, ^{
-                completion([OCSPCacheLookupResult lookupResultWithResponse:nil
-                                                                     error:err
-                                                                    cached:FALSE]);
-            });
+                                       NSUnderlyingErrorKey:errorGettingOCSPRequestData}];
+            [strongSelf finishFetch:fetch forKey:key response:nil error:err];
             return;
         }
 
@@ -367,12 +868,23 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
             }
         }
 
-        // Make OCSP requests
+        // Make OCSP requests. Requests to the same responders made at about the same time, e.g.
+        // for each certificate in a chain, are sent together.
 
-        [[OCSPRequestService getSuccessfulOCSPResponse:newURLs
-                                       ocspRequestData:ocspReqData
-                                               session:session
-                                                 queue:strongSelf->workQueue]
+        // Set if a responder answered with an unsuccessful response status, which distinguishes
+        // unsuccessful responses from network failures if no successful response is obtained
+        __block BOOL unsuccessfulResponse = FALSE;
+
+        // Set if a successful response failed the check. The service completes after emitting a
+        // successful response, so the fetch is failed on completion.
+        __block NSError *rejectedResponseError = nil;
+
+        [[strongSelf->batcher requestForCert:secCertRef
+                                      issuer:issuerRef
+                             ocspRequestData:ocspReqData
+                                        urls:newURLs
+                               responderURLs:urls
+                                     session:session]
          subscribeNext:^(NSObject * _Nullable x) {
              // OCSPService emits NSError and OCSPResponse
              // - Each error encountered is emitted
@@ -386,17 +898,31 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
                  // OCSP response from OCSPService
                  // Still need to check if it was successful
                  OCSPResponse *r = (OCSPResponse*)x;
-                 if (r.success) {
+                 NSError *checkError = nil;
+                 if (r.success && strongSelf.verifyResponses) {
+                     checkError = [r checkForCert:secCertRef issuer:issuerRef];
+                 }
+                 if (r.success && checkError == nil) {
                      // Successful response, OCSPServer will complete after emitting this
-                     [response sendNext:r];
-                     [response sendCompleted];
+                     [self log:@"Service returned response"];
+                     [strongSelf finishFetch:fetch forKey:key response:r error:nil];
+                 } else if (checkError != nil) {
+                     // Not cached, so that the lookup fails rather than returning a response which
+                     // trust evaluation would reject
+                     [self log:[NSString stringWithFormat:@"Got OCSP response which failed check: "
+                                                           "%@", checkError]];
+                     rejectedResponseError = checkError;
                  } else {
                      [self log:[NSString stringWithFormat:@"Got invalid OCSP response with code: "
                                                            "%d", [r status]]];
+                     unsuccessfulResponse = TRUE;
                  }
              } else {
                  // Should never happen
-                 [response sendError:[OCSPCache unknownObjectError:x]];
+                 [strongSelf finishFetch:fetch
+                                  forKey:key
+                                response:nil
+                                   error:[OCSPCache unknownObjectError:x]];
              }
          } error:^(NSError * _Nullable error) {
              NSError *err =
@@ -404,63 +930,193 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
                                  code:OCSPCacheErrorCodeNoSuccessfulResponse
                              userInfo:@{NSLocalizedDescriptionKey:
                                         @"Failed to get a succesful response"}];
-             [response sendError:err];
+             [strongSelf failFetch:fetch
+                            forKey:key
+                             error:err
+                        errorClass:unsuccessfulResponse
+                                   ? OCSPNegativeCacheErrorClassUnsuccessfulResponse
+                                   : OCSPNegativeCacheErrorClassNetworkFailure];
          } completed:^{
              [self log:@"OCSPService completed"];
+             if (rejectedResponseError != nil) {
+                 NSError *err =
+                 [NSError errorWithDomain:OCSPCacheErrorDomain
+                                     code:OCSPCacheErrorCodeNoSuccessfulResponse
+                                 userInfo:@{NSLocalizedDescriptionKey:
+                                            @"Response failed verification",
+                                            NSUnderlyingErrorKey:rejectedResponseError}];
+                 [strongSelf failFetch:fetch
+                                forKey:key
+                                 error:err
+                            errorClass:OCSPNegativeCacheErrorClassUnsuccessfulResponse];
+             }
          }];
+    });
+}
 
-        // Wait for response with timeout
+/// Complete the lookup with the cached response. Returns FALSE, after evicting the entry, if the
+/// cached data is not a valid OCSP response.
+- (BOOL)completeLookup:(void (^)(OCSPCacheLookupResult *result))completion
+       withCachedEntry:(OCSPCacheEntry*)cachedEntry
+                forKey:(OCSPCacheKey*)key
+          revalidating:(BOOL)revalidating {
+
+    // The response was decoded when the entry was created and is shared by every hit
+    OCSPResponse *r = cachedEntry.response;
+    if (r == nil) {
+        [self log:@"Error: cache returned invalid data, evicting invalid data"];
+        [self removeCacheValueForKey:key];
+        return FALSE;
+    }
 
-        NSError *timeoutError =
-        [NSError errorWithDomain:OCSPCacheErrorDomain
-                            code:OCSPCacheErrorCodeLookupTimedOut
-                        userInfo:@{NSLocalizedDescriptionKey:@"Lookup timed out"}];
+    [self log:@"Cache returned response"];
+    dispatch_async(self->callbackQueue, ^{
+        OCSPCacheLookupResult *result = [OCSPCacheLookupResult lookupResultWithResponse:r
+                                                                                  error:nil
+                                                                                 cached:TRUE];
+        result.revalidating = revalidating;
+        completion(result);
+    });
+
+    return TRUE;
+}
 
-        RACSignal *responseWithOptionalTimeout;
+/// Fetch a new response in the background if the cached entry is within the stale-while-revalidate
+/// window of its nextUpdate. Returns TRUE if the entry is being revalidated, whether by this call
+/// or by an earlier lookup.
+- (BOOL)revalidateEntry:(OCSPCacheEntry*)entry
+                 forKey:(OCSPCacheKey*)key
+                   cert:(SecCertificateRef)secCertRef
+                 issuer:(SecCertificateRef)issuerRef
+                timeout:(NSTimeInterval)timeout
+          modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
+                session:(NSURLSession*__nullable)session {
+
+    NSTimeInterval window = self.staleWhileRevalidateWindow;
+    if (window <= 0 || ![entry expiredAt:[NSDate dateWithTimeIntervalSinceNow:window]]) {
+        return FALSE;
+    }
 
-        if (timeout > 0) {
-            responseWithOptionalTimeout =
-            [[response merge:[[RACSignal return:timeoutError] delay:timeout]] take:1];
-        } else {
-            responseWithOptionalTimeout = response;
+    @synchronized (self) {
+        if ([self->revalidatingKeys containsObject:key]) {
+            return TRUE;
         }
+        [self->revalidatingKeys addObject:key];
+    }
 
-        [[[responseWithOptionalTimeout subscribeOn:strongSelf->scheduler]
-         flattenMap:^__kindof RACSignal * _Nullable(id  _Nullable x) {
+    [self log:@"Revalidating cached response"];
 
-            if ([x isKindOfClass:[NSError class]]) {
-                return [RACSignal error:x];
-            } else if ([x isKindOfClass:[OCSPResponse class]]) {
-                return [RACSignal return:x];
-            }
+    // The lookup which triggered the revalidation completes before the fetch, so the certificates
+    // are retained until then
+    id cert = (__bridge id)secCertRef;
+    id issuer = (__bridge id)issuerRef;
 
-            return [RACSignal error:[OCSPCache unknownObjectError:x]];
-        }] subscribeNext:^(OCSPResponse *r) {
-            @synchronized (self) {
-                // Add response to the cache and remove pending response
-                [strongSelf->cache setObject:r.data forKey:key];
-                [strongSelf->pendingResponseCache removeObjectForKey:key];
+    // Shares a fetch which is already in progress, e.g. a proactive refresh
+    [self lookup:(__bridge SecCertificateRef)cert
+      withIssuer:(__bridge SecCertificateRef)issuer
+      andTimeout:timeout
+   modifyOCSPURL:modifyOCSPURL
+         session:session
+    forceRefresh:TRUE
+      completion:^(OCSPCacheLookupResult *result) {
+        @synchronized (self) {
+            [self->revalidatingKeys removeObject:key];
+        }
+        // Released with the block
+        (void)cert;
+        (void)issuer;
+    }];
+
+    return TRUE;
+}
+
+/// Complete the fetch with the error and cache the failure for the TTL of its class, so that
+/// lookups fail fast until it expires.
+- (void)failFetch:(OCSPCachePendingFetch*)fetch
+           forKey:(OCSPCacheKey*)key
+            error:(NSError*)err
+       errorClass:(OCSPNegativeCacheErrorClass)errorClass {
+    // Cached before the waiters are completed, so that lookups which follow them fail fast
+    [self.negativeCache setError:err errorClass:errorClass forKey:key];
+    [self finishFetch:fetch forKey:key response:nil error:err];
+}
+
+/// Complete all the lookups waiting for the fetch with a single dispatch to the callback queue and
+/// remove it from the pending table. Only the first call for a fetch completes the lookups, but a
+/// successful response which arrives after the fetch timed out is still cached.
+- (void)finishFetch:(OCSPCachePendingFetch*)fetch
+             forKey:(OCSPCacheKey*)key
+           response:(OCSPResponse*__nullable)r
+              error:(NSError*__nullable)err {
+
+    NSArray<void (^)(OCSPCacheLookupResult*)>* waiters;
+    OCSPCacheEntry *entry = nil;
+    NSMutableArray<OCSPCacheKey*>* otherKeys = nil;
+
+    if (r != nil && !self.verifyResponses) {
+        // A response to a request for several certificates also answers for the others. Only the
+        // single response for the requested certificate was checked, so the others are not
+        // stored when responses are verified; lookups for them check the response themselves.
+        otherKeys = [[OCSPCacheKey keysForResponse:r] mutableCopy];
+        [otherKeys removeObject:key];
+    }
+
+    @synchronized (self) {
+        if (r != nil) {
+            // Add response to the cache
+            entry = [OCSPCacheEntry entryWithResponse:r];
+            [self->cache setEntry:entry forKey:key];
+            for (OCSPCacheKey *k in otherKeys) {
+                [self->cache setEntry:entry forKey:k];
             }
-            dispatch_async(strongSelf->callbackQueue, ^{
-                completion([OCSPCacheLookupResult lookupResultWithResponse:r
-                                                                     error:nil
-                                                                    cached:FALSE]);
-            });
-            [self log:@"Service returned response"];
+            atomic_fetch_add(&self->storedFetches, 1);
+            [self.refresher scheduleRefreshForKey:key entry:entry];
+            for (OCSPCacheKey *k in otherKeys) {
+                [self.refresher scheduleRefreshForKey:k entry:entry];
+            }
+        }
 
-         } error:^(NSError * _Nullable err) {
-             @synchronized (self) {
-                 [self->pendingResponseCache removeObjectForKey:key];
-             }
-             [self logError:err];
-             dispatch_async(strongSelf->callbackQueue, ^{
-                 completion([OCSPCacheLookupResult lookupResultWithResponse:nil
-                                                                      error:err
-                                                                     cached:FALSE]);
-             });
-        } completed:^{
-            // Should never happen
-            [self log:@"Response completed"];
+        if ([self->pendingFetches objectForKey:key] == fetch) {
+            [self->pendingFetches removeObjectForKey:key];
+        }
+
+        waiters = fetch.waiters;
+        fetch.waiters = nil;
+
+        if (fetch.timer != nil) {
+            dispatch_source_cancel(fetch.timer);
+            fetch.timer = nil;
+        }
+    }
+
+    if (entry != nil) {
+        [self.negativeCache removeErrorForKey:key];
+        for (OCSPCacheKey *k in otherKeys) {
+            [self.negativeCache removeErrorForKey:k];
+        }
+        [self journalOp:OCSPCacheJournalOpSet key:key data:entry.data];
+        for (OCSPCacheKey *k in otherKeys) {
+            [self journalOp:OCSPCacheJournalOpSet key:k data:entry.data];
+        }
+    }
+
+    if (err != nil) {
+        [self logError:err];
+    }
+
+    if (waiters == nil) {
+        // Already completed
+        return;
+    }
+
+    dispatch_async(self->callbackQueue, ^{
+        [waiters enumerateObjectsUsingBlock:^(void (^waiter)(OCSPCacheLookupResult*),
+                                              NSUInteger i,
+                                              BOOL *stop) {
+            // Lookups which joined the fetch started by the first one are served from the cache
+            waiter([OCSPCacheLookupResult lookupResultWithResponse:r
+                                                             error:err
+                                                            cached:(r != nil && i > 0)]);
         }];
     });
 }
@@ -491,50 +1147,218 @@ NSErrorDomain _Nonnull const OCSPCacheErrorDomain = @"OCSPCacheErrorDomain";
     return r;
 }
 
+// See comment in header
+- (OCSPResponse*)cachedResponseForCert:(SecCertificateRef)secCertRef
+                                issuer:(SecCertificateRef)issuerRef {
+    OCSPCacheKey *key = [OCSPCacheKey keyForCertificate:secCertRef issuer:issuerRef];
+
+    OCSPCacheEntry *entry = [self->cache entryForKey:key];
+    if (entry == nil) {
+        @synchronized (self) {
+            entry = [self promoteFileEntryForKey:key];
+        }
+    }
+
+    return entry.response;
+}
+
+// See comment in header
+- (NSTimeInterval)requestCoalescingWindow {
+    return self->batcher.coalescingWindow;
+}
+
+// See comment in header
+- (void)setRequestCoalescingWindow:(NSTimeInterval)requestCoalescingWindow {
+    self->batcher.coalescingWindow = requestCoalescingWindow;
+}
+
+// See comment in header
+- (NSTimeInterval)requestHedgeDelay {
+    return self->batcher.hedgeDelay;
+}
+
+// See comment in header
+- (void)setRequestHedgeDelay:(NSTimeInterval)requestHedgeDelay {
+    self->batcher.hedgeDelay = requestHedgeDelay;
+}
+
+// See comment in header
+- (OCSPResponderRegistry*)responderRegistry {
+    return self->batcher.responderRegistry;
+}
+
+// See comment in header
+- (OCSPSessionPool*)sessionPool {
+    return self->batcher.sessionPool;
+}
+
+// See comment in header
+- (OCSPRequestMethod)requestMethodForOCSPURL:(NSURL*)url {
+    return [self->batcher requestMethodForURL:url];
+}
+
+// See comment in header
+- (void)setRequestMethod:(OCSPRequestMethod)method forOCSPURL:(NSURL*)url {
+    [self->batcher setRequestMethod:method forURL:url];
+}
+
+#pragma mark - Proactive refresh
+
+// See comment in header
+- (void)startProactiveRefresh:(OCSPCacheRefreshPolicy*)policy {
+    __weak OCSPCache *weakSelf = self;
+
+    OCSPCacheRefresher *newRefresher =
+    [[OCSPCacheRefresher alloc] initWithPolicy:policy
+                                       refresh:^(SecCertificateRef cert,
+                                                 SecCertificateRef issuer,
+                                                 NSURL* (^modifyOCSPURL)(NSURL *url),
+                                                 NSURLSession *session,
+                                                 NSTimeInterval timeout,
+                                                 void (^completion)(OCSPCacheEntry *entry)) {
+        __strong OCSPCache *strongSelf = weakSelf;
+        if (!strongSelf) {
+            completion(nil);
+            return;
+        }
+
+        [strongSelf log:@"Refreshing cached response"];
+
+        [strongSelf lookup:cert
+                withIssuer:issuer
+                andTimeout:timeout
+             modifyOCSPURL:modifyOCSPURL
+                   session:session
+              forceRefresh:TRUE
+                completion:^(OCSPCacheLookupResult *result) {
+            if (result.err != nil) {
+                completion(nil);
+                return;
+            }
+            completion([OCSPCacheEntry entryWithResponse:result.response]);
+        }];
+    }];
+
+    @synchronized (self) {
+        [self.refresher stop];
+        self.refresher = newRefresher;
+    }
+}
+
+// See comment in header
+- (void)stopProactiveRefresh {
+    @synchronized (self) {
+        [self.refresher stop];
+        self.refresher = nil;
+    }
+}
+
+// See comment in header
+- (OCSPCacheRefresherMetrics*)refreshMetrics {
+    @synchronized (self) {
+        return [self.refresher metrics];
+    }
+}
+
 #pragma mark - Managing the cache
 
 // See comment in header
-- (void)setCacheValueForCert:(SecCertificateRef)secCertRef data:(nonnull NSData *)data {
-    NSString *key = [OCSPCache sha256Base64Key:secCertRef];
+- (void)setCacheValueForCert:(SecCertificateRef)secCertRef
+                      issuer:(SecCertificateRef)issuerRef
+                        data:(nonnull NSData *)data {
+    OCSPCacheKey *key = [OCSPCacheKey keyForCertificate:secCertRef issuer:issuerRef];
+
+    OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:data];
 
     @synchronized (self) {
-        [cache setObject:data forKey:key];
+        [cache setEntry:entry forKey:key];
     }
+
+    [self.negativeCache removeErrorForKey:key];
+    [self journalOp:OCSPCacheJournalOpSet key:key data:data];
 }
 
 // See comment in header
-- (BOOL)removeCacheValueForCert:(SecCertificateRef)secCertRef {
-    NSString *key = [OCSPCache sha256Base64Key:secCertRef];
+- (BOOL)removeCacheValueForCert:(SecCertificateRef)secCertRef
+                         issuer:(SecCertificateRef)issuerRef {
+    OCSPCacheKey *key = [OCSPCacheKey keyForCertificate:secCertRef issuer:issuerRef];
 
     return [self removeCacheValueForKey:key];
 }
 
 // See comment in header
-- (BOOL)removeCacheValueForKey:(NSString*)key {
+- (BOOL)validateCacheValueForCert:(SecCertificateRef)secCertRef
+                           issuer:(SecCertificateRef)issuerRef
+                            error:(NSError**)error {
+    OCSPResponse *response = [self cachedResponseForCert:secCertRef issuer:issuerRef];
+    if (response == nil) {
+        return FALSE;
+    }
+
+    NSError *checkError = [response checkForCert:secCertRef issuer:issuerRef];
+    if (checkError == nil) {
+        return TRUE;
+    }
+
+    [self log:[NSString stringWithFormat:@"Cached response failed check: %@", checkError]];
+    [self removeCacheValueForCert:secCertRef issuer:issuerRef];
+
+    if (error != NULL) {
+        *error = checkError;
+    }
+
+    return FALSE;
+}
+
+// See comment in header
+- (BOOL)removeCacheValueForKey:(OCSPCacheKey*)key {
     BOOL valueEvicted = NO;
 
     [self log:@"Evicting cache value"];
     @synchronized (self) {
-        if ([cache objectForKey:key]) {
-            [cache removeObjectForKey:key];
-            valueEvicted = TRUE;
+        valueEvicted = [cache removeEntryForKey:key];
+        if (self->file != nil && ![self->fileRemovals containsObject:key]) {
+            if ([self->file dataForKey:key] != nil) {
+                [self->fileRemovals addObject:key];
+                valueEvicted = TRUE;
+            }
         }
     }
 
+    if (valueEvicted) {
+        [self journalOp:OCSPCacheJournalOpRemove key:key data:nil];
+    }
+
     [self log:@"Evicted cache value"];
     return valueEvicted;
 }
 
-#pragma mark - Certificate hashing
+/// Move the response for the key from the loaded file, if any, into the store.
+/// Must be called while synchronized.
+- (OCSPCacheEntry*)promoteFileEntryForKey:(OCSPCacheKey*)key {
+    if (self->file == nil || [self->fileRemovals containsObject:key]) {
+        return nil;
+    }
+
+    NSData *data = [self->file dataForKey:key];
+    if (data == nil) {
+        return nil;
+    }
 
-// TODO: there could be a more concise key
-+ (NSString*)sha256Base64Key:(SecCertificateRef)secCertRef {
-    NSData *dataIn = (__bridge_transfer NSData *)SecCertificateCopyData(secCertRef);
+    OCSPCacheEntry *entry = [OCSPCacheEntry entryWithData:data];
+    if ([entry expiredAt:[NSDate date]]) {
+        [self->fileRemovals addObject:key];
+        return nil;
+    }
 
-    NSMutableData *macOut = [NSMutableData dataWithLength:CC_SHA256_DIGEST_LENGTH];
-    CC_SHA256(dataIn.bytes, (unsigned int)dataIn.length, macOut.mutableBytes);
+    [self->cache setEntry:entry forKey:key];
 
-    return [macOut base64EncodedStringWithOptions:0];
+    return entry;
+}
+
+// See comment in header
+- (id<OCSPCacheStore>)store {
+    return self->cache;
 }
 
 #pragma mark - Logging
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPResponse.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Maximum age, measured from thisUpdate, of an entry whose response does not specify a nextUpdate.
+FOUNDATION_EXPORT const NSTimeInterval OCSPCacheEntryMaxAgeWithoutNextUpdate;
+
+/// Cached OCSP response data along with its decoded response and parsed validity window.
+@interface OCSPCacheEntry : NSObject
+
+/// OCSP response data. Only needed to persist the entry; lookups use `response`.
+@property (readonly, strong, nonatomic) NSData *data;
+
+/// Decoded OCSP response, which is shared by every lookup that hits the entry. Nil if the data
+/// could not be deserialized as an OCSP response.
+@property (readonly, strong, nonatomic, nullable) OCSPResponse *response;
+
+/// Latest thisUpdate of the single responses. Nil if the response could not be parsed.
+@property (readonly, strong, nonatomic, nullable) NSDate *thisUpdate;
+
+/// Earliest nextUpdate of the single responses. Nil if the response could not be parsed or no
+/// single response specifies a nextUpdate.
+@property (readonly, strong, nonatomic, nullable) NSDate *nextUpdate;
+
+/// Time at which the response was signed by the OCSP responder. Nil if the response could not be
+/// parsed.
+@property (readonly, strong, nonatomic, nullable) NSDate *producedAt;
+
+/// TRUE if the data could not be deserialized as an OCSP response or the validity window of the
+/// response could not be parsed. Invalid entries are always expired.
+@property (readonly, assign, nonatomic) BOOL invalid;
+
+/// Time at which the entry expires. This is nextUpdate if the response specifies one, otherwise
+/// thisUpdate plus OCSPCacheEntryMaxAgeWithoutNextUpdate. Distant past for invalid entries.
+@property (readonly, strong, nonatomic) NSDate *expiry;
+
+/// Create an entry from an OCSP response.
++ (instancetype)entryWithResponse:(OCSPResponse*)response;
+
+/// Create an entry from OCSP response data. If the data cannot be deserialized as an OCSP response,
+/// an invalid entry with no validity window is returned; it is up to the caller to handle the invalid
+/// data.
++ (instancetype)entryWithData:(NSData*)data;
+
+/// Returns TRUE if the expiry of the entry is at or before the provided date. Invalid entries are
+/// always expired.
+- (BOOL)expiredAt:(NSDate*)date;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheEntry.h"
+
+// See comment in header
+const NSTimeInterval OCSPCacheEntryMaxAgeWithoutNextUpdate = 24 * 60 * 60;
+
+@interface OCSPCacheEntry ()
+
+@property (strong, nonatomic) NSData *data;
+@property (strong, nonatomic, nullable) OCSPResponse *response;
+@property (strong, nonatomic, nullable) NSDate *thisUpdate;
+@property (strong, nonatomic, nullable) NSDate *nextUpdate;
+@property (strong, nonatomic, nullable) NSDate *producedAt;
+@property (assign, nonatomic) BOOL invalid;
+@property (strong, nonatomic) NSDate *expiry;
+
+@end
+
+@implementation OCSPCacheEntry
+
+/// See comment in header
++ (instancetype)entryWithResponse:(OCSPResponse*)response {
+    OCSPCacheEntry *entry = [[OCSPCacheEntry alloc] init];
+    entry.data = response.data;
+    entry.response = response;
+
+    NSDate *thisUpdate, *nextUpdate;
+    Error *e = [response thisUpdate:&thisUpdate nextUpdate:&nextUpdate];
+    if (e == nil && thisUpdate != nil) {
+        entry.thisUpdate = thisUpdate;
+        entry.nextUpdate = nextUpdate;
+        if (nextUpdate != nil) {
+            entry.expiry = nextUpdate;
+        } else {
+            // A response without nextUpdate indicates that newer information is always available;
+            // bound how long it is served instead of keeping it indefinitely.
+            entry.expiry = [thisUpdate dateByAddingTimeInterval:OCSPCacheEntryMaxAgeWithoutNextUpdate];
+        }
+    } else {
+        entry.invalid = TRUE;
+        entry.expiry = [NSDate distantPast];
+    }
+    entry.producedAt = [response producedAt];
+
+    return entry;
+}
+
+/// See comment in header
++ (instancetype)entryWithData:(NSData*)data {
+    OCSPResponse *response = [[OCSPResponse alloc] initWithData:data];
+    if (response != nil) {
+        return [OCSPCacheEntry entryWithResponse:response];
+    }
+
+    OCSPCacheEntry *entry = [[OCSPCacheEntry alloc] init];
+    entry.data = data;
+    entry.invalid = TRUE;
+    entry.expiry = [NSDate distantPast];
+
+    return entry;
+}
+
+/// See comment in header
+- (BOOL)expiredAt:(NSDate*)date {
+    return [self.expiry compare:date] != NSOrderedDescending;
+}
+
+@end
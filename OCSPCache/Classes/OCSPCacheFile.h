@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPCacheKey.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+FOUNDATION_EXPORT NSErrorDomain const OCSPCacheFileErrorDomain;
+
+/// Error codes which can be returned by OCSPCacheFile
+typedef NS_ERROR_ENUM(OCSPCacheFileErrorDomain, OCSPCacheFileErrorCode) {
+
+    /*!
+     * Unknown error.
+     */
+    OCSPCacheFileErrorCodeUnknown = -1,
+
+    /*!
+     * The file could not be read or mapped.
+     * @code
+     * // Underlying error will be set with more information
+     * [error.userInfo objectForKey:NSUnderlyingErrorKey]
+     * @endcode
+     */
+    OCSPCacheFileErrorCodeReadFailed = 1,
+
+    /*!
+     * The file is not an OCSP cache file, was written by an unsupported version or is truncated.
+     */
+    OCSPCacheFileErrorCodeInvalidFormat,
+
+    /*!
+     * The file could not be written.
+     * @code
+     * // Underlying error will be set with more information
+     * [error.userInfo objectForKey:NSUnderlyingErrorKey]
+     * @endcode
+     */
+    OCSPCacheFileErrorCodeWriteFailed,
+};
+
+/*!
+ * Memory mapped file of OCSP responses.
+ *
+ * Layout (all integers are little-endian):
+ * @code
+ * header: magic "OCSPCF\0\0" | version u32 | count u32 | index offset u64 | blob offset u64
+ * index:  count x { key[32] | blob offset u64 | length u32 | reserved u32 }, sorted by key
+ * blobs:  DER encoded OCSP responses, appended one after the other
+ * @endcode
+ *
+ * Lookups binary search the index and return the response bytes from the mapping without copying
+ * them. Files are written to a temporary file which is renamed over the destination, so a crash
+ * while persisting leaves either the old or the new file in place.
+ */
+@interface OCSPCacheFile : NSObject
+
+/// Number of responses in the file.
+@property (readonly, assign, nonatomic) NSUInteger count;
+
+/// Map the file at the provided URL. Returns nil and sets error if the file cannot be mapped or is
+/// not a valid OCSP cache file.
++ (instancetype __nullable)fileWithContentsOfURL:(NSURL*)url error:(NSError**)error;
+
+/// Returns the response data for the key or nil if there is none. The returned data references the
+/// mapping and keeps it alive.
+- (NSData*__nullable)dataForKey:(OCSPCacheKey*)key;
+
+/// Enumerate the keys and response data in key order.
+- (void)enumerateKeysAndDataUsingBlock:(void (^)(OCSPCacheKey *key, NSData *data, BOOL *stop))block;
+
+/// Atomically write the provided responses to the file at the provided URL.
++ (BOOL)writeEntries:(NSDictionary<OCSPCacheKey*, NSData*>*)entries
+               toURL:(NSURL*)url
+               error:(NSError**)error;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheFile.h"
+#import <fcntl.h>
+#import <libkern/OSByteOrder.h>
+#import <unistd.h>
+
+NSErrorDomain _Nonnull const OCSPCacheFileErrorDomain = @"OCSPCacheFileErrorDomain";
+
+static const char OCSPCacheFileMagic[8] = {'O', 'C', 'S', 'P', 'C', 'F', 0, 0};
+static const uint32_t OCSPCacheFileVersion = 1;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t indexOffset;
+    uint64_t blobOffset;
+} __attribute__((packed)) OCSPCacheFileHeader;
+
+typedef struct {
+    uint8_t key[OCSPCacheKeyLength];
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+} __attribute__((packed)) OCSPCacheFileIndexEntry;
+
+@implementation OCSPCacheFile {
+    NSData *mapped;
+    const OCSPCacheFileIndexEntry *index;
+    const uint8_t *blobs;
+    uint64_t blobsLength;
+}
+
+// See comment in header
++ (instancetype)fileWithContentsOfURL:(NSURL*)url error:(NSError**)error {
+    NSError *e;
+    NSData *mapped = [NSData dataWithContentsOfURL:url
+                                           options:NSDataReadingMappedAlways
+                                             error:&e];
+    if (mapped == nil) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:OCSPCacheFileErrorDomain
+                                         code:OCSPCacheFileErrorCodeReadFailed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to map file",
+                                                NSUnderlyingErrorKey:e}];
+        }
+        return nil;
+    }
+
+    OCSPCacheFile *file = [[OCSPCacheFile alloc] init];
+    if (![file loadMapping:mapped]) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:OCSPCacheFileErrorDomain
+                                         code:OCSPCacheFileErrorCodeInvalidFormat
+                                     userInfo:@{NSLocalizedDescriptionKey:
+                                                    @"Invalid OCSP cache file"}];
+        }
+        return nil;
+    }
+
+    return file;
+}
+
+/// Validate the header and index bounds.
+- (BOOL)loadMapping:(NSData*)data {
+    if (data.length < sizeof(OCSPCacheFileHeader)) {
+        return FALSE;
+    }
+
+    OCSPCacheFileHeader header;
+    memcpy(&header, data.bytes, sizeof(header));
+
+    if (memcmp(header.magic, OCSPCacheFileMagic, sizeof(OCSPCacheFileMagic)) != 0) {
+        return FALSE;
+    }
+    if (OSSwapLittleToHostInt32(header.version) != OCSPCacheFileVersion) {
+        return FALSE;
+    }
+
+    uint64_t count = OSSwapLittleToHostInt32(header.count);
+    uint64_t indexOffset = OSSwapLittleToHostInt64(header.indexOffset);
+    uint64_t blobOffset = OSSwapLittleToHostInt64(header.blobOffset);
+
+    if (indexOffset < sizeof(OCSPCacheFileHeader)
+        || blobOffset > data.length
+        || indexOffset > blobOffset
+        || count * sizeof(OCSPCacheFileIndexEntry) > blobOffset - indexOffset) {
+        return FALSE;
+    }
+
+    self->mapped = data;
+    self->_count = (NSUInteger)count;
+    self->index = (const OCSPCacheFileIndexEntry*)((const uint8_t*)data.bytes + indexOffset);
+    self->blobs = (const uint8_t*)data.bytes + blobOffset;
+    self->blobsLength = data.length - blobOffset;
+
+    return TRUE;
+}
+
+// See comment in header
+- (NSData*)dataForKey:(OCSPCacheKey*)key {
+    NSUInteger lo = 0, hi = self->_count;
+
+    while (lo < hi) {
+        NSUInteger mid = lo + (hi - lo) / 2;
+        int c = memcmp(key.bytes, self->index[mid].key, OCSPCacheKeyLength);
+        if (c == 0) {
+            return [self dataAtIndex:mid];
+        } else if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return nil;
+}
+
+// See comment in header
+- (void)enumerateKeysAndDataUsingBlock:(void (^)(OCSPCacheKey *key, NSData *data, BOOL *stop))block {
+    BOOL stop = FALSE;
+
+    for (NSUInteger i = 0; i < self->_count && !stop; i++) {
+        NSData *data = [self dataAtIndex:i];
+        if (data == nil) {
+            continue;
+        }
+        OCSPCacheKey *key = [OCSPCacheKey keyWithBytes:self->index[i].key];
+        block(key, data, &stop);
+    }
+}
+
+/// Response data of the index entry without copying. Returns nil if the entry is out of bounds.
+- (NSData*)dataAtIndex:(NSUInteger)i {
+    OCSPCacheFileIndexEntry entry;
+    memcpy(&entry, &self->index[i], sizeof(entry));
+
+    uint64_t offset = OSSwapLittleToHostInt64(entry.offset);
+    uint64_t length = OSSwapLittleToHostInt32(entry.length);
+
+    if (offset > self->blobsLength || length > self->blobsLength - offset) {
+        return nil;
+    }
+
+    // Keep the mapping alive for as long as the returned data is
+    NSData *mapping = self->mapped;
+
+    return [[NSData alloc] initWithBytesNoCopy:(void*)(self->blobs + offset)
+                                        length:(NSUInteger)length
+                                   deallocator:^(void *bytes, NSUInteger len) {
+        (void)mapping;
+    }];
+}
+
+#pragma mark - Writing
+
+// See comment in header
++ (BOOL)writeEntries:(NSDictionary<OCSPCacheKey*, NSData*>*)entries
+               toURL:(NSURL*)url
+               error:(NSError**)error {
+
+    NSArray<OCSPCacheKey*>* keys = [[entries allKeys] sortedArrayUsingSelector:@selector(compare:)];
+
+    uint64_t indexOffset = sizeof(OCSPCacheFileHeader);
+    uint64_t blobOffset = indexOffset + [keys count] * sizeof(OCSPCacheFileIndexEntry);
+
+    OCSPCacheFileHeader header;
+    memcpy(header.magic, OCSPCacheFileMagic, sizeof(OCSPCacheFileMagic));
+    header.version = OSSwapHostToLittleInt32(OCSPCacheFileVersion);
+    header.count = OSSwapHostToLittleInt32((uint32_t)[keys count]);
+    header.indexOffset = OSSwapHostToLittleInt64(indexOffset);
+    header.blobOffset = OSSwapHostToLittleInt64(blobOffset);
+
+    NSMutableData *out = [[NSMutableData alloc] initWithCapacity:blobOffset];
+    [out appendBytes:&header length:sizeof(header)];
+
+    uint64_t offset = 0;
+    for (OCSPCacheKey *key in keys) {
+        NSData *data = [entries objectForKey:key];
+
+        OCSPCacheFileIndexEntry entry;
+        memcpy(entry.key, key.bytes, OCSPCacheKeyLength);
+        entry.offset = OSSwapHostToLittleInt64(offset);
+        entry.length = OSSwapHostToLittleInt32((uint32_t)data.length);
+        entry.reserved = 0;
+        [out appendBytes:&entry length:sizeof(entry)];
+
+        offset += data.length;
+    }
+
+    for (OCSPCacheKey *key in keys) {
+        [out appendData:[entries objectForKey:key]];
+    }
+
+    return [OCSPCacheFile atomicallyWriteData:out toURL:url error:error];
+}
+
+/// Write to a uniquely named temporary file in the same directory, flush it to disk and rename it
+/// over the destination.
++ (BOOL)atomicallyWriteData:(NSData*)data toURL:(NSURL*)url error:(NSError**)error {
+    NSString *path = [url path];
+
+    // Unique per write, so concurrent writes to the same destination do not share a temporary file
+    const char *pattern = [[path stringByAppendingString:@".tmp-XXXXXX"] fileSystemRepresentation];
+    NSMutableData *tmpPathData = [NSMutableData dataWithBytes:pattern length:strlen(pattern) + 1];
+    char *tmpPath = tmpPathData.mutableBytes;
+
+    int fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        if (error != NULL) {
+            *error = [OCSPCacheFile writeErrorWithErrno:errno];
+        }
+        return FALSE;
+    }
+
+    const uint8_t *p = data.bytes;
+    size_t remaining = data.length;
+
+    while (remaining > 0) {
+        ssize_t n = write(fd, p, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (error != NULL) {
+                *error = [OCSPCacheFile writeErrorWithErrno:errno];
+            }
+            close(fd);
+            unlink(tmpPath);
+            return FALSE;
+        }
+        p += n;
+        remaining -= n;
+    }
+
+    // fsync does not flush the drive cache on Apple platforms. F_FULLFSYNC does, but is not
+    // supported by every file system. The descriptor is closed whether or not the flush succeeded.
+    int err = 0;
+    if (fcntl(fd, F_FULLFSYNC) != 0 && fsync(fd) != 0) {
+        err = errno;
+    }
+    if (close(fd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        if (error != NULL) {
+            *error = [OCSPCacheFile writeErrorWithErrno:err];
+        }
+        unlink(tmpPath);
+        return FALSE;
+    }
+
+    if (rename(tmpPath, [path fileSystemRepresentation]) != 0) {
+        if (error != NULL) {
+            *error = [OCSPCacheFile writeErrorWithErrno:errno];
+        }
+        unlink(tmpPath);
+        return FALSE;
+    }
+
+    // Persist the rename
+    int dirfd = open([[path stringByDeletingLastPathComponent] fileSystemRepresentation], O_RDONLY);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    return TRUE;
+}
+
++ (NSError*)writeErrorWithErrno:(int)err {
+    NSError *underlying = [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:nil];
+
+    return [NSError errorWithDomain:OCSPCacheFileErrorDomain
+                               code:OCSPCacheFileErrorCodeWriteFailed
+                           userInfo:@{NSLocalizedDescriptionKey:@"Failed to write file",
+                                      NSUnderlyingErrorKey:underlying}];
+}
+
+@end
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPCacheKey.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+FOUNDATION_EXPORT NSErrorDomain const OCSPCacheJournalErrorDomain;
+
+/// Error codes which can be returned by OCSPCacheJournal
+typedef NS_ERROR_ENUM(OCSPCacheJournalErrorDomain, OCSPCacheJournalErrorCode) {
+
+    /*!
+     * Unknown error.
+     */
+    OCSPCacheJournalErrorCodeUnknown = -1,
+
+    /*!
+     * The journal file could not be opened, read or written.
+     * @code
+     * // Underlying error will be set with more information
+     * [error.userInfo objectForKey:NSUnderlyingErrorKey]
+     * @endcode
+     */
+    OCSPCacheJournalErrorCodeIOFailed = 1,
+
+    /*!
+     * The file is not an OCSP cache journal or was written by an unsupported version.
+     */
+    OCSPCacheJournalErrorCodeInvalidFormat,
+};
+
+/// Operations recorded in the journal.
+typedef NS_ENUM(uint8_t, OCSPCacheJournalOp) {
+    /// A response was cached for the key.
+    OCSPCacheJournalOpSet = 1,
+    /// The response cached for the key was evicted.
+    OCSPCacheJournalOpRemove = 2,
+};
+
+/*!
+ * Append-only journal of changes to the cache.
+ *
+ * Layout (all integers are little-endian):
+ * @code
+ * header: magic "OCSPCJ\0\0" | version u32 | reserved u32
+ * record: op u8 | key[32] | length u32 | data[length] | checksum u32
+ * @endcode
+ *
+ * The checksum is the 32-bit FNV-1a hash of the record preceding it. Replay stops at the first
+ * incomplete or corrupt record, which is where a crash interrupted an append; later appends
+ * overwrite it.
+ *
+ * Records are written without fsync, so they survive the app crashing or being terminated but not
+ * the device losing power before the OS flushes them.
+ *
+ * Not thread safe; callers are expected to serialize access.
+ */
+@interface OCSPCacheJournal : NSObject
+
+/// Size of the journal file in bytes.
+@property (readonly, assign, nonatomic) uint64_t size;
+
+/*!
+ Open the journal at the provided URL, creating it if it does not exist, and replay the records
+ it contains in order.
+
+ @param url Location of the journal file. The directory must exist.
+ @param replay Called with each valid record. Data is nil for OCSPCacheJournalOpRemove.
+ @param error Set if the journal could not be opened.
+ */
++ (instancetype __nullable)journalWithURL:(NSURL*)url
+                                   replay:(void (^__nullable)(OCSPCacheJournalOp op,
+                                                              OCSPCacheKey *key,
+                                                              NSData *__nullable data))replay
+                                    error:(NSError**)error;
+
+/// Append a record.
+- (BOOL)appendOp:(OCSPCacheJournalOp)op
+             key:(OCSPCacheKey*)key
+            data:(NSData*__nullable)data
+           error:(NSError**)error;
+
+/// Discard all records, e.g. once they have been folded into a snapshot.
+- (BOOL)reset:(NSError**)error;
+
+@end
+
+NS_ASSUME_NONNULL_END
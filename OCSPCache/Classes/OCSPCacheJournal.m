@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheJournal.h"
+#import <fcntl.h>
+#import <libkern/OSByteOrder.h>
+#import <unistd.h>
+
+NSErrorDomain _Nonnull const OCSPCacheJournalErrorDomain = @"OCSPCacheJournalErrorDomain";
+
+static const char OCSPCacheJournalMagic[8] = {'O', 'C', 'S', 'P', 'C', 'J', 0, 0};
+static const uint32_t OCSPCacheJournalVersion = 1;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} __attribute__((packed)) OCSPCacheJournalHeader;
+
+typedef struct {
+    uint8_t op;
+    uint8_t key[OCSPCacheKeyLength];
+    uint32_t length;
+} __attribute__((packed)) OCSPCacheJournalRecordHeader;
+
+/// 32-bit FNV-1a
+static uint32_t OCSPCacheJournalChecksum(uint32_t hash, const uint8_t *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const uint32_t OCSPCacheJournalChecksumSeed = 2166136261u;
+
+@implementation OCSPCacheJournal {
+    int fd;
+}
+
+// See comment in header
++ (instancetype)journalWithURL:(NSURL*)url
+                        replay:(void (^)(OCSPCacheJournalOp, OCSPCacheKey*, NSData*))replay
+                         error:(NSError**)error {
+
+    int fd = open([[url path] fileSystemRepresentation], O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        if (error != NULL) {
+            *error = [OCSPCacheJournal ioErrorWithErrno:errno
+                                            description:@"Failed to open journal"];
+        }
+        return nil;
+    }
+
+    OCSPCacheJournal *journal = [[OCSPCacheJournal alloc] init];
+    journal->fd = fd;
+
+    NSError *e;
+    NSData *contents = [NSData dataWithContentsOfURL:url
+                                             options:NSDataReadingMappedIfSafe
+                                               error:&e];
+    if (contents == nil) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:OCSPCacheJournalErrorDomain
+                                         code:OCSPCacheJournalErrorCodeIOFailed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to read journal",
+                                                NSUnderlyingErrorKey:e}];
+        }
+        return nil;
+    }
+
+    if (contents.length == 0) {
+        if (![journal reset:error]) {
+            return nil;
+        }
+        return journal;
+    }
+
+    uint64_t validLength = [OCSPCacheJournal replayContents:contents block:replay];
+    if (validLength == 0) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:OCSPCacheJournalErrorDomain
+                                         code:OCSPCacheJournalErrorCodeInvalidFormat
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Invalid OCSP cache journal"}];
+        }
+        return nil;
+    }
+
+    // Drop a torn record left by an interrupted append so the next append follows the last valid
+    // record.
+    if (![journal truncateToLength:validLength error:error]) {
+        return nil;
+    }
+
+    return journal;
+}
+
+- (void)dealloc {
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+}
+
+/// Replay the valid records in the journal contents. Returns the length of the valid prefix, or 0
+/// if the header is invalid.
++ (uint64_t)replayContents:(NSData*)contents
+                     block:(void (^)(OCSPCacheJournalOp, OCSPCacheKey*, NSData*))block {
+
+    const uint8_t *bytes = contents.bytes;
+    uint64_t length = contents.length;
+
+    if (length < sizeof(OCSPCacheJournalHeader)) {
+        return 0;
+    }
+
+    OCSPCacheJournalHeader header;
+    memcpy(&header, bytes, sizeof(header));
+
+    if (memcmp(header.magic, OCSPCacheJournalMagic, sizeof(OCSPCacheJournalMagic)) != 0
+        || OSSwapLittleToHostInt32(header.version) != OCSPCacheJournalVersion) {
+        return 0;
+    }
+
+    uint64_t offset = sizeof(OCSPCacheJournalHeader);
+
+    while (length - offset >= sizeof(OCSPCacheJournalRecordHeader)) {
+        OCSPCacheJournalRecordHeader record;
+        memcpy(&record, bytes + offset, sizeof(record));
+
+        uint64_t dataLength = OSSwapLittleToHostInt32(record.length);
+        uint64_t remaining = length - offset - sizeof(record);
+        if (dataLength > remaining || remaining - dataLength < sizeof(uint32_t)) {
+            break;
+        }
+
+        const uint8_t *start = bytes + offset;
+        uint64_t recordLength = sizeof(record) + dataLength;
+
+        uint32_t checksum;
+        memcpy(&checksum, start + recordLength, sizeof(checksum));
+        if (OSSwapLittleToHostInt32(checksum) !=
+            OCSPCacheJournalChecksum(OCSPCacheJournalChecksumSeed, start, (size_t)recordLength)) {
+            break;
+        }
+
+        if (record.op != OCSPCacheJournalOpSet && record.op != OCSPCacheJournalOpRemove) {
+            break;
+        }
+
+        if (block != nil) {
+            OCSPCacheKey *key = [OCSPCacheKey keyWithBytes:record.key];
+            NSData *data = nil;
+            if (record.op == OCSPCacheJournalOpSet) {
+                data = [NSData dataWithBytes:start + sizeof(record) length:(NSUInteger)dataLength];
+            }
+            block(record.op, key, data);
+        }
+
+        offset += recordLength + sizeof(checksum);
+    }
+
+    return offset;
+}
+
+// See comment in header
+- (BOOL)appendOp:(OCSPCacheJournalOp)op
+             key:(OCSPCacheKey*)key
+            data:(NSData*)data
+           error:(NSError**)error {
+
+    if (op == OCSPCacheJournalOpSet && data == nil) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:OCSPCacheJournalErrorDomain
+                                         code:OCSPCacheJournalErrorCodeUnknown
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Invalid journal record"}];
+        }
+        return FALSE;
+    }
+
+    if (op != OCSPCacheJournalOpSet) {
+        data = nil;
+    }
+
+    OCSPCacheJournalRecordHeader record;
+    record.op = op;
+    memcpy(record.key, key.bytes, OCSPCacheKeyLength);
+    record.length = OSSwapHostToLittleInt32((uint32_t)data.length);
+
+    // Write the record with a single call so that a crash leaves at most one torn record
+    NSMutableData *out =
+        [[NSMutableData alloc] initWithCapacity:sizeof(record) + data.length + sizeof(uint32_t)];
+    [out appendBytes:&record length:sizeof(record)];
+    if (data != nil) {
+        [out appendData:data];
+    }
+    uint32_t checksum =
+        OSSwapHostToLittleInt32(OCSPCacheJournalChecksum(OCSPCacheJournalChecksumSeed,
+                                                         out.bytes,
+                                                         out.length));
+    [out appendBytes:&checksum length:sizeof(checksum)];
+
+    uint64_t previousSize = self->_size;
+
+    if (![self writeData:out error:error]) {
+        // Roll back any partial record
+        ftruncate(self->fd, (off_t)previousSize);
+        lseek(self->fd, (off_t)previousSize, SEEK_SET);
+        self->_size = previousSize;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// See comment in header
+- (BOOL)reset:(NSError**)error {
+    if (![self truncateToLength:0 error:error]) {
+        return FALSE;
+    }
+
+    OCSPCacheJournalHeader header;
+    memcpy(header.magic, OCSPCacheJournalMagic, sizeof(OCSPCacheJournalMagic));
+    header.version = OSSwapHostToLittleInt32(OCSPCacheJournalVersion);
+    header.reserved = 0;
+
+    return [self writeData:[NSData dataWithBytes:&header length:sizeof(header)] error:error];
+}
+
+- (BOOL)truncateToLength:(uint64_t)length error:(NSError**)error {
+    if (ftruncate(self->fd, (off_t)length) != 0 || lseek(self->fd, (off_t)length, SEEK_SET) < 0) {
+        if (error != NULL) {
+            *error = [OCSPCacheJournal ioErrorWithErrno:errno
+                                            description:@"Failed to truncate journal"];
+        }
+        return FALSE;
+    }
+    self->_size = length;
+
+    return TRUE;
+}
+
+- (BOOL)writeData:(NSData*)data error:(NSError**)error {
+    const uint8_t *p = data.bytes;
+    size_t remaining = data.length;
+
+    while (remaining > 0) {
+        ssize_t n = write(self->fd, p, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (error != NULL) {
+                *error = [OCSPCacheJournal ioErrorWithErrno:errno
+                                                description:@"Failed to write journal"];
+            }
+            return FALSE;
+        }
+        p += n;
+        remaining -= n;
+        self->_size += n;
+    }
+
+    return TRUE;
+}
+
++ (NSError*)ioErrorWithErrno:(int)err description:(NSString*)description {
+    NSError *underlying = [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:nil];
+
+    return [NSError errorWithDomain:OCSPCacheJournalErrorDomain
+                               code:OCSPCacheJournalErrorCodeIOFailed
+                           userInfo:@{NSLocalizedDescriptionKey:description,
+                                      NSUnderlyingErrorKey:underlying}];
+}
+
+@end
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <Security/Security.h>
+#import <openssl/ocsp.h>
+#import "OCSPResponse.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Length in bytes of a cache key.
+#define OCSPCacheKeyLength 32
+
+/*!
+ * Immutable cache key stored inline.
+ *
+ * The key is the SHA-256 digest of the OCSP CertID of the certificate: the SHA-1 hashes of the
+ * issuer name and of the issuer public key, followed by the serial number of the certificate. So
+ * the key for a certificate and issuer is also the key of every SingleResponse which answers for
+ * the certificate, including those in responses for several certificates.
+ *
+ * Hashing reads the first word of the digest and equality is a memcmp, so dictionary lookups do no
+ * encoding or allocation. The bytes are the same ones stored in the index of OCSPCacheFile and in
+ * the records of OCSPCacheJournal.
+ */
+@interface OCSPCacheKey : NSObject <NSCopying>
+
+/// Key bytes. Always OCSPCacheKeyLength bytes long.
+@property (readonly, assign, nonatomic) const uint8_t *bytes;
+
+/// Returns the key for the certificate issued by the provided issuer. Keys are memoized per
+/// certificate and issuer hashes per issuer certificate, so a certificate which was seen recently
+/// is not encoded again; otherwise only its serial number is read from its encoding.
+/// If the CertID cannot be derived, e.g. the certificate cannot be parsed, the key falls back to
+/// the SHA-256 digest of the certificate, which matches no SingleResponse.
++ (instancetype)keyForCertificate:(SecCertificateRef)secCertRef
+                           issuer:(SecCertificateRef)issuerRef;
+
+/// Returns the key for the CertID. Returns nil if the CertID is not hashed with SHA-1, since no
+/// certificate key could match it.
++ (instancetype __nullable)keyForCertID:(OCSP_CERTID*)certID;
+
+/// Returns the keys of the single responses in the response for which a key can be derived.
++ (NSArray<OCSPCacheKey*>*)keysForResponse:(OCSPResponse*)response;
+
+/// Issuer name hash followed by issuer key hash, as they appear in the CertIDs of the certificates
+/// the issuer issued. Memoized per issuer certificate. Returns nil if the certificate cannot be
+/// parsed.
++ (NSData*__nullable)issuerHashesForCertificate:(SecCertificateRef)issuerRef;
+
+/// Create a key from the provided bytes, which must be OCSPCacheKeyLength bytes long.
++ (instancetype)keyWithBytes:(const uint8_t*)bytes;
+
+/// Create a key from the provided data. Returns nil if the data is not OCSPCacheKeyLength bytes
+/// long.
++ (instancetype __nullable)keyWithData:(NSData*)data;
+
+/// Create a key from its base64 encoding. Returns nil if the string is not a valid encoding of a
+/// key.
++ (instancetype __nullable)keyWithBase64String:(NSString*)string;
+
+/// Copy of the key bytes.
+- (NSData*)data;
+
+/// Base64 encoding of the key bytes. This was the format of keys before OCSPCacheKey and is still
+/// used when persisting to NSUserDefaults.
+- (NSString*)base64String;
+
+/// Compare the key bytes, e.g. for sorting an index.
+- (NSComparisonResult)compare:(OCSPCacheKey*)other;
+
+@end
+
+NS_ASSUME_NONNULL_END
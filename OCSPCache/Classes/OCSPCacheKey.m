@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheKey.h"
+#import <CommonCrypto/CommonDigest.h>
+#import <openssl/x509.h>
+#import "OCSPOpenSSLBridge.h"
+
+/// Maximum number of memoized issuer hashes.
+#define OCSPCacheKeyIssuerMemoLimit 256
+
+/// Maximum number of memoized certificate keys.
+#define OCSPCacheKeyCertificateMemoLimit 1024
+
+/// Length of the issuer name hash and issuer key hash of a CertID.
+#define OCSPCacheKeyIssuerHashLength CC_SHA1_DIGEST_LENGTH
+
+/// Read the identifier and length octets of the DER element at *offset. On success *offset is
+/// moved to the start of the contents.
+static BOOL OCSPCacheKeyReadDERHeader(const uint8_t *der, size_t length, size_t *offset,
+                                      uint8_t *tag, size_t *contentLength) {
+    size_t o = *offset;
+    if (o + 2 > length) {
+        return FALSE;
+    }
+
+    *tag = der[o++];
+
+    size_t l = der[o++];
+    if (l & 0x80) {
+        size_t n = l & 0x7f;
+        if (n == 0 || n > sizeof(uint32_t) || o + n > length) {
+            return FALSE;
+        }
+        l = 0;
+        for (size_t i = 0; i < n; i++) {
+            l = (l << 8) | der[o++];
+        }
+    }
+
+    if (l > length - o) {
+        return FALSE;
+    }
+
+    *offset = o;
+    *contentLength = l;
+
+    return TRUE;
+}
+
+/// Locate the contents of the serial number INTEGER of a DER encoded certificate without decoding
+/// the rest of it:
+/// @code
+/// Certificate ::= SEQUENCE { tbsCertificate SEQUENCE { [0] version OPTIONAL,
+///                                                      serialNumber INTEGER, ... }, ... }
+/// @endcode
+static BOOL OCSPCacheKeySerialFromDER(const uint8_t *der, size_t length,
+                                      const uint8_t **serial, size_t *serialLength) {
+    size_t offset = 0, contentLength;
+    uint8_t tag;
+
+    // Certificate and TBSCertificate
+    for (int i = 0; i < 2; i++) {
+        if (!OCSPCacheKeyReadDERHeader(der, length, &offset, &tag, &contentLength) || tag != 0x30) {
+            return FALSE;
+        }
+    }
+
+    if (!OCSPCacheKeyReadDERHeader(der, length, &offset, &tag, &contentLength)) {
+        return FALSE;
+    }
+
+    // Explicitly tagged version
+    if (tag == 0xa0) {
+        offset += contentLength;
+        if (!OCSPCacheKeyReadDERHeader(der, length, &offset, &tag, &contentLength)) {
+            return FALSE;
+        }
+    }
+
+    if (tag != 0x02 || contentLength == 0) {
+        return FALSE;
+    }
+
+    *serial = der + offset;
+    *serialLength = contentLength;
+
+    return TRUE;
+}
+
+/// Memoized key of a certificate, which is only valid for the issuer it was derived with.
+@interface OCSPCacheKeyMemo : NSObject
+
+@property (strong, nonatomic) NSData *issuerHashes;
+@property (strong, nonatomic) OCSPCacheKey *key;
+
+@end
+
+@implementation OCSPCacheKeyMemo
+@end
+
+@implementation OCSPCacheKey {
+    uint8_t key[OCSPCacheKeyLength];
+}
+
+/// See comment in header
++ (instancetype)keyForCertificate:(SecCertificateRef)secCertRef
+                           issuer:(SecCertificateRef)issuerRef {
+    static NSCache<id, OCSPCacheKeyMemo*>* memo;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        memo = [[NSCache alloc] init];
+        memo.countLimit = OCSPCacheKeyCertificateMemoLimit;
+    });
+
+    NSData *issuerHashes = [OCSPCacheKey issuerHashesForCertificate:issuerRef];
+
+    // Keys are immutable, so the memoized instance is returned as is. The issuer hashes are the
+    // same instance while the issuer is memoized, which makes the comparison a pointer check.
+    id cert = (__bridge id)secCertRef;
+    OCSPCacheKeyMemo *m = [memo objectForKey:cert];
+    if (m != nil && issuerHashes != nil &&
+        (m.issuerHashes == issuerHashes || [m.issuerHashes isEqualToData:issuerHashes])) {
+        return m.key;
+    }
+
+    NSData *der = (__bridge_transfer NSData *)SecCertificateCopyData(secCertRef);
+
+    const uint8_t *serial;
+    size_t serialLength;
+
+    OCSPCacheKey *k = [[OCSPCacheKey alloc] init];
+
+    if (issuerHashes != nil &&
+        OCSPCacheKeySerialFromDER(der.bytes, der.length, &serial, &serialLength)) {
+        [k setIssuerHashes:issuerHashes.bytes serial:serial length:serialLength];
+
+        m = [[OCSPCacheKeyMemo alloc] init];
+        m.issuerHashes = issuerHashes;
+        m.key = k;
+        [memo setObject:m forKey:cert];
+    } else {
+        CC_SHA256(der.bytes, (CC_LONG)der.length, k->key);
+    }
+
+    return k;
+}
+
+/// See comment in header
++ (instancetype)keyForCertID:(OCSP_CERTID*)certID {
+    if (certID == NULL || certID->hashAlgorithm == NULL ||
+        OBJ_obj2nid(certID->hashAlgorithm->algorithm) != NID_sha1 ||
+        certID->issuerNameHash == NULL ||
+        certID->issuerNameHash->length != OCSPCacheKeyIssuerHashLength ||
+        certID->issuerKeyHash == NULL ||
+        certID->issuerKeyHash->length != OCSPCacheKeyIssuerHashLength ||
+        certID->serialNumber == NULL) {
+        return nil;
+    }
+
+    uint8_t issuerHashes[2 * OCSPCacheKeyIssuerHashLength];
+    memcpy(issuerHashes, certID->issuerNameHash->data, OCSPCacheKeyIssuerHashLength);
+    memcpy(issuerHashes + OCSPCacheKeyIssuerHashLength,
+           certID->issuerKeyHash->data,
+           OCSPCacheKeyIssuerHashLength);
+
+    // Re-encode the serial number as the contents of a DER INTEGER, which is how it appears in
+    // the certificate
+    int serialLength = i2c_ASN1_INTEGER(certID->serialNumber, NULL);
+    if (serialLength <= 0) {
+        return nil;
+    }
+    NSMutableData *serial = [NSMutableData dataWithLength:serialLength];
+    unsigned char *p = serial.mutableBytes;
+    i2c_ASN1_INTEGER(certID->serialNumber, &p);
+
+    OCSPCacheKey *k = [[OCSPCacheKey alloc] init];
+    [k setIssuerHashes:issuerHashes serial:serial.bytes length:serial.length];
+
+    return k;
+}
+
+/// See comment in header
++ (NSArray<OCSPCacheKey*>*)keysForResponse:(OCSPResponse*)response {
+    NSMutableArray<OCSPCacheKey*>* keys = [[NSMutableArray alloc] init];
+
+    for (OCSPSingleResponse *sr in [response singleResponses]) {
+        OCSPCacheKey *k = [OCSPCacheKey keyForCertID:sr.response->certId];
+        if (k != nil) {
+            [keys addObject:k];
+        }
+    }
+
+    return keys;
+}
+
+/// See comment in header
++ (NSData*)issuerHashesForCertificate:(SecCertificateRef)issuerRef {
+    static NSCache<id, NSData*>* memo;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        memo = [[NSCache alloc] init];
+        memo.countLimit = OCSPCacheKeyIssuerMemoLimit;
+    });
+
+    // SecCertificate equality compares the DER encoding, so distinct certificate objects for the
+    // same certificate share an entry.
+    id issuer = (__bridge id)issuerRef;
+
+    NSData *hashes = [memo objectForKey:issuer];
+    if (hashes != nil) {
+        return hashes;
+    }
+
+    X509 *x = [OCSPOpenSSLBridge secCertRefToX509:issuerRef];
+    if (x == NULL) {
+        return nil;
+    }
+
+    NSMutableData *h = [NSMutableData dataWithLength:2 * OCSPCacheKeyIssuerHashLength];
+    unsigned char *p = h.mutableBytes;
+    unsigned int len = 0;
+
+    // Same hashes as OCSP_cert_to_id
+    BOOL ok = X509_NAME_digest(X509_get_subject_name(x), EVP_sha1(), p, &len) == 1 &&
+              len == OCSPCacheKeyIssuerHashLength &&
+              X509_pubkey_digest(x, EVP_sha1(), p + OCSPCacheKeyIssuerHashLength, &len) == 1 &&
+              len == OCSPCacheKeyIssuerHashLength;
+
+    X509_free(x);
+
+    if (!ok) {
+        return nil;
+    }
+
+    [memo setObject:h forKey:issuer];
+
+    return h;
+}
+
+/// Set the key to the digest of the CertID fields.
+- (void)setIssuerHashes:(const uint8_t*)issuerHashes
+                 serial:(const uint8_t*)serial
+                 length:(size_t)serialLength {
+    CC_SHA256_CTX ctx;
+    CC_SHA256_Init(&ctx);
+    CC_SHA256_Update(&ctx, issuerHashes, 2 * OCSPCacheKeyIssuerHashLength);
+    CC_SHA256_Update(&ctx, serial, (CC_LONG)serialLength);
+    CC_SHA256_Final(self->key, &ctx);
+}
+
+/// See comment in header
++ (instancetype)keyWithBytes:(const uint8_t*)bytes {
+    OCSPCacheKey *k = [[OCSPCacheKey alloc] init];
+    memcpy(k->key, bytes, OCSPCacheKeyLength);
+    return k;
+}
+
+/// See comment in header
++ (instancetype)keyWithData:(NSData*)data {
+    if (data.length != OCSPCacheKeyLength) {
+        return nil;
+    }
+    return [OCSPCacheKey keyWithBytes:data.bytes];
+}
+
+/// See comment in header
++ (instancetype)keyWithBase64String:(NSString*)string {
+    NSData *data = [[NSData alloc] initWithBase64EncodedString:string options:0];
+    if (data == nil) {
+        return nil;
+    }
+    return [OCSPCacheKey keyWithData:data];
+}
+
+- (const uint8_t*)bytes {
+    return self->key;
+}
+
+/// See comment in header
+- (NSData*)data {
+    return [NSData dataWithBytes:self->key length:OCSPCacheKeyLength];
+}
+
+/// See comment in header
+- (NSString*)base64String {
+    return [[self data] base64EncodedStringWithOptions:0];
+}
+
+/// See comment in header
+- (NSComparisonResult)compare:(OCSPCacheKey*)other {
+    int c = memcmp(self->key, other->key, OCSPCacheKeyLength);
+    if (c < 0) {
+        return NSOrderedAscending;
+    } else if (c > 0) {
+        return NSOrderedDescending;
+    }
+    return NSOrderedSame;
+}
+
+#pragma mark - NSObject
+
+- (NSUInteger)hash {
+    // The key is a digest, so any word of it is uniformly distributed
+    NSUInteger h;
+    memcpy(&h, self->key, sizeof(h));
+    return h;
+}
+
+- (BOOL)isEqual:(id)object {
+    if (object == self) {
+        return TRUE;
+    }
+    if (![object isKindOfClass:[OCSPCacheKey class]]) {
+        return FALSE;
+    }
+    return memcmp(self->key, ((OCSPCacheKey*)object)->key, OCSPCacheKeyLength) == 0;
+}
+
+- (NSString*)description {
+    return [self base64String];
+}
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone*)zone {
+    // Immutable
+    return self;
+}
+
+@end
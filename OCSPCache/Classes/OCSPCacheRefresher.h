@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPCacheEntry.h"
+#import "OCSPCacheKey.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Configuration of proactive refreshes.
+@interface OCSPCacheRefreshPolicy : NSObject
+
+/// Fraction of the validity window (thisUpdate to nextUpdate) after which a response is refreshed.
+/// Must be in (0, 1]. Defaults to 0.75.
+@property (assign, nonatomic) double refreshFraction;
+
+/// Maximum random offset applied to the refresh time as a fraction of the validity window. Spreads
+/// out refreshes of responses which were fetched at the same time. Defaults to 0.05.
+@property (assign, nonatomic) double jitterFraction;
+
+/// Maximum number of refreshes in flight at once. Defaults to 2.
+@property (assign, nonatomic) NSUInteger maxConcurrentRefreshes;
+
+/// Timeout in seconds of each refresh. A timeout value of 0 indicates that there should be no
+/// timeout. Defaults to 30.
+@property (assign, nonatomic) NSTimeInterval timeout;
+
++ (instancetype)defaultPolicy;
+
+@end
+
+/// Refresh counters.
+@interface OCSPCacheRefresherMetrics : NSObject
+
+/// Number of certificates being tracked for refresh.
+@property (readonly, assign, nonatomic) NSUInteger tracked;
+
+/// Number of refreshes started.
+@property (readonly, assign, nonatomic) NSUInteger started;
+
+/// Number of refreshes which failed to obtain a new response.
+@property (readonly, assign, nonatomic) NSUInteger failed;
+
+/// Number of certificates which were dropped because they were not looked up since their last
+/// refresh.
+@property (readonly, assign, nonatomic) NSUInteger dropped;
+
+@end
+
+/*!
+ Block which refreshes the OCSP response for a certificate. `completion` must be called once the
+ refresh completes, with the new entry if the refresh succeeded; otherwise nil.
+ */
+typedef void (^OCSPCacheRefreshBlock)(SecCertificateRef cert,
+                                      SecCertificateRef issuer,
+                                      NSURL* __nullable (^__nullable modifyOCSPURL)(NSURL *url),
+                                      NSURLSession *__nullable session,
+                                      NSTimeInterval timeout,
+                                      void (^completion)(OCSPCacheEntry *__nullable entry));
+
+/*!
+ * Schedules background refreshes of cached OCSP responses based on their validity window, so that
+ * lookups hit a fresh response instead of waiting on the network.
+ *
+ * A certificate is only refreshed again if it was looked up since its previous refresh; otherwise
+ * it is no longer tracked. This keeps the refresher from indefinitely refreshing responses which
+ * are not being used.
+ */
+@interface OCSPCacheRefresher : NSObject
+
+- (instancetype)initWithPolicy:(OCSPCacheRefreshPolicy*)policy
+                       refresh:(OCSPCacheRefreshBlock)refresh;
+
+/*!
+ Record a lookup of a certificate. The modifyOCSPURL block and session are retained and used for
+ its refreshes.
+
+ @param entry Entry returned by the lookup, if any. Used to schedule a refresh if none is scheduled.
+ */
+- (void)trackKey:(OCSPCacheKey*)key
+            cert:(SecCertificateRef)cert
+          issuer:(SecCertificateRef)issuer
+   modifyOCSPURL:(NSURL* __nullable (^__nullable)(NSURL *url))modifyOCSPURL
+         session:(NSURLSession*__nullable)session
+           entry:(OCSPCacheEntry*__nullable)entry;
+
+/// Schedule the refresh of a tracked certificate for which a new response was cached. Replaces any
+/// previously scheduled refresh of the certificate.
+- (void)scheduleRefreshForKey:(OCSPCacheKey*)key entry:(OCSPCacheEntry*)entry;
+
+/// Stop tracking the certificate.
+- (void)untrackKey:(OCSPCacheKey*)key;
+
+/// Cancel all scheduled refreshes. Refreshes in flight are allowed to complete.
+- (void)stop;
+
+- (OCSPCacheRefresherMetrics*)metrics;
+
+/// Time at which the response should be refreshed according to the policy. Returns nil if the
+/// entry has no validity window.
++ (NSDate*__nullable)refreshDateForEntry:(OCSPCacheEntry*)entry
+                                  policy:(OCSPCacheRefreshPolicy*)policy;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheRefresher.h"
+
+@implementation OCSPCacheRefreshPolicy
+
+- (instancetype)init {
+    self = [super init];
+
+    if (self) {
+        self.refreshFraction = 0.75;
+        self.jitterFraction = 0.05;
+        self.maxConcurrentRefreshes = 2;
+        self.timeout = 30;
+    }
+
+    return self;
+}
+
++ (instancetype)defaultPolicy {
+    return [[OCSPCacheRefreshPolicy alloc] init];
+}
+
+@end
+
+@interface OCSPCacheRefresherMetrics ()
+
+@property (assign, nonatomic) NSUInteger tracked;
+@property (assign, nonatomic) NSUInteger started;
+@property (assign, nonatomic) NSUInteger failed;
+@property (assign, nonatomic) NSUInteger dropped;
+
+@end
+
+@implementation OCSPCacheRefresherMetrics
+
+- (NSString*)description {
+    return [NSString stringWithFormat:@"tracked: %lu, started: %lu, failed: %lu, dropped: %lu",
+            (unsigned long)self.tracked, (unsigned long)self.started,
+            (unsigned long)self.failed, (unsigned long)self.dropped];
+}
+
+@end
+
+/// Certificate tracked for refresh.
+@interface OCSPCacheRefreshTarget : NSObject
+
+@property (strong, nonatomic) OCSPCacheKey *key;
+@property (strong, nonatomic) id cert;
+@property (strong, nonatomic) id issuer;
+@property (copy, nonatomic) NSURL* (^modifyOCSPURL)(NSURL *url);
+@property (strong, nonatomic) NSURLSession *session;
+
+/// Incremented each time a refresh is scheduled. Used to ignore superseded timers.
+@property (assign, nonatomic) NSUInteger generation;
+@property (assign, nonatomic) BOOL scheduled;
+@property (assign, nonatomic) BOOL refreshing;
+
+/// Set when the certificate is looked up and cleared when a refresh starts.
+@property (assign, nonatomic) BOOL lookedUp;
+
+@end
+
+@implementation OCSPCacheRefreshTarget
+@end
+
+@implementation OCSPCacheRefresher {
+    OCSPCacheRefreshPolicy *policy;
+    OCSPCacheRefreshBlock refresh;
+    dispatch_queue_t queue;
+
+    // Only accessed on `queue`
+    NSMutableDictionary<OCSPCacheKey*, OCSPCacheRefreshTarget*>* targets;
+    NSMutableArray<OCSPCacheRefreshTarget*>* due;
+    NSUInteger inFlight;
+    OCSPCacheRefresherMetrics *metrics;
+}
+
+// See comment in header
+- (instancetype)initWithPolicy:(OCSPCacheRefreshPolicy*)policy
+                       refresh:(OCSPCacheRefreshBlock)refresh {
+    self = [super init];
+
+    if (self) {
+        assert(policy.refreshFraction > 0 && policy.refreshFraction <= 1);
+        assert(policy.maxConcurrentRefreshes > 0);
+        self->policy = policy;
+        self->refresh = refresh;
+        self->queue = dispatch_queue_create("ca.psiphon.OCSPCache.RefreshQueue",
+                                            DISPATCH_QUEUE_SERIAL);
+        self->targets = [[NSMutableDictionary alloc] init];
+        self->due = [[NSMutableArray alloc] init];
+        self->metrics = [[OCSPCacheRefresherMetrics alloc] init];
+    }
+
+    return self;
+}
+
+// See comment in header
+- (void)trackKey:(OCSPCacheKey*)key
+            cert:(SecCertificateRef)cert
+          issuer:(SecCertificateRef)issuer
+   modifyOCSPURL:(NSURL* (^__nullable)(NSURL *url))modifyOCSPURL
+         session:(NSURLSession*__nullable)session
+           entry:(OCSPCacheEntry*__nullable)entry {
+
+    id certObj = (__bridge id)cert;
+    id issuerObj = (__bridge id)issuer;
+
+    dispatch_async(self->queue, ^{
+        OCSPCacheRefreshTarget *target = [self->targets objectForKey:key];
+        if (target == nil) {
+            target = [[OCSPCacheRefreshTarget alloc] init];
+            target.key = key;
+            [self->targets setObject:target forKey:key];
+        }
+
+        target.cert = certObj;
+        target.issuer = issuerObj;
+        target.modifyOCSPURL = modifyOCSPURL;
+        target.session = session;
+        target.lookedUp = TRUE;
+
+        if (entry != nil && !target.scheduled && !target.refreshing) {
+            [self schedule:target entry:entry];
+        }
+    });
+}
+
+// See comment in header
+- (void)scheduleRefreshForKey:(OCSPCacheKey*)key entry:(OCSPCacheEntry*)entry {
+    dispatch_async(self->queue, ^{
+        OCSPCacheRefreshTarget *target = [self->targets objectForKey:key];
+        if (target != nil) {
+            [self schedule:target entry:entry];
+        }
+    });
+}
+
+// See comment in header
+- (void)untrackKey:(OCSPCacheKey*)key {
+    dispatch_async(self->queue, ^{
+        OCSPCacheRefreshTarget *target = [self->targets objectForKey:key];
+        if (target != nil) {
+            [self->targets removeObjectForKey:key];
+            [self->due removeObjectIdenticalTo:target];
+        }
+    });
+}
+
+// See comment in header
+- (void)stop {
+    dispatch_async(self->queue, ^{
+        [self->targets removeAllObjects];
+        [self->due removeAllObjects];
+    });
+}
+
+// See comment in header
+- (OCSPCacheRefresherMetrics*)metrics {
+    OCSPCacheRefresherMetrics *m = [[OCSPCacheRefresherMetrics alloc] init];
+
+    dispatch_sync(self->queue, ^{
+        m.tracked = [self->targets count];
+        m.started = self->metrics.started;
+        m.failed = self->metrics.failed;
+        m.dropped = self->metrics.dropped;
+    });
+
+    return m;
+}
+
+// See comment in header
++ (NSDate*)refreshDateForEntry:(OCSPCacheEntry*)entry
+                        policy:(OCSPCacheRefreshPolicy*)policy {
+    if (entry.thisUpdate == nil || entry.nextUpdate == nil) {
+        return nil;
+    }
+
+    NSTimeInterval window = [entry.nextUpdate timeIntervalSinceDate:entry.thisUpdate];
+    if (window <= 0) {
+        return nil;
+    }
+
+    // Uniform in [-1, 1]
+    double r = ((double)arc4random_uniform(UINT32_MAX) / (double)(UINT32_MAX - 1)) * 2 - 1;
+
+    NSTimeInterval offset = window * policy.refreshFraction + window * policy.jitterFraction * r;
+    offset = MAX(0, MIN(window, offset));
+
+    return [entry.thisUpdate dateByAddingTimeInterval:offset];
+}
+
+#pragma mark - Scheduling (on queue)
+
+- (void)schedule:(OCSPCacheRefreshTarget*)target entry:(OCSPCacheEntry*)entry {
+    NSDate *refreshDate = [OCSPCacheRefresher refreshDateForEntry:entry policy:self->policy];
+    if (refreshDate == nil) {
+        // No validity window to refresh within
+        target.scheduled = FALSE;
+        return;
+    }
+
+    NSTimeInterval delay = MAX(0, [refreshDate timeIntervalSinceNow]);
+
+    target.generation++;
+    target.scheduled = TRUE;
+
+    NSUInteger generation = target.generation;
+    OCSPCacheKey *key = target.key;
+
+    __weak OCSPCacheRefresher *weakSelf = self;
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+                   self->queue, ^{
+        __strong OCSPCacheRefresher *strongSelf = weakSelf;
+        if (!strongSelf) {
+            return;
+        }
+
+        OCSPCacheRefreshTarget *t = [strongSelf->targets objectForKey:key];
+        if (t == nil || t.generation != generation) {
+            // Untracked or superseded
+            return;
+        }
+
+        t.scheduled = FALSE;
+
+        if (!t.lookedUp) {
+            // Not used since the last refresh
+            [strongSelf->targets removeObjectForKey:key];
+            strongSelf->metrics.dropped++;
+            return;
+        }
+
+        [strongSelf->due addObject:t];
+        [strongSelf pump];
+    });
+}
+
+/// Start due refreshes up to the concurrency limit.
+- (void)pump {
+    while (self->inFlight < self->policy.maxConcurrentRefreshes && [self->due count] > 0) {
+        OCSPCacheRefreshTarget *target = [self->due firstObject];
+        [self->due removeObjectAtIndex:0];
+
+        target.lookedUp = FALSE;
+        target.refreshing = TRUE;
+        self->inFlight++;
+        self->metrics.started++;
+
+        __weak OCSPCacheRefresher *weakSelf = self;
+
+        self->refresh((__bridge SecCertificateRef)target.cert,
+                      (__bridge SecCertificateRef)target.issuer,
+                      target.modifyOCSPURL,
+                      target.session,
+                      self->policy.timeout,
+                      ^(OCSPCacheEntry *__nullable entry) {
+            __strong OCSPCacheRefresher *strongSelf = weakSelf;
+            if (!strongSelf) {
+                return;
+            }
+            dispatch_async(strongSelf->queue, ^{
+                strongSelf->inFlight--;
+                target.refreshing = FALSE;
+                if (entry == nil) {
+                    // The next lookup which hits a cached response will reschedule
+                    strongSelf->metrics.failed++;
+                }
+                [strongSelf pump];
+            });
+        });
+    }
+}
+
+@end
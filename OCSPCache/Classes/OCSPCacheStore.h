@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPCacheEntry.h"
+#import "OCSPCacheKey.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Snapshot of the counters kept by a cache store.
+@interface OCSPCacheStoreMetrics : NSObject
+
+/// Number of entries currently in the store.
+@property (readonly, assign, nonatomic) NSUInteger entryCount;
+
+/// Total size in bytes of the OCSP response data currently in the store.
+@property (readonly, assign, nonatomic) NSUInteger byteCount;
+
+/// Number of lookups which returned an entry.
+@property (readonly, assign, nonatomic) NSUInteger hits;
+
+/// Number of lookups which did not return an entry. Includes lookups of expired entries.
+@property (readonly, assign, nonatomic) NSUInteger misses;
+
+/// Number of entries evicted to stay within the entry and byte budgets.
+@property (readonly, assign, nonatomic) NSUInteger capacityEvictions;
+
+/// Number of entries evicted because their nextUpdate had passed.
+@property (readonly, assign, nonatomic) NSUInteger expiryEvictions;
+
+/// Number of entries removed explicitly, e.g. after failing trust evaluation.
+@property (readonly, assign, nonatomic) NSUInteger removals;
+
+- (instancetype)initWithEntryCount:(NSUInteger)entryCount
+                         byteCount:(NSUInteger)byteCount
+                              hits:(NSUInteger)hits
+                            misses:(NSUInteger)misses
+                 capacityEvictions:(NSUInteger)capacityEvictions
+                   expiryEvictions:(NSUInteger)expiryEvictions
+                          removals:(NSUInteger)removals;
+
+@end
+
+/*!
+ * Storage for cached OCSP responses.
+ *
+ * Implementations must be safe to call from multiple threads and must not return entries which
+ * have expired.
+ */
+@protocol OCSPCacheStore <NSObject>
+
+/// Returns the entry for the key or nil if there is no entry or the entry has expired. Expired
+/// entries are evicted.
+- (OCSPCacheEntry*__nullable)entryForKey:(OCSPCacheKey*)key;
+
+/// Add or replace the entry for the key. May evict other entries to stay within budget.
+- (void)setEntry:(OCSPCacheEntry*)entry forKey:(OCSPCacheKey*)key;
+
+/// Remove the entry for the key. Returns TRUE if an entry was removed; otherwise FALSE.
+- (BOOL)removeEntryForKey:(OCSPCacheKey*)key;
+
+/// Evict all entries which have expired at the provided date. Returns the number of entries evicted.
+- (NSUInteger)removeEntriesExpiredAt:(NSDate*)date;
+
+/// Enumerate a snapshot of the entries in the store.
+- (void)enumerateEntriesUsingBlock:(void (^)(OCSPCacheKey *key, OCSPCacheEntry *entry, BOOL *stop))block;
+
+/// Snapshot of the store counters.
+- (OCSPCacheStoreMetrics*)metrics;
+
+@end
+
+/*!
+ * In-memory cache store bounded by a maximum number of entries and a maximum number of bytes of
+ * OCSP response data.
+ *
+ * When the store is over budget entries are evicted with the CLOCK algorithm (an approximation of
+ * LRU which only sets a reference bit on hits). Expired entries are evicted before any unexpired
+ * entry.
+ *
+ * Lookups take a shared read lock and only set the reference bit, so hits run in parallel. Writes,
+ * removals and evictions take the lock exclusively.
+ */
+@interface OCSPMemoryCacheStore : NSObject <OCSPCacheStore>
+
+/// Maximum number of entries. 0 indicates no limit.
+@property (readonly, assign, nonatomic) NSUInteger maxEntries;
+
+/// Maximum number of bytes of OCSP response data. 0 indicates no limit.
+@property (readonly, assign, nonatomic) NSUInteger maxBytes;
+
+/// Initialize with default budgets of 1024 entries and 4 MiB.
+- (instancetype)init;
+
+/// Initialize with the provided budgets. A value of 0 indicates no limit.
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries maxBytes:(NSUInteger)maxBytes;
+
+@end
+
+/*!
+ * Cache store which spreads its entries across several OCSPMemoryCacheStore shards by key, so that
+ * writes to one shard do not block lookups in the others.
+ *
+ * The budgets are split evenly between the shards, and eviction is done within each shard.
+ */
+@interface OCSPShardedCacheStore : NSObject <OCSPCacheStore>
+
+/// Number of shards.
+@property (readonly, assign, nonatomic) NSUInteger shardCount;
+
+/// Initialize with 8 shards and the default budgets of OCSPMemoryCacheStore in total.
+- (instancetype)init;
+
+/// Initialize with the provided number of shards and total budgets. A budget of 0 indicates no
+/// limit.
+- (instancetype)initWithShardCount:(NSUInteger)shardCount
+                        maxEntries:(NSUInteger)maxEntries
+                          maxBytes:(NSUInteger)maxBytes;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPCacheStore.h"
+#import <pthread.h>
+#import <stdatomic.h>
+
+static const NSUInteger OCSPMemoryCacheStoreDefaultMaxEntries = 1024;
+static const NSUInteger OCSPMemoryCacheStoreDefaultMaxBytes = 4 * 1024 * 1024;
+static const NSUInteger OCSPShardedCacheStoreDefaultShardCount = 8;
+
+@implementation OCSPCacheStoreMetrics
+
+- (instancetype)initWithEntryCount:(NSUInteger)entryCount
+                         byteCount:(NSUInteger)byteCount
+                              hits:(NSUInteger)hits
+                            misses:(NSUInteger)misses
+                 capacityEvictions:(NSUInteger)capacityEvictions
+                   expiryEvictions:(NSUInteger)expiryEvictions
+                          removals:(NSUInteger)removals {
+    self = [super init];
+
+    if (self) {
+        self->_entryCount = entryCount;
+        self->_byteCount = byteCount;
+        self->_hits = hits;
+        self->_misses = misses;
+        self->_capacityEvictions = capacityEvictions;
+        self->_expiryEvictions = expiryEvictions;
+        self->_removals = removals;
+    }
+
+    return self;
+}
+
+- (NSString*)description {
+    return [NSString stringWithFormat:@"entries: %lu, bytes: %lu, hits: %lu, misses: %lu, "
+                                       "capacity evictions: %lu, expiry evictions: %lu, "
+                                       "removals: %lu",
+            (unsigned long)self.entryCount, (unsigned long)self.byteCount,
+            (unsigned long)self.hits, (unsigned long)self.misses,
+            (unsigned long)self.capacityEvictions, (unsigned long)self.expiryEvictions,
+            (unsigned long)self.removals];
+}
+
+@end
+
+/// Slot on the clock. Removed slots have a nil entry and are dropped when the hand reaches them.
+@interface OCSPMemoryCacheStoreSlot : NSObject
+
+@property (strong, nonatomic) OCSPCacheKey *key;
+@property (strong, nonatomic) OCSPCacheEntry *entry;
+/// Set by readers holding the read lock, so it must be atomic.
+@property (assign, atomic) BOOL referenced;
+
+@end
+
+@implementation OCSPMemoryCacheStoreSlot
+@end
+
+@implementation OCSPMemoryCacheStore {
+    // Lookups take the read lock so that hits run in parallel. Everything else takes the write
+    // lock.
+    pthread_rwlock_t lock;
+
+    NSMutableDictionary<OCSPCacheKey*, OCSPMemoryCacheStoreSlot*>* slots;
+    NSMutableArray<OCSPMemoryCacheStoreSlot*>* clock;
+    NSUInteger hand;
+    NSUInteger removedSlots;
+
+    NSUInteger byteCount;
+    // Updated by readers holding the read lock.
+    _Atomic(NSUInteger) hits;
+    _Atomic(NSUInteger) misses;
+    NSUInteger capacityEvictions;
+    NSUInteger expiryEvictions;
+    NSUInteger removals;
+}
+
+- (instancetype)init {
+    return [self initWithMaxEntries:OCSPMemoryCacheStoreDefaultMaxEntries
+                           maxBytes:OCSPMemoryCacheStoreDefaultMaxBytes];
+}
+
+// See comment in header
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries maxBytes:(NSUInteger)maxBytes {
+    self = [super init];
+
+    if (self) {
+        self->_maxEntries = maxEntries;
+        self->_maxBytes = maxBytes;
+        self->slots = [[NSMutableDictionary alloc] init];
+        self->clock = [[NSMutableArray alloc] init];
+        pthread_rwlock_init(&self->lock, NULL);
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    pthread_rwlock_destroy(&self->lock);
+}
+
+#pragma mark - OCSPCacheStore implementation
+
+// See comment in header
+- (OCSPCacheEntry*)entryForKey:(OCSPCacheKey*)key {
+    pthread_rwlock_rdlock(&self->lock);
+
+    OCSPMemoryCacheStoreSlot *slot = [self->slots objectForKey:key];
+    OCSPCacheEntry *entry = slot.entry;
+
+    if (slot == nil) {
+        pthread_rwlock_unlock(&self->lock);
+        atomic_fetch_add_explicit(&self->misses, 1, memory_order_relaxed);
+        return nil;
+    }
+
+    if (![entry expiredAt:[NSDate date]]) {
+        slot.referenced = TRUE;
+        pthread_rwlock_unlock(&self->lock);
+        atomic_fetch_add_explicit(&self->hits, 1, memory_order_relaxed);
+        return entry;
+    }
+
+    pthread_rwlock_unlock(&self->lock);
+
+    // Evict the expired entry unless it was replaced after the read lock was released
+    pthread_rwlock_wrlock(&self->lock);
+    if ([self->slots objectForKey:key] == slot && slot.entry == entry) {
+        [self evictSlot:slot];
+        self->expiryEvictions++;
+    }
+    pthread_rwlock_unlock(&self->lock);
+
+    atomic_fetch_add_explicit(&self->misses, 1, memory_order_relaxed);
+
+    return nil;
+}
+
+// See comment in header
+- (void)setEntry:(OCSPCacheEntry*)entry forKey:(OCSPCacheKey*)key {
+    pthread_rwlock_wrlock(&self->lock);
+
+    OCSPMemoryCacheStoreSlot *slot = [self->slots objectForKey:key];
+    if (slot != nil) {
+        self->byteCount -= slot.entry.data.length;
+        slot.entry = entry;
+        slot.referenced = TRUE;
+        self->byteCount += entry.data.length;
+    } else {
+        slot = [[OCSPMemoryCacheStoreSlot alloc] init];
+        slot.key = key;
+        slot.entry = entry;
+        slot.referenced = FALSE;
+
+        // Insert behind the hand so the new entry is the last to be considered for eviction.
+        [self->clock insertObject:slot atIndex:self->hand];
+        self->hand = (self->hand + 1) % [self->clock count];
+        [self->slots setObject:slot forKey:key];
+        self->byteCount += entry.data.length;
+    }
+
+    [self evictToBudget];
+
+    pthread_rwlock_unlock(&self->lock);
+}
+
+// See comment in header
+- (BOOL)removeEntryForKey:(OCSPCacheKey*)key {
+    pthread_rwlock_wrlock(&self->lock);
+
+    OCSPMemoryCacheStoreSlot *slot = [self->slots objectForKey:key];
+    if (slot != nil) {
+        [self evictSlot:slot];
+        self->removals++;
+    }
+
+    pthread_rwlock_unlock(&self->lock);
+
+    return slot != nil;
+}
+
+// See comment in header
+- (NSUInteger)removeEntriesExpiredAt:(NSDate*)date {
+    NSUInteger evicted = 0;
+
+    pthread_rwlock_wrlock(&self->lock);
+
+    for (OCSPMemoryCacheStoreSlot *slot in [self->slots allValues]) {
+        if ([slot.entry expiredAt:date]) {
+            [self evictSlot:slot];
+            evicted++;
+        }
+    }
+
+    self->expiryEvictions += evicted;
+
+    pthread_rwlock_unlock(&self->lock);
+
+    return evicted;
+}
+
+// See comment in header
+- (void)enumerateEntriesUsingBlock:(void (^)(OCSPCacheKey *key,
+                                             OCSPCacheEntry *entry,
+                                             BOOL *stop))block {
+    NSMutableDictionary<OCSPCacheKey*, OCSPCacheEntry*>* snapshot;
+
+    pthread_rwlock_rdlock(&self->lock);
+
+    snapshot = [[NSMutableDictionary alloc] initWithCapacity:[self->slots count]];
+    [self->slots enumerateKeysAndObjectsUsingBlock:^(OCSPCacheKey *key,
+                                                     OCSPMemoryCacheStoreSlot *slot,
+                                                     BOOL *stop) {
+        [snapshot setObject:slot.entry forKey:key];
+    }];
+
+    pthread_rwlock_unlock(&self->lock);
+
+    [snapshot enumerateKeysAndObjectsUsingBlock:block];
+}
+
+// See comment in header
+- (OCSPCacheStoreMetrics*)metrics {
+    pthread_rwlock_rdlock(&self->lock);
+
+    OCSPCacheStoreMetrics *metrics =
+    [[OCSPCacheStoreMetrics alloc] initWithEntryCount:[self->slots count]
+                                            byteCount:self->byteCount
+                                                 hits:atomic_load(&self->hits)
+                                               misses:atomic_load(&self->misses)
+                                    capacityEvictions:self->capacityEvictions
+                                      expiryEvictions:self->expiryEvictions
+                                             removals:self->removals];
+
+    pthread_rwlock_unlock(&self->lock);
+
+    return metrics;
+}
+
+#pragma mark - Eviction
+
+/// Remove the slot from the store. The slot stays on the clock until the hand reaches it.
+/// Must be called with the write lock held.
+- (void)evictSlot:(OCSPMemoryCacheStoreSlot*)slot {
+    self->byteCount -= slot.entry.data.length;
+    [self->slots removeObjectForKey:slot.key];
+    slot.entry = nil;
+    self->removedSlots++;
+
+    // Do not let removed slots dominate the clock.
+    if (self->removedSlots > [self->slots count]) {
+        [self compactClock];
+    }
+}
+
+/// Drop removed slots from the clock. Must be called with the write lock held.
+- (void)compactClock {
+    NSMutableArray<OCSPMemoryCacheStoreSlot*>* compacted =
+    [[NSMutableArray alloc] initWithCapacity:[self->slots count]];
+
+    NSUInteger newHand = 0;
+
+    for (NSUInteger i = 0; i < [self->clock count]; i++) {
+        OCSPMemoryCacheStoreSlot *slot = [self->clock objectAtIndex:i];
+        if (i == self->hand) {
+            newHand = [compacted count];
+        }
+        if (slot.entry != nil) {
+            [compacted addObject:slot];
+        }
+    }
+
+    self->clock = compacted;
+    self->hand = [compacted count] > 0 ? newHand % [compacted count] : 0;
+    self->removedSlots = 0;
+}
+
+- (BOOL)overBudget {
+    if (self->_maxEntries > 0 && [self->slots count] > self->_maxEntries) {
+        return TRUE;
+    }
+    if (self->_maxBytes > 0 && self->byteCount > self->_maxBytes) {
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/// Evict expired entries and then advance the clock hand, evicting entries until the store is
+/// within budget. Must be called with the write lock held.
+- (void)evictToBudget {
+    if (![self overBudget]) {
+        return;
+    }
+
+    NSDate *now = [NSDate date];
+
+    // Expired entries are of no use, so they are always evicted before unexpired entries.
+    for (OCSPMemoryCacheStoreSlot *slot in [self->slots allValues]) {
+        if ([slot.entry expiredAt:now]) {
+            [self evictSlot:slot];
+            self->expiryEvictions++;
+        }
+    }
+
+    while ([self overBudget] && [self->clock count] > 0) {
+        if (self->hand >= [self->clock count]) {
+            self->hand = 0;
+        }
+
+        OCSPMemoryCacheStoreSlot *slot = [self->clock objectAtIndex:self->hand];
+
+        if (slot.entry == nil) {
+            // Previously removed slot
+            [self->clock removeObjectAtIndex:self->hand];
+            self->removedSlots--;
+            continue;
+        }
+
+        if (slot.referenced) {
+            // Second chance
+            slot.referenced = FALSE;
+            self->hand++;
+        } else {
+            [self evictSlot:slot];
+            self->capacityEvictions++;
+        }
+    }
+}
+
+@end
+
+@implementation OCSPShardedCacheStore {
+    NSArray<OCSPMemoryCacheStore*>* shards;
+}
+
+- (instancetype)init {
+    return [self initWithShardCount:OCSPShardedCacheStoreDefaultShardCount
+                         maxEntries:OCSPMemoryCacheStoreDefaultMaxEntries
+                           maxBytes:OCSPMemoryCacheStoreDefaultMaxBytes];
+}
+
+// See comment in header
+- (instancetype)initWithShardCount:(NSUInteger)shardCount
+                        maxEntries:(NSUInteger)maxEntries
+                          maxBytes:(NSUInteger)maxBytes {
+    self = [super init];
+
+    if (self) {
+        if (shardCount == 0) {
+            shardCount = 1;
+        }
+
+        // Round up so that the budgets of the shards add up to at least the total budget
+        NSUInteger shardMaxEntries = (maxEntries + shardCount - 1) / shardCount;
+        NSUInteger shardMaxBytes = (maxBytes + shardCount - 1) / shardCount;
+
+        NSMutableArray<OCSPMemoryCacheStore*>* newShards =
+        [[NSMutableArray alloc] initWithCapacity:shardCount];
+
+        for (NSUInteger i = 0; i < shardCount; i++) {
+            [newShards addObject:[[OCSPMemoryCacheStore alloc] initWithMaxEntries:shardMaxEntries
+                                                                         maxBytes:shardMaxBytes]];
+        }
+
+        self->shards = newShards;
+        self->_shardCount = shardCount;
+    }
+
+    return self;
+}
+
+- (OCSPMemoryCacheStore*)shardForKey:(OCSPCacheKey*)key {
+    // Shard on the last word of the digest rather than on the hash (its first word), so the keys
+    // of a shard are still spread across the buckets of its dictionary.
+    uint32_t h;
+    memcpy(&h, key.bytes + OCSPCacheKeyLength - sizeof(h), sizeof(h));
+    return [self->shards objectAtIndex:h % self->_shardCount];
+}
+
+#pragma mark - OCSPCacheStore implementation
+
+// See comment in header
+- (OCSPCacheEntry*)entryForKey:(OCSPCacheKey*)key {
+    return [[self shardForKey:key] entryForKey:key];
+}
+
+// See comment in header
+- (void)setEntry:(OCSPCacheEntry*)entry forKey:(OCSPCacheKey*)key {
+    [[self shardForKey:key] setEntry:entry forKey:key];
+}
+
+// See comment in header
+- (BOOL)removeEntryForKey:(OCSPCacheKey*)key {
+    return [[self shardForKey:key] removeEntryForKey:key];
+}
+
+// See comment in header
+- (NSUInteger)removeEntriesExpiredAt:(NSDate*)date {
+    NSUInteger evicted = 0;
+
+    for (OCSPMemoryCacheStore *shard in self->shards) {
+        evicted += [shard removeEntriesExpiredAt:date];
+    }
+
+    return evicted;
+}
+
+// See comment in header
+- (void)enumerateEntriesUsingBlock:(void (^)(OCSPCacheKey *key,
+                                             OCSPCacheEntry *entry,
+                                             BOOL *stop))block {
+    __block BOOL stopped = FALSE;
+
+    for (OCSPMemoryCacheStore *shard in self->shards) {
+        [shard enumerateEntriesUsingBlock:^(OCSPCacheKey *key, OCSPCacheEntry *entry, BOOL *stop) {
+            block(key, entry, &stopped);
+            *stop = stopped;
+        }];
+        if (stopped) {
+            break;
+        }
+    }
+}
+
+// See comment in header
+- (OCSPCacheStoreMetrics*)metrics {
+    NSUInteger entryCount = 0, byteCount = 0, hits = 0, misses = 0;
+    NSUInteger capacityEvictions = 0, expiryEvictions = 0, removals = 0;
+
+    for (OCSPMemoryCacheStore *shard in self->shards) {
+        OCSPCacheStoreMetrics *m = [shard metrics];
+        entryCount += m.entryCount;
+        byteCount += m.byteCount;
+        hits += m.hits;
+        misses += m.misses;
+        capacityEvictions += m.capacityEvictions;
+        expiryEvictions += m.expiryEvictions;
+        removals += m.removals;
+    }
+
+    return [[OCSPCacheStoreMetrics alloc] initWithEntryCount:entryCount
+                                                   byteCount:byteCount
+                                                        hits:hits
+                                                      misses:misses
+                                           capacityEvictions:capacityEvictions
+                                             expiryEvictions:expiryEvictions
+                                                    removals:removals];
+}
+
+@end
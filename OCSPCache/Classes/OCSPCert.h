@@ -88,6 +88,21 @@ typedef NS_ERROR_ENUM(OCSPCertErrorDomain, OCSPCertErrorCode) {
                               withIssuerCertRef:(SecCertificateRef)issuerCertRef
                                           error:(NSError**)error;
 
+/// Return data required for an OCSP request using the POST method which asks for the status of
+/// several certificates at once.
+///
+/// The request contains one CertID per certificate in its requestList, in the order provided. See
+/// https://tools.ietf.org/html/rfc6960#section-4.1.1. Responders are not required to answer for
+/// every CertID, so callers should check the response for each certificate.
+///
+/// @param secCertRefs Target certificates (SecCertificateRef).
+/// @param issuerCertRefs Issuer certificates (SecCertificateRef) of the target certificates at the
+/// same index.
+/// @param error Any error encountered when trying to construct the OCSP request data. If set, the return value should be ignored.
++ (NSData*)ocspDataForPostRequestFromSecCertRefs:(NSArray*)secCertRefs
+                              withIssuerCertRefs:(NSArray*)issuerCertRefs
+                                           error:(NSError**)error;
+
 @end
 
 NS_ASSUME_NONNULL_END
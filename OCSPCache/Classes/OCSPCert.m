@@ -149,54 +149,32 @@ NSErrorDomain _Nonnull const OCSPCertErrorDomain = @"OCSPCertErrorDomain";
                               withIssuerCertRef:(SecCertificateRef)issuerCertRef
                                           error:(NSError**)error {
 
-    NSMutableArray <void(^)(void)> *cleanup = [[NSMutableArray alloc] init];
+    return [OCSPCert ocspDataForPostRequestFromSecCertRefs:@[(__bridge id)secCertRef]
+                                        withIssuerCertRefs:@[(__bridge id)issuerCertRef]
+                                                     error:error];
+}
 
-    X509 *leaf = [OCSPOpenSSLBridge secCertRefToX509:secCertRef];
-    if (leaf == NULL) {
-        *error = [NSError errorWithDomain:OCSPCertErrorDomain
-                                     code:OCSPCertErrorCodeSecCertToX509Failed
-                                 userInfo:@{NSLocalizedDescriptionKey:@"Failed to convert leaf "
-                                            "cert to OpenSSL X509 "
-                                            "object"}];
-        return nil;
-    }
+/// See comment in header
++ (NSData*)ocspDataForPostRequestFromSecCertRefs:(NSArray*)secCertRefs
+                              withIssuerCertRefs:(NSArray*)issuerCertRefs
+                                           error:(NSError**)error {
 
-    [cleanup addObject:^(){
-        X509_free(leaf);
-    }];
+    NSMutableArray <void(^)(void)> *cleanup = [[NSMutableArray alloc] init];
 
-    X509 *issuer = [OCSPOpenSSLBridge secCertRefToX509:issuerCertRef];
-    if (issuer == NULL) {
+    if ([secCertRefs count] == 0 || [secCertRefs count] != [issuerCertRefs count]) {
         *error = [NSError errorWithDomain:OCSPCertErrorDomain
-                                     code:OCSPCertErrorCodeSecCertToX509Failed
-                                 userInfo:@{NSLocalizedDescriptionKey:@"Failed to convert issuer "
-                                            "cert to OpenSSL X509 "
-                                            "object"}];
-        [OCSPCert execCleanupTasks:cleanup];
+                                     code:OCSPCertErrorCodeUnknown
+                                 userInfo:@{NSLocalizedDescriptionKey:@"Expected an issuer for "
+                                            "each cert"}];
         return nil;
     }
 
-    [cleanup addObject:^(){
-        X509_free(issuer);
-    }];
-
     const EVP_MD *cert_id_md = EVP_sha1();
     if (cert_id_md == NULL) {
         *error = [NSError errorWithDomain:OCSPCertErrorDomain
                                      code:OCSPCertErrorCodeEVPAllocFailed
                                  userInfo:@{NSLocalizedDescriptionKey:@"Failed to allocate new EVP "
                                             "sha1"}];
-        [OCSPCert execCleanupTasks:cleanup];
-        return nil;
-    }
-
-    OCSP_CERTID *id_t = OCSP_cert_to_id(cert_id_md, leaf, issuer);
-    if (id_t == NULL) {
-        *error = [NSError errorWithDomain:OCSPCertErrorDomain
-                                     code:OCSPCertErrorCodeCertToIdFailed
-                                 userInfo:@{NSLocalizedDescriptionKey:@"Failed to create "
-                                            "OCSP_CERTID structure"}];
-        [OCSPCert execCleanupTasks:cleanup];
         return nil;
     }
 
@@ -206,7 +184,6 @@ NSErrorDomain _Nonnull const OCSPCertErrorDomain = @"OCSPCertErrorDomain";
                                      code:OCSPCertErrorCodeReqAllocFailed
                                  userInfo:@{NSLocalizedDescriptionKey:@"Failed to allocate new "
                                             "OCSP request"}];
-        [OCSPCert execCleanupTasks:cleanup];
         return nil;
     }
 
@@ -214,13 +191,63 @@ NSErrorDomain _Nonnull const OCSPCertErrorDomain = @"OCSPCertErrorDomain";
         OCSP_REQUEST_free(req);
     }];
 
-    if (OCSP_request_add0_id(req, id_t) == NULL) {
-        *error = [NSError errorWithDomain:OCSPCertErrorDomain
-                                     code:OCSPCertErrorCodeAddCertsToReqFailed
-                                 userInfo:@{NSLocalizedDescriptionKey:@"Failed to add certs to "
-                                            "OCSP request"}];
-        [OCSPCert execCleanupTasks:cleanup];
-        return nil;
+    // One CertID per certificate in the requestList. See
+    // https://tools.ietf.org/html/rfc6960#section-4.1.1
+    for (NSUInteger i = 0; i < [secCertRefs count]; i++) {
+        SecCertificateRef secCertRef = (__bridge SecCertificateRef)[secCertRefs objectAtIndex:i];
+        SecCertificateRef issuerCertRef =
+            (__bridge SecCertificateRef)[issuerCertRefs objectAtIndex:i];
+
+        X509 *leaf = [OCSPOpenSSLBridge secCertRefToX509:secCertRef];
+        if (leaf == NULL) {
+            *error = [NSError errorWithDomain:OCSPCertErrorDomain
+                                         code:OCSPCertErrorCodeSecCertToX509Failed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to convert leaf "
+                                                "cert to OpenSSL X509 "
+                                                "object"}];
+            [OCSPCert execCleanupTasks:cleanup];
+            return nil;
+        }
+
+        [cleanup addObject:^(){
+            X509_free(leaf);
+        }];
+
+        X509 *issuer = [OCSPOpenSSLBridge secCertRefToX509:issuerCertRef];
+        if (issuer == NULL) {
+            *error = [NSError errorWithDomain:OCSPCertErrorDomain
+                                         code:OCSPCertErrorCodeSecCertToX509Failed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to convert issuer "
+                                                "cert to OpenSSL X509 "
+                                                "object"}];
+            [OCSPCert execCleanupTasks:cleanup];
+            return nil;
+        }
+
+        [cleanup addObject:^(){
+            X509_free(issuer);
+        }];
+
+        OCSP_CERTID *id_t = OCSP_cert_to_id(cert_id_md, leaf, issuer);
+        if (id_t == NULL) {
+            *error = [NSError errorWithDomain:OCSPCertErrorDomain
+                                         code:OCSPCertErrorCodeCertToIdFailed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to create "
+                                                "OCSP_CERTID structure"}];
+            [OCSPCert execCleanupTasks:cleanup];
+            return nil;
+        }
+
+        // On success the request takes ownership of the CertID
+        if (OCSP_request_add0_id(req, id_t) == NULL) {
+            OCSP_CERTID_free(id_t);
+            *error = [NSError errorWithDomain:OCSPCertErrorDomain
+                                         code:OCSPCertErrorCodeAddCertsToReqFailed
+                                     userInfo:@{NSLocalizedDescriptionKey:@"Failed to add certs to "
+                                                "OCSP request"}];
+            [OCSPCert execCleanupTasks:cleanup];
+            return nil;
+        }
     }
 
     unsigned char *ocspReq = NULL;
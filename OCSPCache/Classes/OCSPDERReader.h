@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Bytes within DER encoded data. Empty, with NULL bytes, if the element is absent.
+typedef struct {
+    const uint8_t *__nullable bytes;
+    size_t length;
+} OCSPDERSlice;
+
+/// Status of the certificate in a single response:
+/// https://tools.ietf.org/html/rfc6960#section-4.2.1
+typedef NS_ENUM(NSInteger, OCSPDERCertStatus) {
+    OCSPDERCertStatusGood = 0,
+    OCSPDERCertStatusRevoked = 1,
+    OCSPDERCertStatusUnknown = 2,
+};
+
+/// Fields of a SingleResponse. Slices are the contents octets of the elements.
+typedef struct {
+    /// OID of the hash algorithm of the CertID.
+    OCSPDERSlice hashAlgorithm;
+    OCSPDERSlice issuerNameHash;
+    OCSPDERSlice issuerKeyHash;
+    /// Serial number INTEGER, as it appears in the certificate.
+    OCSPDERSlice serialNumber;
+    OCSPDERCertStatus certStatus;
+    /// GeneralizedTime. Empty unless the certificate is revoked.
+    OCSPDERSlice revocationTime;
+    /// GeneralizedTime.
+    OCSPDERSlice thisUpdate;
+    /// GeneralizedTime. Empty if the response does not specify a nextUpdate.
+    OCSPDERSlice nextUpdate;
+} OCSPDERSingleResponse;
+
+/// Fields of an OCSPResponse. Slices are the contents octets of the elements.
+typedef struct {
+    /// OCSPResponseStatus, e.g. OCSP_RESPONSE_STATUS_SUCCESSFUL.
+    int status;
+    /// GeneralizedTime. Empty if the response has no basic response.
+    OCSPDERSlice producedAt;
+    /// Contents of the SEQUENCE OF SingleResponse. Empty if the response has no basic response.
+    OCSPDERSlice responses;
+} OCSPDERResponse;
+
+/*!
+ * Read-only walker over DER encoded OCSP responses.
+ *
+ * Reads the response status, producedAt and the CertID, certStatus and times of each single
+ * response in place, without decoding the response with OpenSSL or allocating. The bytes must
+ * outlive the structures filled in, which point into them. This suits reading responses straight
+ * from a mapped OCSPCacheFile.
+ *
+ * The signature, responder ID, certificates and extensions are not read. Verifying a response still
+ * requires decoding it with OpenSSL, see OCSPResponse.
+ */
+@interface OCSPDERReader : NSObject
+
+/// Read the response. Returns FALSE if the bytes are not a DER encoded OCSP response or any of its
+/// single responses is malformed. Responses which are not successful have no basic response, in
+/// which case only the status is set.
++ (BOOL)readResponse:(const uint8_t*)bytes
+              length:(size_t)length
+            response:(OCSPDERResponse*)response;
+
+/// Read the next single response of a response read with readResponse:length:response:. `cursor`
+/// starts as the `responses` slice of the response and is advanced past the single response.
+/// Returns FALSE once there are no more single responses.
++ (BOOL)nextSingleResponse:(OCSPDERSingleResponse*)singleResponse
+                    cursor:(OCSPDERSlice*)cursor;
+
+/// Earliest nextUpdate of the single responses of the response data, in seconds since the epoch.
+/// Returns FALSE if the data cannot be read, has no single responses or none of them specify a
+/// nextUpdate.
++ (BOOL)earliestNextUpdate:(NSTimeInterval*)nextUpdate ofResponseData:(NSData*)data;
+
+@end
+
+NS_ASSUME_NONNULL_END
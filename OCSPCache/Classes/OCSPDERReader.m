@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPDERReader.h"
+#import "OCSPGeneralizedTime.h"
+
+/// DER encoding of id-pkix-ocsp-basic (1.3.6.1.5.5.7.48.1.1), the only response type.
+static const uint8_t OCSPDERBasicResponseOID[] = {
+    0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x01, 0x01
+};
+
+/// Read the DER element at the start of `in`, which must have the provided tag, and advance `in`
+/// past it. `contents` is set to the contents octets of the element.
+static BOOL OCSPDERReadElement(OCSPDERSlice *in, uint8_t tag, OCSPDERSlice *contents) {
+    const uint8_t *p = in->bytes;
+    size_t length = in->length;
+
+    if (length < 2 || p[0] != tag) {
+        return FALSE;
+    }
+
+    size_t o = 2;
+    size_t l = p[1];
+    if (l & 0x80) {
+        // Long form. The indefinite form (0x80) is not allowed in DER.
+        size_t n = l & 0x7f;
+        if (n == 0 || n > sizeof(uint32_t) || n > length - o) {
+            return FALSE;
+        }
+        l = 0;
+        for (size_t i = 0; i < n; i++) {
+            l = (l << 8) | p[o++];
+        }
+    }
+
+    if (l > length - o) {
+        return FALSE;
+    }
+
+    contents->bytes = p + o;
+    contents->length = l;
+
+    in->bytes = p + o + l;
+    in->length = length - o - l;
+
+    return TRUE;
+}
+
+/// Returns TRUE if the next element of `in` has the provided tag.
+static inline BOOL OCSPDERPeekTag(const OCSPDERSlice *in, uint8_t tag) {
+    return in->length > 0 && in->bytes[0] == tag;
+}
+
+/// Read the SingleResponse at the start of `in` and advance `in` past it.
+/// @code
+/// SingleResponse ::= SEQUENCE {
+///    certID                  CertID,
+///    certStatus              CertStatus,
+///    thisUpdate              GeneralizedTime,
+///    nextUpdate          [0] EXPLICIT GeneralizedTime OPTIONAL,
+///    singleExtensions    [1] EXPLICIT Extensions OPTIONAL }
+/// CertID ::= SEQUENCE {
+///    hashAlgorithm           AlgorithmIdentifier,
+///    issuerNameHash          OCTET STRING,
+///    issuerKeyHash           OCTET STRING,
+///    serialNumber            CertificateSerialNumber }
+/// CertStatus ::= CHOICE {
+///    good                [0] IMPLICIT NULL,
+///    revoked             [1] IMPLICIT RevokedInfo,
+///    unknown             [2] IMPLICIT UnknownInfo }
+/// @endcode
+static BOOL OCSPDERReadSingleResponse(OCSPDERSlice *in, OCSPDERSingleResponse *out) {
+    OCSPDERSlice single, certID, algorithm, status, tagged;
+
+    memset(out, 0, sizeof(*out));
+
+    if (!OCSPDERReadElement(in, 0x30, &single) ||
+        !OCSPDERReadElement(&single, 0x30, &certID) ||
+        !OCSPDERReadElement(&certID, 0x30, &algorithm) ||
+        !OCSPDERReadElement(&algorithm, 0x06, &out->hashAlgorithm) ||
+        !OCSPDERReadElement(&certID, 0x04, &out->issuerNameHash) ||
+        !OCSPDERReadElement(&certID, 0x04, &out->issuerKeyHash) ||
+        !OCSPDERReadElement(&certID, 0x02, &out->serialNumber) ||
+        out->serialNumber.length == 0) {
+        return FALSE;
+    }
+
+    if (OCSPDERReadElement(&single, 0x80, &status)) {
+        out->certStatus = OCSPDERCertStatusGood;
+        if (status.length != 0) {
+            return FALSE;
+        }
+    } else if (OCSPDERReadElement(&single, 0xa1, &status)) {
+        out->certStatus = OCSPDERCertStatusRevoked;
+        if (!OCSPDERReadElement(&status, 0x18, &out->revocationTime)) {
+            return FALSE;
+        }
+    } else if (OCSPDERReadElement(&single, 0x82, &status)) {
+        out->certStatus = OCSPDERCertStatusUnknown;
+        if (status.length != 0) {
+            return FALSE;
+        }
+    } else {
+        return FALSE;
+    }
+
+    if (!OCSPDERReadElement(&single, 0x18, &out->thisUpdate)) {
+        return FALSE;
+    }
+
+    if (OCSPDERPeekTag(&single, 0xa0)) {
+        if (!OCSPDERReadElement(&single, 0xa0, &tagged) ||
+            !OCSPDERReadElement(&tagged, 0x18, &out->nextUpdate)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+@implementation OCSPDERReader
+
+// See comment in header
+//
+// @code
+// OCSPResponse ::= SEQUENCE {
+//    responseStatus          OCSPResponseStatus,
+//    responseBytes       [0] EXPLICIT ResponseBytes OPTIONAL }
+// ResponseBytes ::= SEQUENCE {
+//    responseType            OBJECT IDENTIFIER,
+//    response                OCTET STRING }
+// BasicOCSPResponse ::= SEQUENCE {
+//    tbsResponseData         ResponseData,
+//    ... }
+// ResponseData ::= SEQUENCE {
+//    version             [0] EXPLICIT Version DEFAULT v1,
+//    responderID             ResponderID,
+//    producedAt              GeneralizedTime,
+//    responses               SEQUENCE OF SingleResponse,
+//    responseExtensions  [1] EXPLICIT Extensions OPTIONAL }
+// @endcode
++ (BOOL)readResponse:(const uint8_t*)bytes
+              length:(size_t)length
+            response:(OCSPDERResponse*)response {
+
+    memset(response, 0, sizeof(*response));
+
+    if (bytes == NULL) {
+        return FALSE;
+    }
+
+    OCSPDERSlice in = {bytes, length};
+    OCSPDERSlice r, status;
+
+    if (!OCSPDERReadElement(&in, 0x30, &r) || in.length != 0 ||
+        !OCSPDERReadElement(&r, 0x0a, &status) || status.length != 1) {
+        return FALSE;
+    }
+
+    // ENUMERATED is a two's complement integer
+    response->status = (int8_t)status.bytes[0];
+
+    if (r.length == 0) {
+        return TRUE;
+    }
+
+    OCSPDERSlice tagged, responseBytes, type, basic, basicResponse, tbs, version, responderID;
+
+    if (!OCSPDERReadElement(&r, 0xa0, &tagged) ||
+        !OCSPDERReadElement(&tagged, 0x30, &responseBytes) ||
+        !OCSPDERReadElement(&responseBytes, 0x06, &type) ||
+        type.length != sizeof(OCSPDERBasicResponseOID) ||
+        memcmp(type.bytes, OCSPDERBasicResponseOID, sizeof(OCSPDERBasicResponseOID)) != 0 ||
+        !OCSPDERReadElement(&responseBytes, 0x04, &basic) ||
+        !OCSPDERReadElement(&basic, 0x30, &basicResponse) ||
+        !OCSPDERReadElement(&basicResponse, 0x30, &tbs)) {
+        return FALSE;
+    }
+
+    if (OCSPDERPeekTag(&tbs, 0xa0) && !OCSPDERReadElement(&tbs, 0xa0, &version)) {
+        return FALSE;
+    }
+
+    // ResponderID is a choice of [1] Name or [2] KeyHash
+    if (!OCSPDERReadElement(&tbs, 0xa1, &responderID) &&
+        !OCSPDERReadElement(&tbs, 0xa2, &responderID)) {
+        return FALSE;
+    }
+
+    if (!OCSPDERReadElement(&tbs, 0x18, &response->producedAt) ||
+        !OCSPDERReadElement(&tbs, 0x30, &response->responses)) {
+        return FALSE;
+    }
+
+    // Validate the single responses up front, so that reading them cannot fail
+    OCSPDERSlice cursor = response->responses;
+    OCSPDERSingleResponse single;
+    while (cursor.length > 0) {
+        if (!OCSPDERReadSingleResponse(&cursor, &single)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// See comment in header
++ (BOOL)nextSingleResponse:(OCSPDERSingleResponse*)singleResponse
+                    cursor:(OCSPDERSlice*)cursor {
+    if (cursor->length == 0) {
+        return FALSE;
+    }
+
+    if (!OCSPDERReadSingleResponse(cursor, singleResponse)) {
+        cursor->length = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// See comment in header
++ (BOOL)earliestNextUpdate:(NSTimeInterval*)nextUpdate ofResponseData:(NSData*)data {
+    OCSPDERResponse response;
+    if (![OCSPDERReader readResponse:data.bytes length:data.length response:&response]) {
+        return FALSE;
+    }
+
+    BOOL found = FALSE;
+    NSTimeInterval earliest = 0;
+
+    OCSPDERSlice cursor = response.responses;
+    OCSPDERSingleResponse single;
+    while ([OCSPDERReader nextSingleResponse:&single cursor:&cursor]) {
+        // Like OCSPResponse, a response with a time which cannot be decoded has no validity window
+        NSTimeInterval t, n;
+        if (![OCSPGeneralizedTime decodeBytes:single.thisUpdate.bytes
+                                       length:single.thisUpdate.length
+                                      seconds:&t]) {
+            return FALSE;
+        }
+        if (single.nextUpdate.bytes == NULL) {
+            continue;
+        }
+        if (![OCSPGeneralizedTime decodeBytes:single.nextUpdate.bytes
+                                       length:single.nextUpdate.length
+                                      seconds:&n]) {
+            return FALSE;
+        }
+        if (!found || n < earliest) {
+            earliest = n;
+            found = TRUE;
+        }
+    }
+
+    if (found) {
+        *nextUpdate = earliest;
+    }
+
+    return found;
+}
+
+@end
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Snapshot of the counters kept by an expiring table.
+@interface OCSPExpiringTableMetrics : NSObject
+
+/// Number of entries currently in the table, including ones which have expired but were not
+/// evicted yet.
+@property (readonly, assign, nonatomic) NSUInteger entryCount;
+
+/// Number of lookups which found an unexpired entry.
+@property (readonly, assign, nonatomic) NSUInteger hits;
+
+/// Number of lookups which did not find an entry. Includes lookups of expired entries.
+@property (readonly, assign, nonatomic) NSUInteger misses;
+
+/// Number of entries added.
+@property (readonly, assign, nonatomic) NSUInteger insertions;
+
+/// Number of entries evicted because they had expired, or to stay within the entry budget.
+@property (readonly, assign, nonatomic) NSUInteger evictions;
+
+/// Number of entries removed by the owner of the table.
+@property (readonly, assign, nonatomic) NSUInteger removals;
+
+@end
+
+/*!
+ * Bounded dictionary whose entries each expire at their own time, for small caches which hold
+ * entries for a fixed time rather than until they are evicted under memory pressure.
+ *
+ * Expired entries are evicted when they are looked up, or when room is needed for a new entry. If
+ * none has expired, the entry closest to expiry is evicted.
+ *
+ * Thread safe.
+ */
+@interface OCSPExpiringTable<KeyType, ObjectType> : NSObject
+
+/// Maximum number of entries. If 0, entries are not added.
+@property (readonly, assign, nonatomic) NSUInteger maxEntries;
+
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries;
+
+/// Returns the object for the key or nil if there is none or it has expired. Expired entries are
+/// evicted.
+- (ObjectType __nullable)objectForKey:(KeyType)key;
+
+/// Add the object for the key until `expiry`. Replaces any entry for the key.
+- (void)setObject:(ObjectType)object forKey:(KeyType)key expiry:(NSDate*)expiry;
+
+/// Remove the entry for the key, if any.
+- (void)removeObjectForKey:(KeyType)key;
+
+/// Remove all the entries.
+- (void)removeAllObjects;
+
+/// Snapshot of the counters, as an instance of the provided subclass of OCSPExpiringTableMetrics.
+- (__kindof OCSPExpiringTableMetrics*)metricsOfClass:(Class)metricsClass;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPExpiringTable.h"
+
+@interface OCSPExpiringTableMetrics ()
+
+@property (assign, nonatomic) NSUInteger entryCount;
+@property (assign, nonatomic) NSUInteger hits;
+@property (assign, nonatomic) NSUInteger misses;
+@property (assign, nonatomic) NSUInteger insertions;
+@property (assign, nonatomic) NSUInteger evictions;
+@property (assign, nonatomic) NSUInteger removals;
+
+@end
+
+@implementation OCSPExpiringTableMetrics
+
+- (NSString*)description {
+    return [NSString stringWithFormat:@"entries: %lu, hits: %lu, misses: %lu, insertions: %lu, "
+                                       "evictions: %lu, removals: %lu",
+            (unsigned long)self.entryCount, (unsigned long)self.hits, (unsigned long)self.misses,
+            (unsigned long)self.insertions, (unsigned long)self.evictions,
+            (unsigned long)self.removals];
+}
+
+@end
+
+/// Entry of the table.
+@interface OCSPExpiringTableEntry : NSObject
+
+@property (strong, nonatomic) id object;
+@property (strong, nonatomic) NSDate *expiry;
+
+@end
+
+@implementation OCSPExpiringTableEntry
+@end
+
+@implementation OCSPExpiringTable {
+    // Guarded by synchronizing on self
+    NSMutableDictionary<id, OCSPExpiringTableEntry*>* entries;
+    OCSPExpiringTableMetrics *counters;
+}
+
+// See comment in header
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries {
+    self = [super init];
+
+    if (self) {
+        self->_maxEntries = maxEntries;
+        self->entries = [[NSMutableDictionary alloc] init];
+        self->counters = [[OCSPExpiringTableMetrics alloc] init];
+    }
+
+    return self;
+}
+
+// See comment in header
+- (id)objectForKey:(id)key {
+    @synchronized (self) {
+        OCSPExpiringTableEntry *entry = [self->entries objectForKey:key];
+
+        if (entry != nil && [entry.expiry timeIntervalSinceNow] <= 0) {
+            [self->entries removeObjectForKey:key];
+            self->counters.evictions++;
+            entry = nil;
+        }
+
+        if (entry == nil) {
+            self->counters.misses++;
+            return nil;
+        }
+
+        self->counters.hits++;
+        return entry.object;
+    }
+}
+
+// See comment in header
+- (void)setObject:(id)object forKey:(id)key expiry:(NSDate*)expiry {
+    @synchronized (self) {
+        if (self.maxEntries == 0) {
+            return;
+        }
+
+        if ([self->entries objectForKey:key] == nil &&
+            [self->entries count] >= self.maxEntries) {
+            [self evictForInsertion];
+        }
+
+        OCSPExpiringTableEntry *entry = [[OCSPExpiringTableEntry alloc] init];
+        entry.object = object;
+        entry.expiry = expiry;
+        [self->entries setObject:entry forKey:key];
+        self->counters.insertions++;
+    }
+}
+
+/// Make room for an entry by evicting the expired entries, or the entry closest to expiry if none
+/// has expired. Must be synchronized on self.
+- (void)evictForInsertion {
+    NSDate *now = [NSDate date];
+    id earliestKey = nil;
+    NSDate *earliestExpiry = nil;
+    NSMutableArray *expired = [[NSMutableArray alloc] init];
+
+    for (id key in self->entries) {
+        NSDate *expiry = [self->entries objectForKey:key].expiry;
+        if ([expiry compare:now] != NSOrderedDescending) {
+            [expired addObject:key];
+        } else if (earliestExpiry == nil || [expiry compare:earliestExpiry] == NSOrderedAscending) {
+            earliestKey = key;
+            earliestExpiry = expiry;
+        }
+    }
+
+    if ([expired count] == 0 && earliestKey != nil) {
+        [expired addObject:earliestKey];
+    }
+
+    [self->entries removeObjectsForKeys:expired];
+    self->counters.evictions += [expired count];
+}
+
+// See comment in header
+- (void)removeObjectForKey:(id)key {
+    @synchronized (self) {
+        if ([self->entries objectForKey:key] != nil) {
+            [self->entries removeObjectForKey:key];
+            self->counters.removals++;
+        }
+    }
+}
+
+// See comment in header
+- (void)removeAllObjects {
+    @synchronized (self) {
+        self->counters.removals += [self->entries count];
+        [self->entries removeAllObjects];
+    }
+}
+
+// See comment in header
+- (OCSPExpiringTableMetrics*)metricsOfClass:(Class)metricsClass {
+    assert([metricsClass isSubclassOfClass:[OCSPExpiringTableMetrics class]]);
+
+    OCSPExpiringTableMetrics *m = [[metricsClass alloc] init];
+
+    @synchronized (self) {
+        m.entryCount = [self->entries count];
+        m.hits = self->counters.hits;
+        m.misses = self->counters.misses;
+        m.insertions = self->counters.insertions;
+        m.evictions = self->counters.evictions;
+        m.removals = self->counters.removals;
+    }
+
+    return m;
+}
+
+@end
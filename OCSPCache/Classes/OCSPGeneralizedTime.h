@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <openssl/asn1.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/*!
+ * Decoder for the times in OCSP responses.
+ *
+ * thisUpdate, nextUpdate and producedAt are GeneralizedTime:
+ * https://tools.ietf.org/html/rfc6960#section-4.2.1 and
+ * https://tools.ietf.org/html/rfc5280#section-4.1.2.5.2
+ *
+ * Both YYYYMMDDHHMMSS and YYMMDDHHMMSS are accepted, the latter being the UTCTime form which
+ * OpenSSL also allows for ASN1_TIME. The seconds may have a fractional part, and the time must end
+ * with "Z" or an offset from UTC of the form +HHMM or -HHMM. Two digit years are interpreted as in
+ * RFC 5280: 50 to 99 are 1950 to 1999 and 00 to 49 are 2000 to 2049.
+ *
+ * Decoding reads the bytes in place and does not allocate, unlike NSDateFormatter.
+ */
+@interface OCSPGeneralizedTime : NSObject
+
+/// Decode the time into seconds since 1970-01-01T00:00:00Z. Returns FALSE if the bytes are not a
+/// valid time, in which case `seconds` is not modified.
++ (BOOL)decodeBytes:(const unsigned char*)bytes
+             length:(size_t)length
+            seconds:(NSTimeInterval*)seconds;
+
+/// Decode the time. Returns nil if it is not a valid time.
++ (NSDate*__nullable)dateFromASN1Time:(const ASN1_TIME*)time;
+
+@end
+
+NS_ASSUME_NONNULL_END
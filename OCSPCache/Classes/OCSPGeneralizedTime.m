@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPGeneralizedTime.h"
+
+/// Read `n` decimal digits. Returns -1 if any of the bytes is not a digit.
+static inline int readDigits(const unsigned char *p, size_t n) {
+    int v = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+static inline BOOL isLeapYear(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static inline int daysInMonth(int year, int month) {
+    static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return month == 2 && isLeapYear(year) ? 29 : days[month - 1];
+}
+
+/// Days since 1970-01-01 of the date in the proleptic Gregorian calendar:
+/// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+static inline long daysFromCivil(int year, int month, int day) {
+    year -= month <= 2;
+    const long era = (year >= 0 ? year : year - 399) / 400;
+    const long yoe = year - era * 400;
+    const long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+@implementation OCSPGeneralizedTime
+
+// See comment in header
++ (BOOL)decodeBytes:(const unsigned char*)bytes
+             length:(size_t)length
+            seconds:(NSTimeInterval*)seconds {
+
+    if (bytes == NULL) {
+        return FALSE;
+    }
+
+    // The year is the digits which precede MMDDHHMMSS
+    size_t yearDigits = 0;
+    while (yearDigits < length && bytes[yearDigits] >= '0' && bytes[yearDigits] <= '9') {
+        yearDigits++;
+    }
+    if (yearDigits == 14) {
+        yearDigits = 4;
+    } else if (yearDigits == 12) {
+        yearDigits = 2;
+    } else {
+        return FALSE;
+    }
+
+    const unsigned char *p = bytes;
+    const unsigned char *end = bytes + length;
+
+    int year = readDigits(p, yearDigits);
+    p += yearDigits;
+    if (yearDigits == 2) {
+        year += year >= 50 ? 1900 : 2000;
+    }
+
+    int month = readDigits(p, 2);
+    int day = readDigits(p + 2, 2);
+    int hour = readDigits(p + 4, 2);
+    int minute = readDigits(p + 6, 2);
+    int second = readDigits(p + 8, 2);
+    p += 10;
+
+    if (month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month) ||
+        hour > 23 || minute > 59 || second > 59) {
+        return FALSE;
+    }
+
+    // Fractional seconds
+    double fraction = 0;
+    if (p < end && (*p == '.' || *p == ',')) {
+        p++;
+        double scale = 0.1;
+        const unsigned char *digits = p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            fraction += (*p - '0') * scale;
+            scale /= 10;
+            p++;
+        }
+        if (p == digits) {
+            return FALSE;
+        }
+    }
+
+    // Offset from UTC. A time without one is local time, which is ambiguous.
+    long offset = 0;
+    if (p < end && *p == 'Z') {
+        p++;
+    } else if (end - p >= 5 && (*p == '+' || *p == '-')) {
+        int offsetHours = readDigits(p + 1, 2);
+        int offsetMinutes = readDigits(p + 3, 2);
+        if (offsetHours < 0 || offsetHours > 23 || offsetMinutes < 0 || offsetMinutes > 59) {
+            return FALSE;
+        }
+        offset = (offsetHours * 60 + offsetMinutes) * 60;
+        if (*p == '-') {
+            offset = -offset;
+        }
+        p += 5;
+    } else {
+        return FALSE;
+    }
+
+    // Trailing bytes
+    if (p != end) {
+        return FALSE;
+    }
+
+    long days = daysFromCivil(year, month, day);
+    *seconds = (double)(days * 86400 + hour * 3600 + minute * 60 + second - offset) + fraction;
+
+    return TRUE;
+}
+
+// See comment in header
++ (NSDate*)dateFromASN1Time:(const ASN1_TIME*)time {
+    if (time == NULL) {
+        return nil;
+    }
+
+    NSTimeInterval seconds;
+    if (![OCSPGeneralizedTime decodeBytes:time->data length:time->length seconds:&seconds]) {
+        return nil;
+    }
+
+    return [NSDate dateWithTimeIntervalSince1970:seconds];
+}
+
+@end
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import <Foundation/Foundation.h>
+#import "OCSPCacheKey.h"
+#import "OCSPExpiringTable.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Class of a lookup failure, which determines how long it is cached.
+typedef NS_ENUM(NSInteger, OCSPNegativeCacheErrorClass) {
+
+    /*!
+     * The certificate has no OCSP URLs.
+     */
+    OCSPNegativeCacheErrorClassNoOCSPURLs = 0,
+
+    /*!
+     * An OCSP URL of the certificate is invalid.
+     */
+    OCSPNegativeCacheErrorClassInvalidOCSPURL,
+
+    /*!
+     * No OCSP responder could be reached. Lookups which time out before the responders answer
+     * are not cached, since the timeout is chosen by the caller.
+     */
+    OCSPNegativeCacheErrorClassNetworkFailure,
+
+    /*!
+     * OCSP responders answered, but without a successful response.
+     */
+    OCSPNegativeCacheErrorClassUnsuccessfulResponse,
+};
+
+/// Snapshot of the counters kept by a negative cache. Entries are cached failures; removals are
+/// failures removed because a response was obtained for the certificate.
+@interface OCSPNegativeCacheMetrics : OCSPExpiringTableMetrics
+@end
+
+/*!
+ * Recent lookup failures, so that lookups of certificates which cannot be checked fail fast
+ * instead of decoding the certificate and waiting on OCSP responders again.
+ *
+ * Each failure is cached for the TTL of its class.
+ *
+ * Thread safe.
+ */
+@interface OCSPNegativeCache : NSObject
+
+/// Maximum number of failures cached. Failures closest to expiry are evicted first.
+@property (readonly, assign, nonatomic) NSUInteger maxEntries;
+
+/// Initialize with room for 1024 failures and the default TTLs: 300s for certificates without OCSP
+/// URLs or with invalid ones, 10s for network failures and 30s for unsuccessful responses.
+- (instancetype)init;
+
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries;
+
+/// Time in seconds failures of the class are cached for.
+- (NSTimeInterval)ttlForErrorClass:(OCSPNegativeCacheErrorClass)errorClass;
+
+/// Set the time in seconds failures of the class are cached for. If 0, they are not cached.
+- (void)setTTL:(NSTimeInterval)ttl forErrorClass:(OCSPNegativeCacheErrorClass)errorClass;
+
+/// Returns the cached error for the key or nil if there is none or it has expired. Expired
+/// failures are evicted.
+- (NSError*__nullable)errorForKey:(OCSPCacheKey*)key;
+
+/// Cache the error for the key for the TTL of its class. Replaces any error cached for the key.
+- (void)setError:(NSError*)error
+      errorClass:(OCSPNegativeCacheErrorClass)errorClass
+          forKey:(OCSPCacheKey*)key;
+
+/// Remove the error cached for the key, if any.
+- (void)removeErrorForKey:(OCSPCacheKey*)key;
+
+/// Remove all the cached errors.
+- (void)removeAllErrors;
+
+/// Snapshot of the counters.
+- (OCSPNegativeCacheMetrics*)metrics;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import "OCSPNegativeCache.h"
+
+/// Number of error classes.
+#define OCSPNegativeCacheErrorClassCount 4
+
+@implementation OCSPNegativeCacheMetrics
+@end
+
+@implementation OCSPNegativeCache {
+    // Guarded by synchronizing on self
+    NSTimeInterval ttls[OCSPNegativeCacheErrorClassCount];
+    // Thread safe on its own
+    OCSPExpiringTable<OCSPCacheKey*, NSError*>* errors;
+}
+
+// See comment in header
+- (instancetype)init {
+    return [self initWithMaxEntries:1024];
+}
+
+// See comment in header
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries {
+    self = [super init];
+
+    if (self) {
+        self->errors = [[OCSPExpiringTable alloc] initWithMaxEntries:maxEntries];
+        self->ttls[OCSPNegativeCacheErrorClassNoOCSPURLs] = 300;
+        self->ttls[OCSPNegativeCacheErrorClassInvalidOCSPURL] = 300;
+        self->ttls[OCSPNegativeCacheErrorClassNetworkFailure] = 10;
+        self->ttls[OCSPNegativeCacheErrorClassUnsuccessfulResponse] = 30;
+    }
+
+    return self;
+}
+
+// See comment in header
+- (NSTimeInterval)ttlForErrorClass:(OCSPNegativeCacheErrorClass)errorClass {
+    assert(errorClass >= 0 && errorClass < OCSPNegativeCacheErrorClassCount);
+
+    @synchronized (self) {
+        return self->ttls[errorClass];
+    }
+}
+
+// See comment in header
+- (void)setTTL:(NSTimeInterval)ttl forErrorClass:(OCSPNegativeCacheErrorClass)errorClass {
+    assert(errorClass >= 0 && errorClass < OCSPNegativeCacheErrorClassCount);
+
+    @synchronized (self) {
+        self->ttls[errorClass] = ttl;
+    }
+}
+
+// See comment in header
+- (NSUInteger)maxEntries {
+    return self->errors.maxEntries;
+}
+
+// See comment in header
+- (NSError*)errorForKey:(OCSPCacheKey*)key {
+    return [self->errors objectForKey:key];
+}
+
+// See comment in header
+- (void)setError:(NSError*)error
+      errorClass:(OCSPNegativeCacheErrorClass)errorClass
+          forKey:(OCSPCacheKey*)key {
+    NSTimeInterval ttl = [self ttlForErrorClass:errorClass];
+    if (ttl <= 0) {
+        return;
+    }
+
+    [self->errors setObject:error forKey:key expiry:[NSDate dateWithTimeIntervalSinceNow:ttl]];
+}
+
+// See comment in header
+- (void)removeErrorForKey:(OCSPCacheKey*)key {
+    [self->errors removeObjectForKey:key];
+}
+
+// See comment in header
+- (void)removeAllErrors {
+    [self->errors removeAllObjects];
+}
+
+// See comment in header
+- (OCSPNegativeCacheMetrics*)metrics {
+    return [self->errors metricsOfClass:[OCSPNegativeCacheMetrics class]];
+}
+
+@end
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OCSPRequestService.h"
+#import "OCSPResponderRegistry.h"
+#import "OCSPSessionPool.h"
+#import "RACSignal.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Hedge delay which adapts to the 95th percentile latency of recent successful requests.
+FOUNDATION_EXPORT const NSTimeInterval OCSPRequestBatcherAdaptiveHedgeDelay;
+
+/*!
+ * Coalesces OCSP requests for certificates which share OCSP responders into a single request with
+ * several CertIDs (https://tools.ietf.org/html/rfc6960#section-4.1.1).
+ *
+ * A request is sent right away unless a batch is pending for the same issuer, responder URLs and
+ * session, so a request which has nothing to coalesce with never waits. Sending it opens a batch
+ * for the coalescing window: the requests which follow within it are sent together once the
+ * window elapses, or once the batch is full. Certificates of different issuers are never
+ * batched together, since a response for several issuers cannot be verified. The
+ * response is then handed to each certificate it answers for; the same signed response data is
+ * valid for every certificate it contains a single response for.
+ *
+ * Responders are not required to support several CertIDs per request. Certificates which are
+ * missing from the response, or all certificates of the batch if it fails, are retried with a
+ * request of their own.
+ *
+ * The OCSP URLs of each request are reordered by the health of their responders, which is
+ * tracked in `responderRegistry`.
+ */
+@interface OCSPRequestBatcher : NSObject
+
+/// Time after a request is sent during which the requests which follow it to the same responder
+/// are batched. If 0, requests are sent immediately and never batched.
+@property (atomic, assign) NSTimeInterval coalescingWindow;
+
+/// Maximum number of certificates in a single request. A batch is sent as soon as it is full.
+@property (atomic, assign) NSUInteger maxCertsPerRequest;
+
+/// Time to wait for a responder before also requesting the next OCSP URL of a certificate. See
+/// OCSPRequestService. If OCSPRequestBatcherAdaptiveHedgeDelay, which is the default, the 95th percentile latency of
+/// recent successful requests is used, or OCSPRequestServiceDefaultHedgeDelay until there are
+/// enough of them.
+@property (atomic, assign) NSTimeInterval hedgeDelay;
+
+/// Health of the OCSP responders requested.
+@property (readonly, strong, nonatomic) OCSPResponderRegistry *responderRegistry;
+
+/// Sessions used for requests which are not provided a session.
+@property (readonly, strong, nonatomic) OCSPSessionPool *sessionPool;
+
+/// Initialize with a coalescing window of 10ms and at most 8 certificates per request.
+/// @param queue Dispatch queue which the network requests should be made on.
+- (instancetype)initWithQueue:(dispatch_queue_t)queue;
+
+/// Request method used for the OCSP URL. Defaults to OCSPRequestMethodAutomatic.
+- (OCSPRequestMethod)requestMethodForURL:(NSURL*)url;
+
+/// Set the request method used for the OCSP URL.
+- (void)setRequestMethod:(OCSPRequestMethod)method forURL:(NSURL*)url;
+
+/*!
+ Request the status of a certificate.
+
+ Follows the contract of +[OCSPRequestService getSuccessfulOCSPResponse:ocspRequestData:session:queue:]:
+ emits a successful OCSPResponse which contains a single response for the certificate and then
+ completes, or errors if none could be obtained.
+
+ @param cert Target certificate.
+ @param issuer Issuer certificate of the target certificate.
+ @param ocspRequestData OCSP request data for the target certificate alone. Used if the
+ certificate is not batched with others or has to be retried on its own.
+ @param urls OCSP server URLs, attempted in the order given by the responder registry.
+ @param session Session with which to perform OCSP requests. If nil, sessions from `sessionPool`
+ are used.
+ */
+- (RACSignal<NSObject*>*)requestForCert:(SecCertificateRef)cert
+                                 issuer:(SecCertificateRef)issuer
+                        ocspRequestData:(NSData*)ocspRequestData
+                                   urls:(NSArray<NSURL*>*)urls
+                                session:(NSURLSession*__nullable)session;
+
+/*!
+ Same as requestForCert:issuer:ocspRequestData:urls:session:, for URLs which differ from the OCSP
+ URLs of the certificate, e.g. because they were rewritten to go through a proxy.
+
+ @param responderURLs OCSP URLs of the certificate, at the same indexes as the URLs they were
+ rewritten to. The health of the responders is tracked by these, so that it does not depend on
+ how they are reached.
+ */
+- (RACSignal<NSObject*>*)requestForCert:(SecCertificateRef)cert
+                                 issuer:(SecCertificateRef)issuer
+                        ocspRequestData:(NSData*)ocspRequestData
+                                   urls:(NSArray<NSURL*>*)urls
+                          responderURLs:(NSArray<NSURL*>*)responderURLs
+                                session:(NSURLSession*__nullable)session;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPRequestBatcher.h"
+#import "OCSPCacheKey.h"
+#import "OCSPCert.h"
+#import "OCSPRequestService.h"
+#import "OCSPResponse.h"
+#import "RACReplaySubject.h"
+#import "RACSignal+Operations.h"
+
+/// See comment in header
+const NSTimeInterval OCSPRequestBatcherAdaptiveHedgeDelay = -1;
+
+/// Number of recent request latencies kept for the adaptive hedge delay.
+#define OCSPRequestBatcherLatencySamples 64
+
+/// Minimum number of latencies before the adaptive hedge delay is used.
+#define OCSPRequestBatcherMinLatencySamples 16
+
+/// Certificate waiting to be sent in a batch.
+@interface OCSPRequestBatchMember : NSObject
+
+@property (strong, nonatomic) id cert;
+@property (strong, nonatomic) id issuer;
+@property (strong, nonatomic) NSData *ocspRequestData;
+@property (strong, nonatomic) RACReplaySubject<NSObject*>* subject;
+
+@end
+
+@implementation OCSPRequestBatchMember
+@end
+
+/// Certificates which share OCSP responder URLs and a session.
+@interface OCSPRequestBatch : NSObject
+
+@property (strong, nonatomic) NSArray<NSURL*>* urls;
+@property (strong, nonatomic) NSArray<NSURL*>* responderURLs;
+@property (strong, nonatomic) NSURLSession *session;
+@property (strong, nonatomic) NSMutableArray<OCSPRequestBatchMember*>* members;
+
+@end
+
+@implementation OCSPRequestBatch
+@end
+
+@implementation OCSPRequestBatcher {
+    dispatch_queue_t requestQueue;
+    dispatch_queue_t batchQueue;
+    // Batches which have not been sent yet. Guarded by synchronizing on the dictionary.
+    NSMutableDictionary<NSString*, OCSPRequestBatch*>* pendingBatches;
+    // Request methods which differ from OCSPRequestMethodAutomatic. Guarded by synchronizing on
+    // the dictionary.
+    NSMutableDictionary<NSURL*, NSNumber*>* requestMethods;
+    // Ring buffer of the latencies of recent successful requests. Guarded by synchronizing on
+    // self.
+    NSTimeInterval latencies[OCSPRequestBatcherLatencySamples];
+    NSUInteger latencyCount;
+}
+
+// See comment in header
+- (instancetype)initWithQueue:(dispatch_queue_t)queue {
+    self = [super init];
+
+    if (self) {
+        self.coalescingWindow = 0.01;
+        self.maxCertsPerRequest = 8;
+        self.hedgeDelay = OCSPRequestBatcherAdaptiveHedgeDelay;
+        self->requestQueue = queue;
+        self->batchQueue = dispatch_queue_create("ca.psiphon.OCSPCache.BatchQueue",
+                                                 DISPATCH_QUEUE_SERIAL);
+        self->pendingBatches = [[NSMutableDictionary alloc] init];
+        self->requestMethods = [[NSMutableDictionary alloc] init];
+        self->_responderRegistry = [[OCSPResponderRegistry alloc] init];
+        self->_sessionPool = [[OCSPSessionPool alloc] init];
+    }
+
+    return self;
+}
+
+// See comment in header
+- (OCSPRequestMethod)requestMethodForURL:(NSURL*)url {
+    @synchronized (self->requestMethods) {
+        return (OCSPRequestMethod)[[self->requestMethods objectForKey:url] integerValue];
+    }
+}
+
+// See comment in header
+- (void)setRequestMethod:(OCSPRequestMethod)method forURL:(NSURL*)url {
+    @synchronized (self->requestMethods) {
+        if (method == OCSPRequestMethodAutomatic) {
+            [self->requestMethods removeObjectForKey:url];
+        } else {
+            [self->requestMethods setObject:@(method) forKey:url];
+        }
+    }
+}
+
+/// Successful OCSP response from the URLs with the configured request methods. The URLs are
+/// attempted in the order of the health of their responders, whose OCSP URLs are the responder
+/// URLs at the same indexes.
+- (RACSignal<NSObject*>*)getSuccessfulOCSPResponse:(NSArray<NSURL*>*)urls
+                                     responderURLs:(NSArray<NSURL*>*)responderURLs
+                                   ocspRequestData:(NSData*)ocspRequestData
+                                           session:(NSURLSession*)session {
+    OCSPRequestMethodForURL requestMethod = ^OCSPRequestMethod(NSURL *url) {
+        return [self requestMethodForURL:url];
+    };
+
+    // Responder health is recorded under the responder URL, which does not change when the URL
+    // requested is rewritten
+    NSMutableDictionary<NSURL*, NSURL*>* responderForURL =
+        [[NSMutableDictionary alloc] initWithCapacity:[urls count]];
+    for (NSUInteger i = 0; i < [urls count]; i++) {
+        if ([responderForURL objectForKey:[urls objectAtIndex:i]] == nil) {
+            [responderForURL setObject:[responderURLs objectAtIndex:i]
+                                forKey:[urls objectAtIndex:i]];
+        }
+    }
+
+    OCSPRequestAttemptStartObserver attemptStartObserver = ^(NSURL *url) {
+        [self.responderRegistry recordRequestStartTo:[responderForURL objectForKey:url]];
+    };
+
+    OCSPRequestAttemptObserver attemptObserver = ^(NSURL *url, NSTimeInterval latency,
+                                                   OCSPRequestAttemptResult result) {
+        [self.responderRegistry recordRequestTo:[responderForURL objectForKey:url]
+                                        latency:latency
+                                         result:result];
+        if (result == OCSPRequestAttemptResultSucceeded) {
+            [self addLatency:latency];
+        }
+    };
+
+    // Ordered on subscription, right before the requests are made
+    return [RACSignal defer:^RACSignal *{
+        NSArray<NSURL*>* orderedURLs = [self.responderRegistry orderURLs:urls
+                                                           responderURLs:responderURLs];
+        if ([orderedURLs count] == 0) {
+            // Fail fast rather than wait on responders which are known to be down
+            NSError *error =
+            [NSError errorWithDomain:OCSPRequestServiceErrorDomain
+                                code:OCSPRequestServiceErrorCodeRespondersUnavailable
+                            userInfo:@{NSLocalizedDescriptionKey:@"All OCSP responders are down"}];
+            return [RACSignal error:error];
+        }
+
+        return [OCSPRequestService getSuccessfulOCSPResponse:orderedURLs
+                                             ocspRequestData:ocspRequestData
+                                               requestMethod:requestMethod
+                                                  hedgeDelay:[self currentHedgeDelay]
+                                        attemptStartObserver:attemptStartObserver
+                                             attemptObserver:attemptObserver
+                                                     session:session
+                                                 sessionPool:self.sessionPool
+                                                       queue:self->requestQueue];
+    }];
+}
+
+/// Record the latency of a successful request.
+- (void)addLatency:(NSTimeInterval)latency {
+    @synchronized (self) {
+        self->latencies[self->latencyCount % OCSPRequestBatcherLatencySamples] = latency;
+        self->latencyCount++;
+    }
+}
+
+/// Hedge delay to use for the next request.
+- (NSTimeInterval)currentHedgeDelay {
+    NSTimeInterval hedgeDelay = self.hedgeDelay;
+    if (hedgeDelay != OCSPRequestBatcherAdaptiveHedgeDelay) {
+        return hedgeDelay;
+    }
+
+    NSTimeInterval sorted[OCSPRequestBatcherLatencySamples];
+    NSUInteger n;
+
+    @synchronized (self) {
+        n = MIN(self->latencyCount, OCSPRequestBatcherLatencySamples);
+        memcpy(sorted, self->latencies, n * sizeof(NSTimeInterval));
+    }
+
+    if (n < OCSPRequestBatcherMinLatencySamples) {
+        return OCSPRequestServiceDefaultHedgeDelay;
+    }
+
+    qsort_b(sorted, n, sizeof(NSTimeInterval), ^int(const void *a, const void *b) {
+        NSTimeInterval x = *(const NSTimeInterval*)a, y = *(const NSTimeInterval*)b;
+        return x < y ? -1 : (x > y ? 1 : 0);
+    });
+
+    return sorted[(n * 95 + 99) / 100 - 1];
+}
+
+// See comment in header
+- (RACSignal<NSObject*>*)requestForCert:(SecCertificateRef)cert
+                                 issuer:(SecCertificateRef)issuer
+                        ocspRequestData:(NSData*)ocspRequestData
+                                   urls:(NSArray<NSURL*>*)urls
+                                session:(NSURLSession*)session {
+    return [self requestForCert:cert
+                         issuer:issuer
+                ocspRequestData:ocspRequestData
+                           urls:urls
+                  responderURLs:urls
+                        session:session];
+}
+
+// See comment in header
+- (RACSignal<NSObject*>*)requestForCert:(SecCertificateRef)cert
+                                 issuer:(SecCertificateRef)issuer
+                        ocspRequestData:(NSData*)ocspRequestData
+                                   urls:(NSArray<NSURL*>*)urls
+                          responderURLs:(NSArray<NSURL*>*)responderURLs
+                                session:(NSURLSession*)session {
+
+    NSTimeInterval window = self.coalescingWindow;
+    NSUInteger maxCerts = self.maxCertsPerRequest;
+
+    if (window <= 0 || maxCerts < 2) {
+        return [self getSuccessfulOCSPResponse:urls
+                                 responderURLs:responderURLs
+                               ocspRequestData:ocspRequestData
+                                       session:session];
+    }
+
+    // Only certificates of the same issuer are batched. OCSP_basic_verify rejects responses whose
+    // single responses are for more than one issuer, and a response can only be signed by one
+    // issuer or its delegated responder anyway. Certificates whose issuer cannot be parsed are
+    // not batched with any other.
+    NSData *issuerHashes = [OCSPCacheKey issuerHashesForCertificate:issuer];
+    NSString *issuerID = issuerHashes != nil
+                         ? [issuerHashes base64EncodedStringWithOptions:0]
+                         : [[NSUUID UUID] UUIDString];
+
+    // The batch holds a strong reference to the session, so its address identifies it for as long
+    // as the batch is pending
+    NSString *batchKey = [NSString stringWithFormat:@"%p %@ %@ %@",
+                          session,
+                          issuerID,
+                          [[urls valueForKey:@"absoluteString"] componentsJoinedByString:@" "],
+                          [[responderURLs valueForKey:@"absoluteString"]
+                           componentsJoinedByString:@" "]];
+
+    OCSPRequestBatchMember *member = nil;
+    OCSPRequestBatch *fullBatch = nil;
+    NSArray<OCSPRequestBatchMember*>* fullMembers = nil;
+
+    @synchronized (self->pendingBatches) {
+        OCSPRequestBatch *batch = [self->pendingBatches objectForKey:batchKey];
+
+        if (batch == nil) {
+            // Nothing to coalesce with, so the request is sent right away. The batch collects the
+            // requests which follow within the window.
+            batch = [[OCSPRequestBatch alloc] init];
+            batch.urls = urls;
+            batch.responderURLs = responderURLs;
+            batch.session = session;
+            batch.members = [[NSMutableArray alloc] init];
+            [self->pendingBatches setObject:batch forKey:batchKey];
+
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(window * NSEC_PER_SEC)),
+                           self->batchQueue, ^{
+                [self sendBatch:batch forKey:batchKey];
+            });
+        } else {
+            member = [[OCSPRequestBatchMember alloc] init];
+            member.cert = (__bridge id)cert;
+            member.issuer = (__bridge id)issuer;
+            member.ocspRequestData = ocspRequestData;
+            member.subject =
+                [RACReplaySubject replaySubjectWithCapacity:RACReplaySubjectUnlimitedCapacity];
+
+            [batch.members addObject:member];
+
+            if ([batch.members count] >= maxCerts) {
+                // Requests which follow open a new batch
+                [self->pendingBatches removeObjectForKey:batchKey];
+                fullBatch = batch;
+                fullMembers = [batch.members copy];
+            }
+        }
+    }
+
+    if (member == nil) {
+        return [self getSuccessfulOCSPResponse:urls
+                                 responderURLs:responderURLs
+                               ocspRequestData:ocspRequestData
+                                       session:session];
+    }
+
+    if (fullBatch != nil) {
+        dispatch_async(self->batchQueue, ^{
+            [self sendMembers:fullMembers batch:fullBatch];
+        });
+    }
+
+    return member.subject;
+}
+
+/// Send the batch once its window elapsed, if it has not been sent already. Must be called on the
+/// batch queue.
+- (void)sendBatch:(OCSPRequestBatch*)batch forKey:(NSString*)batchKey {
+    NSArray<OCSPRequestBatchMember*>* members;
+
+    @synchronized (self->pendingBatches) {
+        if ([self->pendingBatches objectForKey:batchKey] != batch) {
+            // Already sent when it filled up
+            return;
+        }
+        [self->pendingBatches removeObjectForKey:batchKey];
+
+        members = [batch.members copy];
+    }
+
+    [self sendMembers:members batch:batch];
+}
+
+/// Send a request for the members of the batch, which has been removed from the pending batches.
+/// Must be called on the batch queue.
+- (void)sendMembers:(NSArray<OCSPRequestBatchMember*>*)members batch:(OCSPRequestBatch*)batch {
+    if ([members count] == 0) {
+        // The request which opened the batch was not followed by any other
+        return;
+    }
+
+    if ([members count] == 1) {
+        [self sendIndividually:members batch:batch];
+        return;
+    }
+
+    NSError *e;
+    NSData *ocspRequestData =
+        [OCSPCert ocspDataForPostRequestFromSecCertRefs:[members valueForKey:@"cert"]
+                                     withIssuerCertRefs:[members valueForKey:@"issuer"]
+                                                  error:&e];
+    if (ocspRequestData == nil) {
+        [self sendIndividually:members batch:batch];
+        return;
+    }
+
+    __block BOOL answered = FALSE;
+
+    [[self getSuccessfulOCSPResponse:batch.urls
+                       responderURLs:batch.responderURLs
+                     ocspRequestData:ocspRequestData
+                             session:batch.session]
+     subscribeNext:^(NSObject *x) {
+        if (![x isKindOfClass:[OCSPResponse class]] || ![(OCSPResponse*)x success]) {
+            // Failed attempt; the signal errors if no URL succeeds
+            return;
+        }
+        answered = TRUE;
+
+        OCSPResponse *r = (OCSPResponse*)x;
+        NSMutableArray<OCSPRequestBatchMember*>* unanswered = [[NSMutableArray alloc] init];
+
+        for (OCSPRequestBatchMember *member in members) {
+            if ([r hasSingleResponseForCert:(__bridge SecCertificateRef)member.cert
+                                     issuer:(__bridge SecCertificateRef)member.issuer]) {
+                [member.subject sendNext:r];
+                [member.subject sendCompleted];
+            } else {
+                [unanswered addObject:member];
+            }
+        }
+
+        [self sendIndividually:unanswered batch:batch];
+    } error:^(NSError *error) {
+        if (!answered) {
+            // The responder may not support several CertIDs per request
+            [self sendIndividually:members batch:batch];
+        }
+    }];
+}
+
+/// Send a request of its own for each member of the batch.
+- (void)sendIndividually:(NSArray<OCSPRequestBatchMember*>*)members
+                   batch:(OCSPRequestBatch*)batch {
+    for (OCSPRequestBatchMember *member in members) {
+        [[self getSuccessfulOCSPResponse:batch.urls
+                           responderURLs:batch.responderURLs
+                         ocspRequestData:member.ocspRequestData
+                                 session:batch.session]
+         subscribe:member.subject];
+    }
+}
+
+@end
@@ -19,6 +19,7 @@
 
 #import <Foundation/Foundation.h>
 #import "OCSPResponse.h"
+#import "OCSPSessionPool.h"
 #import "RACReplaySubject.h"
 
 NS_ASSUME_NONNULL_BEGIN
@@ -52,9 +53,74 @@ typedef NS_ERROR_ENUM(OCSPRequestServiceErrorDomain, OCSPRequestServiceErrorCode
     /*!
      * No successful OCSP response could be obtained.
      */
-    OCSPRequestServiceErrorCodeNoSuccessfulResponse
+    OCSPRequestServiceErrorCodeNoSuccessfulResponse,
+
+    /*!
+     * No request was made because the circuit breakers of all the OCSP responders are open.
+     * See OCSPResponderRegistry.
+     */
+    OCSPRequestServiceErrorCodeRespondersUnavailable
+};
+
+/// HTTP method used for OCSP requests. See https://tools.ietf.org/html/rfc6960#appendix-A.1.
+typedef NS_ENUM(NSInteger, OCSPRequestMethod) {
+
+    /*!
+     * GET if the encoded request is less than 255 bytes and the URL has no query or fragment;
+     * otherwise POST. If the GET request fails, or does not return a successful OCSP response, the
+     * request is retried with POST.
+     *
+     * Unlike POST requests, GET requests can be answered by HTTP caches, e.g. a CDN in front of
+     * the responder or a caching proxy.
+     */
+    OCSPRequestMethodAutomatic = 0,
+
+    /*!
+     * GET only. Falls back to POST if the request cannot be encoded in the URL.
+     */
+    OCSPRequestMethodGET,
+
+    /*!
+     * POST only.
+     */
+    OCSPRequestMethodPOST,
 };
 
+/// Returns the request method to use for an OCSP URL.
+typedef OCSPRequestMethod (^OCSPRequestMethodForURL)(NSURL *url);
+
+/// Result of a request to an OCSP URL.
+typedef NS_ENUM(NSInteger, OCSPRequestAttemptResult) {
+
+    /*!
+     * A successful OCSP response was obtained.
+     */
+    OCSPRequestAttemptResultSucceeded = 0,
+
+    /*!
+     * The request failed, or did not return a successful OCSP response.
+     */
+    OCSPRequestAttemptResultFailed,
+
+    /*!
+     * The request was cancelled before it finished, e.g. because another responder answered
+     * first. The latency is a lower bound of the latency of the responder.
+     */
+    OCSPRequestAttemptResultCancelled,
+};
+
+/// Called right before a request to an OCSP URL is sent.
+typedef void (^OCSPRequestAttemptStartObserver)(NSURL *url);
+
+/// Called when a request to an OCSP URL finishes or is cancelled, with the time it was in flight for.
+typedef void (^OCSPRequestAttemptObserver)(NSURL *url,
+                                           NSTimeInterval latency,
+                                           OCSPRequestAttemptResult result);
+
+/// Delay before hedging to the next OCSP URL used by
+/// getSuccessfulOCSPResponse:ocspRequestData:session:queue:.
+FOUNDATION_EXPORT const NSTimeInterval OCSPRequestServiceDefaultHedgeDelay;
+
 @interface OCSPRequestService : NSObject
 
 /*!
@@ -64,12 +130,14 @@ typedef NS_ERROR_ENUM(OCSPRequestServiceErrorDomain, OCSPRequestServiceErrorCode
  Emits either OCSPResponse or NSError. Each error and unsuccessful response encountered are emitted, but they do not cause signal
  termination.
 
- OCSP URLs are attempted in order.
+ OCSP URLs are attempted in order with OCSPRequestMethodAutomatic, hedging to the next URL after
+ OCSPRequestServiceDefaultHedgeDelay. See
+ getSuccessfulOCSPResponse:ocspRequestData:requestMethod:hedgeDelay:attemptStartObserver:attemptObserver:session:sessionPool:queue:.
 
  @param ocspURLs OCSP server URLs.
  @param session Session with which to perform OCSP requests. This is an opportunity for the caller
- to specify a proxy to be used by the OCSP requests. If nil, a session with
- `ephemeralSessionConfiguration` is created and used.
+ to specify a proxy to be used by the OCSP requests. If nil, sessions from
+ +[OCSPSessionPool sharedPool] are used.
  @param queue Dispatch queue which the network requests should be made on.
  */
 + (RACSignal<NSObject*>*)getSuccessfulOCSPResponse:(NSArray<NSURL*>*)ocspURLs
@@ -77,6 +145,35 @@ typedef NS_ERROR_ENUM(OCSPRequestServiceErrorDomain, OCSPRequestServiceErrorCode
                                            session:(NSURLSession*__nullable)session
                                              queue:(dispatch_queue_t)queue;
 
+/*!
+ Same as getSuccessfulOCSPResponse:ocspRequestData:session:queue:, with hedged requests.
+
+ The first URL is the primary. If it has not returned a successful response within the hedge
+ delay, or as soon as it fails, the next URL is requested as well, and so on. The first successful
+ response wins and the requests which are still in flight are cancelled. This bounds the latency
+ added by a slow responder to the hedge delay, at the cost of an extra request when the primary is
+ slow.
+
+ @param requestMethod Returns the request method for an OCSP URL. If nil,
+ OCSPRequestMethodAutomatic is used for all URLs.
+ @param hedgeDelay Time to wait for a request before also requesting the next URL. If 0, all URLs
+ are raced in parallel.
+ @param attemptStartObserver Called as each request is sent, before it can finish. May be nil.
+ @param attemptObserver Called as each request finishes, and for each request in flight when the
+ signal is disposed of, including the losers of a race. May be nil.
+ @param sessionPool Pool whose session for each URL is used if `session` is nil. If nil,
+ +[OCSPSessionPool sharedPool] is used.
+ */
++ (RACSignal<NSObject*>*)getSuccessfulOCSPResponse:(NSArray<NSURL*>*)ocspURLs
+                                   ocspRequestData:(NSData*)OCSPRequestData
+                                     requestMethod:(OCSPRequestMethodForURL __nullable)requestMethod
+                                        hedgeDelay:(NSTimeInterval)hedgeDelay
+                              attemptStartObserver:(OCSPRequestAttemptStartObserver __nullable)attemptStartObserver
+                                   attemptObserver:(OCSPRequestAttemptObserver __nullable)attemptObserver
+                                           session:(NSURLSession*__nullable)session
+                                       sessionPool:(OCSPSessionPool*__nullable)sessionPool
+                                             queue:(dispatch_queue_t)queue;
+
 /*!
  Cold terminating signal which performs an OCSP request with the POST method.
 
@@ -86,8 +183,8 @@ typedef NS_ERROR_ENUM(OCSPRequestServiceErrorDomain, OCSPRequestServiceErrorCode
 
  @param ocspURL OCSP server URL to make an OCSP request to.
  @param session Session with which to perform OCSP requests. This is an opportunity for the caller
- to specify a proxy to be used by the OCSP requests. If nil, a session with
- `ephemeralSessionConfiguration` is created and used.
+ to specify a proxy to be used by the OCSP requests. If nil, the session for the URL from
+ +[OCSPSessionPool sharedPool] is used.
  @param queue Dispatch queue which the network requests should be made on.
  */
 + (RACSignal<NSObject*>*)ocspRequest:(NSURL*)ocspURL
@@ -95,6 +192,38 @@ typedef NS_ERROR_ENUM(OCSPRequestServiceErrorDomain, OCSPRequestServiceErrorCode
                              session:(NSURLSession*__nullable)session
                                queue:(dispatch_queue_t)queue;
 
+/*!
+ Cold terminating signal which performs an OCSP request with the provided method.
+
+ Emits either OCSPResponse or NSError and then completes.
+
+ GET requests use the default cache policy of the session, so responses are cached and revalidated
+ according to their Cache-Control, Expires and ETag headers. A cached response whose nextUpdate
+ has passed is requested again, bypassing caches.
+
+ See: https://tools.ietf.org/html/rfc6960#appendix-A.1
+
+ @param ocspURL OCSP server URL to make an OCSP request to.
+ @param method Request method.
+ @param session Session with which to perform OCSP requests. See
+ ocspRequest:ocspRequestData:session:queue:.
+ @param queue Dispatch queue which the network requests should be made on.
+ */
++ (RACSignal<NSObject*>*)ocspRequest:(NSURL*)ocspURL
+                     ocspRequestData:(NSData*)ocspRequestData
+                              method:(OCSPRequestMethod)method
+                             session:(NSURLSession*__nullable)session
+                               queue:(dispatch_queue_t)queue;
+
+/*!
+ URL for an OCSP request with the GET method: the OCSP URL followed by the URL encoding of the
+ base64 encoding of the request.
+
+ Returns nil if the encoded request is 255 bytes or longer, or if the OCSP URL has a query or a
+ fragment which the encoded request cannot be appended to.
+ */
++ (NSURL*__nullable)getRequestURL:(NSURL*)ocspURL ocspRequestData:(NSData*)ocspRequestData;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -20,13 +20,201 @@
 #import "OCSPRequestService.h"
 #import <openssl/ocsp.h>
 #import "OCSPResponse.h"
+#import "OCSPURLEncode.h"
+#import "RACCompoundDisposable.h"
 #import "RACDisposable.h"
-#import "RACReplaySubject.h"
-#import "RACSequence.h"
-#import "NSArray+RACSequenceAdditions.h"
+#import "RACSubscriber.h"
 
 NSErrorDomain _Nonnull const OCSPRequestServiceErrorDomain = @"OCSPRequestServiceErrorDomain";
 
+/// GET requests must be less than 255 bytes after encoding.
+/// See: https://tools.ietf.org/html/rfc6960#appendix-A.1
+static const NSUInteger OCSPRequestServiceMaxGetRequestLength = 255;
+
+/// See comment in header
+const NSTimeInterval OCSPRequestServiceDefaultHedgeDelay = 1;
+
+/// Hedged requests to the OCSP URLs of a certificate for a single subscriber.
+@interface OCSPHedgedRequest : NSObject
+
+@property (strong, nonatomic) NSArray<NSURL*>* urls;
+@property (strong, nonatomic) NSData *ocspRequestData;
+@property (copy, nonatomic) OCSPRequestMethodForURL requestMethod;
+@property (assign, nonatomic) NSTimeInterval hedgeDelay;
+@property (copy, nonatomic) OCSPRequestAttemptStartObserver attemptStartObserver;
+@property (copy, nonatomic) OCSPRequestAttemptObserver attemptObserver;
+@property (strong, nonatomic) NSURLSession *session;
+@property (strong, nonatomic) OCSPSessionPool *sessionPool;
+@property (strong, nonatomic) dispatch_queue_t queue;
+@property (strong, nonatomic) id<RACSubscriber> subscriber;
+
+/// Disposes the requests in flight.
+@property (readonly, strong, nonatomic) RACCompoundDisposable *disposable;
+
+/// Start the request to the first URL.
+- (void)start;
+
+@end
+
+@implementation OCSPHedgedRequest {
+    // Guarded by synchronizing on self
+    NSUInteger started;
+    NSUInteger finished;
+    BOOL done;
+    // Start times of the requests in flight, keyed by URL index
+    NSMutableDictionary<NSNumber*, NSDate*>* inFlight;
+}
+
+- (instancetype)init {
+    self = [super init];
+
+    if (self) {
+        self->_disposable = [RACCompoundDisposable compoundDisposable];
+        self->inFlight = [[NSMutableDictionary alloc] init];
+    }
+
+    return self;
+}
+
+// See comment in interface
+- (void)start {
+    __weak OCSPHedgedRequest *weakSelf = self;
+
+    [self.disposable addDisposable:[RACDisposable disposableWithBlock:^{
+        __strong OCSPHedgedRequest *strongSelf = weakSelf;
+        if (strongSelf == nil) {
+            return;
+        }
+
+        NSDictionary<NSNumber*, NSDate*>* cancelled;
+        @synchronized (strongSelf) {
+            strongSelf->done = TRUE;
+            cancelled = [strongSelf->inFlight copy];
+            [strongSelf->inFlight removeAllObjects];
+        }
+
+        if (strongSelf.attemptObserver != nil) {
+            for (NSNumber *index in cancelled) {
+                NSURL *url = [strongSelf.urls objectAtIndex:[index unsignedIntegerValue]];
+                strongSelf.attemptObserver(url,
+                                           -[[cancelled objectForKey:index] timeIntervalSinceNow],
+                                           OCSPRequestAttemptResultCancelled);
+            }
+        }
+    }]];
+
+    [self startNext];
+}
+
+/// Request the next URL, if any, and schedule the hedge after it.
+- (void)startNext {
+    NSUInteger index;
+    NSDate *startTime = [NSDate date];
+
+    @synchronized (self) {
+        if (self->done || self->started == [self.urls count]) {
+            return;
+        }
+        index = self->started++;
+        [self->inFlight setObject:startTime forKey:@(index)];
+    }
+
+    NSURL *url = [self.urls objectAtIndex:index];
+    OCSPRequestMethod method =
+        self.requestMethod != nil ? self.requestMethod(url) : OCSPRequestMethodAutomatic;
+    NSURLSession *session = self.session ?: [self.sessionPool sessionForURL:url];
+
+    if (self.attemptStartObserver != nil) {
+        self.attemptStartObserver(url);
+    }
+
+    RACDisposable *d =
+    [[OCSPRequestService ocspRequest:url
+                     ocspRequestData:self.ocspRequestData
+                              method:method
+                             session:session
+                               queue:self.queue]
+     subscribeNext:^(NSObject *x) {
+        [self finishedRequestAtIndex:index result:x];
+    }];
+
+    [self.disposable addDisposable:d];
+
+    if (index + 1 == [self.urls count]) {
+        return;
+    }
+
+    if (self.hedgeDelay <= 0) {
+        // Race all the URLs
+        [self startNext];
+        return;
+    }
+
+    // Hedge to the next URL if this one has not succeeded in time. The request is retained until
+    // then, but does nothing once it is done.
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.hedgeDelay * NSEC_PER_SEC)),
+                   self.queue, ^{
+        @synchronized (self) {
+            if (self->started != index + 1) {
+                // A failure already started the next URL
+                return;
+            }
+        }
+        [self startNext];
+    });
+}
+
+/// Handle the result of the request to a URL.
+- (void)finishedRequestAtIndex:(NSUInteger)index result:(NSObject*)x {
+    BOOL success = [x isKindOfClass:[OCSPResponse class]] && [(OCSPResponse*)x success];
+    BOOL exhausted = FALSE;
+    NSDate *startTime;
+
+    @synchronized (self) {
+        if (self->done) {
+            // Lost the race; only reached if the request completed before being cancelled, in
+            // which case it was reported as cancelled
+            return;
+        }
+        startTime = [self->inFlight objectForKey:@(index)];
+        [self->inFlight removeObjectForKey:@(index)];
+        self->finished++;
+        if (success) {
+            self->done = TRUE;
+        } else if (self->finished == [self.urls count]) {
+            self->done = TRUE;
+            exhausted = TRUE;
+        }
+    }
+
+    if (self.attemptObserver != nil) {
+        self.attemptObserver([self.urls objectAtIndex:index],
+                             -[startTime timeIntervalSinceNow],
+                             success ? OCSPRequestAttemptResultSucceeded
+                                     : OCSPRequestAttemptResultFailed);
+    }
+
+    [self.subscriber sendNext:x];
+
+    if (success) {
+        [self.subscriber sendCompleted];
+        // Cancel the losers
+        [self.disposable dispose];
+    } else if (exhausted) {
+        // No successful response could be obtained, send an error
+        NSError *error =
+        [NSError errorWithDomain:OCSPRequestServiceErrorDomain
+                            code:OCSPRequestServiceErrorCodeNoSuccessfulResponse
+                        userInfo:@{NSLocalizedDescriptionKey:@"No successful OCSP response"}];
+        [self.subscriber sendError:error];
+    } else {
+        // Do not wait for the hedge delay after a failure
+        [self startNext];
+    }
+}
+
+@end
+
 @implementation OCSPRequestService
 
 // See comment in header
@@ -34,78 +222,152 @@ NSErrorDomain _Nonnull const OCSPRequestServiceErrorDomain = @"OCSPRequestServic
                                    ocspRequestData:(NSData*)ocspRequestData
                                            session:(NSURLSession *_Nullable)session
                                              queue:(dispatch_queue_t)queue
+{
+    return [OCSPRequestService getSuccessfulOCSPResponse:ocspURLs
+                                         ocspRequestData:ocspRequestData
+                                           requestMethod:nil
+                                              hedgeDelay:OCSPRequestServiceDefaultHedgeDelay
+                                    attemptStartObserver:nil
+                                         attemptObserver:nil
+                                                 session:session
+                                             sessionPool:nil
+                                                   queue:queue];
+}
+
+// See comment in header
++ (RACSignal<NSObject*>*)getSuccessfulOCSPResponse:(NSArray<NSURL*>*)ocspURLs
+                                   ocspRequestData:(NSData*)ocspRequestData
+                                     requestMethod:(OCSPRequestMethodForURL)requestMethod
+                                        hedgeDelay:(NSTimeInterval)hedgeDelay
+                              attemptStartObserver:(OCSPRequestAttemptStartObserver)attemptStartObserver
+                                   attemptObserver:(OCSPRequestAttemptObserver)attemptObserver
+                                           session:(NSURLSession *_Nullable)session
+                                       sessionPool:(OCSPSessionPool *_Nullable)sessionPool
+                                             queue:(dispatch_queue_t)queue
 {
     assert([ocspURLs count] != 0);
 
     return [RACSignal createSignal:^RACDisposable *(id<RACSubscriber>  _Nonnull subscriber) {
-        RACSequence *urls = ocspURLs.rac_sequence;
-
-        RACSignal *signal =
-        [[[urls signal]
-         flattenMap:^__kindof RACSignal * _Nullable(NSURL *url) {
-             return [OCSPRequestService ocspRequest:url
-                                    ocspRequestData:ocspRequestData
-                                      session:session
-                                              queue:queue];
-         }]
-         takeUntilBlock:^BOOL(id  _Nullable x) {
-             static int requestCount = 0;
-             if ([x isKindOfClass:[OCSPResponse class]]) {
-                 if ([x success]) {
-                     // Successful response, stop making requests and complete
-                     [subscriber sendNext:x];
-                     [subscriber sendCompleted];
-                 }
-             }
-
-             requestCount++;
-
-             if (requestCount == [ocspURLs count]) {
-                 // No successful response could be obtained, send an error
-                 NSError *error =
-                 [NSError errorWithDomain:OCSPRequestServiceErrorDomain
-                                     code:OCSPRequestServiceErrorCodeNoSuccessfulResponse
-                                 userInfo:@{NSLocalizedDescriptionKey:@"No successful subscriber"}];
-                 [subscriber sendError:error];
-                 return TRUE;
-             }
-
-             return FALSE;
-         }];
-
-        [signal subscribeCompleted:^{
-            // Kick off cold signal
-        }];
+        // State is kept per subscription so that concurrent lookups do not affect each other
+        OCSPHedgedRequest *request = [[OCSPHedgedRequest alloc] init];
+        request.urls = ocspURLs;
+        request.ocspRequestData = ocspRequestData;
+        request.requestMethod = requestMethod;
+        request.hedgeDelay = hedgeDelay;
+        request.attemptStartObserver = attemptStartObserver;
+        request.attemptObserver = attemptObserver;
+        request.session = session;
+        request.sessionPool = sessionPool ?: [OCSPSessionPool sharedPool];
+        request.queue = queue;
+        request.subscriber = subscriber;
 
-        return nil;
+        [request start];
+
+        return request.disposable;
     }];
 }
 
 /// See comment in header
-+ (RACSignal<OCSPResponse*>*)ocspRequest:(NSURL*)ocspURL
-                         ocspRequestData:(NSData*)OCSPRequestData
-                                 session:(NSURLSession*)session
-                                   queue:(dispatch_queue_t)queue
++ (RACSignal<NSObject*>*)ocspRequest:(NSURL*)ocspURL
+                     ocspRequestData:(NSData*)OCSPRequestData
+                             session:(NSURLSession*)session
+                               queue:(dispatch_queue_t)queue
 {
-    return [RACSignal createSignal:^RACDisposable *(id<RACSubscriber>  _Nonnull subscriber) {
-        NSURLSession *sessionForRequest;
+    return [OCSPRequestService ocspRequest:ocspURL
+                           ocspRequestData:OCSPRequestData
+                                    method:OCSPRequestMethodPOST
+                                   session:session
+                                     queue:queue];
+}
+
+/// See comment in header
++ (RACSignal<NSObject*>*)ocspRequest:(NSURL*)ocspURL
+                     ocspRequestData:(NSData*)ocspRequestData
+                              method:(OCSPRequestMethod)method
+                             session:(NSURLSession*)session
+                               queue:(dispatch_queue_t)queue
+{
+    // Make an OCSP request with the POST method.
+    // OCSP POST request format: https://tools.ietf.org/html/rfc2560#appendix-A.1.1
+
+    NSMutableURLRequest *postReq = [NSMutableURLRequest requestWithURL:ocspURL];
+    postReq.HTTPMethod = @"POST";
+    [postReq addValue:@"application/ocsp-request" forHTTPHeaderField:@"Content-Type"];
+    [postReq setHTTPBody:ocspRequestData];
 
-        if (session) {
-            sessionForRequest = session;
-        } else {
-            NSURLSessionConfiguration *config =
-            [NSURLSessionConfiguration ephemeralSessionConfiguration];
+    RACSignal<NSObject*>* post = [OCSPRequestService ocspResponseForRequest:postReq
+                                                                    session:session];
 
-            sessionForRequest = [NSURLSession sessionWithConfiguration:config];
+    NSURL *getURL = nil;
+    if (method != OCSPRequestMethodPOST) {
+        getURL = [OCSPRequestService getRequestURL:ocspURL ocspRequestData:ocspRequestData];
+    }
+
+    if (getURL == nil) {
+        return post;
+    }
+
+    // Make an OCSP request with the GET method, which HTTP caches can answer.
+    // OCSP GET request format: https://tools.ietf.org/html/rfc6960#appendix-A.1
+
+    NSURLRequest *getReq = [NSURLRequest requestWithURL:getURL];
+
+    RACSignal<NSObject*>* get =
+    [[OCSPRequestService ocspResponseForRequest:getReq session:session]
+     flattenMap:^__kindof RACSignal * _Nullable(NSObject *x) {
+        if ([x isKindOfClass:[OCSPResponse class]] &&
+            [OCSPRequestService nextUpdatePassed:(OCSPResponse*)x]) {
+            // Stale response from a cache. Ask caches along the way to revalidate.
+            NSMutableURLRequest *reloadReq = [getReq mutableCopy];
+            reloadReq.cachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+            [reloadReq addValue:@"no-cache" forHTTPHeaderField:@"Cache-Control"];
+            return [OCSPRequestService ocspResponseForRequest:reloadReq session:session];
         }
+        return [RACSignal return:x];
+    }];
+
+    if (method == OCSPRequestMethodGET) {
+        return get;
+    }
+
+    return [get flattenMap:^__kindof RACSignal * _Nullable(NSObject *x) {
+        if ([x isKindOfClass:[OCSPResponse class]] && [(OCSPResponse*)x success]) {
+            return [RACSignal return:x];
+        }
+        // The responder may not support GET requests
+        return post;
+    }];
+}
+
+/// See comment in header
++ (NSURL*)getRequestURL:(NSURL*)ocspURL ocspRequestData:(NSData*)ocspRequestData {
+    if (ocspURL.query != nil || ocspURL.fragment != nil) {
+        return nil;
+    }
+
+    NSString *encoded = [URLEncode encode:[ocspRequestData base64EncodedStringWithOptions:0]];
+    if (encoded == nil || [encoded length] >= OCSPRequestServiceMaxGetRequestLength) {
+        return nil;
+    }
 
-        // Make an OCSP request with the POST method.
-        // OCSP POST request format: https://tools.ietf.org/html/rfc2560#appendix-A.1.1
+    NSString *base = [ocspURL absoluteString];
+    if (![base hasSuffix:@"/"]) {
+        base = [base stringByAppendingString:@"/"];
+    }
 
-        NSMutableURLRequest *ocspReq = [NSMutableURLRequest requestWithURL:ocspURL];
-        ocspReq.HTTPMethod = @"POST";
-        [ocspReq addValue:@"application/ocsp-request" forHTTPHeaderField:@"Content-Type"];
-        [ocspReq setHTTPBody:OCSPRequestData];
+    return [NSURL URLWithString:[base stringByAppendingString:encoded]];
+}
+
+/// Cold terminating signal which performs the request and emits either OCSPResponse or NSError
+/// and then completes. If the session is nil, the session for the URL from the shared pool is
+/// used.
++ (RACSignal<NSObject*>*)ocspResponseForRequest:(NSURLRequest*)ocspReq
+                                         session:(NSURLSession*)session
+{
+    return [RACSignal createSignal:^RACDisposable *(id<RACSubscriber>  _Nonnull subscriber) {
+        // Taken from the pool on subscription, right before the task is created
+        NSURLSession *sessionForRequest =
+            session ?: [[OCSPSessionPool sharedPool] sessionForURL:ocspReq.URL];
 
         NSURLSessionDataTask *dataTask =
         [sessionForRequest dataTaskWithRequest:ocspReq
@@ -132,6 +394,7 @@ NSErrorDomain _Nonnull const OCSPRequestServiceErrorDomain = @"OCSPRequestServic
                                 userInfo:@{NSLocalizedDescriptionKey:@"Invalid OCSP response data"}];
                 [subscriber sendNext:error];
                 [subscriber sendCompleted];
+                return;
             }
 
             [subscriber sendNext:r];
@@ -145,4 +408,14 @@ NSErrorDomain _Nonnull const OCSPRequestServiceErrorDomain = @"OCSPRequestServic
     }];
 }
 
+/// Returns TRUE if the earliest nextUpdate of the response has passed.
++ (BOOL)nextUpdatePassed:(OCSPResponse*)r {
+    NSDate *thisUpdate, *nextUpdate;
+    Error *e = [r thisUpdate:&thisUpdate nextUpdate:&nextUpdate];
+    if (e != nil || nextUpdate == nil) {
+        return FALSE;
+    }
+    return [nextUpdate timeIntervalSinceNow] <= 0;
+}
+
 @end
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import <Foundation/Foundation.h>
+#import "OCSPRequestService.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Circuit breaker state of an OCSP responder.
+typedef NS_ENUM(NSInteger, OCSPResponderState) {
+
+    /*!
+     * Healthy. Requests are sent to the responder as usual.
+     */
+    OCSPResponderStateClosed = 0,
+
+    /*!
+     * Failed repeatedly. Until the open duration has passed, the responder is attempted after all
+     * the other OCSP URLs of a certificate, or not at all if they are all open.
+     */
+    OCSPResponderStateOpen,
+
+    /*!
+     * The open duration has passed. A single probe request is let through; if it succeeds the
+     * responder is closed again, otherwise it is opened again.
+     */
+    OCSPResponderStateHalfOpen,
+};
+
+/// Health of an OCSP responder. Instances are snapshots which are not updated.
+@interface OCSPResponderStats : NSObject
+
+/// Host of the responder.
+@property (readonly, strong, nonatomic) NSString *host;
+
+/// Circuit breaker state.
+@property (readonly, assign, nonatomic) OCSPResponderState state;
+
+/// Exponentially weighted moving average of the request latency in seconds. 0 until a request
+/// succeeds or is cancelled.
+@property (readonly, assign, nonatomic) NSTimeInterval latency;
+
+/// Exponentially weighted moving average of the fraction of requests which failed.
+@property (readonly, assign, nonatomic) double errorRate;
+
+/// Time of the last failed request, if any.
+@property (readonly, strong, nonatomic) NSDate *__nullable lastFailure;
+
+/// Number of failed requests since the last successful one.
+@property (readonly, assign, nonatomic) NSUInteger consecutiveFailures;
+
+/// Number of requests which finished or were cancelled.
+@property (readonly, assign, nonatomic) NSUInteger requests;
+
+/// Number of requests which failed.
+@property (readonly, assign, nonatomic) NSUInteger failures;
+
+@end
+
+/*!
+ * Tracks the health of OCSP responders, keyed by the host of their OCSP URL, so that a slow or
+ * unavailable responder does not cost every lookup a full timeout.
+ *
+ * Each responder has a circuit breaker: once `failureThreshold` consecutive requests to it have
+ * failed it is opened and its URLs are attempted after those of healthy responders, or not at
+ * all if no healthy responder is left. After `openDuration` a single probe request is let
+ * through, which closes the circuit again if it succeeds.
+ *
+ * Thread safe.
+ */
+@interface OCSPResponderRegistry : NSObject
+
+/// Weight of the latest request in the latency and error rate averages. Must be in (0, 1].
+/// Defaults to 0.2.
+@property (atomic, assign) double smoothingFactor;
+
+/// Number of consecutive failures after which the circuit of a responder is opened. Defaults to 3.
+@property (atomic, assign) NSUInteger failureThreshold;
+
+/// Time in seconds a circuit stays open before a probe request is let through. Also the time
+/// after which a probe which has not reported back is considered lost and another one is let
+/// through. Defaults to 30.
+@property (atomic, assign) NSTimeInterval openDuration;
+
+/*!
+ Record that a request is about to be sent. If the circuit of the responder is half-open and its
+ probe has not been let through yet, the request is the probe. Must only be called for requests
+ which are actually sent, so that a probe is not lost to a URL which is never requested.
+
+ @param url OCSP URL of the responder, as found in the certificate.
+ */
+- (void)recordRequestStartTo:(NSURL*)url;
+
+/*!
+ Record the result of a request.
+
+ @param url OCSP URL of the responder, as found in the certificate.
+ @param latency Time in seconds the request took, or was in flight for if it was cancelled.
+ @param result Result of the request.
+ */
+- (void)recordRequestTo:(NSURL*)url
+                latency:(NSTimeInterval)latency
+                 result:(OCSPRequestAttemptResult)result;
+
+/*!
+ OCSP URLs in the order they should be attempted.
+
+ URLs of responders whose circuit is closed, or which are due a half-open probe, come first,
+ ordered by expected time to a successful response: the latency average scaled by the success
+ rate, plus a penalty for the error rate. Responders without any recorded requests are attempted
+ first so that they are measured. URLs of open circuits come last rather than being dropped, so
+ that they are still attempted if all the others fail. The relative order of equally ranked URLs
+ is preserved.
+
+ If the circuits of all the responders are open, and none is due a probe, returns an empty array:
+ the URLs should not be requested at all.
+
+ Does not let through the probe of a half-open responder; see recordRequestStartTo:.
+ */
+- (NSArray<NSURL*>*)orderURLs:(NSArray<NSURL*>*)urls;
+
+/*!
+ Same as orderURLs:, for URLs which differ from the OCSP URLs of the responders, e.g. because they
+ were rewritten to go through a proxy. Each URL is ranked by the responder URL at the same index.
+ */
+- (NSArray<NSURL*>*)orderURLs:(NSArray<NSURL*>*)urls
+                responderURLs:(NSArray<NSURL*>*)responderURLs;
+
+/// Stats of the responder at the host, or nil if no requests to it were recorded.
+- (OCSPResponderStats*__nullable)statsForHost:(NSString*)host;
+
+/// Stats of all the responders with recorded requests, keyed by host.
+- (NSDictionary<NSString*, OCSPResponderStats*>*)allStats;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import "OCSPResponderRegistry.h"
+
+/// Lowest success rate used when ranking responders, so that the expected time to a successful
+/// response of a responder which always fails stays finite.
+static const double OCSPResponderRegistryMinSuccessRate = 0.05;
+
+/// Latency in seconds added to the rank of a responder per unit of error rate. Failures are not
+/// timed, so this stands in for the time lost to a failed request before the next URL is tried.
+static const NSTimeInterval OCSPResponderRegistryFailurePenalty = 1;
+
+@interface OCSPResponderStats ()
+
+@property (strong, nonatomic) NSString *host;
+@property (assign, nonatomic) OCSPResponderState state;
+@property (assign, nonatomic) NSTimeInterval latency;
+@property (assign, nonatomic) double errorRate;
+@property (strong, nonatomic) NSDate *lastFailure;
+@property (assign, nonatomic) NSUInteger consecutiveFailures;
+@property (assign, nonatomic) NSUInteger requests;
+@property (assign, nonatomic) NSUInteger failures;
+
+/// Number of latencies in the average.
+@property (assign, nonatomic) NSUInteger latencySamples;
+
+/// When the circuit was opened, or when the probe was let through if it is half-open.
+@property (strong, nonatomic) NSDate *stateChanged;
+
+/// TRUE if the circuit is half-open and its probe has been let through.
+@property (assign, nonatomic) BOOL probeInFlight;
+
+@end
+
+@implementation OCSPResponderStats
+
+/// Add a latency to the average.
+- (void)addLatency:(NSTimeInterval)latency smoothingFactor:(double)alpha {
+    if (self.latencySamples == 0) {
+        self.latency = latency;
+    } else {
+        self.latency = alpha * latency + (1 - alpha) * self.latency;
+    }
+    self.latencySamples++;
+}
+
+/// Copy of the public properties.
+- (OCSPResponderStats*)snapshot {
+    OCSPResponderStats *s = [[OCSPResponderStats alloc] init];
+    s.host = self.host;
+    s.state = self.state;
+    s.latency = self.latency;
+    s.errorRate = self.errorRate;
+    s.lastFailure = self.lastFailure;
+    s.consecutiveFailures = self.consecutiveFailures;
+    s.requests = self.requests;
+    s.failures = self.failures;
+    return s;
+}
+
+- (NSString*)description {
+    NSArray<NSString*>* states = @[@"closed", @"open", @"half-open"];
+    return [NSString stringWithFormat:@"%@: %@, latency: %.3fs, error rate: %.2f, requests: %lu, "
+                                       "failures: %lu",
+            self.host, [states objectAtIndex:self.state], self.latency, self.errorRate,
+            (unsigned long)self.requests, (unsigned long)self.failures];
+}
+
+@end
+
+@implementation OCSPResponderRegistry {
+    // Guarded by synchronizing on self
+    NSMutableDictionary<NSString*, OCSPResponderStats*>* responders;
+}
+
+- (instancetype)init {
+    self = [super init];
+
+    if (self) {
+        self.smoothingFactor = 0.2;
+        self.failureThreshold = 3;
+        self.openDuration = 30;
+        self->responders = [[NSMutableDictionary alloc] init];
+    }
+
+    return self;
+}
+
+/// Key of the responder at the URL.
++ (NSString*)hostForURL:(NSURL*)url {
+    return [url.host lowercaseString] ?: @"";
+}
+
+/// Open the circuit for a probe if the open duration has passed, or let through another probe if
+/// the last one never reported back. Must be called while synchronized on self.
+- (void)updateStateOf:(OCSPResponderStats*)s now:(NSDate*)now {
+    NSTimeInterval openDuration = self.openDuration;
+
+    if (s.state == OCSPResponderStateOpen &&
+        [now timeIntervalSinceDate:s.stateChanged] >= openDuration) {
+        s.state = OCSPResponderStateHalfOpen;
+        s.probeInFlight = FALSE;
+    } else if (s.state == OCSPResponderStateHalfOpen && s.probeInFlight &&
+               [now timeIntervalSinceDate:s.stateChanged] >= openDuration) {
+        // The probe never reported back
+        s.probeInFlight = FALSE;
+    }
+}
+
+// See comment in header
+- (void)recordRequestStartTo:(NSURL*)url {
+    NSString *host = [OCSPResponderRegistry hostForURL:url];
+    NSDate *now = [NSDate date];
+
+    @synchronized (self) {
+        OCSPResponderStats *s = [self->responders objectForKey:host];
+        if (s == nil) {
+            return;
+        }
+
+        [self updateStateOf:s now:now];
+
+        if (s.state == OCSPResponderStateHalfOpen && !s.probeInFlight) {
+            s.probeInFlight = TRUE;
+            s.stateChanged = now;
+        }
+    }
+}
+
+// See comment in header
+- (void)recordRequestTo:(NSURL*)url
+                latency:(NSTimeInterval)latency
+                 result:(OCSPRequestAttemptResult)result {
+    NSString *host = [OCSPResponderRegistry hostForURL:url];
+    double alpha = self.smoothingFactor;
+    NSUInteger failureThreshold = self.failureThreshold;
+
+    @synchronized (self) {
+        OCSPResponderStats *s = [self->responders objectForKey:host];
+        if (s == nil) {
+            s = [[OCSPResponderStats alloc] init];
+            s.host = host;
+            [self->responders setObject:s forKey:host];
+        }
+
+        s.requests++;
+
+        switch (result) {
+            case OCSPRequestAttemptResultSucceeded:
+                [s addLatency:latency smoothingFactor:alpha];
+                s.errorRate = (1 - alpha) * s.errorRate;
+                s.consecutiveFailures = 0;
+                s.state = OCSPResponderStateClosed;
+                s.probeInFlight = FALSE;
+                break;
+
+            case OCSPRequestAttemptResultFailed:
+                // The latency of failures is not recorded since a responder which refuses
+                // connections would otherwise look fast
+                s.errorRate = alpha + (1 - alpha) * s.errorRate;
+                s.failures++;
+                s.consecutiveFailures++;
+                s.lastFailure = [NSDate date];
+
+                if (s.state == OCSPResponderStateHalfOpen ||
+                    (s.state == OCSPResponderStateClosed &&
+                     s.consecutiveFailures >= failureThreshold)) {
+                    s.state = OCSPResponderStateOpen;
+                    s.stateChanged = s.lastFailure;
+                    s.probeInFlight = FALSE;
+                }
+                break;
+
+            case OCSPRequestAttemptResultCancelled:
+                // The responder took at least this long, which is only news if it is slower than
+                // the average
+                if (latency > s.latency) {
+                    [s addLatency:latency smoothingFactor:alpha];
+                }
+                if (s.state == OCSPResponderStateHalfOpen) {
+                    // Inconclusive probe; let another one through
+                    s.probeInFlight = FALSE;
+                }
+                break;
+        }
+    }
+}
+
+// See comment in header
+- (NSArray<NSURL*>*)orderURLs:(NSArray<NSURL*>*)urls {
+    return [self orderURLs:urls responderURLs:urls];
+}
+
+// See comment in header
+- (NSArray<NSURL*>*)orderURLs:(NSArray<NSURL*>*)urls
+                responderURLs:(NSArray<NSURL*>*)responderURLs {
+    assert([urls count] == [responderURLs count]);
+
+    NSDate *now = [NSDate date];
+
+    // Ranks in the same order as the URLs
+    NSMutableArray<NSNumber*>* available = [[NSMutableArray alloc] initWithCapacity:[urls count]];
+    NSMutableArray<NSNumber*>* costs = [[NSMutableArray alloc] initWithCapacity:[urls count]];
+
+    @synchronized (self) {
+        for (NSURL *url in responderURLs) {
+            OCSPResponderStats *s =
+                [self->responders objectForKey:[OCSPResponderRegistry hostForURL:url]];
+
+            if (s == nil) {
+                [available addObject:@(TRUE)];
+                [costs addObject:@(0)];
+                continue;
+            }
+
+            [self updateStateOf:s now:now];
+
+            // The probe is only let through once it is sent, see recordRequestStartTo:
+            BOOL isAvailable = s.state == OCSPResponderStateClosed ||
+                               (s.state == OCSPResponderStateHalfOpen && !s.probeInFlight);
+
+            [available addObject:@(isAvailable)];
+            double successRate = MAX(1 - s.errorRate, OCSPResponderRegistryMinSuccessRate);
+            [costs addObject:@(s.latency / successRate +
+                               s.errorRate * OCSPResponderRegistryFailurePenalty)];
+        }
+    }
+
+    if (![available containsObject:@(TRUE)]) {
+        return @[];
+    }
+
+    NSMutableArray<NSNumber*>* indexes = [[NSMutableArray alloc] initWithCapacity:[urls count]];
+    for (NSUInteger i = 0; i < [urls count]; i++) {
+        [indexes addObject:@(i)];
+    }
+
+    [indexes sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(NSNumber *a,
+                                                                             NSNumber *b) {
+        NSUInteger i = [a unsignedIntegerValue], j = [b unsignedIntegerValue];
+        BOOL availableA = [[available objectAtIndex:i] boolValue];
+        BOOL availableB = [[available objectAtIndex:j] boolValue];
+
+        if (availableA != availableB) {
+            return availableA ? NSOrderedAscending : NSOrderedDescending;
+        }
+        if (!availableA) {
+            // Open circuits keep their relative order
+            return NSOrderedSame;
+        }
+        return [[costs objectAtIndex:i] compare:[costs objectAtIndex:j]];
+    }];
+
+    NSMutableArray<NSURL*>* ordered = [[NSMutableArray alloc] initWithCapacity:[urls count]];
+    for (NSNumber *i in indexes) {
+        [ordered addObject:[urls objectAtIndex:[i unsignedIntegerValue]]];
+    }
+
+    return ordered;
+}
+
+// See comment in header
+- (OCSPResponderStats*)statsForHost:(NSString*)host {
+    @synchronized (self) {
+        return [[self->responders objectForKey:[host lowercaseString]] snapshot];
+    }
+}
+
+// See comment in header
+- (NSDictionary<NSString*, OCSPResponderStats*>*)allStats {
+    NSMutableDictionary<NSString*, OCSPResponderStats*>* stats = [[NSMutableDictionary alloc] init];
+
+    @synchronized (self) {
+        for (NSString *host in self->responders) {
+            [stats setObject:[[self->responders objectForKey:host] snapshot] forKey:host];
+        }
+    }
+
+    return stats;
+}
+
+@end
@@ -24,6 +24,40 @@
 
 NS_ASSUME_NONNULL_BEGIN
 
+FOUNDATION_EXPORT NSErrorDomain const OCSPResponseErrorDomain;
+
+/// Error codes which can be returned by checkForCert:issuer:
+typedef NS_ERROR_ENUM(OCSPResponseErrorDomain, OCSPResponseErrorCode) {
+    OCSPResponseErrorCodeUnknown = -1,
+
+    /*!
+     * The response status is not successful or the response has no basic response.
+     */
+    OCSPResponseErrorCodeUnsuccessful = 1,
+
+    /*!
+     * The certificate or issuer could not be converted to OpenSSL objects.
+     */
+    OCSPResponseErrorCodeSecCertToX509Failed,
+
+    /*!
+     * The response has no single response whose CertID matches the certificate and issuer.
+     */
+    OCSPResponseErrorCodeNoSingleResponseForCert,
+
+    /*!
+     * The current time is not within thisUpdate and nextUpdate of the single response, or the
+     * times could not be parsed.
+     */
+    OCSPResponseErrorCodeOutsideValidityWindow,
+
+    /*!
+     * The response is not signed by the issuer or by a responder certificate which the issuer
+     * delegated OCSP signing to.
+     */
+    OCSPResponseErrorCodeInvalidSignature,
+};
+
 /// Convenience wrapper around OCSP response data
 @interface OCSPResponse : NSObject
 
@@ -35,6 +69,41 @@ NS_ASSUME_NONNULL_BEGIN
 /// Expired responses in OCSP response
 - (NSArray<RACThreeTuple<Error*,OCSPSingleResponse*,NSNumber*>*>*)expiredResponses;
 
+/// Single responses in OCSP response
+- (NSArray<OCSPSingleResponse*>*)singleResponses;
+
+/// Returns TRUE if the response contains a single response for the provided certificate. A
+/// response to a request with several CertIDs may not answer for all of them.
+- (BOOL)hasSingleResponseForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer;
+
+/// Time at which the OCSP responder signed the response. Returns nil if the response has no basic
+/// response or the time could not be parsed.
+- (NSDate*__nullable)producedAt;
+
+/// Validity window of the response. This is the latest thisUpdate and the earliest nextUpdate of
+/// all the single responses in the response. nextUpdate is set to nil if none of the single
+/// responses specify a nextUpdate.
+- (Error*)thisUpdate:(NSDate*__nullable*__nonnull)thisUpdate
+          nextUpdate:(NSDate*__nullable*__nonnull)nextUpdate;
+
+/// Check that the response is usable for the certificate: the response is successful, has a single
+/// response whose CertID matches the certificate and issuer, is signed by the issuer or by a
+/// delegated responder certificate issued by the issuer and the current time is within thisUpdate
+/// and nextUpdate. Returns nil if all checks pass.
+/// The certificate status is not checked. A response which passes the checks and says the
+/// certificate is revoked or unknown is an authentic answer, which must be kept so that trust
+/// evaluation rejects the certificate; see reportsRevokedOrUnknownForCert:issuer:.
+/// The signature is verified with OCSP_basic_verify, with the issuer as the only trust anchor. The
+/// result of every check but the validity window is memoized per certificate and issuer, so
+/// repeated checks of a shared response are cheap. Thread safe.
+/// @note The issuer itself is not verified, which is left to trust evaluation.
+- (NSError*__nullable)checkForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer;
+
+/// Returns TRUE if the single response for the certificate says it is revoked or unknown to the
+/// responder, and the response is signed by the issuer or its delegated responder. The validity
+/// window is not checked. Memoized like checkForCert:issuer:.
+- (BOOL)reportsRevokedOrUnknownForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer;
+
 /// OCSP response status
 - (int)status;
 
@@ -18,7 +18,57 @@
  */
 
 #import "OCSPResponse.h"
+#import <openssl/err.h>
 #import <openssl/ocsp.h>
+#import <openssl/x509_vfy.h>
+#import "OCSPGeneralizedTime.h"
+#import "OCSPOpenSSLBridge.h"
+
+NSErrorDomain _Nonnull const OCSPResponseErrorDomain = @"OCSPResponseErrorDomain";
+
+/// Allowed difference in seconds between the clocks of the responder and the device when checking
+/// thisUpdate.
+#define OCSPResponseClockSkew (5 * 60)
+
+/// Owns a decoded basic response. Single responses borrowed from it retain the owner rather than
+/// the OCSPResponse, which holds them, to avoid a retain cycle.
+@interface OCSPBasicResponseOwner : NSObject
+
+@property (readonly, assign, nonatomic) OCSP_BASICRESP *basicResponse;
+
+@end
+
+@implementation OCSPBasicResponseOwner
+
+- (instancetype)initWithBasicResponse:(OCSP_BASICRESP*)basicResponse {
+    self = [super init];
+
+    if (self) {
+        self->_basicResponse = basicResponse;
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    OCSP_BASICRESP_free(self->_basicResponse);
+}
+
+@end
+
+/// Result of the checks of a response for a certificate which do not depend on the current time.
+@interface OCSPResponseVerification : NSObject
+
+/// Single response for the certificate. Nil if there is none.
+@property (strong, nonatomic) OCSPSingleResponse *singleResponse;
+
+/// Reason the checks failed. Nil if they passed.
+@property (strong, nonatomic) NSError *error;
+
+@end
+
+@implementation OCSPResponseVerification
+@end
 
 @interface OCSPResponse ()
 
@@ -28,6 +78,18 @@
 
 @implementation OCSPResponse {
     OCSP_RESPONSE *response;
+    // Decoded once so that it is shared by the single responses and every caller. NULL if the
+    // response has no basic response, e.g. if it is unsuccessful.
+    OCSP_BASICRESP *basicResponse;
+    OCSPBasicResponseOwner *basicResponseOwner;
+    NSArray<OCSPSingleResponse*>* singleResponses;
+    // Validity window, or the error encountered parsing it
+    NSDate *thisUpdate;
+    NSDate *nextUpdate;
+    Error *validityError;
+    NSDate *producedAt;
+    // Verifications by certificate and issuer DER. Guarded by synchronizing on self.
+    NSMutableDictionary<NSData*, OCSPResponseVerification*>* verifications;
 }
 
 - (void)dealloc {
@@ -46,6 +108,18 @@
         if (!self->response) {
             return nil;
         }
+
+        // Everything derived from the response is decoded up front. Responses are immutable
+        // afterwards, so they can be shared between threads, e.g. by every hit on a cache entry.
+        self->basicResponse = OCSP_response_get1_basic(self->response);
+        if (self->basicResponse != NULL) {
+            self->basicResponseOwner =
+              [[OCSPBasicResponseOwner alloc] initWithBasicResponse:self->basicResponse];
+        }
+        self->singleResponses = [self singleResponsesFromBasicResponse];
+        self->validityError = [self parseValidityWindow];
+        self->producedAt = [self parseProducedAt];
+        self->verifications = [[NSMutableDictionary alloc] init];
     }
 
     return self;
@@ -55,21 +129,12 @@
 - (NSArray<RACThreeTuple<Error*,
                          OCSPSingleResponse*,
                          NSNumber*>*>*)expiredResponses {
-    return [OCSPResponse numExpiredResponsesFromResponse:self->response];
-}
-
-+ (NSArray<RACThreeTuple<Error*,
-                         OCSPSingleResponse*,
-                         NSNumber*>*>*)numExpiredResponsesFromResponse:(OCSP_RESPONSE*)r {
 
     NSMutableArray<RACThreeTuple<Error*,
                                  OCSPSingleResponse*,
                                  NSNumber*>*>* results = [[NSMutableArray alloc] init];
 
-    NSArray<OCSPSingleResponse*>* responses = [OCSPResponse
-                                               singleResponsesFromResponse:r];
-
-    for (OCSPSingleResponse *response in responses) {
+    for (OCSPSingleResponse *response in self->singleResponses) {
         BOOL expired;
 
         Error *e = [response expired:&expired];
@@ -83,29 +148,275 @@
     return results;
 }
 
-+ (NSArray<OCSPSingleResponse*>*)singleResponsesFromResponse:(OCSP_RESPONSE*)r {
+/// Single responses of the basic response, which they borrow from this object.
+- (NSArray<OCSPSingleResponse*>*)singleResponsesFromBasicResponse {
     NSMutableArray<OCSPSingleResponse*>* responses = [[NSMutableArray alloc] init];
 
-    OCSP_BASICRESP *basicResponse = OCSP_response_get1_basic(r);
-
-    if (!basicResponse) {
+    if (!self->basicResponse) {
         return responses;
     }
 
-    int responseCount = OCSP_resp_count(basicResponse);
+    int responseCount = OCSP_resp_count(self->basicResponse);
 
     for (int i = 0; i < responseCount; i++) {
-        OCSP_SINGLERESP *singleResponseC = OCSP_resp_get0(basicResponse, i);
+        OCSP_SINGLERESP *singleResponseC = OCSP_resp_get0(self->basicResponse, i);
 
         OCSPSingleResponse *singleResponse =
-          [[OCSPSingleResponse alloc] initWithResponse:singleResponseC];
+          [[OCSPSingleResponse alloc] initWithResponse:singleResponseC
+                                                owner:self->basicResponseOwner];
 
-        [responses addObject:singleResponse];
+        if (singleResponse != nil) {
+            [responses addObject:singleResponse];
+        }
     }
 
     return responses;
 }
 
+/// See comment in header
+- (NSArray<OCSPSingleResponse*>*)singleResponses {
+    return self->singleResponses;
+}
+
+/// See comment in header
+- (BOOL)hasSingleResponseForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer {
+    if (!self->basicResponse) {
+        return FALSE;
+    }
+
+    X509 *x509Cert = [OCSPOpenSSLBridge secCertRefToX509:cert];
+    X509 *x509Issuer = [OCSPOpenSSLBridge secCertRefToX509:issuer];
+
+    OCSP_CERTID *certID = NULL;
+    if (x509Cert != NULL && x509Issuer != NULL) {
+        certID = OCSP_cert_to_id(EVP_sha1(), x509Cert, x509Issuer);
+    }
+
+    BOOL found = certID != NULL && OCSP_resp_find(self->basicResponse, certID, -1) >= 0;
+
+    OCSP_CERTID_free(certID);
+    X509_free(x509Issuer);
+    X509_free(x509Cert);
+
+    return found;
+}
+
+/// See comment in header
+- (NSDate*)producedAt {
+    return self->producedAt;
+}
+
+/// Parse the time at which the response was signed.
+- (NSDate*)parseProducedAt {
+    if (!self->basicResponse) {
+        return nil;
+    }
+
+    ASN1_GENERALIZEDTIME *t = self->basicResponse->tbsResponseData->producedAt;
+
+    return [OCSPGeneralizedTime dateFromASN1Time:t];
+}
+
+/// See comment in header
+- (Error*)thisUpdate:(NSDate**)thisUpdate nextUpdate:(NSDate**)nextUpdate {
+    *thisUpdate = self->thisUpdate;
+    *nextUpdate = self->nextUpdate;
+
+    return self->validityError;
+}
+
+/// Parse the validity window of the single responses. Returns an error if it cannot be parsed.
+- (Error*)parseValidityWindow {
+    if ([self->singleResponses count] == 0) {
+        return @"No single responses in OCSP response";
+    }
+
+    NSDate *latestThisUpdate = nil, *earliestNextUpdate = nil;
+
+    for (OCSPSingleResponse *response in self->singleResponses) {
+        NSDate *t, *n;
+
+        Error *e = [response thisUpdate:&t nextUpdate:&n];
+        if (e != nil) {
+            return e;
+        }
+
+        if (latestThisUpdate == nil || [t compare:latestThisUpdate] == NSOrderedDescending) {
+            latestThisUpdate = t;
+        }
+
+        if (n != nil &&
+            (earliestNextUpdate == nil || [n compare:earliestNextUpdate] == NSOrderedAscending)) {
+            earliestNextUpdate = n;
+        }
+    }
+
+    self->thisUpdate = latestThisUpdate;
+    self->nextUpdate = earliestNextUpdate;
+
+    return nil;
+}
+
+/// See comment in header
+- (NSError*)checkForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer {
+    if (![self success] || self->basicResponse == NULL) {
+        return [OCSPResponse errorWithCode:OCSPResponseErrorCodeUnsuccessful
+                               description:@"Response is not successful"];
+    }
+
+    OCSPResponseVerification *verification = [self verificationForCert:cert issuer:issuer];
+    if (verification.error != nil) {
+        return verification.error;
+    }
+
+    // The validity window depends on the current time, so it is checked on every call
+    NSDate *thisUpdate, *nextUpdate;
+    Error *e = [verification.singleResponse thisUpdate:&thisUpdate nextUpdate:&nextUpdate];
+    if (e != nil ||
+        [thisUpdate timeIntervalSinceNow] > OCSPResponseClockSkew ||
+        (nextUpdate != nil && [nextUpdate timeIntervalSinceNow] <= 0)) {
+        return [OCSPResponse errorWithCode:OCSPResponseErrorCodeOutsideValidityWindow
+                               description:e != nil ? e : @"Current time is outside of the "
+                                                           "validity window of the response"];
+    }
+
+    return nil;
+}
+
+// See comment in header
+- (BOOL)reportsRevokedOrUnknownForCert:(SecCertificateRef)cert issuer:(SecCertificateRef)issuer {
+    if (![self success] || self->basicResponse == NULL) {
+        return FALSE;
+    }
+
+    OCSPResponseVerification *verification = [self verificationForCert:cert issuer:issuer];
+    if (verification.error != nil) {
+        return FALSE;
+    }
+
+    return verification.singleResponse.response->certStatus->type != V_OCSP_CERTSTATUS_GOOD;
+}
+
+/// Memoized result of verifyForCert:issuer:.
+- (OCSPResponseVerification*)verificationForCert:(SecCertificateRef)cert
+                                          issuer:(SecCertificateRef)issuer {
+    // DER encodings are self-delimiting, so the concatenation identifies the pair
+    NSMutableData *key =
+      [(__bridge_transfer NSData*)SecCertificateCopyData(cert) mutableCopy];
+    [key appendData:(__bridge_transfer NSData*)SecCertificateCopyData(issuer)];
+
+    OCSPResponseVerification *verification;
+
+    @synchronized (self) {
+        verification = [self->verifications objectForKey:key];
+    }
+
+    if (verification != nil) {
+        return verification;
+    }
+
+    // Verified outside of the lock, a concurrent check for the same pair only duplicates work
+    verification = [self verifyForCert:cert issuer:issuer];
+
+    @synchronized (self) {
+        [self->verifications setObject:verification forKey:key];
+    }
+
+    return verification;
+}
+
+/// Find the single response for the certificate and verify the signature. The certificate status
+/// is not checked: a revoked or unknown status is an answer, not a reason to discard the response.
+- (OCSPResponseVerification*)verifyForCert:(SecCertificateRef)cert
+                                    issuer:(SecCertificateRef)issuer {
+    OCSPResponseVerification *verification = [[OCSPResponseVerification alloc] init];
+
+    X509 *x509Cert = [OCSPOpenSSLBridge secCertRefToX509:cert];
+    X509 *x509Issuer = [OCSPOpenSSLBridge secCertRefToX509:issuer];
+
+    if (x509Cert == NULL || x509Issuer == NULL) {
+        verification.error =
+          [OCSPResponse errorWithCode:OCSPResponseErrorCodeSecCertToX509Failed
+                          description:@"Failed to convert cert to OpenSSL X509 object"];
+    } else {
+        verification.singleResponse = [self singleResponseForCert:x509Cert issuer:x509Issuer];
+
+        if (verification.singleResponse == nil) {
+            verification.error =
+              [OCSPResponse errorWithCode:OCSPResponseErrorCodeNoSingleResponseForCert
+                              description:@"No single response for the certificate"];
+        } else if (![self verifySignatureWithIssuer:x509Issuer]) {
+            verification.error =
+              [OCSPResponse errorWithCode:OCSPResponseErrorCodeInvalidSignature
+                              description:@"Response is not signed by the issuer or a delegated "
+                                           "responder"];
+        }
+    }
+
+    X509_free(x509Issuer);
+    X509_free(x509Cert);
+
+    return verification;
+}
+
+/// Single response whose CertID matches the certificate and issuer, or nil if there is none.
+- (OCSPSingleResponse*)singleResponseForCert:(X509*)x509Cert issuer:(X509*)x509Issuer {
+    // The CertID is compared with the hash algorithm chosen by the responder, which need not be
+    // SHA-1
+    for (OCSPSingleResponse *singleResponse in self->singleResponses) {
+        OCSP_CERTID *responseCertID = singleResponse.response->certId;
+        const EVP_MD *md = EVP_get_digestbyobj(responseCertID->hashAlgorithm->algorithm);
+        if (md == NULL) {
+            continue;
+        }
+        OCSP_CERTID *certID = OCSP_cert_to_id(md, x509Cert, x509Issuer);
+        BOOL match = certID != NULL && OCSP_id_cmp(certID, responseCertID) == 0;
+        OCSP_CERTID_free(certID);
+        if (match) {
+            return singleResponse;
+        }
+    }
+
+    return nil;
+}
+
+/// Verify the response with OCSP_basic_verify, with the issuer as the only trust anchor. The
+/// response must be signed by the issuer, or by a responder certificate included in the response
+/// which the issuer issued with the OCSP signing extended key usage:
+/// https://tools.ietf.org/html/rfc6960#section-4.2.2.2
+- (BOOL)verifySignatureWithIssuer:(X509*)x509Issuer {
+    X509_STORE *store = X509_STORE_new();
+    STACK_OF(X509) *issuerCerts = sk_X509_new_null();
+
+    BOOL verified = FALSE;
+
+    if (store != NULL && issuerCerts != NULL &&
+        X509_STORE_add_cert(store, x509Issuer) == 1 &&
+        sk_X509_push(issuerCerts, x509Issuer) > 0) {
+        // The issuer is usually an intermediate, so the chain of the signer must be allowed to end
+        // at it rather than at a self-signed root
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+
+        // OCSP_NOEXPLICIT: signers which are neither the issuer nor delegated by it are rejected,
+        // even if their chain is trusted
+        verified = OCSP_basic_verify(self->basicResponse, issuerCerts, store, OCSP_NOEXPLICIT) > 0;
+    }
+
+    sk_X509_free(issuerCerts);
+    X509_STORE_free(store);
+
+    // Failed verifications leave errors on the OpenSSL error queue of the thread
+    ERR_clear_error();
+
+    return verified;
+}
+
++ (NSError*)errorWithCode:(OCSPResponseErrorCode)code description:(NSString*)description {
+    return [NSError errorWithDomain:OCSPResponseErrorDomain
+                               code:code
+                           userInfo:@{NSLocalizedDescriptionKey:description}];
+}
+
 /// See comment in header
 - (int)status {
     return [OCSPResponse statusFromResponse:self->response];
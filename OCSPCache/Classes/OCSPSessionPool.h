@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/*!
+ * Sessions for OCSP requests which are made without a session provided by the caller.
+ *
+ * Each responder host gets a session of its own, created from the base configuration, which is
+ * reused for all requests to the host. This keeps connections to the responder alive between
+ * requests, so that only the first request to a host pays for the DNS lookup and the TCP
+ * handshake, and bounds the number of concurrent connections to each host. Since the base
+ * configuration is ephemeral by default, each host also gets its own in-memory HTTP cache for
+ * GET requests.
+ *
+ * Sessions which are not used for `idleTimeout` are invalidated, letting their tasks finish. All
+ * the sessions are invalidated when the pool is deallocated or `invalidateSessions` is called.
+ *
+ * Thread safe.
+ */
+@interface OCSPSessionPool : NSObject
+
+/// Configuration the sessions are created from.
+@property (readonly, copy, nonatomic) NSURLSessionConfiguration *configuration;
+
+/// Time in seconds after which a session which has not been used is invalidated. Defaults to 90.
+@property (atomic, assign) NSTimeInterval idleTimeout;
+
+/// Number of sessions in the pool.
+@property (readonly, atomic, assign) NSUInteger sessionCount;
+
+/// Number of sessions created since the pool was initialized.
+@property (readonly, atomic, assign) NSUInteger sessionsCreated;
+
+/// Pool used by OCSPRequestService when neither a session nor a pool is provided.
++ (instancetype)sharedPool;
+
+/// Initialize with an ephemeral configuration which allows 2 connections per host.
+- (instancetype)init;
+
+/*!
+ Initialize with the provided configuration.
+
+ @param configuration Configuration the sessions are created from. It is copied, and its
+ HTTPMaximumConnectionsPerHost is replaced with `maxConnectionsPerHost`.
+ @param maxConnectionsPerHost Maximum number of concurrent connections to each responder host.
+ Requests beyond it wait for a connection.
+ */
+- (instancetype)initWithConfiguration:(NSURLSessionConfiguration*)configuration
+                maxConnectionsPerHost:(NSInteger)maxConnectionsPerHost;
+
+/// Session for requests to the host of the URL. Creates the session if there is none.
+- (NSURLSession*)sessionForURL:(NSURL*)url;
+
+/// Invalidate all the sessions, letting their tasks finish. The pool can still be used afterwards;
+/// new sessions are created as needed.
+- (void)invalidateSessions;
+
+@end
+
+NS_ASSUME_NONNULL_END
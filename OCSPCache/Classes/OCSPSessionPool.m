@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#import "OCSPSessionPool.h"
+
+/// Session of a responder host.
+@interface OCSPPooledSession : NSObject
+
+@property (strong, nonatomic) NSURLSession *session;
+@property (strong, nonatomic) NSDate *lastUsed;
+
+@end
+
+@implementation OCSPPooledSession
+@end
+
+@interface OCSPSessionPool ()
+
+@property (atomic, assign) NSUInteger sessionsCreated;
+
+@end
+
+@implementation OCSPSessionPool {
+    // Guarded by synchronizing on self
+    NSMutableDictionary<NSString*, OCSPPooledSession*>* sessions;
+}
+
+// See comment in header
++ (instancetype)sharedPool {
+    static OCSPSessionPool *sharedPool;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedPool = [[OCSPSessionPool alloc] init];
+    });
+    return sharedPool;
+}
+
+// See comment in header
+- (instancetype)init {
+    return [self initWithConfiguration:[NSURLSessionConfiguration ephemeralSessionConfiguration]
+                 maxConnectionsPerHost:2];
+}
+
+// See comment in header
+- (instancetype)initWithConfiguration:(NSURLSessionConfiguration*)configuration
+                maxConnectionsPerHost:(NSInteger)maxConnectionsPerHost {
+    self = [super init];
+
+    if (self) {
+        self->_configuration = [configuration copy];
+        self->_configuration.HTTPMaximumConnectionsPerHost = maxConnectionsPerHost;
+        self.idleTimeout = 90;
+        self->sessions = [[NSMutableDictionary alloc] init];
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    for (OCSPPooledSession *s in [self->sessions allValues]) {
+        [s.session finishTasksAndInvalidate];
+    }
+}
+
+// See comment in header
+- (NSUInteger)sessionCount {
+    @synchronized (self) {
+        return [self->sessions count];
+    }
+}
+
+// See comment in header
+- (NSURLSession*)sessionForURL:(NSURL*)url {
+    NSString *host = [url.host lowercaseString] ?: @"";
+    NSDate *now = [NSDate date];
+    NSTimeInterval idleTimeout = self.idleTimeout;
+
+    @synchronized (self) {
+        // Invalidate idle sessions. There are only as many sessions as there are responder hosts,
+        // so this is cheap.
+        for (NSString *h in [self->sessions allKeys]) {
+            OCSPPooledSession *s = [self->sessions objectForKey:h];
+            if ([now timeIntervalSinceDate:s.lastUsed] >= idleTimeout) {
+                [s.session finishTasksAndInvalidate];
+                [self->sessions removeObjectForKey:h];
+            }
+        }
+
+        OCSPPooledSession *s = [self->sessions objectForKey:host];
+        if (s == nil) {
+            s = [[OCSPPooledSession alloc] init];
+            s.session = [NSURLSession sessionWithConfiguration:self.configuration];
+            [self->sessions setObject:s forKey:host];
+            self.sessionsCreated++;
+        }
+        s.lastUsed = now;
+
+        return s.session;
+    }
+}
+
+// See comment in header
+- (void)invalidateSessions {
+    @synchronized (self) {
+        for (OCSPPooledSession *s in [self->sessions allValues]) {
+            [s.session finishTasksAndInvalidate];
+        }
+        [self->sessions removeAllObjects];
+    }
+}
+
+@end
@@ -27,12 +27,21 @@ NS_ASSUME_NONNULL_BEGIN
 
 @property (readonly, assign, nonatomic) OCSP_SINGLERESP *response;
 
+/// Init with a copy of the provided single response. Returns nil if the response cannot be copied.
 - (instancetype)initWithResponse:(OCSP_SINGLERESP*)response;
 
+/// Init with the provided single response without copying it. `owner` must keep the structure
+/// which contains `response` alive, and is retained for the lifetime of the single response.
+- (instancetype)initWithResponse:(OCSP_SINGLERESP*)response owner:(id)owner;
+
+/// Returns TRUE in `expired` if nextUpdate is in the past. A response without nextUpdate never
+/// expires.
 - (Error*)expired:(BOOL*)expired;
 
 + (Error*)expiredWithResponse:(OCSP_SINGLERESP*)response expired:(BOOL*)expired;
 
+/// thisUpdate and nextUpdate, which are parsed once when the single response is initialized.
+/// nextUpdate is optional and is set to nil if it is not present in the response.
 - (Error*)thisUpdate:(NSDate*__nullable*__nonnull)thisUpdate
           nextUpdate:(NSDate*__nullable*__nonnull)nextUpdate;
 
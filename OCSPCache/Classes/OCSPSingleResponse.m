@@ -18,31 +18,67 @@
  */
 
 #import "OCSPSingleResponse.h"
+#import "OCSPGeneralizedTime.h"
 
 @interface OCSPSingleResponse ()
 
 @property (assign, nonatomic) OCSP_SINGLERESP *response;
 
+/// Keeps the structure containing `response` alive. nil if `response` is a copy owned by this object.
+@property (strong, nonatomic) id owner;
+
 @end
 
-@implementation OCSPSingleResponse
+@implementation OCSPSingleResponse {
+    // Parsed from the response at init
+    NSDate *thisUpdate;
+    NSDate *nextUpdate;
+    Error *datesError;
+}
 
 - (instancetype)initWithResponse:(OCSP_SINGLERESP*)response {
     self = [super init];
 
     if (self) {
+        // The provided response is owned by its parent OCSP_BASICRESP, so keep a copy which
+        // can outlive it.
+        self.response = ASN1_item_dup(ASN1_ITEM_rptr(OCSP_SINGLERESP), response);
+        if (!self.response) {
+            return nil;
+        }
+        [self parseDates];
+    }
+
+    return self;
+}
+
+- (instancetype)initWithResponse:(OCSP_SINGLERESP*)response owner:(id)owner {
+    self = [super init];
+
+    if (self) {
+        self.owner = owner;
         self.response = response;
+        [self parseDates];
     }
 
     return self;
 }
 
 - (void)dealloc {
-    if (self.response) {
+    if (self.response && !self.owner) {
         OCSP_SINGLERESP_free(self.response);
     }
 }
 
+- (void)parseDates {
+    NSDate *t, *n;
+    self->datesError = [OCSPSingleResponse datesFromResponse:self.response
+                                                  thisUpdate:&t
+                                                  nextUpdate:&n];
+    self->thisUpdate = t;
+    self->nextUpdate = n;
+}
+
 - (Error*)expired:(BOOL*)expired {
     return [OCSPSingleResponse expiredWithResponse:self.response expired:expired];
 }
@@ -50,6 +86,13 @@
 + (Error*)expiredWithResponse:(OCSP_SINGLERESP*)response expired:(BOOL*)expired {
     int pday, psec, ret;
 
+    if (response->nextUpdate == NULL) {
+        // No nextUpdate indicates that newer revocation information is always available; the
+        // response does not expire.
+        *expired = FALSE;
+        return nil;
+    }
+
     ret = ASN1_TIME_diff(&pday, &psec, NULL, response->nextUpdate);
     if (ret == 0) {
         // Error pday and psec will be unset
@@ -69,77 +112,31 @@
 
 - (NSString*)thisUpdate:(NSDate**)thisUpdate
              nextUpdate:(NSDate**)nextUpdate {
-    return [OCSPSingleResponse datesFromResponse:self.response
-                                      thisUpdate:thisUpdate
-                                      nextUpdate:nextUpdate];
+    *thisUpdate = self->thisUpdate;
+    *nextUpdate = self->nextUpdate;
+
+    return self->datesError;
 }
 
 + (Error*)datesFromResponse:(OCSP_SINGLERESP*)response
                  thisUpdate:(NSDate**)thisUpdate
                  nextUpdate:(NSDate**)nextUpdate {
 
-    unsigned char *t = ASN1_STRING_data(response->thisUpdate);
-    unsigned char *n = ASN1_STRING_data(response->nextUpdate);
-
-    NSString *thisUpdateISO8601 = [NSString stringWithFormat:@"%s", t];
-    NSString *nextUpdateISO8601 = [NSString stringWithFormat:@"%s", n];
-
-    free(t);
-    free(n);
-
     // thisUpdate and nextUpdate are in GeneralizedTime:
     // https://tools.ietf.org/html/rfc2560#section-4.2.1
-    //
-    // GeneralizedTime format:
-    // https://tools.ietf.org/html/rfc5280#section-4.1.2.5.2
-    //
-    // According to
-    // https://www.openssl.org/docs/man1.1.1/man3/ASN1_TIME_to_generalizedtime.html
-    // YYMMDDHHMMSSZ is also supported by GeneralizedTime.
-    //
-    // Format string mapped by following:
-    // https://nsdateformatter.com/ and
-    // https://www.unicode.org/reports/tr35/tr35-dates.html#Date_Format_Patterns
-    NSDateFormatter *formatter = [OCSPSingleResponse generalizedTimeDateFormat1];
-
-    *thisUpdate = [formatter dateFromString:thisUpdateISO8601];
-    *nextUpdate = [formatter dateFromString:nextUpdateISO8601];
-
-    if (*thisUpdate == NULL || *nextUpdate == NULL) {
-        NSDateFormatter *formatter = [OCSPSingleResponse generalizedTimeDateFormat2];
-        if (*thisUpdate == NULL) {
-            *thisUpdate = [formatter dateFromString:thisUpdateISO8601];
-        }
-        if (*nextUpdate == NULL) {
-            *nextUpdate = [formatter dateFromString:nextUpdateISO8601];
-        }
+    *thisUpdate = [OCSPGeneralizedTime dateFromASN1Time:response->thisUpdate];
+
+    // nextUpdate is optional: https://tools.ietf.org/html/rfc6960#section-4.2.1
+    *nextUpdate = nil;
+    if (response->nextUpdate != NULL) {
+        *nextUpdate = [OCSPGeneralizedTime dateFromASN1Time:response->nextUpdate];
     }
 
-    if (*thisUpdate == NULL || *nextUpdate == NULL) {
+    if (*thisUpdate == NULL || (response->nextUpdate != NULL && *nextUpdate == NULL)) {
         return @"Failed to parse thisUpdate and nextUpdate in OCSP_SINGLERESP";
     }
 
     return nil;
 }
 
-#pragma mark - Helpers
-
-+ (NSDateFormatter*)generalizedTimeDateFormat1 {
-    return [OCSPSingleResponse dateFormatterHelper:@"yyyyMMddHHmmssZ"];
-}
-
-+ (NSDateFormatter*)generalizedTimeDateFormat2 {
-    return [OCSPSingleResponse dateFormatterHelper:@"yyMMddHHmmssZ"];
-}
-
-+ (NSDateFormatter*)dateFormatterHelper:(NSString*)dateFormat {
-    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
-    NSLocale *enUSPOSIXLocale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
-    [formatter setLocale:enUSPOSIXLocale];
-    [formatter setTimeZone:[NSTimeZone timeZoneForSecondsFromGMT:0]];
-    [formatter setDateFormat:dateFormat];
-
-    return formatter;
-}
-
 @end
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <Security/Security.h>
+#import "OCSPExpiringTable.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Snapshot of the counters kept by a verdict cache. Entries are cached verdicts.
+@interface OCSPTrustVerdictCacheMetrics : OCSPExpiringTableMetrics
+@end
+
+/*!
+ * Trust objects which were recently evaluated successfully with revocation checks, so that repeat
+ * handshakes with the same certificates and policies can skip the revocation checks. A verdict
+ * does not cover the anchors of the trust object, so the chain must still be evaluated.
+ *
+ * Verdicts are keyed by a fingerprint of the certificates and policies of the trust object, and
+ * expire no later than the time passed when they are cached, e.g. the earliest nextUpdate of the
+ * OCSP responses which the evaluation relied on, and no later than `maxAge` after being cached.
+ *
+ * Thread safe.
+ */
+@interface OCSPTrustVerdictCache : NSObject
+
+/// Maximum number of verdicts cached. Verdicts closest to expiry are evicted first.
+@property (readonly, assign, nonatomic) NSUInteger maxEntries;
+
+/// Maximum time in seconds a verdict is cached for, whatever its expiry. This bounds how long
+/// changes which the expiry does not capture, e.g. to the trust settings of the device, go
+/// unnoticed. Defaults to 1 hour. If 0, verdicts are not cached.
+@property (atomic, assign) NSTimeInterval maxAge;
+
+/// Initialize with room for 256 verdicts.
+- (instancetype)init;
+
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries;
+
+/// SHA-256 fingerprint of the certificates and policies of the trust object.
+///
+/// The certificates are the ones which the trust object reports without being evaluated. For the
+/// trust object of an authentication challenge this is the leaf certificate; the policies include
+/// the host name of the SSL policy, so verdicts are per leaf certificate and host.
+/// @param trust Trust object. Must not be evaluated concurrently.
+/// @param policies Policies to fingerprint. If NULL, the policies of the trust object are used.
++ (NSData*)keyForTrust:(SecTrustRef)trust policies:(CFArrayRef __nullable)policies;
+
+/// Returns TRUE if a verdict is cached for the key and has not expired. Expired verdicts are
+/// evicted.
+- (BOOL)hasVerdictForKey:(NSData*)key;
+
+/// Cache a verdict for the key, which expires at `expiry` or after `maxAge`, whichever comes
+/// first. Replaces any verdict cached for the key.
+/// @param expiry Time at which the verdict expires. If nil, it expires after `maxAge`.
+- (void)setVerdictForKey:(NSData*)key expiry:(NSDate*__nullable)expiry;
+
+/// Remove the verdict cached for the key, if any.
+- (void)removeVerdictForKey:(NSData*)key;
+
+/// Remove all the cached verdicts.
+- (void)removeAllVerdicts;
+
+/// Snapshot of the counters.
+- (OCSPTrustVerdictCacheMetrics*)metrics;
+
+@end
+
+NS_ASSUME_NONNULL_END
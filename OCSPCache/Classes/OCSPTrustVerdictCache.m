@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2019, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#import "OCSPTrustVerdictCache.h"
+#import <CommonCrypto/CommonDigest.h>
+
+@implementation OCSPTrustVerdictCacheMetrics
+@end
+
+/// Add the length of the bytes, then the bytes, so that adjacent fields cannot be confused.
+static void OCSPTrustVerdictCacheDigestUpdate(CC_SHA256_CTX *ctx,
+                                              const void *bytes,
+                                              size_t length) {
+    uint32_t l = (uint32_t)length;
+    CC_SHA256_Update(ctx, &l, sizeof(l));
+    CC_SHA256_Update(ctx, bytes, (CC_LONG)length);
+}
+
+@implementation OCSPTrustVerdictCache {
+    // Verdicts are only ever positive, so the objects are all @TRUE
+    OCSPExpiringTable<NSData*, NSNumber*>* verdicts;
+}
+
+// See comment in header
+- (instancetype)init {
+    return [self initWithMaxEntries:256];
+}
+
+// See comment in header
+- (instancetype)initWithMaxEntries:(NSUInteger)maxEntries {
+    self = [super init];
+
+    if (self) {
+        self->_maxAge = 60 * 60;
+        self->verdicts = [[OCSPExpiringTable alloc] initWithMaxEntries:maxEntries];
+    }
+
+    return self;
+}
+
+// See comment in header
++ (NSData*)keyForTrust:(SecTrustRef)trust policies:(CFArrayRef)policies {
+    CC_SHA256_CTX ctx;
+    CC_SHA256_Init(&ctx);
+
+    // Does not evaluate the trust object, see comment in header
+    CFIndex certCount = SecTrustGetCertificateCount(trust);
+    OCSPTrustVerdictCacheDigestUpdate(&ctx, &certCount, sizeof(certCount));
+
+    for (CFIndex i = 0; i < certCount; i++) {
+        SecCertificateRef cert = SecTrustGetCertificateAtIndex(trust, i);
+        NSData *der = (__bridge_transfer NSData*)SecCertificateCopyData(cert);
+        OCSPTrustVerdictCacheDigestUpdate(&ctx, der.bytes, der.length);
+    }
+
+    NSArray *policyArray;
+    if (policies != NULL) {
+        policyArray = (__bridge NSArray*)policies;
+    } else {
+        CFArrayRef trustPolicies = NULL;
+        SecTrustCopyPolicies(trust, &trustPolicies);
+        policyArray = (__bridge_transfer NSArray*)trustPolicies;
+    }
+
+    // Policies are identified by their properties, e.g. the OID and the host name of the SSL
+    // policy. The keys are sorted since dictionary order is not defined.
+    for (id policy in policyArray) {
+        NSDictionary *properties =
+          (__bridge_transfer NSDictionary*)SecPolicyCopyProperties((__bridge SecPolicyRef)policy);
+
+        NSArray *keys = [[properties allKeys] sortedArrayUsingSelector:@selector(compare:)];
+        for (NSString *k in keys) {
+            NSData *key = [[k description] dataUsingEncoding:NSUTF8StringEncoding];
+            NSData *value = [[[properties objectForKey:k] description]
+                             dataUsingEncoding:NSUTF8StringEncoding];
+            OCSPTrustVerdictCacheDigestUpdate(&ctx, key.bytes, key.length);
+            OCSPTrustVerdictCacheDigestUpdate(&ctx, value.bytes, value.length);
+        }
+
+        // Separate the policies
+        OCSPTrustVerdictCacheDigestUpdate(&ctx, NULL, 0);
+    }
+
+    NSMutableData *digest = [NSMutableData dataWithLength:CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(digest.mutableBytes, &ctx);
+
+    return digest;
+}
+
+// See comment in header
+- (NSUInteger)maxEntries {
+    return self->verdicts.maxEntries;
+}
+
+// See comment in header
+- (BOOL)hasVerdictForKey:(NSData*)key {
+    return [self->verdicts objectForKey:key] != nil;
+}
+
+// See comment in header
+- (void)setVerdictForKey:(NSData*)key expiry:(NSDate*)expiry {
+    NSDate *maxExpiry = [NSDate dateWithTimeIntervalSinceNow:self.maxAge];
+    if (expiry == nil || [expiry compare:maxExpiry] == NSOrderedDescending) {
+        expiry = maxExpiry;
+    }
+
+    if ([expiry timeIntervalSinceNow] <= 0) {
+        return;
+    }
+
+    [self->verdicts setObject:@(TRUE) forKey:key expiry:expiry];
+}
+
+// See comment in header
+- (void)removeVerdictForKey:(NSData*)key {
+    [self->verdicts removeObjectForKey:key];
+}
+
+// See comment in header
+- (void)removeAllVerdicts {
+    [self->verdicts removeAllObjects];
+}
+
+// See comment in header
+- (OCSPTrustVerdictCacheMetrics*)metrics {
+    return [self->verdicts metricsOfClass:[OCSPTrustVerdictCacheMetrics class]];
+}
+
+@end